@@ -43,6 +43,18 @@ v1_2 = Version( "v1_2",
 			dependencies = [],
 			variables = [ Variable("string", "Name2") ],
 			mappings = [ RenamedVariable("Name2","Name") ]
+			),
+		NewItem( "TestItemC",
+			variables = [ Variable("entity_ref", "Reference") ]
+			),
+		NewEntity( "TestEntityC", 
+			dependencies = [ Dependency( "ItemTable", include_in_header = True),
+							 Dependency( "TestItemC", include_in_header = True ) ],
+			templates = [ Template("reference_table", template = "ItemTable", types = ["item_ref","TestItemC"] ) ],
+			variables = [ Variable("string", "Name"),
+						  Variable("entity_ref", "Parent", optional = True ),
+						  Variable("entity_ref", "Children", vector = True ),
+						  Variable("reference_table", "References", optional = True ) ] 
 			)
 		]
 	) 
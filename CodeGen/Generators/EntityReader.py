@@ -10,15 +10,21 @@ def EntityReader_h(run_clang_format):
 	lines.append('#pragma once')
 	lines.append('')
 	lines.append('#include "ValueTypes.h"')
+	lines.append('#include "ArrayView.h"')
+	lines.append('')
+	lines.append('#include <unordered_map>')
 	lines.append('')
 	lines.append('namespace pds')
 	lines.append('    {')
 	lines.append('    class MemoryReadStream;')
+	lines.append('    class LazySection;')
+	lines.append('    struct LazySectionSource;')
 	lines.append('')
 	lines.append('    class EntityReader')
 	lines.append('        {')
 	lines.append('        private:')
 	lines.append('            MemoryReadStream &sstream;')
+	lines.append('            const u64 begin_position;')
 	lines.append('            const u64 end_position;')
 	lines.append('')
 	lines.append('            std::unique_ptr<EntityReader> active_subsection;')
@@ -26,6 +32,22 @@ def EntityReader_h(run_clang_format):
 	lines.append('            size_t active_subsection_index = size_t(~0);')
 	lines.append('            u64 active_subsection_end_pos = 0;')
 	lines.append('')
+	lines.append('            // if set, all non-null entity_ref values read are added to the vector, also by section readers')
+	lines.append('            std::vector<entity_ref> *referenced_entities = nullptr;')
+	lines.append('            void collect_referenced_entities( const entity_ref *refs, const size_t count );')
+	lines.append('')
+	lines.append('            // if set, the reader defers blocks to lazy sections, and the source keeps the data of the stream alive')
+	lines.append('            std::shared_ptr<const LazySectionSource> deferred_source;')
+	lines.append('')
+	lines.append('            // if set, the table of contents of the stream, which maps the paths of the keys to the positions of their blocks')
+	lines.append('            std::shared_ptr<const std::unordered_map<std::string,u64>> table_of_contents;')
+	lines.append('            std::string table_of_contents_path;')
+	lines.append('            bool is_sections_array = false;')
+	lines.append('            bool has_seeked = false;')
+	lines.append('')
+	lines.append('            // scan the block headers of the reader for the first block with the key')
+	lines.append('            bool find_block( const char *key, const u8 key_length, u64 &dest_position ) const;')
+	lines.append('')
 	lines.append('        public:')
 	lines.append('            EntityReader( MemoryReadStream &_sstream );')
 	lines.append('            EntityReader( MemoryReadStream &_sstream , const u64 _end_position );')
@@ -44,9 +66,49 @@ def EntityReader_h(run_clang_format):
 	lines.append('            bool EndReadSectionInArray( const EntityReader *sections_array_reader , const size_t section_index );')
 	lines.append('            bool EndReadSectionsArray( const EntityReader *sections_array_reader );')
 	lines.append('')
+	lines.append('            // Collect the entity_ref values read by the reader and its section readers into dest, to find the')
+	lines.append('            // entities an entity references. Set to nullptr to stop collecting.')
+	lines.append('            void SetReferencedEntities( std::vector<entity_ref> *dest ) { this->referenced_entities = dest; }')
+	lines.append('')
+	lines.append('            // Defer the decoding of sections and large values to first access (see LazySection). The owner of the source')
+	lines.append('            // must keep the data of the stream alive, it is held by the lazy sections until they are decoded. Set to nullptr')
+	lines.append('            // to decode directly. The entity_ref values of deferred blocks are not collected by SetReferencedEntities.')
+	lines.append('            void SetDeferredSource( const std::shared_ptr<const LazySectionSource> &source ) { this->deferred_source = source; }')
+	lines.append('            bool IsDeferringSections() const { return this->deferred_source != nullptr; }')
+	lines.append('')
+	lines.append('            // Defer the large block (section, sections array or array value) with the key to the lazy section, and skip past')
+	lines.append('            // it. The block is decoded by calling decode( obj, reader ) with a reader on the block, on first access. Small')
+	lines.append('            // blocks are decoded directly, as they are cheaper to decode than to defer.')
+	lines.append('            bool DeferBlock( const char *key, const u8 key_length, LazySection &dest, void *obj, bool (*decode)( void *obj, EntityReader &reader ) );')
+	lines.append('')
+	lines.append('            // Read the key table of the stream, if the stream is written with interned keys (see EntityWriter::InternKeys), and set it')
+	lines.append('            // on the stream. Call on the top reader, before any blocks are read, also before ReadTableOfContents. Returns true if')
+	lines.append('            // the keys are not interned, and false if the table is corrupted.')
+	lines.append('            bool ReadKeyTable();')
+	lines.append('')
+	lines.append('            // Read the table of contents block of the stream, if the stream has one (see EntityWriter::WriteTableOfContents).')
+	lines.append('            // Call on the top reader, the section readers which are created after the call use the table as well.')
+	lines.append('            // Returns true if there is no table of contents, and false if the table is corrupted.')
+	lines.append('            bool ReadTableOfContents();')
+	lines.append('            bool HasTableOfContents() const { return this->table_of_contents != nullptr; }')
+	lines.append('')
+	lines.append('            // Move the reader to the block of the key, so it is read by the next call, in any order within the reader. The block')
+	lines.append('            // is looked up in the table of contents if read, else the block headers are scanned and skipped by their size.')
+	lines.append('            // Without a table of contents, small values are matched by the key at the end of the block, and a block where the bytes')
+	lines.append('            // before the key could also be the start of a longer key is not matched, since the key length is not stored. Write a')
+	lines.append('            // table of contents to seek any small value. Returns false if not found, and can not be used in sections arrays.')
+	lines.append('            // A section which is read with Seek is skipped to its end in EndReadSection.')
+	lines.append('            bool Seek( const char *key, const u8 key_length );')
+	lines.append('')
 	lines.append('            // The Read function template, specifically implemented below for all supported value types.')
 	lines.append('            template <class T> bool Read( const char *key, const u8 key_length, T &value );')
 	lines.append('')
+	lines.append('            // Read an array as a view of the values in the data of the stream, without copying them. The owner of the data, such as')
+	lines.append('            // a memory mapped file, must keep it alive while the view is used. If the stream flips the byte order, does not have')
+	lines.append('            // all of its data in memory, or the values are not aligned in the data, the values are read into copy, and the view is')
+	lines.append('            // of copy. Implemented for the array types of all value types except bool, string and the reference types.')
+	lines.append('            template <class T> bool ReadView( const char *key, const u8 key_length, array_view<T> &view, std::vector<T> &copy );')
+	lines.append('')
 
 	# print the base types
 	for basetype in hlp.base_types:
@@ -103,6 +165,8 @@ def EntityReader_inl(run_clang_format):
 			num_items_per_object = str(type_impl.num_items_per_object)
 
 			if type_impl.overrides_type:
+				# entity_ref values are collected, if the reader is set up to do so
+				collects_references = ( implementing_type == 'entity_ref' )
 
 				lines.append(f'	// {implementing_type}: using {item_type} to read')
 				lines.append(f'	template <> inline bool EntityReader::Read<{implementing_type}>( const char *key, const u8 key_length, {implementing_type} &dest_variable )')
@@ -112,6 +176,8 @@ def EntityReader_inl(run_clang_format):
 				lines.append(f'			return false;')
 				lines.append(f'')
 				lines.append(f'		dest_variable = {implementing_type}::from_{item_type}( tmp_variable );')
+				if collects_references:
+					lines.append(f'		this->collect_referenced_entities( &dest_variable, 1 );')
 				lines.append(f'')
 				lines.append(f'		return true;')
 				lines.append(f'		}}')
@@ -125,7 +191,13 @@ def EntityReader_inl(run_clang_format):
 				lines.append(f'			return false;')
 				lines.append(f'')
 				lines.append(f'		if( tmp_variable.has_value() )')
-				lines.append(f'			dest_variable.set( {implementing_type}::from_{item_type}(tmp_variable.value()) );')
+				if collects_references:
+					lines.append(f'			{{')
+					lines.append(f'			dest_variable.set( {implementing_type}::from_{item_type}(tmp_variable.value()) );')
+					lines.append(f'			this->collect_referenced_entities( &dest_variable.value(), 1 );')
+					lines.append(f'			}}')
+				else:
+					lines.append(f'			dest_variable.set( {implementing_type}::from_{item_type}(tmp_variable.value()) );')
 				lines.append(f'		else')
 				lines.append(f'			dest_variable.reset();')
 				lines.append(f'')
@@ -144,6 +216,8 @@ def EntityReader_inl(run_clang_format):
 				lines.append(f'		dest_variable.reserve( tmp_variable.size() );')
 				lines.append(f'		for( size_t i = 0; i < tmp_variable.size(); ++i )')
 				lines.append(f'			dest_variable.emplace_back( {implementing_type}::from_{item_type}(tmp_variable[i]) );')
+				if collects_references:
+					lines.append(f'		this->collect_referenced_entities( dest_variable.data(), dest_variable.size() );')
 				lines.append(f'')
 				lines.append(f'		return true;')
 				lines.append(f'		}}')
@@ -164,6 +238,8 @@ def EntityReader_inl(run_clang_format):
 				lines.append(f'			dest_variable.values().reserve( tmp_variable.values().size() );')
 				lines.append(f'			for( size_t i = 0; i < tmp_variable.values().size(); ++i )')
 				lines.append(f'				dest_variable.values().emplace_back( {implementing_type}::from_{item_type}(tmp_variable.values()[i]) );')
+				if collects_references:
+					lines.append(f'			this->collect_referenced_entities( dest_variable.values().data(), dest_variable.values().size() );')
 				lines.append(f'			}}')
 				lines.append(f'		else')
 				lines.append(f'			{{')
@@ -188,6 +264,8 @@ def EntityReader_inl(run_clang_format):
 				lines.append(f'		dest_variable.values().reserve( tmp_variable.values().size() );')
 				lines.append(f'		for( size_t i = 0; i < tmp_variable.values().size(); ++i )')
 				lines.append(f'			dest_variable.values().emplace_back( {implementing_type}::from_{item_type}(tmp_variable.values()[i]) );')
+				if collects_references:
+					lines.append(f'		this->collect_referenced_entities( dest_variable.values().data(), dest_variable.values().size() );')
 				lines.append(f'')
 				lines.append(f'		return true;')
 				lines.append(f'		}}')
@@ -211,6 +289,8 @@ def EntityReader_inl(run_clang_format):
 				lines.append(f'			dest_variable.values().reserve( tmp_variable.values().size() );')
 				lines.append(f'			for( size_t i = 0; i < tmp_variable.values().size(); ++i )')
 				lines.append(f'				dest_variable.values().emplace_back( {implementing_type}::from_{item_type}(tmp_variable.values()[i]) );')
+				if collects_references:
+					lines.append(f'			this->collect_referenced_entities( dest_variable.values().data(), dest_variable.values().size() );')
 				lines.append(f'			}}')
 				lines.append(f'		else')
 				lines.append(f'			{{')
@@ -222,6 +302,16 @@ def EntityReader_inl(run_clang_format):
 				lines.append(f'')
 
 			else:
+				# arrays which are read as raw values can be viewed in place
+				if basetype.name != 'Bool' and basetype.name != 'String':
+					lines.append(f'	// {type_name}: array_view<{implementing_type}>' )
+					lines.append(f'	template <> inline bool EntityReader::ReadView<{implementing_type}>( const char *key, const u8 key_length, array_view<{implementing_type}> &view, std::vector<{implementing_type}> &copy )')
+					lines.append(f'		{{')
+					lines.append(f'		reader_status status = read_array_view<ValueType::{array_type_name},{implementing_type}>(this->sstream, key, key_length, view, copy );')
+					lines.append(f'		return status != reader_status::fail;')
+					lines.append(f'		}}')
+					lines.append(f'')
+
 				lines.append(f'	// {type_name}: {implementing_type}')
 				lines.append(f'	template <> inline bool EntityReader::Read<{implementing_type}>( const char *key, const u8 key_length, {implementing_type} &dest_variable )')
 				lines.append(f'		{{')
@@ -27,6 +27,12 @@ def EntityWriter_h(run_clang_format):
 	lines.append('            size_t active_array_index = size_t(~0);')
 	lines.append('            u64 active_array_index_start_position = 0;')
 	lines.append('')
+	lines.append('            // if set, the paths of the keys written by the writer and its section writers, and the stream positions')
+	lines.append('            // of their blocks, are collected for the table of contents')
+	lines.append('            std::shared_ptr<std::vector<std::pair<std::string,u64>>> table_of_contents;')
+	lines.append('            std::string table_of_contents_path;')
+	lines.append('            void add_table_of_contents_entry( const char *key, const u8 key_length );')
+	lines.append('')
 	lines.append('        public:')
 	lines.append('            EntityWriter( MemoryWriteStream &_dstream );')
 	lines.append('')
@@ -42,6 +48,18 @@ def EntityWriter_h(run_clang_format):
 	lines.append('            bool EndWriteSectionsArray( const EntityWriter *sections_array_writer );')
 	lines.append('            bool WriteNullSectionsArray( const char *key, const u8 key_length );')
 	lines.append('')
+	lines.append('            // Collect the keys written by the writer and its section writers, and write them as a table of contents block')
+	lines.append('            // after the other blocks with WriteTableOfContents. Readers use the table of contents to find keys in any order.')
+	lines.append('            // The keys in sections arrays are not collected.')
+	lines.append('            void CollectTableOfContents();')
+	lines.append('            bool WriteTableOfContents();')
+	lines.append('')
+	lines.append('            // Write the keys once, in a key table, and write the id of the key in the blocks instead of the key (see EntityKeyTable).')
+	lines.append('            // InternKeys must be called before any blocks are written, and WriteKeyTable after all other blocks, also after')
+	lines.append('            // the table of contents. Readers must call EntityReader::ReadKeyTable before the blocks are read.')
+	lines.append('            bool InternKeys();')
+	lines.append('            bool WriteKeyTable();')
+	lines.append('')
 	lines.append('            // The Write function template, specifically implemented below for all supported value types.')
 	lines.append('            template <class T> bool Write( const char *key, const u8 key_length, const T &value );')
 	lines.append('')
@@ -177,6 +195,7 @@ def EntityWriter_inl(run_clang_format):
 				lines.append(f'	// {type_name}: {implementing_type}')
 				lines.append(f'	template <> inline bool EntityWriter::Write<{implementing_type}>( const char *key, const u8 key_length, const {implementing_type} &src_variable )')
 				lines.append(f'		{{')
+				lines.append(f'		this->add_table_of_contents_entry( key, key_length );')
 				lines.append(f'		return write_single_value<ValueType::{type_name},{implementing_type}>( this->dstream, key, key_length, &src_variable );')
 				lines.append(f'		}}')
 				lines.append(f'')
@@ -185,6 +204,7 @@ def EntityWriter_inl(run_clang_format):
 				lines.append(f'	template <> inline bool EntityWriter::Write<optional_value<{implementing_type}>>( const char *key, const u8 key_length, const optional_value<{implementing_type}> &src_variable )')
 				lines.append(f'		{{')
 				lines.append(f'		const {implementing_type} *p_src_variable = (src_variable.has_value()) ? &(src_variable.value()) : nullptr;')
+				lines.append(f'		this->add_table_of_contents_entry( key, key_length );')
 				lines.append(f'		return write_single_value<ValueType::{type_name},{implementing_type}>( this->dstream, key, key_length, p_src_variable );')
 				lines.append(f'		}}')
 				lines.append(f'')
@@ -192,6 +212,7 @@ def EntityWriter_inl(run_clang_format):
 				lines.append(f'	//  {array_type_name}: std::vector<{implementing_type}>' )
 				lines.append(f'	template <> inline bool EntityWriter::Write<std::vector<{implementing_type}>>( const char *key, const u8 key_length, const std::vector<{implementing_type}> &src_variable )')
 				lines.append(f'		{{')
+				lines.append(f'		this->add_table_of_contents_entry( key, key_length );')
 				lines.append(f'		return write_array<ValueType::{array_type_name},{implementing_type}>(this->dstream, key, key_length, &src_variable , nullptr );')
 				lines.append(f'		}}')
 				lines.append(f'')
@@ -200,6 +221,7 @@ def EntityWriter_inl(run_clang_format):
 				lines.append(f'	template <> inline bool EntityWriter::Write<optional_vector<{implementing_type}>>( const char *key, const u8 key_length, const optional_vector<{implementing_type}> &src_variable )')
 				lines.append(f'		{{')
 				lines.append(f'		const std::vector<{implementing_type}> *p_src_variable = (src_variable.has_value()) ? &(src_variable.values()) : nullptr;')
+				lines.append(f'		this->add_table_of_contents_entry( key, key_length );')
 				lines.append(f'		return write_array<ValueType::{array_type_name},{implementing_type}>(this->dstream, key, key_length, p_src_variable , nullptr );')
 				lines.append(f'		}}')
 				lines.append(f'')
@@ -207,6 +229,7 @@ def EntityWriter_inl(run_clang_format):
 				lines.append(f'	//  {array_type_name}: idx_vector<{implementing_type}>' )
 				lines.append(f'	template <> inline bool EntityWriter::Write<idx_vector<{implementing_type}>>( const char *key, const u8 key_length, const idx_vector<{implementing_type}> &src_variable )')
 				lines.append(f'		{{')
+				lines.append(f'		this->add_table_of_contents_entry( key, key_length );')
 				lines.append(f'		return write_array<ValueType::{array_type_name},{implementing_type}>(this->dstream, key, key_length, &(src_variable.values()) , &(src_variable.index()) );')
 				lines.append(f'		}}')
 				lines.append(f'')
@@ -216,6 +239,7 @@ def EntityWriter_inl(run_clang_format):
 				lines.append(f'		{{')
 				lines.append(f'		const std::vector<{implementing_type}> *p_src_values = (src_variable.has_value()) ? &(src_variable.values()) : nullptr;')
 				lines.append(f'		const std::vector<i32> *p_src_index = (src_variable.has_value()) ? &(src_variable.index()) : nullptr;')
+				lines.append(f'		this->add_table_of_contents_entry( key, key_length );')
 				lines.append(f'		return write_array<ValueType::{array_type_name},{implementing_type}>(this->dstream, key, key_length, p_src_values , p_src_index );')
 				lines.append(f'		}}')
 				lines.append(f'')
@@ -8,6 +8,13 @@ import CodeGeneratorHelpers as hlp
 from ctypes import c_ulonglong 
 from ctypes import c_ubyte
 
+# the sections and array variables of entities are lazy, and are decoded on first access (see pds::LazySection)
+def IsLazyVariable(item: Item, var):
+	return item.IsEntity and ( not var.IsBaseType or var.Vector )
+
+def LazyVariables(item: Item):
+	return [var for var in item.Variables if IsLazyVariable(item,var)]
+
 def CreateItemHeader(item: Item, run_clang_format):
 	packageName = item.Package.Name
 	versionName = item.Version.Name
@@ -41,6 +48,9 @@ def CreateItemHeader(item: Item, run_clang_format):
 			previousVersionName = item.PreviousVersion.Version.Name
 			lines.append(f'#include "../{previousVersionName}/{previousVersionName}_{item.Name}.h"')
 		
+		if len(LazyVariables(item)) > 0:
+			lines.append(f'#include <pds/LazySection.h>')
+
 		# list dependences that needs to be included in the header
 		for dep in item.Dependencies:
 			if dep.IncludeInHeader:
@@ -108,14 +118,22 @@ def CreateItemHeader(item: Item, run_clang_format):
 			else:
 				lines.append(f'            {var.TypeString} v_{var.Name};')
 
+		# list the lazy sections of the variables which are decoded on first access
+		for var in LazyVariables(item):
+			lines.append(f'            pds::LazySection l_{var.Name};')
+
 		lines.append('')
 		lines.append('        public:')
 
-		# create accessor ref for variables, const and non-const versions
+		# create accessor ref for variables, const and non-const versions. lazy variables are decoded before they are returned
 		for var in item.Variables:
 			lines.append(f'            // accessor for referencing variable {var.Name}')
-			lines.append(f'            const {var.TypeString} & {var.Name}() const {{ return this->v_{var.Name}; }}')
-			lines.append(f'            {var.TypeString} & {var.Name}() {{ return this->v_{var.Name}; }}')
+			if IsLazyVariable(item,var):
+				lines.append(f'            const {var.TypeString} & {var.Name}() const {{ this->l_{var.Name}.Materialize( this ); return this->v_{var.Name}; }}')
+				lines.append(f'            {var.TypeString} & {var.Name}() {{ this->l_{var.Name}.Materialize( this ); return this->v_{var.Name}; }}')
+			else:
+				lines.append(f'            const {var.TypeString} & {var.Name}() const {{ return this->v_{var.Name}; }}')
+				lines.append(f'            {var.TypeString} & {var.Name}() {{ return this->v_{var.Name}; }}')
 			lines.append('')
 
 		lines.append('        };')
@@ -138,6 +156,17 @@ def CreateItemHeader(item: Item, run_clang_format):
 		lines.append('')
 		lines.append(f'            static bool Validate( const {item.Name} &obj, pds::EntityValidator &validator );')
 		lines.append('')
+		if len(LazyVariables(item)) > 0:
+			lines.append(f'            // decode all lazy sections of the object which are not decoded yet')
+			lines.append(f'            static void MaterializeSections( const {item.Name} &obj );')
+			lines.append('')
+			lines.append(f'            // returns true if any of the lazy sections of the object is not decoded yet')
+			lines.append(f'            static bool HasPendingSections( const {item.Name} &obj );')
+			lines.append('')
+			lines.append(f'            // read functions of the lazy variables, which are called directly, or when the variable is first accessed')
+			for var in LazyVariables(item):
+				lines.append(f'            static bool ReadSection_{var.Name}( void *pobj, pds::EntityReader &reader );')
+			lines.append('')
 		if item.IsEntity:
 			lines.append(f'            static const {item.Name} *EntitySafeCast( const pds::Entity *srcEnt );')
 			lines.append(f'            static std::shared_ptr<const {item.Name}> EntitySafeCast( std::shared_ptr<const pds::Entity> srcEnt );')
@@ -183,6 +212,10 @@ def ImplementClearCall(item,var):
 	lines.append('')
 	lines.append(f'        // clear variable "{var.Name}"')
 
+	# drop the lazy section, the value is overwritten
+	if IsLazyVariable(item,var):
+		lines.append(f'        obj.l_{var.Name}.Reset();')
+
 	# clear all values, base values and Entities
 	if var.Optional:
 		lines.append(f'        obj.v_{var.Name}.reset();')
@@ -203,6 +236,10 @@ def ImplementDeepCopyCall(item,var):
 	lines.append('')
 	lines.append(f'        // copy variable "{var.Name}"')
 
+	# drop the lazy section of the dest, the value is overwritten by the decoded value of the source
+	if IsLazyVariable(item,var):
+		lines.append(f'        dest.l_{var.Name}.Reset();')
+
 	# clear all base values, Entities will clear themselves
 	# deep copy all values
 	if var.IsBaseType:
@@ -286,6 +323,23 @@ def ImplementWriterCall(item,var):
 def ImplementReaderCall(item,var):
 	lines = []
 
+	# lazy variables are read by the ReadSection function of the variable, or deferred to first access
+	if IsLazyVariable(item,var):
+		lines.append(f'        // read variable "{var.Name}", or defer it to first access')
+		lines.append(f'        if( reader.IsDeferringSections() )')
+		lines.append(f'            success = reader.DeferBlock( pdsKeyMacro("{var.Name}") , obj.l_{var.Name} , &obj , &MF::ReadSection_{var.Name} );')
+		lines.append(f'        else')
+		lines.append(f'            success = MF::ReadSection_{var.Name}( &obj , reader );')
+		lines.append(f'        if( !success )')
+		lines.append(f'            return false;')
+		lines.append('')
+		return lines
+
+	return ImplementVariableReaderCall(item,var)
+
+def ImplementVariableReaderCall(item,var):
+	lines = []
+
 	if var.Optional:
 		value_can_be_null = "true"
 	else:
@@ -466,6 +520,10 @@ def CreateItemSource(item, run_clang_format):
 		if base_type is None:
 			vars_have_item = True
 			break
+
+	# check if there are lazy variables, and if any of the variables which are read directly are items
+	has_lazy_vars = len(LazyVariables(item)) > 0
+	vars_have_eager_item = any( (not var.IsBaseType) and (not IsLazyVariable(item,var)) for var in item.Variables )
 	
 	# clear code
 	lines.append(f'    void {item.Name}::MF::Clear( {item.Name} &obj )')
@@ -485,6 +543,10 @@ def CreateItemSource(item, run_clang_format):
 	lines.append('            MF::Clear( dest );')
 	lines.append('            return;')
 	lines.append('            }')
+	if has_lazy_vars:
+		lines.append('')
+		lines.append('        // decode the source, the dest is a decoded copy')
+		lines.append('        MF::MaterializeSections( *source );')
 	for var in item.Variables:
 		lines.extend(ImplementDeepCopyCall(item,var))
 	lines.append('        }')
@@ -501,6 +563,11 @@ def CreateItemSource(item, run_clang_format):
 	lines.append('        if( !lvar || !rvar )')
 	lines.append('            return false;')
 	lines.append('')
+	if has_lazy_vars:
+		lines.append('        // compare the decoded values')
+		lines.append('        MF::MaterializeSections( *lvar );')
+		lines.append('        MF::MaterializeSections( *rvar );')
+		lines.append('')
 	for var in item.Variables:
 		lines.extend(ImplementEqualsCall(item,var))
 	lines.append('        return true;')
@@ -514,6 +581,10 @@ def CreateItemSource(item, run_clang_format):
 	if vars_have_item:
 		lines.append('        pds::EntityWriter *section_writer = nullptr;')
 	lines.append('')
+	if has_lazy_vars:
+		lines.append('        // write the decoded values')
+		lines.append('        MF::MaterializeSections( obj );')
+		lines.append('')
 	for var in item.Variables:
 		lines.extend(ImplementWriterCall(item,var))
 	lines.append('        return true;')
@@ -524,7 +595,7 @@ def CreateItemSource(item, run_clang_format):
 	lines.append(f'    bool {item.Name}::MF::Read( {item.Name} &obj, pds::EntityReader &reader )')
 	lines.append('        {')
 	lines.append('        bool success = true;')
-	if vars_have_item:
+	if vars_have_eager_item:
 		lines.append('        pds::EntityReader *section_reader = nullptr;')
 	lines.append('')
 	for var in item.Variables:
@@ -533,6 +604,33 @@ def CreateItemSource(item, run_clang_format):
 	lines.append('        }')
 	lines.append('')
 
+	# lazy section code
+	if has_lazy_vars:
+		lines.append(f'    void {item.Name}::MF::MaterializeSections( const {item.Name} &obj )')
+		lines.append('        {')
+		for var in LazyVariables(item):
+			lines.append(f'        obj.l_{var.Name}.Materialize( &obj );')
+		lines.append('        }')
+		lines.append('')
+		lines.append(f'    bool {item.Name}::MF::HasPendingSections( const {item.Name} &obj )')
+		lines.append('        {')
+		pending_checks = ' || '.join(f'obj.l_{var.Name}.IsPending()' for var in LazyVariables(item))
+		lines.append(f'        return {pending_checks};')
+		lines.append('        }')
+		lines.append('')
+		for var in LazyVariables(item):
+			lines.append(f'    bool {item.Name}::MF::ReadSection_{var.Name}( void *pobj, pds::EntityReader &reader )')
+			lines.append('        {')
+			lines.append(f'        {item.Name} &obj = *(({item.Name} *)pobj);')
+			lines.append('        bool success = true;')
+			if not var.IsBaseType:
+				lines.append('        pds::EntityReader *section_reader = nullptr;')
+			lines.append('')
+			lines.extend(ImplementVariableReaderCall(item,var))
+			lines.append('        return true;')
+			lines.append('        }')
+			lines.append('')
+
 	# setup validation lines first, and see if there are any lines generated
 	validation_lines = []
 	for var in item.Variables:
@@ -548,6 +646,10 @@ def CreateItemSource(item, run_clang_format):
 		lines.append('        {')
 		lines.append('        bool success = {};')
 		lines.append('')
+		if has_lazy_vars:
+			lines.append('        // validate the decoded values')
+			lines.append('        MF::MaterializeSections( obj );')
+			lines.append('')
 		lines.extend( validation_lines )
 		lines.append('')
 	else:
@@ -586,6 +688,9 @@ def CreateItemSource(item, run_clang_format):
 		lines.append('        {')
 		lines.append('        bool success = {};')
 		lines.append('')			
+		if has_lazy_vars:
+			lines.append('        MF::MaterializeSections( obj );')
+			lines.append('')
 		for mapping in item.Mappings:
 			lines.extend(ImplementToPreviousCall(item,mapping))	
 		lines.append('')			
@@ -596,6 +701,8 @@ def CreateItemSource(item, run_clang_format):
 		lines.append('        {')
 		lines.append('        bool success = {};')
 		lines.append('')			
+		for var in LazyVariables(item):
+			lines.append(f'        obj.l_{var.Name}.Reset();')
 		for mapping in item.Mappings:
 			lines.extend(ImplementFromPreviousCall(item,mapping))	
 		lines.append('')			
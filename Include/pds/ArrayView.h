@@ -0,0 +1,32 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include <cstddef>
+
+namespace pds
+	{
+	// array_view is a read-only view of a contiguous array of values, which it does not own, such as
+	// the values of an array in the data of a stream (see EntityReader::ReadView). The owner of the
+	// values must keep them alive as long as the view is used.
+	template <class T> class array_view
+		{
+		private:
+			const T *p_data = nullptr;
+			size_t v_size = 0;
+
+		public:
+			array_view() = default;
+			array_view( const T *_data, size_t _size ) : p_data( _data ), v_size( _size ) {}
+
+			const T *data() const { return this->p_data; }
+			size_t size() const { return this->v_size; }
+			bool empty() const { return this->v_size == 0; }
+
+			const T &operator[]( size_t index ) const { return this->p_data[index]; }
+
+			const T *begin() const { return this->p_data; }
+			const T *end() const { return this->p_data + this->v_size; }
+		};
+	};
@@ -0,0 +1,637 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define PDS_HAS_IO_URING
+#endif
+#endif
+
+#ifdef PDS_HAS_IO_URING
+#include <linux/io_uring.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <chrono>
+#endif
+
+namespace pds
+	{
+	// Batch file reader reads a list of whole files into memory. On Linux, the opens, size queries,
+	// reads and closes of all the files are submitted through an io_uring, with up to QueueDepth files
+	// in flight at once, so a large batch of files is read with a few system calls, instead of a
+	// handful of blocking system calls per file.
+	// Initialize fails with ECantOpen if io_uring is not available on the system (or on other platforms),
+	// in which case the caller should fall back to reading the files one by one.
+	// Caveat: The object is NOT thread safe, and should be accessed by
+	// only one thread at a time.
+	class BatchFileReader
+		{
+		public:
+			// called once per file as soon as it is read, with the index of the file in the list, the status, and
+			// the file data. no new I/O is submitted while the callback runs, so it should hand off any heavy work.
+			typedef std::function<void( size_t index, Status status, std::vector<u8> &&data )> ReadCallback;
+
+			// size of the name buffer of a file, including the terminating zero
+			static const size_t FileNameSize = 256;
+
+			// called for each file before it is opened, to get the descriptor of the directory the file is opened relative to,
+			// and the zero-terminated name of the file. returns false if the file can't be located, which is reported as ECantOpen.
+			typedef std::function<bool( size_t index, int &directoryDescriptor, char( &fileName )[FileNameSize] )> LocateCallback;
+
+			static const uint DefaultQueueDepth = 64;
+
+			BatchFileReader() = default;
+			BatchFileReader( const BatchFileReader &other ) = delete;
+			BatchFileReader &operator=( const BatchFileReader &other ) = delete;
+			~BatchFileReader() { this->Deinitialize(); }
+
+			// set up the reader, with up to queueDepth files in flight at once
+			Status Initialize( uint queueDepth = DefaultQueueDepth );
+
+			// release the io_uring. safe to call even if not initialized
+			void Deinitialize();
+
+			// read the fileCount files which are located with locateFile, and call onFileRead for each file. returns when all 
+			// files are done. the callbacks are called on the calling thread, and onFileRead in the order the files complete.
+			Status ReadFiles( size_t fileCount, const LocateCallback &locateFile, const ReadCallback &onFileRead );
+
+#ifdef PDS_HAS_IO_URING
+		private:
+			// the state of a file which is being read
+			struct FileSlot
+				{
+				size_t Index = 0;
+				int DirectoryDescriptor = -1;
+				char FileName[FileNameSize] = {}; // owned by the slot, since the kernel reads it while the open and size query are in flight
+				int FileDescriptor = -1;
+				uint PendingOperations = 0; // one bit per Operation in flight
+				Status FileStatus = Status::Ok;
+				struct statx FileStat = {};
+				std::vector<u8> Data;
+				u64 BytesRead = 0;
+				};
+
+			// operation ids, stored in the low bits of the user data of the submissions
+			enum class Operation : u64
+				{
+				Open = 0,
+				Stat = 1,
+				Read = 2,
+				Close = 3,
+				Cancel = 4, // cancels an operation of the slot, not counted as pending on the slot
+				};
+			static const u64 OperationBits = 3;
+
+			// number of times the ring is retried when it fails while the reads are aborted
+			static const uint MaxAbortRetries = 16;
+
+			int RingFileDescriptor = -1;
+			uint QueueDepth = 0;
+			unsigned SubmissionEntryCount = 0;
+
+			// the mapped rings and submission entries
+			void *SubmissionRingMapping = nullptr;
+			size_t SubmissionRingMappingSize = 0;
+			void *CompletionRingMapping = nullptr;
+			size_t CompletionRingMappingSize = 0;
+			io_uring_sqe *SubmissionEntries = nullptr;
+			size_t SubmissionEntriesMappingSize = 0;
+
+			// pointers into the submission ring
+			unsigned *SubmissionHead = nullptr;
+			unsigned *SubmissionTail = nullptr;
+			unsigned SubmissionMask = 0;
+			unsigned *SubmissionArray = nullptr;
+
+			// pointers into the completion ring
+			unsigned *CompletionHead = nullptr;
+			unsigned *CompletionTail = nullptr;
+			unsigned CompletionMask = 0;
+			io_uring_cqe *CompletionEntries = nullptr;
+
+			// number of entries added to the submission ring, but not yet submitted to the kernel
+			unsigned UnsubmittedCount = 0;
+
+			static u64 GetUserData( size_t slotIndex, Operation operation ) { return ( u64( slotIndex ) << OperationBits ) | u64( operation ); }
+			io_uring_sqe *GetSubmissionEntry( FileSlot *slot, size_t slotIndex, Operation operation );
+			void SubmitClose( FileSlot *slot, size_t slotIndex );
+			void SubmitRead( FileSlot *slot, size_t slotIndex );
+			int Enter();
+			void OnCompletion( std::vector<FileSlot> &slots, const io_uring_cqe &completion, const ReadCallback &onFileRead, uint &activeSlotCount, bool aborting );
+			void HandleCompletions( std::vector<FileSlot> &slots, const ReadCallback &onFileRead, uint &activeSlotCount, std::vector<size_t> &freeSlots, bool aborting );
+			void AbortReads( std::vector<FileSlot> &slots, uint &activeSlotCount, std::vector<size_t> &freeSlots );
+			void DrainRing( std::vector<FileSlot> &slots, uint &activeSlotCount, std::vector<size_t> &freeSlots );
+			bool IsOperationSupported( const io_uring_probe *probe, uint opcode ) const;
+#endif
+		};
+
+#ifdef PDS_HAS_IO_URING
+
+	inline bool BatchFileReader::IsOperationSupported( const io_uring_probe *probe, uint opcode ) const
+		{
+		if( opcode > probe->last_op )
+			{
+			return false;
+			}
+		return (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED) != 0;
+		}
+
+	inline Status BatchFileReader::Initialize( uint queueDepth )
+		{
+		if( this->RingFileDescriptor >= 0 )
+			{
+			return Status::EAlreadyInitialized;
+			}
+		if( queueDepth == 0 )
+			{
+			return Status::EParam;
+			}
+
+		// each file has at most two operations in flight at once (the open and the size query)
+		io_uring_params params = {};
+		params.flags = IORING_SETUP_CLAMP;
+		int ringFileDescriptor = (int)::syscall( __NR_io_uring_setup, queueDepth * 2, &params );
+		if( ringFileDescriptor < 0 )
+			{
+			// io_uring is not available, or disabled on the system
+			return Status::ECantOpen;
+			}
+		this->RingFileDescriptor = ringFileDescriptor;
+		this->QueueDepth = std::min( queueDepth, params.sq_entries / 2 );
+		this->SubmissionEntryCount = params.sq_entries;
+
+		// make sure all the needed operations are supported by the kernel (they were added in 5.6)
+		const size_t probeSize = sizeof( io_uring_probe ) + 256 * sizeof( io_uring_probe_op );
+		std::vector<u8> probeAllocation( probeSize, 0 );
+		io_uring_probe *probe = (io_uring_probe *)probeAllocation.data();
+		if( ::syscall( __NR_io_uring_register, this->RingFileDescriptor, IORING_REGISTER_PROBE, probe, 256 ) < 0
+			|| !this->IsOperationSupported( probe, IORING_OP_OPENAT )
+			|| !this->IsOperationSupported( probe, IORING_OP_STATX )
+			|| !this->IsOperationSupported( probe, IORING_OP_READ )
+			|| !this->IsOperationSupported( probe, IORING_OP_CLOSE )
+			|| !this->IsOperationSupported( probe, IORING_OP_ASYNC_CANCEL ) )
+			{
+			this->Deinitialize();
+			return Status::ECantOpen;
+			}
+
+		// map the submission and completion rings, which share one mapping on newer kernels
+		this->SubmissionRingMappingSize = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+		this->CompletionRingMappingSize = params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe );
+		const bool singleMapping = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if( singleMapping )
+			{
+			this->SubmissionRingMappingSize = std::max( this->SubmissionRingMappingSize, this->CompletionRingMappingSize );
+			}
+
+		void *mapping = ::mmap( nullptr, this->SubmissionRingMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->RingFileDescriptor, IORING_OFF_SQ_RING );
+		if( mapping == MAP_FAILED )
+			{
+			this->Deinitialize();
+			return Status::ECantOpen;
+			}
+		this->SubmissionRingMapping = mapping;
+
+		if( singleMapping )
+			{
+			this->CompletionRingMappingSize = 0; // owned by the submission ring mapping
+			mapping = this->SubmissionRingMapping;
+			}
+		else
+			{
+			mapping = ::mmap( nullptr, this->CompletionRingMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->RingFileDescriptor, IORING_OFF_CQ_RING );
+			if( mapping == MAP_FAILED )
+				{
+				this->Deinitialize();
+				return Status::ECantOpen;
+				}
+			this->CompletionRingMapping = mapping;
+			}
+
+		this->SubmissionEntriesMappingSize = params.sq_entries * sizeof( io_uring_sqe );
+		void *entriesMapping = ::mmap( nullptr, this->SubmissionEntriesMappingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->RingFileDescriptor, IORING_OFF_SQES );
+		if( entriesMapping == MAP_FAILED )
+			{
+			this->Deinitialize();
+			return Status::ECantOpen;
+			}
+		this->SubmissionEntries = (io_uring_sqe *)entriesMapping;
+
+		u8 *submissionRing = (u8 *)this->SubmissionRingMapping;
+		this->SubmissionHead = (unsigned *)( submissionRing + params.sq_off.head );
+		this->SubmissionTail = (unsigned *)( submissionRing + params.sq_off.tail );
+		this->SubmissionMask = *(unsigned *)( submissionRing + params.sq_off.ring_mask );
+		this->SubmissionArray = (unsigned *)( submissionRing + params.sq_off.array );
+
+		u8 *completionRing = (u8 *)mapping;
+		this->CompletionHead = (unsigned *)( completionRing + params.cq_off.head );
+		this->CompletionTail = (unsigned *)( completionRing + params.cq_off.tail );
+		this->CompletionMask = *(unsigned *)( completionRing + params.cq_off.ring_mask );
+		this->CompletionEntries = (io_uring_cqe *)( completionRing + params.cq_off.cqes );
+
+		this->UnsubmittedCount = 0;
+
+		return Status::Ok;
+		}
+
+	inline void BatchFileReader::Deinitialize()
+		{
+		if( this->SubmissionEntries )
+			{
+			::munmap( this->SubmissionEntries, this->SubmissionEntriesMappingSize );
+			this->SubmissionEntries = nullptr;
+			}
+		if( this->CompletionRingMapping )
+			{
+			::munmap( this->CompletionRingMapping, this->CompletionRingMappingSize );
+			this->CompletionRingMapping = nullptr;
+			}
+		if( this->SubmissionRingMapping )
+			{
+			::munmap( this->SubmissionRingMapping, this->SubmissionRingMappingSize );
+			this->SubmissionRingMapping = nullptr;
+			}
+		if( this->RingFileDescriptor >= 0 )
+			{
+			::close( this->RingFileDescriptor );
+			this->RingFileDescriptor = -1;
+			}
+		}
+
+	inline io_uring_sqe *BatchFileReader::GetSubmissionEntry( FileSlot *slot, size_t slotIndex, Operation operation )
+		{
+		// the ring is sized so that it can't run full, since each slot has at most two entries queued at once
+		// (the cancels of an abort are only queued when there is room, see AbortReads)
+		const unsigned tail = *this->SubmissionTail;
+		const unsigned index = tail & this->SubmissionMask;
+		io_uring_sqe *entry = &this->SubmissionEntries[index];
+		memset( entry, 0, sizeof( io_uring_sqe ) );
+		entry->user_data = GetUserData( slotIndex, operation );
+		this->SubmissionArray[index] = index;
+
+		// publish the entry to the kernel
+		__atomic_store_n( this->SubmissionTail, tail + 1, __ATOMIC_RELEASE );
+		++this->UnsubmittedCount;
+		if( operation != Operation::Cancel )
+			{
+			slot->PendingOperations |= 1u << uint( operation );
+			}
+		return entry;
+		}
+
+	inline void BatchFileReader::SubmitClose( FileSlot *slot, size_t slotIndex )
+		{
+		io_uring_sqe *entry = this->GetSubmissionEntry( slot, slotIndex, Operation::Close );
+		entry->opcode = IORING_OP_CLOSE;
+		entry->fd = slot->FileDescriptor;
+		slot->FileDescriptor = -1;
+		}
+
+	inline void BatchFileReader::SubmitRead( FileSlot *slot, size_t slotIndex )
+		{
+		// cap each read at 1GB, larger files are read in multiple reads
+		const u64 bytesLeft = slot->Data.size() - slot->BytesRead;
+		const u32 bytesToRead = (u32)std::min<u64>( bytesLeft, 1024 * 1024 * 1024 );
+
+		io_uring_sqe *entry = this->GetSubmissionEntry( slot, slotIndex, Operation::Read );
+		entry->opcode = IORING_OP_READ;
+		entry->fd = slot->FileDescriptor;
+		entry->addr = (u64)( slot->Data.data() + slot->BytesRead );
+		entry->len = bytesToRead;
+		entry->off = slot->BytesRead;
+		}
+
+	inline int BatchFileReader::Enter()
+		{
+		// submit the queued entries, and wait for at least one completion
+		const int ret = (int)::syscall( __NR_io_uring_enter, this->RingFileDescriptor, this->UnsubmittedCount, 1, IORING_ENTER_GETEVENTS, nullptr, 0 );
+		if( ret >= 0 )
+			{
+			this->UnsubmittedCount -= (unsigned)ret;
+			}
+		return ret;
+		}
+
+	inline void BatchFileReader::OnCompletion( std::vector<FileSlot> &slots, const io_uring_cqe &completion, const ReadCallback &onFileRead, uint &activeSlotCount, bool aborting )
+		{
+		const size_t slotIndex = size_t( completion.user_data >> OperationBits );
+		const Operation operation = Operation( completion.user_data & ( ( u64( 1 ) << OperationBits ) - 1 ) );
+		if( operation == Operation::Cancel )
+			{
+			// the result of the cancelled operation is in its own completion
+			return;
+			}
+		FileSlot *slot = &slots[slotIndex];
+		slot->PendingOperations &= ~( 1u << uint( operation ) );
+
+		switch( operation )
+			{
+			case Operation::Open:
+				if( completion.res < 0 )
+					{
+					slot->FileStatus = Status::ECantOpen;
+					}
+				else
+					{
+					slot->FileDescriptor = completion.res;
+					}
+				break;
+
+			case Operation::Stat:
+				if( completion.res < 0 )
+					{
+					slot->FileStatus = Status::ECantOpen;
+					}
+				break;
+
+			case Operation::Read:
+				if( completion.res <= 0 )
+					{
+					// failed, or the file was truncated while reading it
+					slot->FileStatus = Status::ECantRead;
+					}
+				else
+					{
+					slot->BytesRead += u64( completion.res );
+					}
+				break;
+
+			case Operation::Close:
+			case Operation::Cancel:
+				break;
+			}
+
+		// wait for both the open and the size query before reading
+		if( slot->PendingOperations != 0 )
+			{
+			return;
+			}
+
+		// when the reads are aborted, nothing new is submitted, and the file is closed right away
+		if( aborting )
+			{
+			if( slot->FileDescriptor >= 0 )
+				{
+				::close( slot->FileDescriptor );
+				slot->FileDescriptor = -1;
+				}
+			--activeSlotCount;
+			return;
+			}
+
+		// start the read when the file is open and the size is known
+		if( slot->FileStatus == Status::Ok && operation != Operation::Read && operation != Operation::Close )
+			{
+			const u64 fileSize = slot->FileStat.stx_size;
+			slot->Data.resize( (size_t)fileSize );
+			if( slot->Data.size() != fileSize )
+				{
+				slot->FileStatus = Status::ECantAllocate;
+				}
+			else if( fileSize > 0 )
+				{
+				this->SubmitRead( slot, slotIndex );
+				return;
+				}
+			}
+
+		// continue reading if the file is only partially read
+		if( slot->FileStatus == Status::Ok && operation == Operation::Read && slot->BytesRead < slot->Data.size() )
+			{
+			this->SubmitRead( slot, slotIndex );
+			return;
+			}
+
+		// the file is done, report it before closing it, so the caller can start working on the data
+		if( operation != Operation::Close )
+			{
+			if( slot->FileStatus != Status::Ok )
+				{
+				slot->Data.clear();
+				}
+			onFileRead( slot->Index, slot->FileStatus, std::move( slot->Data ) );
+			slot->Data = std::vector<u8>();
+
+			if( slot->FileDescriptor >= 0 )
+				{
+				this->SubmitClose( slot, slotIndex );
+				return;
+				}
+			}
+
+		// all operations are done, the slot can be reused
+		--activeSlotCount;
+		}
+
+	inline void BatchFileReader::HandleCompletions( std::vector<FileSlot> &slots, const ReadCallback &onFileRead, uint &activeSlotCount, std::vector<size_t> &freeSlots, bool aborting )
+		{
+		unsigned head = *this->CompletionHead;
+		const unsigned tail = __atomic_load_n( this->CompletionTail, __ATOMIC_ACQUIRE );
+		while( head != tail )
+			{
+			const io_uring_cqe completion = this->CompletionEntries[head & this->CompletionMask];
+			++head;
+			__atomic_store_n( this->CompletionHead, head, __ATOMIC_RELEASE );
+
+			const uint activeBefore = activeSlotCount;
+			this->OnCompletion( slots, completion, onFileRead, activeSlotCount, aborting );
+			if( activeSlotCount < activeBefore )
+				{
+				freeSlots.emplace_back( size_t( completion.user_data >> OperationBits ) );
+				}
+			}
+		}
+
+	inline void BatchFileReader::AbortReads( std::vector<FileSlot> &slots, uint &activeSlotCount, std::vector<size_t> &freeSlots )
+		{
+		// cancel the operations in flight, as far as there is room in the submission ring. operations which can't be
+		// cancelled, or which are still queued, run to completion, and the files are closed when they are done.
+		const Operation cancelledOperations[] = { Operation::Open, Operation::Stat, Operation::Read };
+		for( size_t slotIndex = 0; slotIndex < slots.size(); ++slotIndex )
+			{
+			FileSlot *slot = &slots[slotIndex];
+			for( const Operation operation : cancelledOperations )
+				{
+				const unsigned queuedCount = *this->SubmissionTail - __atomic_load_n( this->SubmissionHead, __ATOMIC_ACQUIRE );
+				if( ( slot->PendingOperations & ( 1u << uint( operation ) ) ) != 0 && queuedCount < this->SubmissionEntryCount )
+					{
+					io_uring_sqe *entry = this->GetSubmissionEntry( slot, slotIndex, Operation::Cancel );
+					entry->opcode = IORING_OP_ASYNC_CANCEL;
+					entry->addr = GetUserData( slotIndex, operation );
+					}
+				}
+			}
+
+		// wait for all the slots to be done, so the kernel no longer writes to the buffers of the slots
+		uint failedCount = 0;
+		while( activeSlotCount > 0 )
+			{
+			if( this->Enter() < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY )
+				{
+				if( ++failedCount >= MaxAbortRetries )
+					{
+					// the ring can't be entered, wait for the operations without it
+					this->DrainRing( slots, activeSlotCount, freeSlots );
+					return;
+					}
+				continue;
+				}
+			this->HandleCompletions( slots, ReadCallback(), activeSlotCount, freeSlots, true );
+			}
+		}
+
+	inline void BatchFileReader::DrainRing( std::vector<FileSlot> &slots, uint &activeSlotCount, std::vector<size_t> &freeSlots )
+		{
+		// take back the entries which the kernel has not taken from the submission ring (it only takes entries while the
+		// ring is entered), so their operations are never started. the files of the close operations are closed here instead.
+		const unsigned head = __atomic_load_n( this->SubmissionHead, __ATOMIC_ACQUIRE );
+		for( unsigned position = head; position != *this->SubmissionTail; ++position )
+			{
+			const io_uring_sqe &entry = this->SubmissionEntries[this->SubmissionArray[position & this->SubmissionMask]];
+			const size_t slotIndex = size_t( entry.user_data >> OperationBits );
+			const Operation operation = Operation( entry.user_data & ( ( u64( 1 ) << OperationBits ) - 1 ) );
+			if( operation == Operation::Cancel )
+				{
+				continue;
+				}
+			if( operation == Operation::Close )
+				{
+				::close( entry.fd );
+				}
+			FileSlot *slot = &slots[slotIndex];
+			slot->PendingOperations &= ~( 1u << uint( operation ) );
+			if( slot->PendingOperations == 0 )
+				{
+				if( slot->FileDescriptor >= 0 )
+					{
+					::close( slot->FileDescriptor );
+					slot->FileDescriptor = -1;
+					}
+				--activeSlotCount;
+				freeSlots.emplace_back( slotIndex );
+				}
+			}
+		__atomic_store_n( this->SubmissionTail, head, __ATOMIC_RELEASE );
+		this->UnsubmittedCount = 0;
+
+		// the kernel posts the completions of the operations it has taken to the completion ring without the ring being
+		// entered, so poll the completion ring until the last slot is done
+		for( ;;)
+			{
+			this->HandleCompletions( slots, ReadCallback(), activeSlotCount, freeSlots, true );
+			if( activeSlotCount == 0 )
+				{
+				return;
+				}
+			std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+			}
+		}
+
+	inline Status BatchFileReader::ReadFiles( size_t fileCount, const LocateCallback &locateFile, const ReadCallback &onFileRead )
+		{
+		if( this->RingFileDescriptor < 0 )
+			{
+			return Status::ENotInitialized;
+			}
+
+		std::vector<FileSlot> slots( this->QueueDepth );
+		std::vector<size_t> freeSlots;
+		freeSlots.reserve( this->QueueDepth );
+		for( size_t i = this->QueueDepth; i > 0; --i )
+			{
+			freeSlots.emplace_back( i - 1 );
+			}
+		uint activeSlotCount = 0;
+		size_t nextFile = 0;
+
+		while( nextFile < fileCount || activeSlotCount > 0 )
+			{
+			// start opening and sizing new files in all the free slots
+			while( nextFile < fileCount && !freeSlots.empty() )
+				{
+				const size_t slotIndex = freeSlots.back();
+				FileSlot *slot = &slots[slotIndex];
+				*slot = FileSlot();
+				slot->Index = nextFile;
+				if( !locateFile( nextFile, slot->DirectoryDescriptor, slot->FileName ) )
+					{
+					onFileRead( nextFile, Status::ECantOpen, std::vector<u8>() );
+					++nextFile;
+					continue;
+					}
+				freeSlots.pop_back();
+				++activeSlotCount;
+
+				const char *fileName = slot->FileName;
+
+				io_uring_sqe *openEntry = this->GetSubmissionEntry( slot, slotIndex, Operation::Open );
+				openEntry->opcode = IORING_OP_OPENAT;
+				openEntry->fd = slot->DirectoryDescriptor;
+				openEntry->addr = (u64)fileName;
+				openEntry->open_flags = O_RDONLY | O_CLOEXEC;
+
+				io_uring_sqe *statEntry = this->GetSubmissionEntry( slot, slotIndex, Operation::Stat );
+				statEntry->opcode = IORING_OP_STATX;
+				statEntry->fd = slot->DirectoryDescriptor;
+				statEntry->addr = (u64)fileName;
+				statEntry->len = STATX_SIZE;
+				statEntry->off = (u64)&slot->FileStat;
+
+				++nextFile;
+				}
+
+			// submit the queued entries, and wait for at least one completion
+			if( this->Enter() < 0 )
+				{
+				if( errno == EINTR || errno == EAGAIN || errno == EBUSY )
+					{
+					continue;
+					}
+
+				// the ring is broken. the files in flight are not reported, but the kernel may still write to the
+				// slots, so wait for the operations to complete before the slots are released
+				this->AbortReads( slots, activeSlotCount, freeSlots );
+				return Status::ECantRead;
+				}
+
+			this->HandleCompletions( slots, onFileRead, activeSlotCount, freeSlots, false );
+			}
+
+		return Status::Ok;
+		}
+
+#else
+
+	inline Status BatchFileReader::Initialize( uint /*queueDepth*/ )
+		{
+		// no batched I/O on this platform
+		return Status::ECantOpen;
+		}
+
+	inline void BatchFileReader::Deinitialize()
+		{
+		}
+
+	inline Status BatchFileReader::ReadFiles( size_t /*fileCount*/, const LocateCallback &/*locateFile*/, const ReadCallback &/*onFileRead*/ )
+		{
+		return Status::ENotInitialized;
+		}
+
+#endif
+
+	};
@@ -0,0 +1,199 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+#include "CpuFeatures.h"
+
+#include <atomic>
+
+namespace pds
+	{
+	// Byte swap copies arrays of 2, 4 or 8 byte values and flips the byte order of the values in the same pass,
+	// which is used by the read and write streams when they flip the byte order. Large arrays are flipped with
+	// SSSE3 or AVX2 byte shuffles, the best backend supported by the cpu is selected at runtime. The source and
+	// destination do not have to be aligned, and may be the same memory, to flip the values in place.
+	class ByteSwap
+		{
+		public:
+			// the implementations of the byte swap
+			enum class Backend
+				{
+				Portable, // one value at a time, runs on all cpus
+				Ssse3, // 16 bytes at a time with pshufb
+				Avx2, // 32 bytes at a time with vpshufb
+				};
+
+			// arrays smaller than this many bytes are flipped one value at a time, as the dispatch costs more than the flip
+			static const u64 MinVectorizedSize = 32;
+
+			// copy count values of type T from src to dest, and flip the byte order of the values
+			template <class T> static void CopySwapped( void *dest, const void *src, u64 count );
+
+			// the backend used for large arrays
+			static Backend GetBackend();
+
+			// check if the cpu supports a backend
+			static bool IsBackendSupported( Backend backend );
+
+			// select the backend, to compare the backends. returns false if the cpu does not support the backend.
+			static bool SetBackend( Backend backend );
+
+		private:
+			static std::atomic<Backend> &SelectedBackend();
+			template <size_t ValueSize> static void CopySwappedPortable( u8 *dest, const u8 *src, u64 count );
+#ifdef PDS_X86
+			template <size_t ValueSize> static void CopySwappedSsse3( u8 *dest, const u8 *src, u64 count );
+			template <size_t ValueSize> static void CopySwappedAvx2( u8 *dest, const u8 *src, u64 count );
+#endif
+		};
+
+	// flip the byte order of one value, the load and store are unaligned
+	template <size_t ValueSize> inline void byte_swap_value( u8 *dest, const u8 *src );
+
+	template <> inline void byte_swap_value<2>( u8 *dest, const u8 *src )
+		{
+		u16 value;
+		memcpy( &value, src, 2 );
+		value = u16( ( value >> 8 ) | ( value << 8 ) );
+		memcpy( dest, &value, 2 );
+		}
+
+	template <> inline void byte_swap_value<4>( u8 *dest, const u8 *src )
+		{
+		u32 value;
+		memcpy( &value, src, 4 );
+		value = ( ( value & 0xff000000u ) >> 24 ) | ( ( value & 0x00ff0000u ) >> 8 ) | ( ( value & 0x0000ff00u ) << 8 ) | ( ( value & 0x000000ffu ) << 24 );
+		memcpy( dest, &value, 4 );
+		}
+
+	template <> inline void byte_swap_value<8>( u8 *dest, const u8 *src )
+		{
+		u64 value;
+		memcpy( &value, src, 8 );
+		value = ( ( value & 0xff00000000000000ull ) >> 56 ) | ( ( value & 0x00ff000000000000ull ) >> 40 )
+			| ( ( value & 0x0000ff0000000000ull ) >> 24 ) | ( ( value & 0x000000ff00000000ull ) >> 8 )
+			| ( ( value & 0x00000000ff000000ull ) << 8 ) | ( ( value & 0x0000000000ff0000ull ) << 24 )
+			| ( ( value & 0x000000000000ff00ull ) << 40 ) | ( ( value & 0x00000000000000ffull ) << 56 );
+		memcpy( dest, &value, 8 );
+		}
+
+	template <size_t ValueSize> inline void ByteSwap::CopySwappedPortable( u8 *dest, const u8 *src, u64 count )
+		{
+		for( u64 i = 0; i < count; ++i )
+			{
+			byte_swap_value<ValueSize>( &dest[i * ValueSize], &src[i * ValueSize] );
+			}
+		}
+
+#ifdef PDS_X86
+
+	// the pshufb mask which reverses the bytes of each value in a 16 byte lane
+	template <size_t ValueSize> inline __m128i byte_swap_mask();
+	template <> inline __m128i byte_swap_mask<2>() { return _mm_set_epi8( 14, 15, 12, 13, 10, 11, 8, 9, 6, 7, 4, 5, 2, 3, 0, 1 ); }
+	template <> inline __m128i byte_swap_mask<4>() { return _mm_set_epi8( 12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3 ); }
+	template <> inline __m128i byte_swap_mask<8>() { return _mm_set_epi8( 8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7 ); }
+
+	template <size_t ValueSize> PDS_TARGET( "ssse3" ) inline void ByteSwap::CopySwappedSsse3( u8 *dest, const u8 *src, u64 count )
+		{
+		const __m128i mask = byte_swap_mask<ValueSize>();
+		const u64 size = count * ValueSize;
+		u64 offset = 0;
+		for( ; offset + 16 <= size; offset += 16 )
+			{
+			const __m128i values = _mm_loadu_si128( (const __m128i *)&src[offset] );
+			_mm_storeu_si128( (__m128i *)&dest[offset], _mm_shuffle_epi8( values, mask ) );
+			}
+		CopySwappedPortable<ValueSize>( &dest[offset], &src[offset], ( size - offset ) / ValueSize );
+		}
+
+	template <size_t ValueSize> PDS_TARGET( "avx2" ) inline void ByteSwap::CopySwappedAvx2( u8 *dest, const u8 *src, u64 count )
+		{
+		// vpshufb shuffles within each 16 byte lane, so the mask is the same in both lanes
+		const __m128i laneMask = byte_swap_mask<ValueSize>();
+		const __m256i mask = _mm256_set_m128i( laneMask, laneMask );
+		const u64 size = count * ValueSize;
+		u64 offset = 0;
+		for( ; offset + 64 <= size; offset += 64 )
+			{
+			const __m256i values0 = _mm256_loadu_si256( (const __m256i *)&src[offset] );
+			const __m256i values1 = _mm256_loadu_si256( (const __m256i *)&src[offset + 32] );
+			_mm256_storeu_si256( (__m256i *)&dest[offset], _mm256_shuffle_epi8( values0, mask ) );
+			_mm256_storeu_si256( (__m256i *)&dest[offset + 32], _mm256_shuffle_epi8( values1, mask ) );
+			}
+		for( ; offset + 16 <= size; offset += 16 )
+			{
+			const __m128i values = _mm_loadu_si128( (const __m128i *)&src[offset] );
+			_mm_storeu_si128( (__m128i *)&dest[offset], _mm_shuffle_epi8( values, laneMask ) );
+			}
+		CopySwappedPortable<ValueSize>( &dest[offset], &src[offset], ( size - offset ) / ValueSize );
+		}
+
+#endif//PDS_X86
+
+	template <class T> inline void ByteSwap::CopySwapped( void *dest, const void *src, u64 count )
+		{
+		static_assert( sizeof(T) == 2 || sizeof(T) == 4 || sizeof(T) == 8, "ByteSwap::CopySwapped only flips 2, 4 and 8 byte values" );
+		u8 *destBytes = (u8 *)dest;
+		const u8 *srcBytes = (const u8 *)src;
+
+#ifdef PDS_X86
+		if( count * sizeof(T) >= MinVectorizedSize )
+			{
+			switch( SelectedBackend().load( std::memory_order_relaxed ) )
+				{
+				case Backend::Avx2:
+					CopySwappedAvx2<sizeof(T)>( destBytes, srcBytes, count );
+					return;
+				case Backend::Ssse3:
+					CopySwappedSsse3<sizeof(T)>( destBytes, srcBytes, count );
+					return;
+				default:
+					break;
+				}
+			}
+#endif
+
+		CopySwappedPortable<sizeof(T)>( destBytes, srcBytes, count );
+		}
+
+	inline std::atomic<ByteSwap::Backend> &ByteSwap::SelectedBackend()
+		{
+		static std::atomic<Backend> backend( IsBackendSupported( Backend::Avx2 ) ? Backend::Avx2 : ( IsBackendSupported( Backend::Ssse3 ) ? Backend::Ssse3 : Backend::Portable ) );
+		return backend;
+		}
+
+	inline ByteSwap::Backend ByteSwap::GetBackend()
+		{
+		return SelectedBackend().load();
+		}
+
+	inline bool ByteSwap::IsBackendSupported( Backend backend )
+		{
+		switch( backend )
+			{
+			case Backend::Portable:
+				return true;
+#ifdef PDS_X86
+			case Backend::Ssse3:
+				return get_cpu_features().Ssse3;
+			case Backend::Avx2:
+				return get_cpu_features().Avx2;
+#endif
+			default:
+				return false;
+			}
+		}
+
+	inline bool ByteSwap::SetBackend( Backend backend )
+		{
+		if( !IsBackendSupported( backend ) )
+			{
+			return false;
+			}
+		SelectedBackend() = backend;
+		return true;
+		}
+
+	};
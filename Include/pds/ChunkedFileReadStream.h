@@ -0,0 +1,345 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+#include "MemoryReadStream.h"
+#include "SHA256.h"
+
+#include <vector>
+#include <memory>
+
+#ifdef _MSC_VER
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+
+namespace pds
+	{
+	// Chunked file read stream is a read stream on a file, which holds only a window of the file in memory.
+	// The data is read into a sliding buffer of ChunkSize bytes as the stream is read, so a large file can be
+	// decoded with an EntityReader without reading all of it into memory first. Reads which are larger than the
+	// buffer are read directly into the destination. The position can be set anywhere in the file, the buffer is
+	// refilled when data outside of it is read. If BeginHashedRead is called, the data of the file is hashed in
+	// order as it is read, and the rest of the file is read and hashed in EndHashedRead.
+	// Caveat: The stream is NOT thread safe, and should be accessed by
+	// only one thread at a time.
+	class ChunkedFileReadStream : public MemoryReadStream
+		{
+		public:
+			// the default size of the sliding buffer
+			static const u64 DefaultChunkSize = 1024*1024; // 1MB
+
+			// the window is aligned down to this size, so short reads just before the window do not reload it
+			static const u64 WindowAlignment = 4096;
+
+		private:
+#ifdef _MSC_VER
+			HANDLE FileHandle = INVALID_HANDLE_VALUE;
+#else
+			int FileDescriptor = -1;
+#endif
+			u64 ChunkSize = DefaultChunkSize;
+			std::vector<u8> Buffer;
+			bool ReadFailed = false;
+
+			// the hash of the data in [0,HashedSize), if BeginHashedRead is called
+			std::unique_ptr<SHA256> Hasher;
+			u64 HashedSize = 0;
+
+			// read count bytes at position from the file into dest, and hash them if they are next in order
+			bool ReadFileData( u64 position, u8 *dest, u64 count );
+
+			// hash the data of the file up to position, if it is not already hashed. uses the buffer, so the window is cleared.
+			bool HashUpTo( u64 position );
+
+			// load the buffer with the window which includes position
+			bool LoadWindow( u64 position );
+
+		protected:
+			u64 ReadOutsideWindow( u8 *dest, u64 count ) override;
+
+		public:
+			ChunkedFileReadStream( u64 _ChunkSize = DefaultChunkSize ) : MemoryReadStream( nullptr, 0 ), ChunkSize( _ChunkSize )
+				{
+				this->WindowEnd = 0;
+				}
+			ChunkedFileReadStream( const ChunkedFileReadStream &other ) = delete;
+			ChunkedFileReadStream &operator=( const ChunkedFileReadStream &other ) = delete;
+			~ChunkedFileReadStream() { this->Close(); }
+
+			// open the file at filePath. returns ECantOpen if the file could not be opened.
+			Status Open( const char *filePath );
+
+#ifndef _MSC_VER
+			// use an opened file descriptor, which is closed by the stream
+			Status Open( int fileDescriptor );
+#endif
+
+			// close the file. safe to call even if the file is not open
+			void Close();
+
+			// returns true if a read from the file has failed, or the file was shorter than its size when opened
+			bool HasReadFailed() const { return this->ReadFailed; }
+
+			// start hashing the data of the file, must be called before any data is read
+			void BeginHashedRead();
+
+			// read and hash the rest of the file, and get the digest. returns false if a read failed.
+			bool EndHashedRead( hash &digest );
+		};
+
+	inline Status ChunkedFileReadStream::Open( const char *filePath )
+		{
+#ifdef _MSC_VER
+		if( this->FileHandle != INVALID_HANDLE_VALUE )
+			{
+			return Status::EAlreadyInitialized;
+			}
+
+		HANDLE fileHandle = ::CreateFileA( filePath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+		if( fileHandle == INVALID_HANDLE_VALUE )
+			{
+			return Status::ECantOpen;
+			}
+
+		LARGE_INTEGER fileSize = {};
+		if( !::GetFileSizeEx( fileHandle, &fileSize ) )
+			{
+			::CloseHandle( fileHandle );
+			return Status::ECantOpen;
+			}
+
+		this->FileHandle = fileHandle;
+		this->DataSize = (u64)fileSize.QuadPart;
+		return Status::Ok;
+#else
+		if( this->FileDescriptor >= 0 )
+			{
+			return Status::EAlreadyInitialized;
+			}
+
+		const int fileDescriptor = ::open( filePath, O_RDONLY | O_CLOEXEC );
+		if( fileDescriptor < 0 )
+			{
+			return Status::ECantOpen;
+			}
+		return this->Open( fileDescriptor );
+#endif
+		}
+
+#ifndef _MSC_VER
+	inline Status ChunkedFileReadStream::Open( int fileDescriptor )
+		{
+		if( this->FileDescriptor >= 0 )
+			{
+			::close( fileDescriptor );
+			return Status::EAlreadyInitialized;
+			}
+
+		struct stat fileStat = {};
+		if( ::fstat( fileDescriptor, &fileStat ) != 0 )
+			{
+			::close( fileDescriptor );
+			return Status::ECantOpen;
+			}
+
+		// the file is read front to back
+#ifdef POSIX_FADV_SEQUENTIAL
+		::posix_fadvise( fileDescriptor, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif
+
+		this->FileDescriptor = fileDescriptor;
+		this->DataSize = (u64)fileStat.st_size;
+		return Status::Ok;
+		}
+#endif
+
+	inline void ChunkedFileReadStream::Close()
+		{
+#ifdef _MSC_VER
+		if( this->FileHandle != INVALID_HANDLE_VALUE )
+			{
+			::CloseHandle( this->FileHandle );
+			this->FileHandle = INVALID_HANDLE_VALUE;
+			}
+#else
+		if( this->FileDescriptor >= 0 )
+			{
+			::close( this->FileDescriptor );
+			this->FileDescriptor = -1;
+			}
+#endif
+
+		this->Data = nullptr;
+		this->DataSize = 0;
+		this->DataPosition = 0;
+		this->WindowBegin = 0;
+		this->WindowEnd = 0;
+		this->Buffer = std::vector<u8>();
+		this->ReadFailed = false;
+		this->Hasher.reset();
+		this->HashedSize = 0;
+		this->KeyTable.reset();
+		this->KeyIdCache.reset();
+		}
+
+	inline void ChunkedFileReadStream::BeginHashedRead()
+		{
+		pdsSanityCheckDebugMacro( this->DataPosition == 0 && this->WindowEnd == 0 );
+		this->Hasher.reset( new SHA256() );
+		this->HashedSize = 0;
+		}
+
+	inline bool ChunkedFileReadStream::EndHashedRead( hash &digest )
+		{
+		if( !this->Hasher )
+			{
+			return false;
+			}
+		const bool hashed = this->HashUpTo( this->DataSize );
+		this->Hasher->GetDigest( digest.digest );
+		this->Hasher.reset();
+		return hashed && !this->ReadFailed;
+		}
+
+	inline bool ChunkedFileReadStream::ReadFileData( u64 position, u8 *dest, u64 count )
+		{
+		u64 bytesRead = 0;
+		while( bytesRead < count )
+			{
+#ifdef _MSC_VER
+			// cap each read at UINT_MAX
+			const u64 bytesLeft = count - bytesRead;
+			const DWORD bytesToRead = ( bytesLeft < UINT_MAX ) ? (DWORD)bytesLeft : UINT_MAX;
+			OVERLAPPED overlapped = {};
+			overlapped.Offset = (DWORD)( ( position + bytesRead ) & 0xffffffff );
+			overlapped.OffsetHigh = (DWORD)( ( position + bytesRead ) >> 32 );
+			DWORD bytesThatWereRead = 0;
+			if( !::ReadFile( this->FileHandle, &dest[bytesRead], bytesToRead, &bytesThatWereRead, &overlapped ) || bytesThatWereRead == 0 )
+				{
+				this->ReadFailed = true;
+				return false;
+				}
+			bytesRead += bytesThatWereRead;
+#else
+			const ssize_t bytesThatWereRead = ::pread( this->FileDescriptor, &dest[bytesRead], (size_t)( count - bytesRead ), (off_t)( position + bytesRead ) );
+			if( bytesThatWereRead < 0 && errno == EINTR )
+				{
+				continue;
+				}
+			if( bytesThatWereRead <= 0 )
+				{
+				// failed to read, or the file was truncated
+				this->ReadFailed = true;
+				return false;
+				}
+			bytesRead += (u64)bytesThatWereRead;
+#endif
+			}
+
+		// hash the part of the data which is next in order. data which is read again is not hashed again
+		if( this->Hasher && position <= this->HashedSize && position + count > this->HashedSize )
+			{
+			this->Hasher->Update( &dest[this->HashedSize - position], (size_t)( position + count - this->HashedSize ) );
+			this->HashedSize = position + count;
+			}
+		return true;
+		}
+
+	inline bool ChunkedFileReadStream::HashUpTo( u64 position )
+		{
+		if( !this->Hasher || this->HashedSize >= position )
+			{
+			return true;
+			}
+
+		// the skipped data is read through the buffer, so the window is cleared
+		this->Data = nullptr;
+		this->WindowBegin = 0;
+		this->WindowEnd = 0;
+		this->Buffer.resize( (size_t)std::min<u64>( this->ChunkSize, this->DataSize ) );
+		while( this->HashedSize < position )
+			{
+			const u64 count = std::min<u64>( this->Buffer.size(), position - this->HashedSize );
+			if( !this->ReadFileData( this->HashedSize, this->Buffer.data(), count ) )
+				{
+				return false;
+				}
+			}
+		return true;
+		}
+
+	inline bool ChunkedFileReadStream::LoadWindow( u64 position )
+		{
+		// the buffer is not larger than the file
+		this->Buffer.resize( (size_t)std::min<u64>( this->ChunkSize, this->DataSize ) );
+
+		// align the window, and make sure it includes the position
+		u64 windowBegin = position - ( position % u64( WindowAlignment ) );
+		if( position - windowBegin >= this->Buffer.size() )
+			{
+			windowBegin = position;
+			}
+		const u64 windowEnd = std::min<u64>( windowBegin + this->Buffer.size(), this->DataSize );
+
+		// the data before the window must be hashed first, so the data is hashed in order
+		if( !this->HashUpTo( windowBegin ) || !this->ReadFileData( windowBegin, this->Buffer.data(), windowEnd - windowBegin ) )
+			{
+			this->Data = nullptr;
+			this->WindowBegin = 0;
+			this->WindowEnd = 0;
+			return false;
+			}
+
+		this->Data = this->Buffer.data();
+		this->WindowBegin = windowBegin;
+		this->WindowEnd = windowEnd;
+		return true;
+		}
+
+	inline u64 ChunkedFileReadStream::ReadOutsideWindow( u8 *dest, u64 count )
+		{
+		u64 bytesRead = 0;
+		while( bytesRead < count )
+			{
+			const u64 position = this->DataPosition;
+			const u64 bytesLeft = count - bytesRead;
+
+			// copy the part which is in the window
+			if( position >= this->WindowBegin && position < this->WindowEnd )
+				{
+				const u64 copyCount = std::min<u64>( bytesLeft, this->WindowEnd - position );
+				memcpy( &dest[bytesRead], &this->Data[position - this->WindowBegin], (size_t)copyCount );
+				this->DataPosition += copyCount;
+				bytesRead += copyCount;
+				continue;
+				}
+
+			// large reads skip the buffer, and are read directly into the destination
+			if( bytesLeft >= this->ChunkSize || bytesLeft >= this->DataSize )
+				{
+				if( !this->HashUpTo( position ) || !this->ReadFileData( position, &dest[bytesRead], bytesLeft ) )
+					{
+					break;
+					}
+				this->DataPosition += bytesLeft;
+				bytesRead += bytesLeft;
+				continue;
+				}
+
+			if( !this->LoadWindow( position ) )
+				{
+				break;
+				}
+			}
+		return bytesRead;
+		}
+
+	};
@@ -0,0 +1,81 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define PDS_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define PDS_TARGET( features )
+#else
+#include <cpuid.h>
+#define PDS_TARGET( features ) __attribute__((target( features )))
+#endif
+#endif
+
+namespace pds
+	{
+	// the instruction set extensions of the cpu, which select the SIMD code paths at runtime. checked once.
+	struct cpu_features
+		{
+		bool Ssse3 = false;
+		bool Sse41 = false;
+		bool ShaExtensions = false;
+		bool Avx2 = false;
+
+		cpu_features()
+			{
+#ifdef PDS_X86
+			u32 leaf1[4] = {};
+			u32 leaf7[4] = {};
+#ifdef _MSC_VER
+			int regs[4] = {};
+			__cpuid( regs, 0 );
+			const u32 maxLeaf = (u32)regs[0];
+			__cpuid( regs, 1 );
+			for( size_t i = 0; i < 4; ++i ) { leaf1[i] = (u32)regs[i]; }
+			if( maxLeaf >= 7 )
+				{
+				__cpuidex( regs, 7, 0 );
+				for( size_t i = 0; i < 4; ++i ) { leaf7[i] = (u32)regs[i]; }
+				}
+#else
+			const u32 maxLeaf = __get_cpuid_max( 0, nullptr );
+			__get_cpuid( 1, &leaf1[0], &leaf1[1], &leaf1[2], &leaf1[3] );
+			if( maxLeaf >= 7 )
+				{
+				__cpuid_count( 7, 0, leaf7[0], leaf7[1], leaf7[2], leaf7[3] );
+				}
+#endif
+			this->Ssse3 = ( leaf1[2] & ( 1u << 9 ) ) != 0;
+			this->Sse41 = ( leaf1[2] & ( 1u << 19 ) ) != 0;
+			const bool osxsave = ( leaf1[2] & ( 1u << 27 ) ) != 0;
+			this->ShaExtensions = this->Ssse3 && this->Sse41 && ( leaf7[1] & ( 1u << 29 ) ) != 0;
+
+			// AVX2 also needs the OS to save the ymm registers
+			if( osxsave && ( leaf7[1] & ( 1u << 5 ) ) != 0 )
+				{
+#ifdef _MSC_VER
+				const u64 xcr0 = _xgetbv( 0 );
+#else
+				u32 xcr0Low = 0;
+				u32 xcr0High = 0;
+				__asm__( "xgetbv" : "=a"( xcr0Low ), "=d"( xcr0High ) : "c"( 0 ) );
+				const u64 xcr0 = ( u64( xcr0High ) << 32 ) | xcr0Low;
+#endif
+				this->Avx2 = ( xcr0 & 0x6 ) == 0x6;
+				}
+#endif//PDS_X86
+			}
+		};
+
+	inline const cpu_features &get_cpu_features()
+		{
+		static const cpu_features features;
+		return features;
+		}
+	};
@@ -0,0 +1,564 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+
+#ifdef _MSC_VER
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+
+namespace pds
+	{
+	// Entity directory locates the loose <sha256-hex>.dat entity files of a store directory.
+	// In the flat layout, all entity files are in the store directory. In the fan-out layout, the files are
+	// spread over 256 subdirectories named by the first byte of the hash, git style: ab/cdef...89.dat,
+	// so that no directory gets too large when the store has millions of entities.
+	// On POSIX, the store directory and the subdirectories are kept open, and entity files are opened
+	// with openat and a file name built on the stack, so no path is allocated for each access.
+	// Caveat: Stores are not converted between the layouts automatically. Use MigrateToFanOut (or the
+	// pds_fanout tool) to move the files of a flat store into the fan-out layout, before opening it as fan-out.
+	class EntityDirectory
+		{
+		public:
+			static const uint SubdirectoryCount = 256;
+
+			// size of a file name buffer, which fits the flat file name, 64 hex digits and ".dat", and a zero
+			static const size_t FileNameSize = 69;
+
+		private:
+			std::string Path;
+			bool UseFanOut = false;
+
+#ifdef _MSC_VER
+			std::atomic<bool> SubdirectoryCreated[SubdirectoryCount];
+#else
+			int DirectoryDescriptor = -1;
+			std::atomic<int> SubdirectoryDescriptors[SubdirectoryCount];
+			std::mutex SubdirectoryMutex;
+
+			int GetDirectoryDescriptor( const hash &id, bool create );
+#endif
+
+			static void WriteHex( char *dest, const u8 *src, size_t count );
+
+			// lists the names of the files in the directory at path. a directory which does not exist has no files.
+			static Status ListDirectory( const std::string &path, std::vector<std::string> &fileNames );
+
+		public:
+			EntityDirectory();
+			EntityDirectory( const EntityDirectory &other ) = delete;
+			EntityDirectory &operator=( const EntityDirectory &other ) = delete;
+			~EntityDirectory() { this->Deinitialize(); }
+
+			// set up the directory of the store at path, in the flat or fan-out layout
+			Status Initialize( const std::string &path, bool useFanOut );
+			void Deinitialize();
+
+			bool IsFanOut() const { return this->UseFanOut; }
+
+			// writes the zero-terminated name of the entity file, relative to its directory, into fileName
+			void GetFileName( const hash &id, char( &fileName )[FileNameSize] ) const;
+
+			// the path of the entity file relative to the store directory, and the full path of the file
+			std::string GetRelativeFilePath( const hash &id ) const;
+			std::string GetFilePath( const hash &id ) const;
+
+			// checks if the entity file exists
+			bool FileExists( const hash &id );
+
+			// gets the size of the entity file. returns false if the file does not exist.
+			bool GetFileSize( const hash &id, u64 &destSize );
+
+			// creates the subdirectory of the entity, if the layout is fan-out and it does not exist.
+			// must be called before an entity file is created by path.
+			Status MakeDirectory( const hash &id );
+
+#ifndef _MSC_VER
+			// opens the entity file with the open flags, relative to its directory. if the flags include
+			// O_CREAT, the subdirectory is created if needed. returns -1 and sets errno on failure.
+			int OpenFile( const hash &id, int flags, mode_t mode = 0 );
+
+			// gets the descriptor of the open directory of the entity file, and writes the name of the file relative to it
+			// into fileName. if create is set, the subdirectory is created if needed. returns -1 on failure.
+			// the descriptor is owned by the directory, and must not be closed.
+			int GetFileLocation( const hash &id, bool create, char( &fileName )[FileNameSize] );
+#endif
+
+			// lists the ids of all entity files in the store directory
+			Status ListEntities( std::vector<hash> &ids ) const;
+
+			// moves the entity files of a flat store at path into the fan-out layout. a file is moved with a
+			// rename, so the move of each file is atomic, and the store can be migrated again if interrupted.
+			static Status MigrateToFanOut( const std::string &path, u64 *movedCount = nullptr );
+		};
+
+	inline EntityDirectory::EntityDirectory()
+		{
+		for( uint i = 0; i < SubdirectoryCount; ++i )
+			{
+#ifdef _MSC_VER
+			this->SubdirectoryCreated[i] = false;
+#else
+			this->SubdirectoryDescriptors[i] = -1;
+#endif
+			}
+		}
+
+	inline Status EntityDirectory::Initialize( const std::string &path, bool useFanOut )
+		{
+		if( !this->Path.empty() )
+			{
+			return Status::EAlreadyInitialized;
+			}
+
+#ifndef _MSC_VER
+		this->DirectoryDescriptor = ::open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+		if( this->DirectoryDescriptor < 0 )
+			{
+			return Status::ECantOpen;
+			}
+#endif
+
+		this->Path = path;
+		this->UseFanOut = useFanOut;
+		return Status::Ok;
+		}
+
+	inline void EntityDirectory::Deinitialize()
+		{
+		if( this->Path.empty() )
+			{
+			return;
+			}
+
+		for( uint i = 0; i < SubdirectoryCount; ++i )
+			{
+#ifdef _MSC_VER
+			this->SubdirectoryCreated[i] = false;
+#else
+			const int descriptor = this->SubdirectoryDescriptors[i].exchange( -1 );
+			if( descriptor >= 0 )
+				{
+				::close( descriptor );
+				}
+#endif
+			}
+
+#ifndef _MSC_VER
+		::close( this->DirectoryDescriptor );
+		this->DirectoryDescriptor = -1;
+#endif
+		this->Path.clear();
+		}
+
+	inline void EntityDirectory::WriteHex( char *dest, const u8 *src, size_t count )
+		{
+		static const char hexDigits[] = "0123456789abcdef";
+		for( size_t i = 0; i < count; ++i )
+			{
+			dest[i * 2 + 0] = hexDigits[src[i] >> 4];
+			dest[i * 2 + 1] = hexDigits[src[i] & 0xf];
+			}
+		}
+
+	inline void EntityDirectory::GetFileName( const hash &id, char( &fileName )[FileNameSize] ) const
+		{
+		// in the fan-out layout, the first byte is the name of the subdirectory
+		const size_t firstByte = this->UseFanOut ? 1 : 0;
+		const size_t hexLength = ( 32 - firstByte ) * 2;
+		WriteHex( fileName, &id.digest[firstByte], 32 - firstByte );
+		memcpy( &fileName[hexLength], ".dat", 5 );
+		}
+
+	inline std::string EntityDirectory::GetRelativeFilePath( const hash &id ) const
+		{
+		char fileName[FileNameSize];
+		this->GetFileName( id, fileName );
+		if( !this->UseFanOut )
+			{
+			return fileName;
+			}
+
+		char subdirectory[4];
+		WriteHex( subdirectory, id.digest, 1 );
+		subdirectory[2] = '/';
+		subdirectory[3] = 0;
+		return std::string( subdirectory ) + fileName;
+		}
+
+	inline std::string EntityDirectory::GetFilePath( const hash &id ) const
+		{
+		return this->Path + "/" + this->GetRelativeFilePath( id );
+		}
+
+	inline Status EntityDirectory::ListEntities( std::vector<hash> &ids ) const
+		{
+		if( this->Path.empty() )
+			{
+			return Status::ENotInitialized;
+			}
+
+		// in the fan-out layout, the first two hex digits are the name of the subdirectory
+		const uint directoryCount = this->UseFanOut ? SubdirectoryCount : 1;
+		const size_t hexLength = this->UseFanOut ? 62 : 64;
+		std::vector<std::string> fileNames;
+		for( uint d = 0; d < directoryCount; ++d )
+			{
+			char hexString[65] = {};
+			std::string directoryPath = this->Path;
+			if( this->UseFanOut )
+				{
+				const u8 subdirectoryIndex = (u8)d;
+				WriteHex( hexString, &subdirectoryIndex, 1 );
+				directoryPath += "/" + std::string( hexString, 2 );
+				}
+
+			fileNames.clear();
+			const Status status = ListDirectory( directoryPath, fileNames );
+			if( status != Status::Ok )
+				{
+				return status;
+				}
+			for( size_t i = 0; i < fileNames.size(); ++i )
+				{
+				// entity files are named <sha256-hex>.dat, skip all other files
+				const std::string &fileName = fileNames[i];
+				if( fileName.size() != hexLength + 4 || fileName.compare( hexLength, 4, ".dat" ) != 0 )
+					{
+					continue;
+					}
+				memcpy( &hexString[64 - hexLength], fileName.c_str(), hexLength );
+				hash id = {};
+				hex_string_to_bytes( &id, hexString, 32 );
+				ids.emplace_back( id );
+				}
+			}
+		return Status::Ok;
+		}
+
+#ifdef _MSC_VER
+
+	inline Status EntityDirectory::ListDirectory( const std::string &path, std::vector<std::string> &fileNames )
+		{
+		WIN32_FIND_DATAA findData = {};
+		HANDLE findHandle = ::FindFirstFileA( ( path + "/*" ).c_str(), &findData );
+		if( findHandle == INVALID_HANDLE_VALUE )
+			{
+			const DWORD error = ::GetLastError();
+			return ( error == ERROR_FILE_NOT_FOUND || error == ERROR_PATH_NOT_FOUND ) ? Status::Ok : Status::ECantOpen;
+			}
+		do
+			{
+			if( ( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) == 0 )
+				{
+				fileNames.emplace_back( findData.cFileName );
+				}
+			}
+		while( ::FindNextFileA( findHandle, &findData ) );
+		::FindClose( findHandle );
+		return Status::Ok;
+		}
+
+	inline bool EntityDirectory::FileExists( const hash &id )
+		{
+		return ::GetFileAttributesA( this->GetFilePath( id ).c_str() ) != INVALID_FILE_ATTRIBUTES;
+		}
+
+	inline bool EntityDirectory::GetFileSize( const hash &id, u64 &destSize )
+		{
+		WIN32_FILE_ATTRIBUTE_DATA attributes = {};
+		if( !::GetFileAttributesExA( this->GetFilePath( id ).c_str(), GetFileExInfoStandard, &attributes ) )
+			{
+			return false;
+			}
+		destSize = ( u64( attributes.nFileSizeHigh ) << 32 ) | u64( attributes.nFileSizeLow );
+		return true;
+		}
+
+	inline Status EntityDirectory::MakeDirectory( const hash &id )
+		{
+		if( !this->UseFanOut || this->SubdirectoryCreated[id.digest[0]] )
+			{
+			return Status::Ok;
+			}
+
+		char subdirectory[3];
+		WriteHex( subdirectory, id.digest, 1 );
+		subdirectory[2] = 0;
+		const std::string subdirectoryPath = this->Path + "/" + subdirectory;
+		if( !::CreateDirectoryA( subdirectoryPath.c_str(), nullptr ) && ::GetLastError() != ERROR_ALREADY_EXISTS )
+			{
+			return Status::ECantWrite;
+			}
+		this->SubdirectoryCreated[id.digest[0]] = true;
+		return Status::Ok;
+		}
+
+	inline Status EntityDirectory::MigrateToFanOut( const std::string &path, u64 *movedCount )
+		{
+		if( movedCount )
+			{
+			*movedCount = 0;
+			}
+
+		WIN32_FIND_DATAA findData = {};
+		HANDLE findHandle = ::FindFirstFileA( ( path + "/*.dat" ).c_str(), &findData );
+		if( findHandle == INVALID_HANDLE_VALUE )
+			{
+			return ( ::GetLastError() == ERROR_FILE_NOT_FOUND ) ? Status::Ok : Status::ECantOpen;
+			}
+		std::vector<std::string> fileNames;
+		do
+			{
+			if( ( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) == 0 )
+				{
+				fileNames.emplace_back( findData.cFileName );
+				}
+			}
+		while( ::FindNextFileA( findHandle, &findData ) );
+		::FindClose( findHandle );
+
+		EntityDirectory directory;
+		Status status = directory.Initialize( path, true );
+		if( status != Status::Ok )
+			{
+			return status;
+			}
+		for( size_t i = 0; i < fileNames.size(); ++i )
+			{
+			// entity files are named <sha256-hex>.dat
+			const std::string &fileName = fileNames[i];
+			if( fileName.size() != 68 || fileName.compare( 64, 4, ".dat" ) != 0 )
+				{
+				continue;
+				}
+			hash id = {};
+			hex_string_to_bytes( &id, fileName.substr( 0, 64 ).c_str(), 32 );
+
+			status = directory.MakeDirectory( id );
+			if( status != Status::Ok )
+				{
+				return status;
+				}
+			const std::string sourcePath = path + "/" + fileName;
+			const std::string destPath = directory.GetFilePath( id );
+			if( !::MoveFileExA( sourcePath.c_str(), destPath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH ) )
+				{
+				pdsErrorLog << "Failed to move entity file: " << sourcePath << pdsErrorLogEnd;
+				return Status::ECantWrite;
+				}
+			if( movedCount )
+				{
+				++( *movedCount );
+				}
+			}
+		return Status::Ok;
+		}
+
+#else
+
+	inline Status EntityDirectory::ListDirectory( const std::string &path, std::vector<std::string> &fileNames )
+		{
+		DIR *dir = ::opendir( path.c_str() );
+		if( !dir )
+			{
+			return ( errno == ENOENT ) ? Status::Ok : Status::ECantOpen;
+			}
+		while( struct dirent *entry = ::readdir( dir ) )
+			{
+			fileNames.emplace_back( entry->d_name );
+			}
+		::closedir( dir );
+		return Status::Ok;
+		}
+
+	inline int EntityDirectory::GetDirectoryDescriptor( const hash &id, bool create )
+		{
+		if( !this->UseFanOut )
+			{
+			return this->DirectoryDescriptor;
+			}
+
+		const u8 subdirectoryIndex = id.digest[0];
+		int descriptor = this->SubdirectoryDescriptors[subdirectoryIndex];
+		if( descriptor >= 0 )
+			{
+			return descriptor;
+			}
+
+		// open the subdirectory once, and keep it open
+		std::lock_guard<std::mutex> lock( this->SubdirectoryMutex );
+		descriptor = this->SubdirectoryDescriptors[subdirectoryIndex];
+		if( descriptor >= 0 )
+			{
+			return descriptor;
+			}
+
+		char subdirectory[3];
+		WriteHex( subdirectory, id.digest, 1 );
+		subdirectory[2] = 0;
+		descriptor = ::openat( this->DirectoryDescriptor, subdirectory, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+		if( descriptor < 0 && errno == ENOENT && create )
+			{
+			// create the subdirectory, and sync the store directory so the subdirectory is durable
+			if( ::mkdirat( this->DirectoryDescriptor, subdirectory, 0755 ) != 0 && errno != EEXIST )
+				{
+				return -1;
+				}
+			::fsync( this->DirectoryDescriptor );
+			descriptor = ::openat( this->DirectoryDescriptor, subdirectory, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+			}
+		if( descriptor >= 0 )
+			{
+			this->SubdirectoryDescriptors[subdirectoryIndex] = descriptor;
+			}
+		return descriptor;
+		}
+
+	inline bool EntityDirectory::FileExists( const hash &id )
+		{
+		const int directoryDescriptor = this->GetDirectoryDescriptor( id, false );
+		if( directoryDescriptor < 0 )
+			{
+			return false;
+			}
+
+		char fileName[FileNameSize];
+		this->GetFileName( id, fileName );
+		return ::faccessat( directoryDescriptor, fileName, F_OK, 0 ) == 0;
+		}
+
+	inline bool EntityDirectory::GetFileSize( const hash &id, u64 &destSize )
+		{
+		const int directoryDescriptor = this->GetDirectoryDescriptor( id, false );
+		if( directoryDescriptor < 0 )
+			{
+			return false;
+			}
+
+		char fileName[FileNameSize];
+		this->GetFileName( id, fileName );
+		struct stat fileStat = {};
+		if( ::fstatat( directoryDescriptor, fileName, &fileStat, 0 ) != 0 )
+			{
+			return false;
+			}
+		destSize = (u64)fileStat.st_size;
+		return true;
+		}
+
+	inline Status EntityDirectory::MakeDirectory( const hash &id )
+		{
+		return ( this->GetDirectoryDescriptor( id, true ) >= 0 ) ? Status::Ok : Status::ECantWrite;
+		}
+
+	inline int EntityDirectory::OpenFile( const hash &id, int flags, mode_t mode )
+		{
+		char fileName[FileNameSize];
+		const int directoryDescriptor = this->GetFileLocation( id, ( flags & O_CREAT ) != 0, fileName );
+		if( directoryDescriptor < 0 )
+			{
+			return -1;
+			}
+		return ::openat( directoryDescriptor, fileName, flags | O_CLOEXEC, mode );
+		}
+
+	inline int EntityDirectory::GetFileLocation( const hash &id, bool create, char( &fileName )[FileNameSize] )
+		{
+		const int directoryDescriptor = this->GetDirectoryDescriptor( id, create );
+		if( directoryDescriptor < 0 )
+			{
+			return -1;
+			}
+		this->GetFileName( id, fileName );
+		return directoryDescriptor;
+		}
+
+	inline Status EntityDirectory::MigrateToFanOut( const std::string &path, u64 *movedCount )
+		{
+		if( movedCount )
+			{
+			*movedCount = 0;
+			}
+
+		DIR *dir = ::opendir( path.c_str() );
+		if( !dir )
+			{
+			return Status::ECantOpen;
+			}
+		std::vector<std::string> fileNames;
+		while( struct dirent *entry = ::readdir( dir ) )
+			{
+			fileNames.emplace_back( entry->d_name );
+			}
+		::closedir( dir );
+
+		EntityDirectory directory;
+		Status status = directory.Initialize( path, true );
+		if( status != Status::Ok )
+			{
+			return status;
+			}
+
+		// move the files with renameat, relative to the open directories
+		std::vector<bool> movedIntoSubdirectory( SubdirectoryCount, false );
+		for( size_t i = 0; i < fileNames.size(); ++i )
+			{
+			// entity files are named <sha256-hex>.dat
+			const std::string &fileName = fileNames[i];
+			if( fileName.size() != 68 || fileName.compare( 64, 4, ".dat" ) != 0 )
+				{
+				continue;
+				}
+			hash id = {};
+			hex_string_to_bytes( &id, fileName.substr( 0, 64 ).c_str(), 32 );
+
+			const int subdirectoryDescriptor = directory.GetDirectoryDescriptor( id, true );
+			if( subdirectoryDescriptor < 0 )
+				{
+				pdsErrorLog << "Failed to create the subdirectory of entity file: " << fileName << pdsErrorLogEnd;
+				return Status::ECantWrite;
+				}
+			char destFileName[FileNameSize];
+			directory.GetFileName( id, destFileName );
+			if( ::renameat( directory.DirectoryDescriptor, fileName.c_str(), subdirectoryDescriptor, destFileName ) != 0 )
+				{
+				pdsErrorLog << "Failed to move entity file: " << fileName << pdsErrorLogEnd;
+				return Status::ECantWrite;
+				}
+			movedIntoSubdirectory[id.digest[0]] = true;
+			if( movedCount )
+				{
+				++( *movedCount );
+				}
+			}
+
+		// make the renames durable
+		for( uint i = 0; i < SubdirectoryCount; ++i )
+			{
+			if( movedIntoSubdirectory[i] )
+				{
+				::fsync( directory.SubdirectoryDescriptors[i] );
+				}
+			}
+		::fsync( directory.DirectoryDescriptor );
+		return Status::Ok;
+		}
+
+#endif
+
+	};
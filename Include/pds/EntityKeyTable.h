@@ -0,0 +1,169 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+namespace pds
+	{
+	// Entity key table holds the keys of a stream which is written with interned keys (see EntityWriter::InternKeys).
+	// The blocks of the stream store the id of their key in the table, instead of the key itself. Ids below 0x80 are
+	// encoded in one byte, and the rest in two bytes, with the top bit of the first byte set. The table is shared by
+	// the write or read stream and the lazy sections of the stream, and is not modified while it is read.
+	class EntityKeyTable
+		{
+		public:
+			// the maximum number of keys in a table, ids must fit in 15 bits
+			static const u16 MaxKeyCount = 0x8000;
+
+		private:
+			std::vector<std::string> Keys;
+			std::unordered_map<u64,u16> IdsByHash; // id of the first key with each hash, other keys with the hash are searched for
+
+			static u64 HashKey( const char *key, const u8 key_length );
+
+		public:
+			// get the id of the key, and add the key to the table if it is not in it. returns false if the table is full.
+			bool Intern( const char *key, const u8 key_length, u16 &dest_id );
+
+			// find the id of the key. returns false if the key is not in the table.
+			bool Find( const char *key, const u8 key_length, u16 &dest_id ) const;
+
+			// returns true if id is the id of the key
+			bool Matches( const u16 id, const char *key, const u8 key_length ) const;
+
+			// the keys of the table, in id order
+			size_t GetKeyCount() const { return this->Keys.size(); }
+			const std::string &GetKey( const u16 id ) const { return this->Keys[id]; }
+
+			// the encoded size of an id, and encode an id into dest, which must have room for 2 bytes. returns the encoded size.
+			static u8 GetIdSize( const u16 id ) { return ( id < 0x80 ) ? 1 : 2; }
+			static u8 EncodeId( const u16 id, u8 *dest );
+		};
+
+	// Entity key id cache maps the keys which are read from a stream to their ids in the key table of the stream, so each key
+	// is looked up in the table once, and the ids of the blocks are then compared as integers. The slot of a key is picked by
+	// its address, since the keys which are read are mostly string literals (see pdsKeyMacro), and the slot holds a copy of
+	// the key, which is compared on each hit, so a key buffer which is reused with a new key is looked up again. The cache
+	// is owned by one read stream, and is cleared when the key table of the stream is set.
+	class EntityKeyIdCache
+		{
+		public:
+			// the number of cached keys, a power of 2
+			static const size_t SlotCount = 32;
+
+		private:
+			struct Slot
+				{
+				const char *Key = nullptr;
+				char KeyData[EntityMaxKeyLength] = {};
+				u8 KeyLength = 0;
+				bool Found = false; // false if the key is not in the table
+				u16 Id = 0;
+				};
+			Slot Slots[SlotCount];
+
+		public:
+			// find the id of the key in the table, and cache it. returns false if the key is not in the table.
+			bool Find( const EntityKeyTable &table, const char *key, const u8 key_length, u16 &dest_id );
+		};
+
+	inline u64 EntityKeyTable::HashKey( const char *key, const u8 key_length )
+		{
+		// FNV-1a
+		u64 hash_value = 0xcbf29ce484222325ull;
+		for( u8 i = 0; i < key_length; ++i )
+			{
+			hash_value = ( hash_value ^ (u8)key[i] ) * 0x100000001b3ull;
+			}
+		return hash_value;
+		}
+
+	inline bool EntityKeyTable::Intern( const char *key, const u8 key_length, u16 &dest_id )
+		{
+		if( this->Find( key, key_length, dest_id ) )
+			{
+			return true;
+			}
+		if( this->Keys.size() >= MaxKeyCount )
+			{
+			pdsErrorLog << "The key table is full, a stream with interned keys can have at most " << MaxKeyCount << " different keys" << pdsErrorLogEnd;
+			return false;
+			}
+
+		dest_id = (u16)this->Keys.size();
+		this->Keys.emplace_back( key, key_length );
+		this->IdsByHash.emplace( HashKey( key, key_length ), dest_id );
+		return true;
+		}
+
+	inline bool EntityKeyTable::Find( const char *key, const u8 key_length, u16 &dest_id ) const
+		{
+		const auto it = this->IdsByHash.find( HashKey( key, key_length ) );
+		if( it == this->IdsByHash.end() )
+			{
+			return false;
+			}
+		if( this->Matches( it->second, key, key_length ) )
+			{
+			dest_id = it->second;
+			return true;
+			}
+
+		// another key has the same hash, search the rest of the keys
+		for( size_t id = (size_t)it->second + 1; id < this->Keys.size(); ++id )
+			{
+			if( this->Matches( (u16)id, key, key_length ) )
+				{
+				dest_id = (u16)id;
+				return true;
+				}
+			}
+		return false;
+		}
+
+	inline bool EntityKeyTable::Matches( const u16 id, const char *key, const u8 key_length ) const
+		{
+		if( id >= this->Keys.size() )
+			{
+			return false;
+			}
+		const std::string &table_key = this->Keys[id];
+		return table_key.size() == key_length && memcmp( table_key.data(), key, key_length ) == 0;
+		}
+
+	inline u8 EntityKeyTable::EncodeId( const u16 id, u8 *dest )
+		{
+		pdsSanityCheckDebugMacro( id < MaxKeyCount );
+		if( id < 0x80 )
+			{
+			dest[0] = (u8)id;
+			return 1;
+			}
+		dest[0] = (u8)( 0x80 | ( id >> 8 ) );
+		dest[1] = (u8)( id & 0xff );
+		return 2;
+		}
+
+	inline bool EntityKeyIdCache::Find( const EntityKeyTable &table, const char *key, const u8 key_length, u16 &dest_id )
+		{
+		// literals are packed without alignment, so mix the bits of the address before picking the slot
+		const u64 address = (u64)reinterpret_cast<uintptr_t>( key );
+		Slot &slot = this->Slots[( ( address * 0x9e3779b97f4a7c15ull ) >> 32 ) & ( SlotCount - 1 )];
+		pdsSanityCheckDebugMacro( key_length <= EntityMaxKeyLength );
+		if( slot.Key != key || slot.KeyLength != key_length || memcmp( slot.KeyData, key, key_length ) != 0 )
+			{
+			slot.Key = key;
+			memcpy( slot.KeyData, key, key_length );
+			slot.KeyLength = key_length;
+			slot.Found = table.Find( key, key_length, slot.Id );
+			}
+		dest_id = slot.Id;
+		return slot.Found;
+		}
+	};
@@ -4,6 +4,7 @@
 #pragma once
 
 #include <pds/DataValuePointers.h>
+#include <pds/EntityKeyTable.h>
 
 // value_type: the ValueType enum to read the block as
 // object_type: the C++ object that stores the data (can be a basic type), such as u32, or glm::vec3
@@ -19,6 +20,33 @@ namespace pds
 		success // success, has value
 		};
 
+	// reads the id of an interned key (see EntityKeyTable), which is one or two bytes
+	inline u16 read_key_id( MemoryReadStream &sstream )
+		{
+		const u8 first_byte = sstream.Read<u8>();
+		if( first_byte < 0x80 )
+			{
+			return first_byte;
+			}
+		return (u16)( ( u16( first_byte & 0x7f ) << 8 ) | sstream.Read<u8>() );
+		}
+
+	// reads the id of an interned key, and makes sure it is the id of the key in the key table of the stream.
+	// the id of the key is looked up once per stream (see EntityKeyIdCache), so the ids are compared as integers
+	inline bool read_and_match_key_id( MemoryReadStream &sstream, const char *key, const u8 key_size_in_bytes )
+		{
+		pdsSanityCheckCoreDebugMacro( sstream.GetKeyTable() && sstream.GetKeyIdCache() );
+		const u16 key_id = read_key_id( sstream );
+		u16 expected_key_id = 0;
+		if( !sstream.GetKeyIdCache()->Find( *sstream.GetKeyTable(), key, key_size_in_bytes, expected_key_id ) || key_id != expected_key_id )
+			{
+			std::string expected_key_name( key, key_size_in_bytes );
+			pdsErrorLog << "Unexpected key id in the stream. Expected name: " << expected_key_name << " read id: " << key_id << pdsErrorLogEnd;
+			return false;
+			}
+		return true;
+		}
+
 	// read the header of a large block
 	// returns the stream position of the expected end of the block, to validate the read position
 	// a stream position of 0 is not possible, and indicates error
@@ -45,6 +73,16 @@ namespace pds
 			return 0;
 			}
 
+		// if the stream interns keys, the block has the id of the key instead of the key
+		if( sstream.GetKeyTable() )
+			{
+			if( !read_and_match_key_id( sstream, key, key_size_in_bytes ) )
+				{
+				return 0;
+				}
+			return expected_end_pos;
+			}
+
 		// read in the key length
 		const u8 read_key_size_in_bytes = sstream.Read<u8>();
 		if( read_key_size_in_bytes != key_size_in_bytes )
@@ -69,6 +107,58 @@ namespace pds
 		return expected_end_pos;
 		}
 
+	// returns true if the size is a possible size of the value of a small block of the value type, or 0 for an empty value
+	inline bool is_small_block_value_size( const u8 value_type, const u64 value_size )
+		{
+		if( value_size == 0 )
+			{
+			return true;
+			}
+		switch( (ValueType)value_type )
+			{
+			case ValueType::VT_Bool: return value_size == 1;
+			case ValueType::VT_Int:
+			case ValueType::VT_UInt: return value_size == 1 || value_size == 2 || value_size == 4 || value_size == 8;
+			case ValueType::VT_Float: return value_size == 4 || value_size == 8;
+			case ValueType::VT_Vec2: return value_size == 8 || value_size == 16;
+			case ValueType::VT_Vec3: return value_size == 12 || value_size == 24;
+			case ValueType::VT_Vec4: return value_size == 16 || value_size == 32;
+			case ValueType::VT_IVec2:
+			case ValueType::VT_UVec2: return value_size == 2 || value_size == 4 || value_size == 8 || value_size == 16;
+			case ValueType::VT_IVec3:
+			case ValueType::VT_UVec3: return value_size == 3 || value_size == 6 || value_size == 12 || value_size == 24;
+			case ValueType::VT_IVec4:
+			case ValueType::VT_UVec4: return value_size == 4 || value_size == 8 || value_size == 16 || value_size == 32;
+			case ValueType::VT_Mat2: return value_size == 16 || value_size == 32;
+			case ValueType::VT_Mat3: return value_size == 36 || value_size == 72;
+			case ValueType::VT_Mat4: return value_size == 64 || value_size == 128;
+			case ValueType::VT_Quat: return value_size == 16 || value_size == 32;
+			case ValueType::VT_Uuid: return value_size == 16;
+			case ValueType::VT_Hash: return value_size == 32;
+			default: return false;
+			}
+		}
+
+	// small blocks do not store the length of the key, so a key which matches the end of a small block may also be the end of a 
+	// longer key, after a smaller value. checks if the bytes before the key, prefix_size bytes at prefix, can be the start of a 
+	// longer key (identifier characters, like the member names which are used as keys), with a value size which is valid for the value type.
+	inline bool is_small_block_key_ambiguous( const u8 value_type, const char *prefix, const u64 prefix_size, const u64 value_size )
+		{
+		for( u64 extra_size = 1; extra_size <= prefix_size; ++extra_size )
+			{
+			const char c = prefix[prefix_size - extra_size];
+			if( !( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || ( c >= '0' && c <= '9' ) || c == '_' ) )
+				{
+				return false;
+				}
+			if( is_small_block_value_size( value_type, value_size - extra_size ) )
+				{
+				return true;
+				}
+			}
+		return false;
+		}
+
 	// ends the block, write the size of the block
 	inline bool end_read_large_block( MemoryReadStream &sstream, u64 expected_end_pos )
 		{
@@ -97,17 +187,32 @@ namespace pds
 			return reader_status::fail;
 			}
 
+		// read in size of the small block
+		const u64 block_size = sstream.Read<u8>();
+
+		// if the stream interns keys, the id of the key is before the value, else the key is after the value
+		const bool has_key_id = ( sstream.GetKeyTable() != nullptr );
+		u64 key_size_in_block = key_size_in_bytes;
+		if( has_key_id )
+			{
+			const u64 key_id_position = sstream.GetPosition();
+			if( !read_and_match_key_id( sstream, key, key_size_in_bytes ) )
+				{
+				return reader_status::fail;
+				}
+			key_size_in_block = sstream.GetPosition() - key_id_position;
+			}
+
 		// calc the expected possible sizes. if empty value, the data size must be 0, else it is the expected size based on the item type (I) and count (IC)
 		const u64 dest_data_size_in_bytes = value_size * value_count;
-		const u64 expected_block_size_if_empty = key_size_in_bytes;
+		const u64 expected_block_size_if_empty = key_size_in_block;
 		const u64 expected_block_size = dest_data_size_in_bytes + expected_block_size_if_empty;
 
 		pdsSanityCheckCoreDebugMacro( key_size_in_bytes <= EntityMaxKeyLength );
 		pdsSanityCheckCoreDebugMacro( expected_block_size < 256 ); // must fit in a byte
 
-		// read in size of the small block, if the size does not match the expected block size, check if empty value is ok (is_optional_value == true), and if not raise error
+		// if the size does not match the expected block size, check if empty value is ok (is_optional_value == true), and if not raise error
 		// any size other than expected_block_size is regarded as empty, and we will check that size if empty is actually allowed
-		const u64 block_size = sstream.Read<u8>();
 		const bool is_empty_value = (block_size != expected_block_size) ? true : false;
 		if( is_empty_value )
 			{
@@ -139,16 +244,19 @@ namespace pds
 				}
 			}
 
-		// read in the key data
-		char read_key[EntityMaxKeyLength];
-		const u64 read_key_length = sstream.Read( (u8 *)read_key, (u64)key_size_in_bytes );
-		if( read_key_length != (u64)key_size_in_bytes
-			|| memcmp( key, read_key, (u64)key_size_in_bytes ) != 0 )
+		// read in the key data, if the key is not interned
+		if( !has_key_id )
 			{
-			std::string expected_key_name( key, key_size_in_bytes );
-			std::string read_key_name( read_key, key_size_in_bytes ); // cap string at lenght of expected data
-			pdsErrorLog << "Unexpected key name in the stream. Expected name: " << expected_key_name << " read name: " << read_key_name << pdsErrorLogEnd;
-			return reader_status::fail;
+			char read_key[EntityMaxKeyLength];
+			const u64 read_key_length = sstream.Read( (u8 *)read_key, (u64)key_size_in_bytes );
+			if( read_key_length != (u64)key_size_in_bytes
+				|| memcmp( key, read_key, (u64)key_size_in_bytes ) != 0 )
+				{
+				std::string expected_key_name( key, key_size_in_bytes );
+				std::string read_key_name( read_key, key_size_in_bytes ); // cap string at lenght of expected data
+				pdsErrorLog << "Unexpected key name in the stream. Expected name: " << expected_key_name << " read name: " << read_key_name << pdsErrorLogEnd;
+				return reader_status::fail;
+				}
 			}
 
 		// get the position beyond the end of the block, and validate position
@@ -179,6 +287,19 @@ namespace pds
 		return status;
 		};
 
+	// skips over the padding before the values of an array or string, a u8 with the size of the padding, and the padding
+	inline bool read_payload_padding( MemoryReadStream &sstream, const u64 block_end_position )
+		{
+		const u8 padding_size = sstream.Read<u8>();
+		if( padding_size >= EntityMaxPayloadAlignment || sstream.GetPosition() + padding_size > block_end_position )
+			{
+			pdsErrorLog << "The padding size in the stream is invalid, it is beyond the size of the value block" << pdsErrorLogEnd;
+			return false;
+			}
+		sstream.SetPosition( sstream.GetPosition() + padding_size );
+		return true;
+		}
+
 	// template method that Reads a small block of a specific ValueType VT to the stream. Since most value types 
 	// can have different bit depths, the second parameter I is the actual type of the data stored. The data can have more than one values of type I, the count is stored in IC.
 	template<> inline reader_status read_single_item<ValueType::VT_String, string>( MemoryReadStream &sstream, const char *key, const u8 key_size_in_bytes, const bool empty_value_is_allowed, string *dest_data )
@@ -219,8 +340,16 @@ namespace pds
 				}
 			}
 
-		// non-empty, read in the string size
-		const u64 string_size = sstream.Read<u64>();
+		// non-empty, read in the string size. if the top bit is set, the characters are padded
+		const u64 string_size_and_flag = sstream.Read<u64>();
+		const u64 string_size = string_size_and_flag & ~0x8000000000000000ull;
+		if( ( string_size_and_flag & 0x8000000000000000ull ) != 0 )
+			{
+			if( !read_payload_padding( sstream, expected_end_position ) )
+				{
+				return reader_status::fail;
+				}
+			}
 
 		// make sure the item count is plausible before allocating the vector
 		const u64 expected_string_size = (expected_end_position - sstream.GetPosition());
@@ -278,7 +407,8 @@ namespace pds
 			}
 		}
 
-	// reads an array header and value size from the stream, and decodes into flags, then reads the index if one exists. 
+	// reads an array header and value size from the stream, and decodes into flags, then reads the index if one exists,
+	// and skips over the padding before the values if the values are padded
 	inline bool read_array_metadata_and_index( MemoryReadStream &sstream, size_t &out_per_item_size, size_t &out_item_count, const u64 block_end_position , std::vector<i32> *dest_index )
 		{
 		static_assert(sizeof( u64 ) <= sizeof( size_t ), "Unsupported size_t, current code requires it to be at least 8 bytes in size, equal to u64");
@@ -290,6 +420,7 @@ namespace pds
 		out_per_item_size = (size_t)(array_flags & 0xff);
 		const bool has_index = (array_flags & 0x100) != 0;
 		const bool index_is_64bit = (array_flags & 0x200) != 0;
+		const bool is_padded = (array_flags & 0x400) != 0;
 
 		// we don't support 64 bit index (yet)
 		if( index_is_64bit )
@@ -347,6 +478,15 @@ namespace pds
 			return false;
 			}
 
+		// if padded, skip the padding
+		if( is_padded )
+			{
+			if( !read_payload_padding( sstream, block_end_position ) )
+				{
+				return false;
+				}
+			}
+
 		return true;
 		}
 
@@ -416,6 +556,77 @@ namespace pds
 		return reader_status::success;
 		}
 
+	// reads an array block as a view of the values in the data of the stream, without copying them. if the stream flips the byte order,
+	// does not have all of its data in memory, or the values are not aligned for T in the data, the values are read into dest_copy, 
+	// and the view is of dest_copy.
+	template<ValueType VT, class T> inline reader_status read_array_view( MemoryReadStream &sstream, const char *key, const u8 key_size_in_bytes, array_view<T> &dest_view, std::vector<T> &dest_copy )
+		{
+		static_assert((VT >= ValueType::VT_Array_Bool) && (VT <= ValueType::VT_Array_Hash), "Invalid type for generic read_array_view template");
+		const size_t value_size = sizeof( typename data_type_information<T>::value_type );
+
+		// read block header, the array must not be empty
+		const u64 block_end_position = begin_read_large_block( sstream, VT, key, key_size_in_bytes );
+		if( block_end_position == 0 )
+			{
+			pdsErrorLog << "begin_read_large_block() failed unexpectedly" << pdsErrorLogEnd;
+			return reader_status::fail;
+			}
+		else if( block_end_position == sstream.GetPosition() )
+			{
+			return end_read_empty_large_block( sstream, key, false, block_end_position );
+			}
+
+		// read item size & count, views are not made of arrays with an index
+		size_t per_item_size = 0;
+		size_t item_count = 0;
+		if( !read_array_metadata_and_index( sstream, per_item_size, item_count, block_end_position, nullptr ) )
+			{
+			return reader_status::fail;
+			}
+		if( value_size != per_item_size )
+			{
+			pdsErrorLog << "The size of the items in the stream does not match the expected size" << pdsErrorLogEnd;
+			return reader_status::fail;
+			}
+		const u64 maximum_possible_item_count = (block_end_position - sstream.GetPosition()) / value_size;
+		if( item_count > maximum_possible_item_count )
+			{
+			pdsErrorLog << "The array item count in the stream is invalid, it is beyond the size of the block" << pdsErrorLogEnd;
+			return reader_status::fail;
+			}
+		const u64 type_count = item_count / data_type_information<T>::value_count;
+
+		// point into the data of the stream if the values can be used as is, else read a copy of the values
+		const u64 data_position = sstream.GetPosition();
+		const u8 *data = sstream.GetData();
+		if( data && !sstream.GetFlipByteOrder() && ( (size_t)( data + data_position ) % alignof( T ) ) == 0 )
+			{
+			dest_view = array_view<T>( (const T *)( data + data_position ), (size_t)type_count );
+			sstream.SetPosition( data_position + item_count * value_size );
+			}
+		else
+			{
+			dest_copy.resize( type_count );
+			T *p_data = dest_copy.data();
+			const u64 read_item_count = sstream.Read( value_ptr( *p_data ), item_count );
+			if( read_item_count != item_count )
+				{
+				pdsErrorLog << "The stream could not read all the items for the array" << pdsErrorLogEnd;
+				return reader_status::fail;
+				}
+			dest_view = array_view<T>( dest_copy.data(), dest_copy.size() );
+			}
+
+		// make sure we are at the expected end pos
+		if( !end_read_large_block( sstream, block_end_position ) )
+			{
+			pdsErrorLog << "End position of data " << sstream.GetPosition() << " does not equal the expected end position which is " << block_end_position << pdsErrorLogEnd;
+			return reader_status::fail;
+			}
+
+		return reader_status::success;
+		}
+
 	// read_array implementation for bool arrays (which need specific packing)
 	template <> inline reader_status read_array<ValueType::VT_Array_Bool, bool>( MemoryReadStream &sstream, const char *key, const u8 key_size_in_bytes, const bool empty_value_is_allowed, std::vector<bool> *dest_items, std::vector<i32> *dest_index )
 		{
@@ -556,14 +767,271 @@ namespace pds
 		}
 
 #ifdef PDS_MAIN_BUILD_FILE
-	EntityReader::EntityReader( MemoryReadStream &_sstream ) : sstream( _sstream ) , end_position( _sstream.GetSize() )
+	EntityReader::EntityReader( MemoryReadStream &_sstream ) : sstream( _sstream ) , begin_position( _sstream.GetPosition() ) , end_position( _sstream.GetSize() )
 		{
 		}
 
-	EntityReader::EntityReader( MemoryReadStream &_sstream , const u64 _end_position ) : sstream( _sstream ) , end_position( _end_position )
+	EntityReader::EntityReader( MemoryReadStream &_sstream , const u64 _end_position ) : sstream( _sstream ) , begin_position( _sstream.GetPosition() ) , end_position( _end_position )
 		{
 		}
 
+	bool EntityReader::find_block( const char *key, const u8 key_length, u64 &dest_position ) const
+		{
+		pdsSanityCheckDebugMacro( key_length <= EntityMaxKeyLength ); // max key length
+
+		// if the stream interns keys, the blocks are matched by the id of the key. if the key is not in the table, it is not in the stream
+		const EntityKeyTable *key_table = this->sstream.GetKeyTable().get();
+		u16 key_id = 0;
+		if( key_table && !this->sstream.GetKeyIdCache()->Find( *key_table, key, key_length, key_id ) )
+			{
+			return false;
+			}
+
+		// walk the block headers from the beginning of the reader, and skip each block by its size
+		const u64 start_position = this->sstream.GetPosition();
+		char read_key[EntityMaxKeyLength];
+		u64 position = this->begin_position;
+		bool found = false;
+		while( !found && position < this->end_position )
+			{
+			this->sstream.SetPosition( position );
+			const u8 value_type = this->sstream.Read<u8>();
+			u64 block_end_position = 0;
+			if( value_type >= 0x40 )
+				{
+				// large block, the key length is stored before the key. the key table blocks have no key, and are skipped
+				const u64 block_size = this->sstream.Read<u64>();
+				if( block_size > this->end_position - this->sstream.GetPosition() )
+					{
+					break;
+					}
+				block_end_position = this->sstream.GetPosition() + block_size;
+				if( key_table )
+					{
+					found = ( value_type != (u8)ValueType::VT_KeyTable && block_size > 0 && read_key_id( this->sstream ) == key_id );
+					}
+				else if( value_type != (u8)ValueType::VT_KeyTable && this->sstream.Read<u8>() == key_length )
+					{
+					this->sstream.Read( (i8 *)read_key, (u64)key_length );
+					found = ( memcmp( key, read_key, (u64)key_length ) == 0 );
+					}
+				}
+			else
+				{
+				// small block, the key is at the end of the block, after the value, or the key id is before the value
+				const u64 block_size = this->sstream.Read<u8>();
+				if( block_size > this->end_position - this->sstream.GetPosition() )
+					{
+					break;
+					}
+				block_end_position = this->sstream.GetPosition() + block_size;
+				if( key_table )
+					{
+					found = ( block_size > 0 && read_key_id( this->sstream ) == key_id 
+						&& this->sstream.GetPosition() <= block_end_position
+						&& is_small_block_value_size( value_type, block_end_position - this->sstream.GetPosition() ) );
+					}
+				else if( block_size >= key_length && is_small_block_value_size( value_type, block_size - key_length ) )
+					{
+					// read the key, and the value bytes before it which could be part of a longer key. if the block could hold
+					// a longer key which ends with the key, it is not used, since it can't be told which key was written
+					const u64 value_size = block_size - key_length;
+					const u64 max_prefix_size = EntityMaxKeyLength - key_length;
+					const u64 prefix_size = ( value_size < max_prefix_size ) ? value_size : max_prefix_size;
+					char block_tail[EntityMaxKeyLength];
+					this->sstream.SetPosition( block_end_position - key_length - prefix_size );
+					this->sstream.Read( (i8 *)block_tail, prefix_size + key_length );
+					found = ( memcmp( key, &block_tail[prefix_size], (u64)key_length ) == 0 
+						&& !is_small_block_key_ambiguous( value_type, block_tail, prefix_size, value_size ) );
+					}
+				}
+
+			if( !found )
+				{
+				position = block_end_position;
+				}
+			}
+
+		this->sstream.SetPosition( start_position );
+		if( found )
+			{
+			dest_position = position;
+			}
+		return found;
+		}
+
+	bool EntityReader::ReadKeyTable()
+		{
+		// a stream with interned keys starts with a block which has the position of the key table block
+		const u64 start_position = this->sstream.GetPosition();
+		if( start_position >= this->end_position || this->sstream.Peek() != (u8)ValueType::VT_KeyTable )
+			{
+			return true;
+			}
+		this->sstream.Read<u8>();
+		const u64 header_size = this->sstream.Read<u64>();
+		const u64 table_position = this->sstream.Read<u64>();
+		const u64 data_position = this->sstream.GetPosition();
+		bool success = ( header_size == sizeof( u64 ) && table_position >= data_position && table_position < this->end_position );
+
+		// read the keys of the table, in id order
+		std::shared_ptr<EntityKeyTable> key_table = std::make_shared<EntityKeyTable>();
+		if( success )
+			{
+			this->sstream.SetPosition( table_position );
+			success = ( this->sstream.Read<u8>() == (u8)ValueType::VT_KeyTable );
+			const u64 table_size = this->sstream.Read<u64>();
+			success = success && ( table_size <= this->end_position - this->sstream.GetPosition() );
+			const u64 table_end_position = this->sstream.GetPosition() + table_size;
+			const u16 key_count = this->sstream.Read<u16>();
+			success = success && ( key_count <= EntityKeyTable::MaxKeyCount );
+			for( u16 key_index = 0; success && key_index < key_count; ++key_index )
+				{
+				char key[EntityMaxKeyLength];
+				const u8 key_length = this->sstream.Read<u8>();
+				u16 key_id = 0;
+				success = ( key_length <= EntityMaxKeyLength )
+					&& ( this->sstream.Read( (i8 *)key, (u64)key_length ) == key_length )
+					&& key_table->Intern( key, key_length, key_id )
+					&& ( key_id == key_index ); // each key is only in the table once
+				}
+			success = success && ( this->sstream.GetPosition() == table_end_position );
+			}
+		if( !success )
+			{
+			this->sstream.SetPosition( start_position );
+			pdsErrorLog << "The key table could not be read, the stream is probably corrupted" << pdsErrorLogEnd;
+			return false;
+			}
+
+		// the blocks are read from after the first block
+		this->sstream.SetPosition( data_position );
+		this->sstream.SetKeyTable( key_table );
+		return true;
+		}
+
+	bool EntityReader::ReadTableOfContents()
+		{
+		u64 table_position = 0;
+		if( !this->find_block( pdsKeyMacro( "TableOfContents" ), table_position ) )
+			{
+			return true;
+			}
+
+		// read the paths and positions of the table, and restore the position of the reader
+		const u64 start_position = this->sstream.GetPosition();
+		this->sstream.SetPosition( table_position );
+		std::vector<string> keys;
+		std::vector<u64> positions;
+		const u64 end_of_section = begin_read_large_block( this->sstream, ValueType::VT_Subsection, pdsKeyMacro( "TableOfContents" ) );
+		const bool success = ( end_of_section != 0 )
+			&& read_array<ValueType::VT_Array_String, string>( this->sstream, pdsKeyMacro( "Keys" ), false, &keys, nullptr ) == reader_status::success
+			&& read_array<ValueType::VT_Array_UInt, u64>( this->sstream, pdsKeyMacro( "Positions" ), false, &positions, nullptr ) == reader_status::success
+			&& end_read_large_block( this->sstream, end_of_section )
+			&& keys.size() == positions.size();
+		this->sstream.SetPosition( start_position );
+		if( !success )
+			{
+			pdsErrorLog << "The table of contents could not be read, the stream is probably corrupted" << pdsErrorLogEnd;
+			return false;
+			}
+
+		// if a key is written more than once in a section, the first block is used, like when the blocks are scanned
+		std::shared_ptr<std::unordered_map<std::string,u64>> table = std::make_shared<std::unordered_map<std::string,u64>>();
+		table->reserve( keys.size() );
+		for( size_t i = 0; i < keys.size(); ++i )
+			{
+			if( positions[i] >= this->sstream.GetSize() )
+				{
+				pdsErrorLog << "The table of contents has a position beyond the end of the stream, the stream is probably corrupted" << pdsErrorLogEnd;
+				return false;
+				}
+			table->emplace( std::move( keys[i] ), positions[i] );
+			}
+		this->table_of_contents = std::move( table );
+		this->table_of_contents_path.clear();
+		return true;
+		}
+
+	bool EntityReader::Seek( const char *key, const u8 key_length )
+		{
+		if( this->active_subsection )
+			{
+			pdsErrorLog << "There is an active subsection, it must be ended before the reader can seek." << pdsErrorLogEnd;
+			return false;
+			}
+		if( this->is_sections_array )
+			{
+			pdsErrorLog << "The sections in a sections array are not named, and can not be found with Seek." << pdsErrorLogEnd;
+			return false;
+			}
+
+		u64 position = 0;
+		if( this->table_of_contents )
+			{
+			const auto it = this->table_of_contents->find( this->table_of_contents_path + std::string( key, key_length ) );
+			if( it == this->table_of_contents->end() || it->second < this->begin_position || it->second >= this->end_position )
+				{
+				return false;
+				}
+			position = it->second;
+			}
+		else if( !this->find_block( key, key_length, position ) )
+			{
+			return false;
+			}
+
+		this->sstream.SetPosition( position );
+		this->has_seeked = true;
+		return true;
+		}
+
+	void EntityReader::collect_referenced_entities( const entity_ref *refs, const size_t count )
+		{
+		if( !this->referenced_entities )
+			{
+			return;
+			}
+		for( size_t i = 0; i < count; ++i )
+			{
+			if( refs[i] )
+				{
+				this->referenced_entities->emplace_back( refs[i] );
+				}
+			}
+		}
+
+	bool EntityReader::DeferBlock( const char *key, const u8 key_length, LazySection &dest, void *obj, bool (*decode)( void *obj, EntityReader &reader ) )
+		{
+		// read the header of the block, which must be a large block that ends within the reader
+		const u64 start_position = this->sstream.GetPosition();
+		const u8 value_type = this->sstream.Peek();
+		if( value_type < 0x40 )
+			{
+			pdsErrorLog << "The type in the input stream:" << (u32)value_type << " is not a large block type, and can't be deferred" << pdsErrorLogEnd;
+			return false;
+			}
+		const u64 end_of_block = begin_read_large_block( this->sstream, (ValueType)value_type, key, key_length );
+		if( end_of_block == 0 || end_of_block > this->end_position )
+			{
+			pdsErrorLog << "begin_read_large_block() failed unexpectedly, stream is probably corrupted" << pdsErrorLogEnd;
+			return false;
+			}
+		const u64 block_size = end_of_block - start_position;
+		this->sstream.SetPosition( start_position );
+
+		// decode small blocks directly. the data of a stream which is not all in memory can't be held, so it is decoded directly as well
+		if( block_size < EntityMinDeferredBlockSize || !this->sstream.GetData() )
+			{
+			return decode( obj, *this );
+			}
+
+		// defer the whole block, including the header, and skip past it
+		dest.Defer( this->deferred_source, this->sstream.GetData() + start_position, block_size, this->sstream.GetFlipByteOrder(), this->sstream.GetKeyTable(), decode );
+		this->sstream.SetPosition( end_of_block );
+		return true;
+		}
+
 	// Read a section. 
 	// If the section is null, the section is directly closed, nullptr+success is returned 
 	// from BeginReadSection, and EndReadSection shall not be called.
@@ -593,6 +1061,13 @@ namespace pds
 
 		// allocate the subsection and return it to the caller to be used to read items in the subsection
 		this->active_subsection = std::unique_ptr<EntityReader>( new EntityReader( this->sstream , end_of_section ) );
+		this->active_subsection->referenced_entities = this->referenced_entities;
+		this->active_subsection->deferred_source = this->deferred_source;
+		if( this->table_of_contents )
+			{
+			this->active_subsection->table_of_contents = this->table_of_contents;
+			this->active_subsection->table_of_contents_path = this->table_of_contents_path + std::string( key, key_length ) + '/';
+			}
 		return std::tuple<EntityReader *, bool>( this->active_subsection.get(), true );
 		}
 
@@ -604,6 +1079,12 @@ namespace pds
 			return false;
 			}
 
+		// a section which was read in any order with Seek is not read to the end, so skip to the end
+		if( this->active_subsection->has_seeked )
+			{
+			this->sstream.SetPosition( this->active_subsection->end_position );
+			}
+
 		if( !end_read_large_block( this->sstream, this->active_subsection->end_position ) )
 			{
 			pdsErrorLog << "end_read_large_block failed unexpectedly, the stream is probably corrupted." << pdsErrorLogEnd;
@@ -652,6 +1133,9 @@ namespace pds
 
 		// allocate the subsection and return it to the caller to be used to read items in the subsection
 		this->active_subsection = std::unique_ptr<EntityReader>( new EntityReader( this->sstream , end_of_section ) );
+		this->active_subsection->referenced_entities = this->referenced_entities;
+		this->active_subsection->deferred_source = this->deferred_source;
+		this->active_subsection->is_sections_array = true;
 		return std::tuple<EntityReader *, size_t, bool>( this->active_subsection.get(), this->active_subsection_array_size, true );
 		}
 
@@ -0,0 +1,158 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+
+namespace pds
+	{
+	// Entity scrubber re-verifies all entities of a store on a background thread, to find entities which
+	// were corrupted on disk after they were written. The scrubber lists the entities of the store, verifies
+	// them one by one, and starts over when all are verified. The reads are spread out in time, so that the
+	// scrubber reads at most a set number of bytes per second, and does not compete with the loads of the store.
+	// Listing and verifying is done by callbacks, so the scrubber does not depend on how the store is laid out.
+	class EntityScrubber
+		{
+		public:
+			// lists the ids of all entities to verify in a pass
+			typedef std::function<void( std::vector<hash> &ids )> ListFunction;
+
+			// verifies the entity, and sets bytesRead to the number of bytes read from the store
+			typedef std::function<Status( const hash &id, u64 &bytesRead )> VerifyFunction;
+
+			// the shortest time of a pass, so a small store is not read over and over
+			static const uint MinimumPassMilliseconds = 1000;
+
+		private:
+			ListFunction ListEntities;
+			VerifyFunction VerifyEntity;
+			u64 BytesPerSecond = 0;
+
+			std::thread ScrubThread;
+			std::mutex StopMutex;
+			std::condition_variable StopCondition;
+			bool Stopping = false;
+
+			// statistics
+			std::atomic<u64> ScrubbedEntityCount;
+			std::atomic<u64> ScrubbedByteCount;
+			std::atomic<u64> CorruptedEntityCount;
+			std::atomic<u64> PassCount;
+
+			void ScrubThreadLoop();
+
+			// waits until the time point, returns false if the scrubber is stopped while waiting
+			bool WaitUntil( std::chrono::steady_clock::time_point timePoint );
+
+		public:
+			EntityScrubber() : ScrubbedEntityCount( 0 ), ScrubbedByteCount( 0 ), CorruptedEntityCount( 0 ), PassCount( 0 ) {}
+			EntityScrubber( const EntityScrubber &other ) = delete;
+			EntityScrubber &operator=( const EntityScrubber &other ) = delete;
+			~EntityScrubber() { this->Stop(); }
+
+			// start the scrub thread, which reads at most bytesPerSecond bytes per second
+			Status Start( u64 bytesPerSecond, ListFunction listEntities, VerifyFunction verifyEntity );
+
+			// stop the scrub thread. the entity which is being verified is finished first
+			void Stop();
+
+			// number of verified entities and bytes, number of entities which failed to verify
+			// with ECorrupted, and number of completed passes over all entities of the store
+			u64 GetScrubbedEntityCount() const { return this->ScrubbedEntityCount; }
+			u64 GetScrubbedByteCount() const { return this->ScrubbedByteCount; }
+			u64 GetCorruptedEntityCount() const { return this->CorruptedEntityCount; }
+			u64 GetPassCount() const { return this->PassCount; }
+		};
+
+	inline Status EntityScrubber::Start( u64 bytesPerSecond, ListFunction listEntities, VerifyFunction verifyEntity )
+		{
+		if( this->ScrubThread.joinable() )
+			{
+			return Status::EAlreadyInitialized;
+			}
+		if( bytesPerSecond == 0 || !listEntities || !verifyEntity )
+			{
+			return Status::EParam;
+			}
+
+		this->ListEntities = std::move( listEntities );
+		this->VerifyEntity = std::move( verifyEntity );
+		this->BytesPerSecond = bytesPerSecond;
+		this->Stopping = false;
+		this->ScrubThread = std::thread( &EntityScrubber::ScrubThreadLoop, this );
+		return Status::Ok;
+		}
+
+	inline void EntityScrubber::Stop()
+		{
+		if( !this->ScrubThread.joinable() )
+			{
+			return;
+			}
+
+			{
+			std::lock_guard<std::mutex> lock( this->StopMutex );
+			this->Stopping = true;
+			}
+		this->StopCondition.notify_all();
+		this->ScrubThread.join();
+		}
+
+	inline bool EntityScrubber::WaitUntil( std::chrono::steady_clock::time_point timePoint )
+		{
+		std::unique_lock<std::mutex> lock( this->StopMutex );
+		return !this->StopCondition.wait_until( lock, timePoint, [this]() { return this->Stopping; } );
+		}
+
+	inline void EntityScrubber::ScrubThreadLoop()
+		{
+		typedef std::chrono::steady_clock clock;
+
+		std::vector<hash> ids;
+		for( ;;)
+			{
+			const clock::time_point passStart = clock::now();
+
+			ids.clear();
+			this->ListEntities( ids );
+
+			// each entity is followed by a wait, which is as long as reading its bytes takes at the set rate.
+			// the schedule is kept across entities, so the time spent verifying counts towards the wait.
+			clock::time_point scheduled = passStart;
+			for( size_t i = 0; i < ids.size(); ++i )
+				{
+				u64 bytesRead = 0;
+				const Status status = this->VerifyEntity( ids[i], bytesRead );
+				if( status == Status::ECorrupted )
+					{
+					++this->CorruptedEntityCount;
+					}
+				++this->ScrubbedEntityCount;
+				this->ScrubbedByteCount += bytesRead;
+
+				scheduled += std::chrono::duration_cast<clock::duration>( std::chrono::duration<double>( double( bytesRead ) / double( this->BytesPerSecond ) ) );
+				if( !this->WaitUntil( scheduled ) )
+					{
+					return;
+					}
+				}
+			++this->PassCount;
+
+			if( !this->WaitUntil( std::max( scheduled, passStart + std::chrono::milliseconds( MinimumPassMilliseconds ) ) ) )
+				{
+				return;
+				}
+			}
+		}
+
+	};
@@ -4,9 +4,23 @@
 #pragma once
 
 #include <pds/DataValuePointers.h>
+#include <pds/EntityKeyTable.h>
 
 namespace pds
 	{
+	// interns the key in the key table of the stream, and encodes the id of the key into dest_key_id, which must have room for 2 bytes
+	// returns the size of the encoded id, or 0 if the key table is full
+	inline u8 encode_key_id( MemoryWriteStream &dstream, const char *key, const u8 key_size_in_bytes, u8 *dest_key_id )
+		{
+		pdsSanityCheckCoreDebugMacro( dstream.GetKeyTable() );
+		u16 key_id = 0;
+		if( !dstream.GetKeyTable()->Intern( key, key_size_in_bytes, key_id ) )
+			{
+			return 0;
+			}
+		return EntityKeyTable::EncodeId( key_id, dest_key_id );
+		}
+
 	// called to begin a large block
 	// returns the stream position of the start of the block, to be used when writing the size when ending the block
 	inline bool begin_write_large_block( MemoryWriteStream &dstream, ValueType VT, const char *key, const u8 key_size_in_bytes )
@@ -15,16 +29,29 @@ namespace pds
 		const u64 start_pos = dstream.GetPosition();
 		pdsSanityCheckDebugMacro( key_size_in_bytes <= EntityMaxKeyLength ); 
 
-		// sizeof(value_type)=1 + sizeof(block_size)=8 + sizeof(key_size_in_bytes)=1 + key_size_in_bytes;
-		const u64 expected_end_pos = start_pos + key_size_in_bytes + 10; 
+		// if the stream interns keys, the id of the key is written instead of the key
+		u8 key_id[2];
+		const u8 key_id_size = ( dstream.GetKeyTable() ) ? encode_key_id( dstream, key, key_size_in_bytes, key_id ) : 0;
+		if( dstream.GetKeyTable() && key_id_size == 0 )
+			{
+			return false;
+			}
+
+		// sizeof(value_type)=1 + sizeof(block_size)=8 + (sizeof(key_size_in_bytes)=1 + key_size_in_bytes, or key_id_size);
+		const u64 expected_end_pos = start_pos + 9 + ( ( key_id_size != 0 ) ? key_id_size : ( key_size_in_bytes + 1 ) );
 
-		// write block header 
-		// write empty stand in value for now (INT64_MAX on purpose), which is definitely 
-		// wrong, as to trigger any test if the value is not overwritten with the correct value
+		// write block header, with a placeholder for the block size
 		dstream.Write( value_type );
-		dstream.Write( (u64)INT64_MAX );
-		dstream.Write( key_size_in_bytes );
-		dstream.Write( (i8*)key, key_size_in_bytes );
+		dstream.WritePlaceholder();
+		if( key_id_size != 0 )
+			{
+			dstream.Write( key_id, key_id_size );
+			}
+		else
+			{
+			dstream.Write( key_size_in_bytes );
+			dstream.Write( (i8*)key, key_size_in_bytes );
+			}
 
 		const u64 end_pos = dstream.GetPosition();
 		pdsSanityCheckCoreDebugMacro( end_pos == expected_end_pos );
@@ -37,12 +64,23 @@ namespace pds
 		{
 		const u64 end_pos = dstream.GetPosition();
 		const u64 block_size = end_pos - start_pos - 9; // total block size - ( sizeof( valuetype )=1 + sizeof( block_size_variable )=8 )
-		dstream.SetPosition( start_pos + 1 ); // skip over the valuetype
-		dstream.Write( block_size );
-		dstream.SetPosition( end_pos ); // move back the where we were
+		dstream.SetPlaceholder( start_pos + 1, block_size ); // skip over the valuetype
 		return (end_pos > start_pos); // only thing we really can check
 		}
 
+	// writes the padding before the values of an array or string, if the stream has a payload alignment: a u8 with the
+	// size of the padding, and the zero bytes of the padding, so the values start at a multiple of the alignment
+	inline void write_payload_padding( MemoryWriteStream &dstream )
+		{
+		const u64 alignment = dstream.GetPayloadAlignment();
+		pdsSanityCheckDebugMacro( alignment != 0 );
+		const u64 values_pos = dstream.GetPosition() + sizeof( u8 );
+		const u8 padding_size = (u8)( ( alignment - ( values_pos % alignment ) ) % alignment );
+		static const u8 padding[EntityMaxPayloadAlignment] = {};
+		dstream.Write( padding_size );
+		dstream.Write( padding, padding_size );
+		}
+
 	// template method that writes a small block of a specific ValueType VT to the stream. Since most value types 
 	// can have different bit depths, the second parameter I is the actual type of the data stored. The data can have more than one values of type I, the count is stored in IC.
 	template<ValueType VT, class T> inline bool write_single_value( MemoryWriteStream &dstream, const char *key, const u8 key_length, const T *data )
@@ -53,8 +91,17 @@ namespace pds
 		const size_t value_size = sizeof( typename data_type_information<T>::value_type );
 		const size_t value_count = data_type_information<T>::value_count;
 		const size_t data_size_in_bytes = (data != nullptr) ? (value_size * value_count) : 0; // if data == nullptr, the block is empty
-		const size_t block_size = data_size_in_bytes + key_length;
 		pdsSanityCheckDebugMacro( key_length <= EntityMaxKeyLength ); // max key length
+
+		// if the stream interns keys, the id of the key is written before the value, instead of the key after the value
+		u8 key_id[2];
+		const u8 key_id_size = ( dstream.GetKeyTable() ) ? encode_key_id( dstream, key, key_length, key_id ) : 0;
+		if( dstream.GetKeyTable() && key_id_size == 0 )
+			{
+			return false;
+			}
+
+		const size_t block_size = data_size_in_bytes + ( ( key_id_size != 0 ) ? key_id_size : key_length );
 		pdsSanityCheckCoreDebugMacro( block_size < 256 ); // must fit in a byte
 		const u8 u8_block_size = (u8)(block_size);
 		const u64 start_pos = dstream.GetPosition();
@@ -63,12 +110,19 @@ namespace pds
 		// write data block 
 		dstream.Write( value_type );
 		dstream.Write( u8_block_size );
+		if( key_id_size != 0 )
+			{
+			dstream.Write( key_id, key_id_size );
+			}
 		if( data_size_in_bytes > 0 )
 			{
 			const typename data_type_information<T>::value_type *pvalue = value_ptr( (*data) );
 			dstream.Write( pvalue, value_count );
 			}
-		dstream.Write( (i8*)key, key_length );
+		if( key_id_size == 0 )
+			{
+			dstream.Write( (i8*)key, key_length );
+			}
 
 		const u64 end_pos = dstream.GetPosition();
 		pdsSanityCheckCoreDebugMacro( end_pos == expected_end_pos );
@@ -112,10 +166,16 @@ namespace pds
 			return true;
 			}
 
-		// write the size of the string, and the actual string values
+		// write the size of the string, and the actual string values. if the stream pads payloads, 
+		// the top bit of the size is set, and the padding is written before the characters
 		const u64 character_count = u64( string_value->size() );
-		const u64 values_size = character_count + sizeof( u64 );
-		dstream.Write( character_count );
+		const bool is_padded = ( dstream.GetPayloadAlignment() != 0 );
+		dstream.Write( is_padded ? ( character_count | 0x8000000000000000ull ) : character_count );
+		if( is_padded )
+			{
+			write_payload_padding( dstream );
+			}
+		const u64 values_size = character_count + ( dstream.GetPosition() - string_data_start_pos );
 		if( character_count > 0 )
 			{
 			const i8 *data = (const i8*)string_value->data();
@@ -144,7 +204,8 @@ namespace pds
 		return true;
 		}
 
-	// reads an array header and value size from the stream, and decodes into flags, then reads the index if one exists. 
+	// writes an array header and value size to the stream, as flags, then writes the index if one exists. if the stream 
+	// pads payloads, arrays of raw values (per_item_size != 0) are padded after the index, so the values are aligned
 	inline bool write_array_metadata_and_index( MemoryWriteStream &dstream, size_t per_item_size, size_t item_count, const std::vector<i32> *index )
 		{
 		static_assert(sizeof( u64 ) <= sizeof( size_t ), "Unsupported size_t, current code requires it to be at least 8 bytes in size, equal to u64");
@@ -155,7 +216,8 @@ namespace pds
 		// indexed array flags: size of each item (if need to decode array outside regular decoding) and bit set if index is used 
 		const u16 has_index = (index) ? (0x100) : (0);
 		const u16 index_is_64bit = 0; // we do not support 64 bit indices yet
-		const u16 array_flags = has_index | index_is_64bit | u16(per_item_size);
+		const u16 is_padded = ( dstream.GetPayloadAlignment() != 0 && per_item_size != 0 ) ? (0x400) : (0);
+		const u16 array_flags = has_index | index_is_64bit | is_padded | u16(per_item_size);
 		dstream.Write( array_flags );
 
 		// write the number of items
@@ -172,12 +234,22 @@ namespace pds
 			index_size = (index_count * sizeof( i32 )) + sizeof( u64 ); // the index values and the value count
 			}
 
+		// if padded, write the padding
+		u64 padding_size = 0;
+		if( is_padded )
+			{
+			const u64 padding_start_pos = dstream.GetPosition();
+			write_payload_padding( dstream );
+			padding_size = dstream.GetPosition() - padding_start_pos;
+			}
+
 		// make sure all data was written
 		const u64 expected_end_pos = 
 			start_pos
 			+ sizeof( u16 ) // the flags
 			+ sizeof( u64 ) // the item count
-			+ index_size; // the (optional) index
+			+ index_size // the (optional) index
+			+ padding_size; // the (optional) padding
 
 		const u64 end_pos = dstream.GetPosition();
 		if( end_pos != expected_end_pos )
@@ -378,9 +450,107 @@ namespace pds
 		return true;
 		}
 
+	inline void EntityWriter::add_table_of_contents_entry( const char *key, const u8 key_length )
+		{
+		if( this->table_of_contents )
+			{
+			this->table_of_contents->emplace_back( this->table_of_contents_path + std::string( key, key_length ), this->dstream.GetPosition() );
+			}
+		}
+
 #ifdef PDS_MAIN_BUILD_FILE
 	EntityWriter::EntityWriter( MemoryWriteStream &_dstream ) : dstream( _dstream ) , start_position( _dstream.GetPosition() ) {}
 
+	void EntityWriter::CollectTableOfContents()
+		{
+		this->table_of_contents = std::make_shared<std::vector<std::pair<std::string,u64>>>();
+		this->table_of_contents_path.clear();
+		}
+
+	bool EntityWriter::WriteTableOfContents()
+		{
+		if( !this->table_of_contents )
+			{
+			pdsErrorLog << "The table of contents is not collected, CollectTableOfContents must be called before the blocks are written." << pdsErrorLogEnd;
+			return false;
+			}
+		if( this->active_subsection )
+			{
+			pdsErrorLog << "There is an active subsection, the table of contents must be written after all other blocks." << pdsErrorLogEnd;
+			return false;
+			}
+
+		// stop collecting, and write the paths and positions as two arrays in a section
+		const std::shared_ptr<std::vector<std::pair<std::string,u64>>> entries = std::move( this->table_of_contents );
+		std::vector<std::string> keys;
+		std::vector<u64> positions;
+		keys.reserve( entries->size() );
+		positions.reserve( entries->size() );
+		for( size_t i = 0; i < entries->size(); ++i )
+			{
+			keys.emplace_back( std::move( (*entries)[i].first ) );
+			positions.emplace_back( (*entries)[i].second );
+			}
+
+		EntityWriter *section_writer = this->BeginWriteSection( pdsKeyMacro( "TableOfContents" ) );
+		if( !section_writer )
+			{
+			return false;
+			}
+		if( !write_array<ValueType::VT_Array_String, std::string>( this->dstream, pdsKeyMacro( "Keys" ), &keys, nullptr ) 
+			|| !write_array<ValueType::VT_Array_UInt, u64>( this->dstream, pdsKeyMacro( "Positions" ), &positions, nullptr ) )
+			{
+			pdsErrorLog << "Failed to write the table of contents." << pdsErrorLogEnd;
+			return false;
+			}
+		return this->EndWriteSection( section_writer );
+		}
+
+	bool EntityWriter::InternKeys()
+		{
+		if( this->dstream.GetPosition() != this->start_position || this->active_subsection )
+			{
+			pdsErrorLog << "InternKeys must be called before any blocks are written." << pdsErrorLogEnd;
+			return false;
+			}
+
+		// start a new key table, and write the block which points at the key table, with a placeholder for the position of the table
+		this->dstream.SetKeyTable( std::make_shared<EntityKeyTable>() );
+		this->dstream.Write( (u8)ValueType::VT_KeyTable );
+		this->dstream.Write( u64( sizeof( u64 ) ) );
+		this->dstream.WritePlaceholder();
+		return true;
+		}
+
+	bool EntityWriter::WriteKeyTable()
+		{
+		const std::shared_ptr<EntityKeyTable> key_table = this->dstream.GetKeyTable();
+		if( !key_table )
+			{
+			pdsErrorLog << "The keys are not interned, InternKeys must be called before the blocks are written." << pdsErrorLogEnd;
+			return false;
+			}
+		if( this->active_subsection )
+			{
+			pdsErrorLog << "There is an active subsection, the key table must be written after all other blocks." << pdsErrorLogEnd;
+			return false;
+			}
+
+		// set the position of the table in the first block, and write the keys in id order, in a block without a key
+		const u64 table_position = this->dstream.GetPosition();
+		this->dstream.SetPlaceholder( this->start_position + 9, table_position );
+		this->dstream.Write( (u8)ValueType::VT_KeyTable );
+		this->dstream.WritePlaceholder();
+		this->dstream.Write( (u16)key_table->GetKeyCount() );
+		for( size_t key_index = 0; key_index < key_table->GetKeyCount(); ++key_index )
+			{
+			const std::string &key = key_table->GetKey( (u16)key_index );
+			this->dstream.Write( (u8)key.size() );
+			this->dstream.Write( (const i8 *)key.data(), (u64)key.size() );
+			}
+		return end_write_large_block( this->dstream, table_position );
+		}
+
 	// Build a section. 
 	EntityWriter *EntityWriter::BeginWriteSection( const char *key, const u8 key_length )
 		{
@@ -393,6 +563,14 @@ namespace pds
 		// create a writer for the array, to store the start position before calling the begin large block 
 		this->active_subsection = std::unique_ptr<EntityWriter>(new EntityWriter( this->dstream ));
 
+		// the keys of the section are collected with the path of the section
+		this->add_table_of_contents_entry( key, key_length );
+		if( this->table_of_contents )
+			{
+			this->active_subsection->table_of_contents = this->table_of_contents;
+			this->active_subsection->table_of_contents_path = this->table_of_contents_path + std::string( key, key_length ) + '/';
+			}
+
 		if( !begin_write_large_block( this->dstream, ValueType::VT_Subsection, key, key_length ) )
 			{
 			pdsErrorLog << "begin_write_large_block failed to write header." << pdsErrorLogEnd;
@@ -440,6 +618,7 @@ namespace pds
 
 		// create a writer for the array, to store the start position before calling the begin large block 
 		this->active_subsection = std::unique_ptr<EntityWriter>(new EntityWriter( this->dstream ));
+		this->add_table_of_contents_entry( key, key_length );
 
 		if( !begin_write_large_block( this->dstream, ValueType::VT_Array_Subsection, key, key_length ) )
 			{
@@ -488,8 +667,8 @@ namespace pds
 		this->active_array_index = section_index;
 		this->active_array_index_start_position = this->dstream.GetPosition();
 
-		// write a temporary subsection size (INT64_MAX on purpose)
-		dstream.Write( (u64)INT64_MAX );
+		// write a placeholder for the subsection size
+		dstream.WritePlaceholder();
 
 		return dstream.GetPosition() == (this->active_array_index_start_position + sizeof( u64 ));
 		}
@@ -504,9 +683,7 @@ namespace pds
 
 		const u64 end_pos = dstream.GetPosition();
 		const u64 block_size = end_pos - this->active_array_index_start_position - sizeof(u64); // total block size - ( sizeof( section_size_value )=8 )
-		dstream.SetPosition( this->active_array_index_start_position ); 
-		dstream.Write( block_size );
-		dstream.SetPosition( end_pos ); // move back the where we were
+		dstream.SetPlaceholder( this->active_array_index_start_position, block_size );
 		return (end_pos > this->active_array_index_start_position); // only thing we really can check
 		}
 
@@ -0,0 +1,408 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+#include "TempFile.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+
+#ifdef _MSC_VER
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#endif
+
+namespace pds
+	{
+	// Group commit queue writes files durably into a directory, so that a file is either
+	// completely on disk with its final name, or not there at all, even if the system crashes.
+	// Each file is first written to a new temporary file in the directory, which is kept open. A commit thread
+	// then takes all pending files as one group, syncs the data of each file through the descriptor it was
+	// written with (fdatasync on Linux), so write errors of the file are reported, renames the files into place,
+	// and syncs the directory once for the whole group. While a group is committed, new files gather in the next
+	// group, so the number of directory syncs per file drops as the write rate goes up.
+	// File names may include a subdirectory of the directory, in which case that subdirectory is synced as well.
+	// At most MaxOpenFileCount temporary files are open at once, writers wait for a group to be synced when the cap is reached.
+	// Temporary files are named <name>.tmp-<pid>-<random> and created exclusively (see create_temp_file), so
+	// queues of several processes can write into the same directory. Temporary files left by processes which
+	// are not running, such as after a crash, are removed from the directory and its subdirectories in Initialize.
+	class GroupCommitQueue
+		{
+		public:
+			// called on the commit thread when the file is durable with its final name, or failed to commit
+			typedef std::function<void( Status status )> CommitCallback;
+
+			// the max number of temporary files which are written and not yet synced, each holds an open file
+			static const size_t MaxOpenFileCount = 256;
+
+		private:
+			struct PendingFile
+				{
+				std::string TempFilePath;
+				std::string FilePath;
+				CommitCallback OnCommitted;
+
+				// the temporary file, open from when it is written until its data is synced
+#ifdef _MSC_VER
+				HANDLE FileHandle = INVALID_HANDLE_VALUE;
+#else
+				int FileDescriptor = -1;
+#endif
+				};
+
+			std::string Path;
+#ifndef _MSC_VER
+			int DirectoryDescriptor = -1;
+#endif
+
+			std::thread CommitThread;
+			std::deque<PendingFile> PendingFiles;
+			std::mutex PendingMutex;
+			std::condition_variable PendingCondition;
+			bool Stopping = false;
+
+			// the number of open temporary files, and the condition writers wait on when the cap is reached
+			size_t OpenFileCount = 0;
+			std::condition_variable OpenFileCondition;
+			void ReleaseOpenFiles( size_t count );
+
+			// statistics
+			std::atomic<u64> CommittedGroupCount;
+			std::atomic<u64> CommittedFileCount;
+
+			void CommitThreadLoop();
+			void CommitGroup( std::vector<PendingFile> &group );
+
+			// create the temporary file of the pending file, and write the data to it. the file is left open.
+			static Status WriteFileData( PendingFile &pending, const u8 *data, u64 size );
+
+			// sync the data of the temporary file, and close it
+			static Status SyncFileData( PendingFile &pending );
+
+			// close the temporary file if it is open, and remove it
+			static void RemoveFile( PendingFile &pending );
+
+		public:
+			GroupCommitQueue() : CommittedGroupCount( 0 ), CommittedFileCount( 0 ) {}
+			GroupCommitQueue( const GroupCommitQueue &other ) = delete;
+			GroupCommitQueue &operator=( const GroupCommitQueue &other ) = delete;
+			~GroupCommitQueue() { this->Deinitialize(); }
+
+			// set up the queue to write files into the directory at path, and start the commit thread
+			Status Initialize( const std::string &path );
+
+			// commit all pending files, and stop the commit thread
+			void Deinitialize();
+
+			// write the data into a temporary file, and queue it to be committed as fileName in the directory.
+			// onCommitted is called when the file is committed. if the write fails, the error is returned, and onCommitted is not called.
+			Status Write( const std::string &fileName, const u8 *data, u64 size, CommitCallback onCommitted );
+
+			// number of committed groups and files, to see how many files each group commits on average
+			u64 GetCommittedGroupCount() const { return this->CommittedGroupCount; }
+			u64 GetCommittedFileCount() const { return this->CommittedFileCount; }
+		};
+
+	inline Status GroupCommitQueue::Initialize( const std::string &path )
+		{
+		if( !this->Path.empty() )
+			{
+			return Status::EAlreadyInitialized;
+			}
+
+#ifndef _MSC_VER
+		// the directory is synced after the renames, so they are durable as well
+		this->DirectoryDescriptor = ::open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+		if( this->DirectoryDescriptor < 0 )
+			{
+			return Status::ECantOpen;
+			}
+#endif
+
+		// remove the temporary files of queues which did not commit them
+		remove_stale_named_temp_files( path, ".tmp-" );
+
+		this->Path = path;
+		this->Stopping = false;
+		this->CommitThread = std::thread( &GroupCommitQueue::CommitThreadLoop, this );
+		return Status::Ok;
+		}
+
+	inline void GroupCommitQueue::Deinitialize()
+		{
+		if( this->Path.empty() )
+			{
+			return;
+			}
+
+		// the commit thread commits the remaining files before it exits
+			{
+			std::lock_guard<std::mutex> lock( this->PendingMutex );
+			this->Stopping = true;
+			}
+		this->PendingCondition.notify_all();
+		this->CommitThread.join();
+
+#ifndef _MSC_VER
+		::close( this->DirectoryDescriptor );
+		this->DirectoryDescriptor = -1;
+#endif
+		this->Path.clear();
+		}
+
+	inline Status GroupCommitQueue::Write( const std::string &fileName, const u8 *data, u64 size, CommitCallback onCommitted )
+		{
+		if( this->Path.empty() )
+			{
+			return Status::ENotInitialized;
+			}
+
+		PendingFile pending;
+		pending.FilePath = this->Path + "/" + fileName;
+		pending.OnCommitted = std::move( onCommitted );
+
+		// wait until the file can be opened without going over the cap
+			{
+			std::unique_lock<std::mutex> lock( this->PendingMutex );
+			this->OpenFileCondition.wait( lock, [this]() { return this->OpenFileCount < MaxOpenFileCount; } );
+			++this->OpenFileCount;
+			}
+
+		// the data is not synced here, that is done when the group is committed
+		const Status status = WriteFileData( pending, data, size );
+		if( status != Status::Ok )
+			{
+			RemoveFile( pending );
+			this->ReleaseOpenFiles( 1 );
+			return status;
+			}
+
+			{
+			std::lock_guard<std::mutex> lock( this->PendingMutex );
+			this->PendingFiles.emplace_back( std::move( pending ) );
+			}
+		this->PendingCondition.notify_one();
+		return Status::Ok;
+		}
+
+	inline void GroupCommitQueue::CommitThreadLoop()
+		{
+		std::vector<PendingFile> group;
+		for( ;;)
+			{
+			// wait for pending files, and take all of them as the next group
+				{
+				std::unique_lock<std::mutex> lock( this->PendingMutex );
+				this->PendingCondition.wait( lock, [this]() { return this->Stopping || !this->PendingFiles.empty(); } );
+				if( this->PendingFiles.empty() )
+					{
+					// stopping, and nothing left to commit
+					return;
+					}
+				group.assign( std::make_move_iterator( this->PendingFiles.begin() ), std::make_move_iterator( this->PendingFiles.end() ) );
+				this->PendingFiles.clear();
+				}
+
+			this->CommitGroup( group );
+			group.clear();
+			}
+		}
+
+	inline void GroupCommitQueue::CommitGroup( std::vector<PendingFile> &group )
+		{
+		std::vector<Status> statuses( group.size(), Status::Ok );
+
+		// 1. make the data of all the temporary files durable, through the descriptors they were written with, so
+		// that no write error of the files is missed
+		for( size_t i = 0; i < group.size(); ++i )
+			{
+			statuses[i] = SyncFileData( group[i] );
+			}
+		this->ReleaseOpenFiles( group.size() );
+
+		// 2. rename the files into place. if a file with the same name exists, it is replaced
+		for( size_t i = 0; i < group.size(); ++i )
+			{
+			if( statuses[i] != Status::Ok )
+				{
+				continue;
+				}
+#ifdef _MSC_VER
+			// write through makes the rename durable, there is no directory to sync
+			if( !::MoveFileExA( group[i].TempFilePath.c_str(), group[i].FilePath.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH ) )
+#else
+			if( ::rename( group[i].TempFilePath.c_str(), group[i].FilePath.c_str() ) != 0 )
+#endif
+				{
+				statuses[i] = Status::ECantWrite;
+				}
+			}
+
+		// 3. make the renames durable, with one sync of each directory the group renamed files in
+#ifndef _MSC_VER
+		std::vector<std::string> directoryPaths;
+		std::unordered_map<std::string, size_t> directoryIndices;
+		std::vector<size_t> fileDirectories( group.size() );
+		for( size_t i = 0; i < group.size(); ++i )
+			{
+			const std::string directoryPath = group[i].FilePath.substr( 0, group[i].FilePath.find_last_of( '/' ) );
+			const auto it = directoryIndices.emplace( directoryPath, directoryPaths.size() ).first;
+			if( it->second == directoryPaths.size() )
+				{
+				directoryPaths.emplace_back( directoryPath );
+				}
+			fileDirectories[i] = it->second;
+			}
+		for( size_t d = 0; d < directoryPaths.size(); ++d )
+			{
+			const bool isCommitDirectory = ( directoryPaths[d] == this->Path );
+			const int directoryDescriptor = isCommitDirectory ? this->DirectoryDescriptor : ::open( directoryPaths[d].c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+			const bool synced = ( directoryDescriptor >= 0 && ::fsync( directoryDescriptor ) == 0 );
+			if( directoryDescriptor >= 0 && !isCommitDirectory )
+				{
+				::close( directoryDescriptor );
+				}
+			if( !synced )
+				{
+				for( size_t i = 0; i < group.size(); ++i )
+					{
+					if( fileDirectories[i] == d )
+						{
+						statuses[i] = Status::ECantWrite;
+						}
+					}
+				}
+			}
+#endif
+
+		++this->CommittedGroupCount;
+		for( size_t i = 0; i < group.size(); ++i )
+			{
+			if( statuses[i] != Status::Ok )
+				{
+				RemoveFile( group[i] );
+				}
+			else
+				{
+				++this->CommittedFileCount;
+				}
+			group[i].OnCommitted( statuses[i] );
+			}
+		}
+
+	inline void GroupCommitQueue::ReleaseOpenFiles( size_t count )
+		{
+			{
+			std::lock_guard<std::mutex> lock( this->PendingMutex );
+			this->OpenFileCount -= count;
+			}
+		this->OpenFileCondition.notify_all();
+		}
+
+	inline Status GroupCommitQueue::WriteFileData( PendingFile &pending, const u8 *data, u64 size )
+		{
+#ifdef _MSC_VER
+		HANDLE fileHandle = create_temp_file( pending.FilePath + ".tmp-", "", pending.TempFilePath );
+		if( fileHandle == INVALID_HANDLE_VALUE )
+			{
+			return Status::ECantOpen;
+			}
+		pending.FileHandle = fileHandle;
+
+		u64 bytesWritten = 0;
+		while( bytesWritten < size )
+			{
+			// check how much to write, capped at UINT_MAX
+			const DWORD bytesToWrite = (DWORD)std::min<u64>( size - bytesWritten, UINT_MAX );
+			DWORD numBytesWritten = 0;
+			if( !::WriteFile( fileHandle, &data[bytesWritten], bytesToWrite, &numBytesWritten, nullptr ) )
+				{
+				return Status::ECantWrite;
+				}
+			bytesWritten += numBytesWritten;
+			}
+#else
+		const int fileDescriptor = create_temp_file( pending.FilePath + ".tmp-", "", pending.TempFilePath );
+		if( fileDescriptor < 0 )
+			{
+			return Status::ECantOpen;
+			}
+		pending.FileDescriptor = fileDescriptor;
+
+		u64 bytesWritten = 0;
+		while( bytesWritten < size )
+			{
+			const ssize_t ret = ::write( fileDescriptor, &data[bytesWritten], (size_t)( size - bytesWritten ) );
+			if( ret < 0 && errno == EINTR )
+				{
+				continue;
+				}
+			if( ret <= 0 )
+				{
+				return Status::ECantWrite;
+				}
+			bytesWritten += (u64)ret;
+			}
+#endif
+		return Status::Ok;
+		}
+
+	inline Status GroupCommitQueue::SyncFileData( PendingFile &pending )
+		{
+#ifdef _MSC_VER
+		const bool synced = ::FlushFileBuffers( pending.FileHandle ) != 0;
+		const bool closed = ::CloseHandle( pending.FileHandle ) != 0;
+		pending.FileHandle = INVALID_HANDLE_VALUE;
+#else
+#if defined(__linux__)
+		// the size of the file is set when it is written, so only the data needs to be synced
+		const bool synced = ::fdatasync( pending.FileDescriptor ) == 0;
+#else
+		const bool synced = ::fsync( pending.FileDescriptor ) == 0;
+#endif
+		const bool closed = ::close( pending.FileDescriptor ) == 0;
+		pending.FileDescriptor = -1;
+#endif
+		return ( synced && closed ) ? Status::Ok : Status::ECantWrite;
+		}
+
+	inline void GroupCommitQueue::RemoveFile( PendingFile &pending )
+		{
+#ifdef _MSC_VER
+		if( pending.FileHandle != INVALID_HANDLE_VALUE )
+			{
+			::CloseHandle( pending.FileHandle );
+			pending.FileHandle = INVALID_HANDLE_VALUE;
+			}
+		if( !pending.TempFilePath.empty() )
+			{
+			::DeleteFileA( pending.TempFilePath.c_str() );
+			}
+#else
+		if( pending.FileDescriptor >= 0 )
+			{
+			::close( pending.FileDescriptor );
+			pending.FileDescriptor = -1;
+			}
+		if( !pending.TempFilePath.empty() )
+			{
+			::unlink( pending.TempFilePath.c_str() );
+			}
+#endif
+		}
+
+	};
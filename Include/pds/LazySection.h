@@ -0,0 +1,94 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+namespace pds
+	{
+	class EntityReader;
+
+	// The source of the deferred data of a loaded entity, shared by the lazy sections of the entity. The owner keeps the
+	// data alive, and a section which fails to decode calls OnDecodeFailed with the entity, if set. With the Deferred
+	// and Sampled verify policies the data may not be verified when the entity is handed out, so a failed decode can
+	// be the first sign that the file is corrupted.
+	struct LazySectionSource
+		{
+		std::shared_ptr<const void> Owner;
+		entity_ref Ref;
+		std::function<void( const entity_ref & )> OnDecodeFailed;
+		};
+
+	// Lazy section holds the serialized data of a section or a large value of an entity, which is decoded into the
+	// entity on first access, instead of when the entity is read. The generated entities have a lazy section for
+	// each section and array variable, and the accessors of the variable materialize the section before the value is
+	// returned. The serialized data is kept alive by the source (the loaded file data or its memory mapping), which is
+	// released when the section is decoded.
+	// The section is materialized at most once, even if the entity is accessed from many threads at the same time.
+	// Copies of a lazy section are never deferred, entities are deep copied from materialized values.
+	class LazySection
+		{
+		public:
+			// decodes the value from a reader positioned on the block of the value, into the object
+			typedef bool( *DecodeFunction )( void *obj, EntityReader &reader );
+
+		private:
+			struct DeferredData
+				{
+				std::shared_ptr<const LazySectionSource> Source;
+				const u8 *Data = nullptr;
+				u64 Size = 0;
+				bool FlipByteOrder = false;
+				std::shared_ptr<const EntityKeyTable> KeyTable;
+				DecodeFunction Decode = nullptr;
+				std::mutex Mutex;
+				};
+
+			mutable std::unique_ptr<DeferredData> Deferred;
+			mutable std::atomic<bool> Pending;
+
+			void MaterializeDeferred( const void *obj ) const;
+
+		public:
+			LazySection() : Pending( false ) {}
+			LazySection( const LazySection &/*other*/ ) : Pending( false ) {}
+			LazySection &operator=( const LazySection &/*other*/ ) { this->Reset(); return *this; }
+			LazySection( LazySection &&other ) noexcept : Deferred( std::move( other.Deferred ) ), Pending( other.Pending.exchange( false ) ) {}
+			LazySection &operator=( LazySection &&other ) noexcept
+				{
+				this->Deferred = std::move( other.Deferred );
+				this->Pending = other.Pending.exchange( false );
+				return *this;
+				}
+
+			// defer the decoding of the data to the first call to Materialize. the data must stay valid as long as the source is held.
+			// the key table is set if the keys of the data are interned.
+			void Defer( const std::shared_ptr<const LazySectionSource> &source, const u8 *data, u64 size, bool flipByteOrder, const std::shared_ptr<const EntityKeyTable> &keyTable, DecodeFunction decode );
+
+			// decode the deferred data into obj, which must be the object which holds the section, if it is not decoded yet
+			void Materialize( const void *obj ) const
+				{
+				if( this->Pending.load( std::memory_order_acquire ) )
+					{
+					this->MaterializeDeferred( obj );
+					}
+				}
+
+			// returns true if the data is not decoded yet
+			bool IsPending() const { return this->Pending.load( std::memory_order_acquire ); }
+
+			// drop the deferred data without decoding it, when the value is overwritten
+			void Reset()
+				{
+				this->Pending = false;
+				this->Deferred.reset();
+				}
+		};
+
+	};
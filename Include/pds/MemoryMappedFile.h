@@ -0,0 +1,199 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+
+#ifdef _MSC_VER
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace pds
+	{
+	// Memory mapped file is a read-only view of a whole file, mapped into memory.
+	// The data can be read directly from the mapping without copying it into
+	// an allocation, for instance using a MemoryReadStream.
+	// The mapping is released when the object is closed or destroyed, so any
+	// pointers into the data must not be used after that.
+	// Caveat: The object is NOT thread safe, and should be accessed by
+	// only one thread at a time.
+	class MemoryMappedFile
+		{
+		private:
+			const u8 *Data = nullptr;
+			u64 DataSize = 0;
+			bool IsOpen = false;
+
+#ifdef _MSC_VER
+			HANDLE MappingHandle = nullptr;
+#endif
+
+		public:
+			// files of at least this size are mapped with a hint that they will be read sequentially
+			static const u64 SequentialAccessSize = 1024*1024; // 1MB
+
+			MemoryMappedFile() = default;
+			MemoryMappedFile( const MemoryMappedFile &other ) = delete;
+			MemoryMappedFile &operator=( const MemoryMappedFile &other ) = delete;
+			~MemoryMappedFile() { this->Close(); }
+
+			// map the whole file at filePath. returns ECantOpen if the file could not be opened or mapped.
+			// empty files can't be mapped, they are opened with no data and a size of 0
+			Status Open( const char *filePath );
+
+#ifndef _MSC_VER
+			// map the whole file of an opened file descriptor, which is closed when it is mapped
+			Status Open( int fileDescriptor );
+#endif
+
+			// release the mapping. safe to call even if the file is not open
+			void Close();
+
+			// get a read-only pointer to the mapped data, nullptr if not open or if the file is empty
+			const u8 *GetData() const { return this->Data; }
+
+			// get the size of the mapped file in bytes
+			u64 GetSize() const { return this->DataSize; }
+		};
+
+	inline Status MemoryMappedFile::Open( const char *filePath )
+		{
+		if( this->IsOpen )
+			{
+			return Status::EAlreadyInitialized;
+			}
+
+#ifdef _MSC_VER
+		HANDLE fileHandle = ::CreateFileA( filePath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+		if( fileHandle == INVALID_HANDLE_VALUE )
+			{
+			return Status::ECantOpen;
+			}
+
+		LARGE_INTEGER fileSize = {};
+		if( !::GetFileSizeEx( fileHandle, &fileSize ) )
+			{
+			::CloseHandle( fileHandle );
+			return Status::ECantOpen;
+			}
+		if( fileSize.QuadPart == 0 )
+			{
+			// empty files can't be mapped, open them without any data
+			::CloseHandle( fileHandle );
+			this->IsOpen = true;
+			return Status::Ok;
+			}
+
+		// the mapping keeps a reference to the file, so the file handle can be closed directly
+		this->MappingHandle = ::CreateFileMappingA( fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr );
+		::CloseHandle( fileHandle );
+		if( this->MappingHandle == nullptr )
+			{
+			return Status::ECantOpen;
+			}
+
+		void *mappedData = ::MapViewOfFile( this->MappingHandle, FILE_MAP_READ, 0, 0, 0 );
+		if( mappedData == nullptr )
+			{
+			::CloseHandle( this->MappingHandle );
+			this->MappingHandle = nullptr;
+			return Status::ECantOpen;
+			}
+
+		this->Data = (const u8 *)mappedData;
+		this->DataSize = (u64)fileSize.QuadPart;
+		this->IsOpen = true;
+		return Status::Ok;
+#else
+		const int fileDescriptor = ::open( filePath, O_RDONLY | O_CLOEXEC );
+		if( fileDescriptor < 0 )
+			{
+			return Status::ECantOpen;
+			}
+		return this->Open( fileDescriptor );
+#endif
+		}
+
+#ifndef _MSC_VER
+	inline Status MemoryMappedFile::Open( int fileDescriptor )
+		{
+		if( this->IsOpen )
+			{
+			::close( fileDescriptor );
+			return Status::EAlreadyInitialized;
+			}
+
+		struct stat fileStat = {};
+		if( ::fstat( fileDescriptor, &fileStat ) != 0 )
+			{
+			::close( fileDescriptor );
+			return Status::ECantOpen;
+			}
+		if( fileStat.st_size <= 0 )
+			{
+			// empty files can't be mapped, open them without any data
+			::close( fileDescriptor );
+			this->IsOpen = true;
+			return Status::Ok;
+			}
+		const u64 fileSize = (u64)fileStat.st_size;
+
+		// small files are populated directly when mapped, to avoid taking a page fault per page when reading
+		const bool sequentialAccess = (fileSize >= SequentialAccessSize);
+		int mapFlags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+		if( !sequentialAccess )
+			{
+			mapFlags |= MAP_POPULATE;
+			}
+#endif
+
+		// the mapping keeps a reference to the file, so the descriptor can be closed directly
+		void *mappedData = ::mmap( nullptr, (size_t)fileSize, PROT_READ, mapFlags, fileDescriptor, 0 );
+		::close( fileDescriptor );
+		if( mappedData == MAP_FAILED )
+			{
+			return Status::ECantOpen;
+			}
+
+		// large files are read front to back (hashed, then decoded), so let the kernel read ahead aggressively
+		if( sequentialAccess )
+			{
+			::madvise( mappedData, (size_t)fileSize, MADV_SEQUENTIAL );
+			}
+
+		this->Data = (const u8 *)mappedData;
+		this->DataSize = fileSize;
+		this->IsOpen = true;
+		return Status::Ok;
+		}
+#endif
+
+	inline void MemoryMappedFile::Close()
+		{
+		this->IsOpen = false;
+		if( !this->Data )
+			{
+			return;
+			}
+
+#ifdef _MSC_VER
+		::UnmapViewOfFile( this->Data );
+		::CloseHandle( this->MappingHandle );
+		this->MappingHandle = nullptr;
+#else
+		::munmap( (void *)this->Data, (size_t)this->DataSize );
+#endif
+
+		this->Data = nullptr;
+		this->DataSize = 0;
+		}
+
+	};
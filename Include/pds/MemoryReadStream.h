@@ -4,6 +4,8 @@
 #pragma once
 
 #include "pds.h"
+#include "ByteSwap.h"
+#include "EntityKeyTable.h"
 
 #include <vector>
 
@@ -14,16 +16,30 @@ namespace pds
 	// does byte order swapping. It can read in more complex types than
 	// just plain old data (POD) types, such as std::string, UUIDs and
 	// std::vectors of the above types.
+	// Derived streams can hold only a window of the data in memory, and load
+	// the data which is outside of the window when it is read (see ChunkedFileReadStream).
 	// Caveat: The stream is NOT thread safe, and should be accessed by 
 	// only one thread at a time.
 	class MemoryReadStream
 		{
-		private:
+		protected:
 			const u8 *Data = nullptr;
 			u64 DataSize = 0;
 			u64 DataPosition = 0;
 			bool FlipByteOrder = false; // true if we should flip BE to LE or LE to BE
+			std::shared_ptr<const EntityKeyTable> KeyTable; // if set, the keys of the blocks in the stream are interned in the table
+			std::unique_ptr<EntityKeyIdCache> KeyIdCache; // the ids of the keys which are read, set with the key table
+
+			// the range of stream positions which is in memory, Data points at the data of position WindowBegin.
+			// the memory stream has all data in memory, so the window is the whole stream.
+			u64 WindowBegin = 0;
+			u64 WindowEnd = 0;
 
+			// read count bytes at the position, of which some are outside of the window, and move the position. 
+			// count is capped to the end of the stream. returns the number of bytes read.
+			virtual u64 ReadOutsideWindow( u8 *dest, u64 count );
+
+		private:
 			// read raw bytes from the memory stream
 			u64 ReadRawData( void *dest, u64 count );
 
@@ -31,11 +47,15 @@ namespace pds
 			template <class T> u64 ReadValues( T *dest, u64 count );
 			
 		public:
-			MemoryReadStream( const void *_Data, u64 _DataSize, bool _FlipByteOrder = false ) : Data( (u8*)_Data ), DataSize( _DataSize ), FlipByteOrder(_FlipByteOrder) {};
+			MemoryReadStream( const void *_Data, u64 _DataSize, bool _FlipByteOrder = false ) : Data( (u8*)_Data ), DataSize( _DataSize ), FlipByteOrder(_FlipByteOrder), WindowEnd( _DataSize ) {};
+			virtual ~MemoryReadStream() = default;
 
 			// get the Size of the stream in bytes
 			u64 GetSize() const;
 
+			// get the data of the stream, nullptr if not all of the data is in memory
+			const u8 *GetData() const;
+
 			// Position is the current data position. the beginning of the stream is position 0. the position will not move past the end of the stream.
 			u64 GetPosition() const;
 			bool SetPosition( u64 new_pos );
@@ -47,8 +67,16 @@ namespace pds
 			bool GetFlipByteOrder() const;
 			void SetFlipByteOrder( bool value );
 
+			// KeyTable is set if the blocks of the stream store key ids instead of keys (see EntityReader::ReadKeyTable)
+			const std::shared_ptr<const EntityKeyTable> &GetKeyTable() const { return this->KeyTable; }
+			void SetKeyTable( const std::shared_ptr<const EntityKeyTable> &value ) { this->KeyTable = value; this->KeyIdCache.reset( value ? new EntityKeyIdCache() : nullptr ); }
+
+			// the cached ids of the keys in the key table, set if the key table is set
+			EntityKeyIdCache *GetKeyIdCache() const { return this->KeyIdCache.get(); }
+
 			// Peek at the next byte in the stream, without modifing the Position or any data. If the Position is beyond the end of the stream, the value will be 0
-			u8 Peek() const;
+			// If the position is outside of the window, the window is moved.
+			u8 Peek();
 
 			// read one item from the memory stream. makes sure to convert endianness
 			template <class T> T Read();
@@ -68,12 +96,26 @@ namespace pds
 			u64 Read( hash *dest , u64 count );
 		};
 
-	inline u8 MemoryReadStream::Peek() const
+	inline u8 MemoryReadStream::Peek()
 		{
 		if( this->DataPosition >= this->DataSize )
 			return 0;
-		else
-			return this->Data[this->DataPosition];
+		if( this->DataPosition < this->WindowBegin || this->DataPosition >= this->WindowEnd )
+			{
+			// read the byte through the derived stream, and restore the position
+			const u64 position = this->DataPosition;
+			u8 value = 0;
+			this->ReadOutsideWindow( &value, 1 );
+			this->DataPosition = position;
+			return value;
+			}
+		return this->Data[this->DataPosition - this->WindowBegin];
+		}
+
+	inline u64 MemoryReadStream::ReadOutsideWindow( u8 * /*dest*/, u64 /*count*/ )
+		{
+		// the window of the memory stream is the whole stream, so no data is outside of it
+		return 0;
 		}
 
 	inline u64 MemoryReadStream::ReadRawData( void *dest, u64 count )
@@ -86,21 +128,36 @@ namespace pds
 			count = end_pos - this->DataPosition;
 			}
 
+		// data outside of the window is read by the derived stream
+		if( this->DataPosition < this->WindowBegin || end_pos > this->WindowEnd )
+			{
+			return this->ReadOutsideWindow( (u8 *)dest, count );
+			}
+
 		// copy the data and move the position
-		memcpy( dest, &this->Data[this->DataPosition], count );
+		memcpy( dest, &this->Data[this->DataPosition - this->WindowBegin], count );
 		this->DataPosition = end_pos;
 		return count;
 		}
 
 	template <class T> inline u64 MemoryReadStream::ReadValues( T *dest, u64 count )
 		{
-		u64 readc = this->ReadRawData( dest, count * sizeof(T) ) / sizeof(T);
 		if( !this->FlipByteOrder )
+			return this->ReadRawData( dest, count * sizeof(T) ) / sizeof(T);
+
+		// reads which are capped by the end of the stream, or are outside of the window, are read as raw data, and flipped in place
+		const u64 end_pos = this->DataPosition + count * sizeof(T);
+		if( end_pos > this->DataSize || this->DataPosition < this->WindowBegin || end_pos > this->WindowEnd )
+			{
+			const u64 readc = this->ReadRawData( dest, count * sizeof(T) ) / sizeof(T);
+			ByteSwap::CopySwapped<T>( dest, dest, readc );
 			return readc;
+			}
 
-		// flip the byte order of the words in the dest
-		swap_byte_order<T>( dest, count );
-		return readc;
+		// copy and flip the values in one pass, and move the position
+		ByteSwap::CopySwapped<T>( dest, &this->Data[this->DataPosition - this->WindowBegin], count );
+		this->DataPosition = end_pos;
+		return count;
 		}
 
 	template <> inline u64 MemoryReadStream::ReadValues<u8>( u8 *dest, u64 count ) 
@@ -113,6 +170,15 @@ namespace pds
 		return this->DataSize;
 		}
 
+	inline const u8 *MemoryReadStream::GetData() const
+		{
+		if( this->WindowBegin != 0 || this->WindowEnd != this->DataSize )
+			{
+			return nullptr;
+			}
+		return this->Data;
+		}
+
 	inline u64 MemoryReadStream::GetPosition() const 
 		{ 
 		return this->DataPosition; 
@@ -4,10 +4,23 @@
 #pragma once
 
 #include "pds.h"
+#include "SHA256.h"
+#include "ByteSwap.h"
+#include "TempFile.h"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <algorithm>
 
 #ifdef _MSC_VER
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <cerrno>
 #endif
 
 namespace pds
@@ -19,24 +32,99 @@ namespace pds
 	// the above types.
 	// Caveat: The stream is NOT thread safe, and should be accessed by 
 	// only one thread at a time.
+	// Placeholders are u64 values, such as block sizes, which are written before their values are known,
+	// and set when they are. To hash the data while it is written, the data is first written in a measure pass, 
+	// which stores nothing but the size of the data and the placeholder values. The data is then written again 
+	// in a hashed pass, where the placeholders are written with their values up front, so the stream never
+	// moves back, and the data is hashed in chunks as it is written, while the chunks are still in the cache.
+	// The stream reserves a large range of address space up front, and commits pages in the range as the stream
+	// grows, so the data never moves and is never copied when the stream grows. If the stream grows past the 
+	// reserved range, the range is moved to a larger one, which on Linux moves the pages without copying them.
+	// If the address space of the process is limited, smaller ranges are reserved, down to the size of the stream.
+	// A segmented stream instead stores the data in a chain of fixed-size segments, which are allocated as the
+	// stream grows. The data is then not contiguous, and is read segment by segment, using GetSegmentData.
+	// A stream can also spill its data to a file, for data which does not fit in memory. The data is then
+	// buffered in a fixed-size buffer, and written to the file at its position, see BeginSpill.
 	class MemoryWriteStream
 		{
+		public:
+			enum class WriteMode
+				{
+				Default, // write the data, placeholders are written as stand-ins and set in place
+				Measure, // only advance the position, and record the placeholder values
+				Hashed, // write the data with the measured placeholder values, and hash it while writing
+				};
+
 		private:
 			static const u64 InitialAllocationSize = 1024*1024*64; // 64MB initial size
+			static const u64 HashChunkSize = 1024*64; // size of the chunks hashed in the hashed write pass
+			static const u64 AddressSpaceReservationSize = 1024ull*1024*1024*64; // 64GB of address space reserved per stream
+			static const u64 FlipChunkSize = 1024*4; // size of the chunks which are flipped before they are written to a segmented or spilled stream
+			static const u64 SpillBufferSize = 1024*1024*4; // size of the buffer of a spilled stream
 
 			u8 *Data = nullptr; // the allocated data
 			u64 DataSize = 0; // the size of the memory stream (not the reserved allocation)
 			u64 Position = 0; // the write position in the memory stream
 			
-			u64 DataReservedSize = 0; // the reserved size of the allocation
+			u64 DataReservedSize = 0; // the committed size of the allocation
+			u64 AddressSpaceSize = 0; // the size of the reserved address space, of which DataReservedSize is committed
 			u32 PageSize = 0; // size of each page of allocation
+
+			u64 SegmentSize = 0; // the size of each segment of a segmented stream, 0 if the stream is contiguous
+			std::vector<u8*> Segments; // the allocated segments of a segmented stream
+
+			std::string SpillFilePath; // the path of the file the stream spills to, empty if the stream is not spilled
+#ifdef _MSC_VER
+			HANDLE SpillFile = INVALID_HANDLE_VALUE; // the open spill file, while the stream spills
+#else
+			int SpillFile = -1; // the open spill file, while the stream spills
+#endif
+			std::vector<u8> SpillBuffer; // buffer of the data at SpillBufferStart, which is not written to the file yet
+			u64 SpillBufferStart = 0;
+			u64 SpillBufferUsed = 0;
+			bool SpillFailed = false; // set if a write to the spill file failed
 			
 			bool FlipByteOrder = false; // true if we should flip BE to LE or LE to BE
+			u64 PayloadAlignment = 0; // if not 0, the alignment of the values of arrays and strings in the stream
+			std::shared_ptr<EntityKeyTable> KeyTable; // if set, the keys of the blocks written to the stream are interned in the table
+
+			WriteMode Mode = WriteMode::Default;
+			std::vector<u64> PlaceholderPositions; // positions of the placeholders, in the order they were written
+			std::vector<u64> PlaceholderValues; // values of the placeholders, set in the measure pass
+			size_t NextPlaceholder = 0; // the next placeholder to write in the hashed pass
+			std::unique_ptr<SHA256> Hasher; // hash of the data in the hashed pass
+			u64 HashedSize = 0; // size of the data which is hashed
+			bool HashedWriteFailed = false; // set if the hashed pass did not write the data the same way as the measure pass
+
+			// hash the written data which is not hashed yet
+			void HashWrittenData();
+
+			// find the index of the placeholder at position, or return false if there is none
+			bool FindPlaceholder( u64 position, size_t &index ) const;
 
 			// reserve data for at least reserveSize.
 			void ReserveForSize( u64 reserveSize );
 			void FreeAllocation();
 
+			// reserve a range of address space, and commit the first pages of a reserved range. if the preferred size can't be
+			// reserved, as when the address space of the process is limited, smaller sizes down to the minimum size are tried.
+			static u8 *ReserveAddressSpace( u64 size );
+			static u8 *ReserveAddressSpace( u64 minimumSize, u64 preferredSize, u64 &destSize );
+			static bool CommitAddressSpace( u8 *data, u64 committedSize, u64 size );
+			static void ReleaseAddressSpace( u8 *data, u64 size );
+			static u32 GetSystemPageSize();
+
+			// copy data into the segments at the position, or hash the segment data in a range
+			void CopyToSegments( u64 position, const u8 *src, u64 count );
+			void HashSegments( u64 begin, u64 end );
+
+			// write data to a spilled stream at the position, and write the buffered data to the spill file
+			bool IsSpilling() const;
+			void WriteSpilledData( u64 position, const u8 *src, u64 count );
+			void FlushSpillBuffer();
+			void WriteSpillFile( u64 position, const u8 *src, u64 count );
+			void CloseSpillFile();
+
 			// resize (grow) the data stream. if the new size is larger than the reserved size, the allocation will be resized to fit the new size
 			void Resize( u64 newSize );
 
@@ -47,15 +135,47 @@ namespace pds
 			template <class T> void WriteValues( const T *src, u64 count );
 			
 		public:
+			static const u64 DefaultSegmentSize = 1024*1024; // 1MB segments
+
 			MemoryWriteStream( u64 _InitialAllocationSize = InitialAllocationSize ) { this->ReserveForSize( _InitialAllocationSize ); };
-			~MemoryWriteStream() { this->FreeAllocation(); };
+			~MemoryWriteStream() { this->CloseSpillFile(); this->FreeAllocation(); };
+
+			// create a segmented stream, with segments of _SegmentSize bytes
+			MemoryWriteStream( u64 _InitialAllocationSize, u64 _SegmentSize ) : SegmentSize( _SegmentSize ) { this->ReserveForSize( _InitialAllocationSize ); };
 
-			// get a read-only pointer to the data
+			// get a read-only pointer to the data. only a contiguous stream has a pointer to all the data, a segmented stream returns nullptr.
 			const void *GetData() const { return this->Data; }
 
+			// the segments of the stream are the parts of the data which are contiguous in memory. a contiguous stream with data has one segment.
+			bool IsSegmented() const { return this->SegmentSize != 0; }
+			size_t GetSegmentCount() const;
+			const u8 *GetSegmentData( size_t index ) const;
+			u64 GetSegmentSize( size_t index ) const;
+
+			// spill the data of the stream to a new temp file, named <filePathPrefix><pid>-<random><filePathSuffix> (see create_temp_file), 
+			// instead of keeping it in memory. the data is buffered, and written to the file at its position, so data can also be set at 
+			// earlier positions, such as placeholders. call on an empty stream, or after the measure pass. the data of a spilled stream 
+			// is only in the file, so a spilled stream has no data pointer and no segments. returns false if the file can't be created.
+			bool BeginSpill( const std::string &filePathPrefix, const std::string &filePathSuffix );
+
+			// write the rest of the buffered data to the spill file, and close it. the file is left in place, and is not removed
+			// by the stream. returns false if any write to the file failed, in which case the file data is invalid.
+			bool EndSpill();
+
+			// the path of the spill file, if the stream is spilled. the stream stays spilled until it is reset.
+			bool IsSpilled() const { return !this->SpillFilePath.empty(); }
+			const std::string &GetSpillFilePath() const { return this->SpillFilePath; }
+
 			// get the Size of the stream in bytes
 			u64 GetSize() const;
 
+			// get the size of the allocation, which is kept when the stream is reset
+			u64 GetReservedSize() const { return this->DataReservedSize; }
+
+			// empty the stream, so it can be reused to write new data. the allocation is kept, the write mode is set
+			// to Default, the byte order is not flipped, and payloads are not padded and keys not interned, as in a new stream.
+			void Reset();
+
 			// Position is the current data position. the beginning of the stream is position 0. the stream grows whenever the position moves past the current end of the stream.
 			u64 GetPosition() const;
 			void SetPosition( u64 new_pos );
@@ -64,6 +184,15 @@ namespace pds
 			bool GetFlipByteOrder() const;
 			void SetFlipByteOrder( bool value );
 
+			// PayloadAlignment is set if the values of arrays and strings written to the stream are padded to start at a multiple of
+			// the alignment, relative to the start of the stream. 0 for no padding, else a power of two, at most EntityMaxPayloadAlignment.
+			u64 GetPayloadAlignment() const { return this->PayloadAlignment; }
+			void SetPayloadAlignment( u64 value );
+
+			// KeyTable is set if the blocks written to the stream store key ids instead of keys (see EntityWriter::InternKeys)
+			const std::shared_ptr<EntityKeyTable> &GetKeyTable() const { return this->KeyTable; }
+			void SetKeyTable( const std::shared_ptr<EntityKeyTable> &value ) { this->KeyTable = value; }
+
 			// write one item to the memory stream. makes sure to convert endianness
 			void Write( const i8 &src );
 			void Write( const i16 &src );
@@ -78,6 +207,23 @@ namespace pds
 			void Write( const uuid &src );
 			void Write( const hash &src );
 
+			// write a placeholder u64 value at the current position, and set its value when it is known
+			void WritePlaceholder();
+			void SetPlaceholder( u64 placeholder_pos, u64 value );
+
+			// start the measure pass. the stream must be empty.
+			void BeginMeasure();
+
+			// start the hashed write pass, after the measure pass. the stream is reset to write the data again.
+			void BeginHashedWrite();
+
+			// end the hashed write pass, and get the digest of the data. returns false if the data was 
+			// not written the same way as in the measure pass, in which case the data and digest are invalid.
+			bool EndHashedWrite( hash &digest );
+
+			// the current write mode
+			WriteMode GetWriteMode() const { return this->Mode; }
+
 			// write an array of items to the memory stream. makes sure to convert endianness
 			void Write( const i8 *src , u64 count );
 			void Write( const i16 *src , u64 count );
@@ -94,56 +240,252 @@ namespace pds
 
 		};
 
-	inline void MemoryWriteStream::ReserveForSize( u64 reserveSize )
+	inline u32 MemoryWriteStream::GetSystemPageSize()
 		{
-		// we need to resize the reserved data area, try doubling size
-		// and if that is not enough, set to the reserveSize
-		this->DataReservedSize *= 2;
-		if( this->DataReservedSize < reserveSize )
+#ifdef _MSC_VER
+		SYSTEM_INFO systemInfo;
+		::GetSystemInfo( &systemInfo );
+		return (u32)systemInfo.dwPageSize;
+#else
+		const long pageSize = ::sysconf( _SC_PAGESIZE );
+		return ( pageSize > 0 ) ? (u32)pageSize : 4096;
+#endif
+		}
+
+	inline u8 *MemoryWriteStream::ReserveAddressSpace( u64 size )
+		{
+#ifdef _MSC_VER
+		return (u8*)::VirtualAlloc( nullptr, size, MEM_RESERVE, PAGE_NOACCESS );
+#else
+		// the pages are not accessible, and not counted as used memory, until they are committed
+		void *data = ::mmap( nullptr, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+		return ( data != MAP_FAILED ) ? (u8*)data : nullptr;
+#endif
+		}
+
+	inline u8 *MemoryWriteStream::ReserveAddressSpace( u64 minimumSize, u64 preferredSize, u64 &destSize )
+		{
+		u64 size = std::max( preferredSize, minimumSize );
+		for( ;; )
 			{
-			this->DataReservedSize = reserveSize;
+			u8 *data = ReserveAddressSpace( size );
+			if( data != nullptr || size <= minimumSize )
+				{
+				destSize = size;
+				return data;
+				}
+			size = std::max( size / 2, minimumSize );
 			}
+		}
 
-		// allocate a new area
+	inline bool MemoryWriteStream::CommitAddressSpace( u8 *data, u64 committedSize, u64 size )
+		{
+		if( size <= committedSize )
+			{
+			return true;
+			}
 #ifdef _MSC_VER
-		u8 *pNewData = (u8*)::VirtualAlloc( nullptr, this->DataReservedSize, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE );
-#elif defined(__GNUC__)
-		u8 *pNewData = (u8*)malloc(this->DataReservedSize);
+		return ::VirtualAlloc( &data[committedSize], size - committedSize, MEM_COMMIT, PAGE_READWRITE ) != nullptr;
+#else
+		// the pages are backed by memory when they are first written
+		return ::mprotect( &data[committedSize], size - committedSize, PROT_READ | PROT_WRITE ) == 0;
 #endif
-		if( pNewData == nullptr )
+		}
+
+	inline void MemoryWriteStream::ReleaseAddressSpace( u8 *data, u64 size )
+		{
+#ifdef _MSC_VER
+		(void)size;
+		::VirtualFree( data, 0, MEM_RELEASE );
+#else
+		::munmap( data, size );
+#endif
+		}
+
+	inline void MemoryWriteStream::ReserveForSize( u64 reserveSize )
+		{
+		// a segmented stream adds segments, the data in the segments never moves
+		if( this->SegmentSize != 0 )
 			{
-			throw std::bad_alloc();
+			while( this->DataReservedSize < reserveSize )
+				{
+				u8 *pNewSegment = (u8*)malloc( (size_t)this->SegmentSize );
+				if( pNewSegment == nullptr )
+					{
+					throw std::bad_alloc();
+					}
+				this->Segments.emplace_back( pNewSegment );
+				this->DataReservedSize += this->SegmentSize;
+				}
+			return;
+			}
+
+		if( this->PageSize == 0 )
+			{
+			this->PageSize = GetSystemPageSize();
+			}
+
+		// we need to grow the committed data area, try doubling size
+		// and if that is not enough, set to the reserveSize. commit whole pages.
+		u64 newReservedSize = this->DataReservedSize * 2;
+		if( newReservedSize < reserveSize )
+			{
+			newReservedSize = reserveSize;
 			}
+		newReservedSize = ( newReservedSize + this->PageSize - 1 ) & ~u64( this->PageSize - 1 );
 
-		// if there is an old area, copy the data and free the old area
-		// the area can never shrink, so we don't need to worry about capping
-		if( this->Data )
+		if( !this->Data )
+			{
+			// reserve the address space the stream grows into, or less if the address space is limited
+			u64 addressSpaceSize = 0;
+			this->Data = ReserveAddressSpace( newReservedSize, u64( AddressSpaceReservationSize ), addressSpaceSize );
+			if( this->Data == nullptr )
+				{
+				throw std::bad_alloc();
+				}
+			this->AddressSpaceSize = addressSpaceSize;
+			}
+		else if( newReservedSize > this->AddressSpaceSize )
 			{
+			// the reserved range is used up, move the data to a range twice as large, or smaller if the address space is limited
+			u64 addressSpaceSize = std::max( newReservedSize, this->AddressSpaceSize * 2 );
+#ifdef __linux__
+			// drop the uncommitted part of the range, and move the committed pages to a larger range without copying them
+			if( this->AddressSpaceSize > this->DataReservedSize )
+				{
+				::munmap( &this->Data[this->DataReservedSize], this->AddressSpaceSize - this->DataReservedSize );
+				}
+			void *pNewData = ::mremap( this->Data, this->DataReservedSize, addressSpaceSize, MREMAP_MAYMOVE );
+			while( pNewData == MAP_FAILED && addressSpaceSize > newReservedSize )
+				{
+				addressSpaceSize = std::max( addressSpaceSize / 2, newReservedSize );
+				pNewData = ::mremap( this->Data, this->DataReservedSize, addressSpaceSize, MREMAP_MAYMOVE );
+				}
+			if( pNewData == MAP_FAILED )
+				{
+				this->AddressSpaceSize = this->DataReservedSize;
+				throw std::bad_alloc();
+				}
+
+			// the grown range is writable, so make the part which is not committed inaccessible again
+			this->Data = (u8*)pNewData;
+			this->AddressSpaceSize = addressSpaceSize;
+			::mprotect( &this->Data[newReservedSize], addressSpaceSize - newReservedSize, PROT_NONE );
+			this->DataReservedSize = newReservedSize;
+			return;
+#else
+			// reserve a new range, copy the data and release the old range
+			u8 *pNewData = ReserveAddressSpace( newReservedSize, addressSpaceSize, addressSpaceSize );
+			if( pNewData == nullptr || !CommitAddressSpace( pNewData, 0, newReservedSize ) )
+				{
+				if( pNewData )
+					{
+					ReleaseAddressSpace( pNewData, addressSpaceSize );
+					}
+				throw std::bad_alloc();
+				}
 			memcpy( pNewData, this->Data, this->DataSize );
-			this->FreeAllocation();
+			ReleaseAddressSpace( this->Data, this->AddressSpaceSize );
+			this->Data = pNewData;
+			this->AddressSpaceSize = addressSpaceSize;
+			this->DataReservedSize = newReservedSize;
+			return;
+#endif
 			}
 
-		// set the new pointer
-		this->Data = pNewData;
+		// commit the pages which the stream grows into, the data does not move
+		if( !CommitAddressSpace( this->Data, this->DataReservedSize, newReservedSize ) )
+			{
+			throw std::bad_alloc();
+			}
+		this->DataReservedSize = newReservedSize;
 		}
 
 	inline void MemoryWriteStream::FreeAllocation()
 		{
+		for( size_t i = 0; i < this->Segments.size(); ++i )
+			{
+			free( this->Segments[i] );
+			}
+		if( !this->Segments.empty() )
+			{
+			this->Segments.clear();
+			this->DataReservedSize = 0;
+			}
 		if( this->Data ) 
 			{ 
-#ifdef _MSC_VER			
-			::VirtualFree( this->Data, 0, MEM_RELEASE );
-#elif defined(__GNUC__)
-			free( this->Data );
-#endif							
+			ReleaseAddressSpace( this->Data, this->AddressSpaceSize );
 			this->Data = nullptr;
+			this->DataReservedSize = 0;
+			this->AddressSpaceSize = 0;
+			}
+		}
+
+
+	inline void MemoryWriteStream::CopyToSegments( u64 position, const u8 *src, u64 count )
+		{
+		// copy the part of the data which goes in each segment
+		while( count > 0 )
+			{
+			const size_t segmentIndex = (size_t)( position / this->SegmentSize );
+			const u64 segmentOffset = position % this->SegmentSize;
+			const u64 copyCount = std::min( count, this->SegmentSize - segmentOffset );
+			memcpy( &this->Segments[segmentIndex][segmentOffset], src, (size_t)copyCount );
+			position += copyCount;
+			src += copyCount;
+			count -= copyCount;
 			}
 		}
 
+	inline void MemoryWriteStream::HashSegments( u64 begin, u64 end )
+		{
+		while( begin < end )
+			{
+			const size_t segmentIndex = (size_t)( begin / this->SegmentSize );
+			const u64 segmentOffset = begin % this->SegmentSize;
+			const u64 hashCount = std::min( end - begin, this->SegmentSize - segmentOffset );
+			this->Hasher->Update( &this->Segments[segmentIndex][segmentOffset], (size_t)hashCount );
+			begin += hashCount;
+			}
+		}
+
+	inline size_t MemoryWriteStream::GetSegmentCount() const
+		{
+		if( this->IsSpilled() )
+			{
+			return 0;
+			}
+		if( this->SegmentSize == 0 )
+			{
+			return ( this->DataSize > 0 ) ? 1 : 0;
+			}
+		return (size_t)( ( this->DataSize + this->SegmentSize - 1 ) / this->SegmentSize );
+		}
+
+	inline const u8 *MemoryWriteStream::GetSegmentData( size_t index ) const
+		{
+		pdsSanityCheckDebugMacro( index < this->GetSegmentCount() );
+		if( this->SegmentSize == 0 )
+			{
+			return this->Data;
+			}
+		return this->Segments[index];
+		}
+
+	inline u64 MemoryWriteStream::GetSegmentSize( size_t index ) const
+		{
+		pdsSanityCheckDebugMacro( index < this->GetSegmentCount() );
+		if( this->SegmentSize == 0 )
+			{
+			return this->DataSize;
+			}
+		return std::min( this->SegmentSize, this->DataSize - index * this->SegmentSize );
+		}
 
 	inline void MemoryWriteStream::Resize( u64 newSize )
 		{
-		if( newSize > this->DataReservedSize )
+		// nothing is stored in the measure pass, and a spilled stream stores the data in the spill file
+		if( newSize > this->DataReservedSize && this->Mode != WriteMode::Measure && !this->IsSpilling() )
 			{
 			this->ReserveForSize( newSize );
 			}
@@ -160,24 +502,69 @@ namespace pds
 			this->Resize( end_pos );
 			}
 
+		// in the measure pass, only move the position
+		if( this->Mode == WriteMode::Measure )
+			{
+			this->Position = end_pos;
+			return;
+			}
+
+		// hash the data written so far in chunks, the data before the position is final in the hashed pass
+		if( this->Mode == WriteMode::Hashed && this->Position - this->HashedSize >= HashChunkSize )
+			{
+			this->HashWrittenData();
+			}
+
 		// copy the data and move the position
-		memcpy( &this->Data[this->Position] , src , count );
+		if( this->IsSpilling() )
+			{
+			this->WriteSpilledData( this->Position, (const u8 *)src, count );
+			}
+		else if( this->SegmentSize != 0 )
+			{
+			this->CopyToSegments( this->Position, (const u8 *)src, count );
+			}
+		else
+			{
+			memcpy( &this->Data[this->Position] , src , count );
+			}
 		this->Position = end_pos;
 		}
 
 	template <class T> inline void MemoryWriteStream::WriteValues( const T *src, u64 count )
 		{
-		if( this->FlipByteOrder )
+		if( !this->FlipByteOrder || this->Mode == WriteMode::Measure )
 			{
-			// flip the byte order of the words in the dest 
-			u64 pos = this->Position;
+			// no flipping, just write as is
 			this->WriteRawData( src, count * sizeof(T) );
-			swap_byte_order<T>( (T*)(&this->Data[pos]), count );
+			}
+		else if( this->SegmentSize != 0 || this->IsSpilling() )
+			{
+			// the values may cross segment boundaries, so flip the values in chunks before they are written
+			T flipped[FlipChunkSize / sizeof(T)];
+			while( count > 0 )
+				{
+				const u64 chunkCount = std::min<u64>( count, FlipChunkSize / sizeof(T) );
+				ByteSwap::CopySwapped<T>( flipped, src, chunkCount );
+				this->WriteRawData( flipped, chunkCount * sizeof(T) );
+				src += chunkCount;
+				count -= chunkCount;
+				}
 			}
 		else
 			{
-			// no flipping, just write as is
-			this->WriteRawData( src, count * sizeof(T) );
+			// copy and flip the values directly into the stream, in one pass (see WriteRawData)
+			const u64 end_pos = this->Position + count * sizeof(T);
+			if( end_pos > this->DataSize )
+				{
+				this->Resize( end_pos );
+				}
+			if( this->Mode == WriteMode::Hashed && this->Position - this->HashedSize >= HashChunkSize )
+				{
+				this->HashWrittenData();
+				}
+			ByteSwap::CopySwapped<T>( &this->Data[this->Position], src, count );
+			this->Position = end_pos;
 			}
 		}
 
@@ -198,6 +585,11 @@ namespace pds
 
 	inline void MemoryWriteStream::SetPosition( u64 new_pos ) 
 		{ 
+		// the hashed data can't be changed
+		if( this->Mode == WriteMode::Hashed && new_pos < this->HashedSize )
+			{
+			this->HashedWriteFailed = true;
+			}
 		if( new_pos > DataSize )
 			{
 			this->Resize( new_pos );
@@ -205,6 +597,28 @@ namespace pds
 		this->Position = new_pos; 
 		}
 
+	inline void MemoryWriteStream::Reset()
+		{
+		this->CloseSpillFile();
+		this->SpillFilePath.clear();
+		std::vector<u8>().swap( this->SpillBuffer );
+		this->SpillBufferStart = 0;
+		this->SpillBufferUsed = 0;
+		this->SpillFailed = false;
+		this->DataSize = 0;
+		this->Position = 0;
+		this->FlipByteOrder = false;
+		this->PayloadAlignment = 0;
+		this->KeyTable.reset();
+		this->Mode = WriteMode::Default;
+		this->PlaceholderPositions.clear();
+		this->PlaceholderValues.clear();
+		this->NextPlaceholder = 0;
+		this->Hasher.reset();
+		this->HashedSize = 0;
+		this->HashedWriteFailed = false;
+		}
+
 	inline bool MemoryWriteStream::GetFlipByteOrder() const 
 		{ 
 		return this->FlipByteOrder; 
@@ -215,6 +629,310 @@ namespace pds
 		this->FlipByteOrder = value;
 		}
 
+	inline void MemoryWriteStream::SetPayloadAlignment( u64 value )
+		{
+		pdsSanityCheckDebugMacro( value <= EntityMaxPayloadAlignment && ( value & ( value - 1 ) ) == 0 );
+		this->PayloadAlignment = value;
+		}
+
+	inline bool MemoryWriteStream::IsSpilling() const
+		{
+#ifdef _MSC_VER
+		return this->SpillFile != INVALID_HANDLE_VALUE;
+#else
+		return this->SpillFile >= 0;
+#endif
+		}
+
+	inline bool MemoryWriteStream::BeginSpill( const std::string &filePathPrefix, const std::string &filePathSuffix )
+		{
+		pdsSanityCheckDebugMacro( this->DataSize == 0 || this->Mode == WriteMode::Measure );
+		if( this->IsSpilled() )
+			{
+			return false;
+			}
+
+		// the file is created exclusively, so the file of another stream or process is never written to
+		std::string filePath;
+		this->SpillFile = create_temp_file( filePathPrefix, filePathSuffix, filePath );
+		if( !this->IsSpilling() )
+			{
+			return false;
+			}
+
+		this->SpillFilePath = filePath;
+		this->SpillBuffer.resize( (size_t)SpillBufferSize );
+		this->SpillBufferStart = 0;
+		this->SpillBufferUsed = 0;
+		this->SpillFailed = false;
+		return true;
+		}
+
+	inline bool MemoryWriteStream::EndSpill()
+		{
+		if( !this->IsSpilling() )
+			{
+			return false;
+			}
+		this->FlushSpillBuffer();
+		this->CloseSpillFile();
+		std::vector<u8>().swap( this->SpillBuffer );
+		return !this->SpillFailed;
+		}
+
+	inline void MemoryWriteStream::CloseSpillFile()
+		{
+		if( !this->IsSpilling() )
+			{
+			return;
+			}
+#ifdef _MSC_VER
+		::CloseHandle( this->SpillFile );
+		this->SpillFile = INVALID_HANDLE_VALUE;
+#else
+		if( ::close( this->SpillFile ) != 0 )
+			{
+			this->SpillFailed = true;
+			}
+		this->SpillFile = -1;
+#endif
+		}
+
+	inline void MemoryWriteStream::WriteSpillFile( u64 position, const u8 *src, u64 count )
+		{
+		u64 bytesWritten = 0;
+		while( bytesWritten < count && !this->SpillFailed )
+			{
+#ifdef _MSC_VER
+			OVERLAPPED overlapped = {};
+			overlapped.Offset = (DWORD)( ( position + bytesWritten ) & 0xffffffff );
+			overlapped.OffsetHigh = (DWORD)( ( position + bytesWritten ) >> 32 );
+			const DWORD bytesToWrite = (DWORD)std::min<u64>( count - bytesWritten, UINT_MAX );
+			DWORD bytesThatWereWritten = 0;
+			if( !::WriteFile( this->SpillFile, &src[bytesWritten], bytesToWrite, &bytesThatWereWritten, &overlapped ) )
+				{
+				this->SpillFailed = true;
+				}
+			bytesWritten += bytesThatWereWritten;
+#else
+			const ssize_t ret = ::pwrite( this->SpillFile, &src[bytesWritten], (size_t)( count - bytesWritten ), (off_t)( position + bytesWritten ) );
+			if( ret < 0 && errno == EINTR )
+				{
+				continue;
+				}
+			if( ret <= 0 )
+				{
+				this->SpillFailed = true;
+				}
+			else
+				{
+				bytesWritten += (u64)ret;
+				}
+#endif
+			}
+		}
+
+	inline void MemoryWriteStream::FlushSpillBuffer()
+		{
+		if( this->SpillBufferUsed == 0 )
+			{
+			return;
+			}
+
+		// the data must be hashed before it leaves the buffer
+		if( this->Mode == WriteMode::Hashed )
+			{
+			this->HashWrittenData();
+			}
+
+		this->WriteSpillFile( this->SpillBufferStart, this->SpillBuffer.data(), this->SpillBufferUsed );
+		this->SpillBufferStart += this->SpillBufferUsed;
+		this->SpillBufferUsed = 0;
+		}
+
+	inline void MemoryWriteStream::WriteSpilledData( u64 position, const u8 *src, u64 count )
+		{
+		// data before the buffer, such as a placeholder, is set directly in the file
+		if( position < this->SpillBufferStart )
+			{
+			const u64 fileCount = std::min( count, this->SpillBufferStart - position );
+			this->WriteSpillFile( position, src, fileCount );
+			position += fileCount;
+			src += fileCount;
+			count -= fileCount;
+			if( count == 0 )
+				{
+				return;
+				}
+			}
+
+		// the buffer holds one contiguous range of data. if the data is not in or right after the range, 
+		// or does not fit in the buffer, write out the buffer, and start a new range at the position.
+		if( position > this->SpillBufferStart + this->SpillBufferUsed || position + count > this->SpillBufferStart + SpillBufferSize )
+			{
+			this->FlushSpillBuffer();
+			this->SpillBufferStart = position;
+
+			// data which is larger than the buffer is hashed and written directly
+			if( count > SpillBufferSize )
+				{
+				if( this->Mode == WriteMode::Hashed )
+					{
+					if( this->HashedSize != position )
+						{
+						this->HashedWriteFailed = true;
+						}
+					this->Hasher->Update( src, (size_t)count );
+					this->HashedSize = position + count;
+					}
+				this->WriteSpillFile( position, src, count );
+				this->SpillBufferStart = position + count;
+				return;
+				}
+			}
+
+		memcpy( &this->SpillBuffer[(size_t)( position - this->SpillBufferStart )], src, (size_t)count );
+		this->SpillBufferUsed = std::max( this->SpillBufferUsed, position + count - this->SpillBufferStart );
+		}
+
+	inline void MemoryWriteStream::HashWrittenData()
+		{
+		if( this->Position > this->HashedSize )
+			{
+			if( this->IsSpilling() )
+				{
+				// the data after the start of the buffer is still in the buffer
+				if( this->HashedSize < this->SpillBufferStart || this->Position > this->SpillBufferStart + this->SpillBufferUsed )
+					{
+					this->HashedWriteFailed = true;
+					return;
+					}
+				this->Hasher->Update( &this->SpillBuffer[(size_t)( this->HashedSize - this->SpillBufferStart )], (size_t)( this->Position - this->HashedSize ) );
+				}
+			else if( this->SegmentSize != 0 )
+				{
+				this->HashSegments( this->HashedSize, this->Position );
+				}
+			else
+				{
+				this->Hasher->Update( &this->Data[this->HashedSize], (size_t)( this->Position - this->HashedSize ) );
+				}
+			this->HashedSize = this->Position;
+			}
+		}
+
+	inline bool MemoryWriteStream::FindPlaceholder( u64 position, size_t &index ) const
+		{
+		// the placeholders are written in order, so the positions are sorted
+		const auto it = std::lower_bound( this->PlaceholderPositions.begin(), this->PlaceholderPositions.end(), position );
+		if( it == this->PlaceholderPositions.end() || *it != position )
+			{
+			return false;
+			}
+		index = (size_t)( it - this->PlaceholderPositions.begin() );
+		return true;
+		}
+
+	inline void MemoryWriteStream::WritePlaceholder()
+		{
+		if( this->Mode == WriteMode::Measure )
+			{
+			this->PlaceholderPositions.emplace_back( this->Position );
+			this->PlaceholderValues.emplace_back( (u64)INT64_MAX );
+			this->Write( (u64)INT64_MAX );
+			}
+		else if( this->Mode == WriteMode::Hashed )
+			{
+			// write the measured value directly
+			if( this->NextPlaceholder >= this->PlaceholderPositions.size() || this->PlaceholderPositions[this->NextPlaceholder] != this->Position )
+				{
+				this->HashedWriteFailed = true;
+				this->Write( (u64)INT64_MAX );
+				return;
+				}
+			this->Write( this->PlaceholderValues[this->NextPlaceholder] );
+			++this->NextPlaceholder;
+			}
+		else
+			{
+			// write empty stand in value for now (INT64_MAX on purpose), which is definitely 
+			// wrong, as to trigger any test if the value is not overwritten with the correct value
+			this->Write( (u64)INT64_MAX );
+			}
+		}
+
+	inline void MemoryWriteStream::SetPlaceholder( u64 placeholder_pos, u64 value )
+		{
+		size_t index = 0;
+		if( this->Mode == WriteMode::Measure )
+			{
+			if( this->FindPlaceholder( placeholder_pos, index ) )
+				{
+				this->PlaceholderValues[index] = value;
+				}
+			}
+		else if( this->Mode == WriteMode::Hashed )
+			{
+			// the value is already written, make sure it is the same
+			if( !this->FindPlaceholder( placeholder_pos, index ) || this->PlaceholderValues[index] != value )
+				{
+				this->HashedWriteFailed = true;
+				}
+			}
+		else
+			{
+			const u64 end_pos = this->Position;
+			this->SetPosition( placeholder_pos );
+			this->Write( value );
+			this->SetPosition( end_pos ); // move back the where we were
+			}
+		}
+
+	inline void MemoryWriteStream::BeginMeasure()
+		{
+		pdsSanityCheckDebugMacro( this->DataSize == 0 );
+		this->Mode = WriteMode::Measure;
+		this->PlaceholderPositions.clear();
+		this->PlaceholderValues.clear();
+		}
+
+	inline void MemoryWriteStream::BeginHashedWrite()
+		{
+		pdsSanityCheckDebugMacro( this->Mode == WriteMode::Measure );
+
+		// the size is known, so reserve all of it once
+		const u64 measuredSize = this->DataSize;
+		this->Mode = WriteMode::Hashed;
+		this->DataSize = 0;
+		this->Position = 0;
+		if( measuredSize > this->DataReservedSize && !this->IsSpilling() )
+			{
+			this->ReserveForSize( measuredSize );
+			}
+
+		this->NextPlaceholder = 0;
+		this->Hasher.reset( new SHA256() );
+		this->HashedSize = 0;
+		this->HashedWriteFailed = false;
+		}
+
+	inline bool MemoryWriteStream::EndHashedWrite( hash &digest )
+		{
+		pdsSanityCheckDebugMacro( this->Mode == WriteMode::Hashed );
+
+		// hash the rest of the data
+		if( this->Position != this->DataSize )
+			{
+			this->HashedWriteFailed = true;
+			}
+		this->HashWrittenData();
+		this->Hasher->GetDigest( digest.digest );
+		this->Hasher.reset();
+		this->Mode = WriteMode::Default;
+
+		return !this->HashedWriteFailed && this->NextPlaceholder == this->PlaceholderPositions.size();
+		}
+
 	//// write one item of data, (but using the multi-values method)
 	inline void MemoryWriteStream::Write( const i8 &src ) { this->Write( &src, 1 ); }
 	inline void MemoryWriteStream::Write( const i16 &src ) { this->Write( &src, 1 ); }
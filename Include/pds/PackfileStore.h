@@ -0,0 +1,838 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+#include "SHA256.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <unordered_map>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+
+#ifdef _MSC_VER
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+
+namespace pds
+	{
+	// Packfile store keeps entities in large append-only segment files, instead of in one file per entity.
+	//
+	// Segment files (segment-NNNNNN.pack):
+	//		u8 Magic[8]; // "PDSPACK1"
+	//		records, each:
+	//			u8 Hash[32]; // the sha256 hash of the entity data
+	//			u64 SizeInBytes; // size of the entity data
+	//			u8 Data[SizeInBytes]; // the entity data, same as in a loose .dat entity file
+	//
+	// Index files (segment-NNNNNN.index), sorted on hash, written when a segment is sealed or the store is closed:
+	//		u8 Magic[8]; // "PDSINDX1"
+	//		u64 SegmentSize; // the size of the segment file the index covers
+	//		u64 EntryCount;
+	//		entries, each:
+	//			u8 Hash[32];
+	//			u64 Offset; // offset of the data in the segment
+	//			u64 SizeInBytes;
+	//
+	// On Initialize, the index files are loaded into one sorted hash -> (segment, offset, size) index.
+	// A segment with a missing or outdated index file (if the store was not closed) is scanned instead. The data
+	// of each scanned record is hashed and compared to the hash of the record, and the scan stops at the first
+	// record which is torn or does not match, such as a zero-filled tail after a crash. The records from there
+	// are ignored, and overwritten by the next write.
+	// Values are stored in native byte order, same as the entity files.
+	// The store is thread safe, reads can be done concurrently, writes are serialized.
+	// Caveat: Only one store at a time can have a directory open.
+	class PackfileStore
+		{
+		public:
+			static const u64 DefaultMaxSegmentSize = 1024*1024*256; // 256MB
+
+		private:
+#ifdef _MSC_VER
+			typedef HANDLE FileHandle;
+#else
+			typedef int FileHandle;
+#endif
+
+			static const u64 SegmentHeaderSize = 8;
+			static const u64 RecordHeaderSize = 40; // hash + size
+			static const u64 IndexHeaderSize = 24; // magic + segment size + entry count
+			static const u64 IndexEntrySize = 48; // hash + offset + size
+
+			// where the data of an entity is stored
+			struct Location
+				{
+				size_t SegmentIndex = 0; // index into Segments
+				u64 Offset = 0;
+				u64 Size = 0;
+				};
+
+			struct IndexEntry
+				{
+				hash Id = {};
+				Location Loc;
+				};
+
+			struct Segment
+				{
+				u32 Id = 0;
+				FileHandle Handle = {};
+				u64 Size = 0; // the end of the last valid record
+				};
+
+			std::string Path;
+			u64 MaxSegmentSize = DefaultMaxSegmentSize;
+
+			// sorted index loaded at Initialize, and the entries appended after that
+			std::vector<IndexEntry> SortedIndex;
+			std::unordered_map<hash, Location> AppendedIndex;
+			std::vector<Segment> Segments;
+			ctle::readers_writer_lock IndexLock;
+
+			// entries of the last (active) segment, which are written to its index file when it is sealed
+			std::vector<IndexEntry> ActiveSegmentEntries;
+			std::mutex WriteMutex;
+
+			bool FindLocation( const hash &id, Location &loc ) const;
+			std::string SegmentFilePath( u32 id, const char *extension ) const;
+			Status OpenSegment( u32 id, bool create );
+			Status LoadSegmentIndex( size_t segmentIndex, std::vector<IndexEntry> &entries ) const;
+			Status ScanSegment( size_t segmentIndex, std::vector<IndexEntry> &entries );
+			Status WriteSegmentIndex( size_t segmentIndex, std::vector<IndexEntry> entries ) const;
+			void Close( bool writeActiveSegmentIndex );
+
+			static Status ReadAt( FileHandle handle, u64 offset, void *dest, u64 size );
+			static Status WriteAt( FileHandle handle, u64 offset, const void *src, u64 size );
+			static Status SyncFile( FileHandle handle );
+			static void CloseFile( FileHandle handle );
+			static Status ListFiles( const std::string &path, std::vector<std::string> &fileNames );
+
+		public:
+			PackfileStore() = default;
+			PackfileStore( const PackfileStore &other ) = delete;
+			PackfileStore &operator=( const PackfileStore &other ) = delete;
+			~PackfileStore() { this->Deinitialize(); }
+
+			// open the store in the directory at path, and load the index of all segments in the directory.
+			// segments are sealed and a new segment is started when a segment would grow past maxSegmentSize.
+			Status Initialize( const std::string &path, u64 maxSegmentSize = DefaultMaxSegmentSize );
+
+			// write the index of the active segment, and close all segments
+			void Deinitialize();
+
+			// checks if the store has an entity
+			bool Contains( const hash &id );
+
+			// lists the ids of all entities in the store
+			void ListEntities( std::vector<hash> &ids );
+
+			// read the data of an entity into dest. returns ECantOpen if the store does not have the entity.
+			Status Read( const hash &id, std::vector<u8> &dest );
+
+			// append the data of an entity. returns WAlreadyExists if the store already has the entity.
+			Status Write( const hash &id, const u8 *data, u64 size );
+
+			// flush the active segment to disk
+			Status Flush();
+
+			// move all loose <sha256-hex>.dat entity files in the store directory into the packfiles. each file is
+			// verified against its hash, and is removed when it is safely in the packfiles. files which fail the
+			// verification are left in place. the number of moved files is returned in compactedCount.
+			// only the flat layout is compacted, files in fan-out subdirectories (see EntityDirectory) are left in place.
+			Status CompactLooseFiles( u64 *compactedCount = nullptr );
+		};
+
+	inline bool PackfileStore::FindLocation( const hash &id, Location &loc ) const
+		{
+		const auto it = std::lower_bound( this->SortedIndex.begin(), this->SortedIndex.end(), id,
+			[]( const IndexEntry &entry, const hash &value ) { return entry.Id < value; } );
+		if( it != this->SortedIndex.end() && it->Id == id )
+			{
+			loc = it->Loc;
+			return true;
+			}
+
+		const auto appended = this->AppendedIndex.find( id );
+		if( appended != this->AppendedIndex.end() )
+			{
+			loc = appended->second;
+			return true;
+			}
+
+		return false;
+		}
+
+	inline std::string PackfileStore::SegmentFilePath( u32 id, const char *extension ) const
+		{
+		char fileName[32];
+		snprintf( fileName, sizeof( fileName ), "segment-%06u.%s", id, extension );
+		return this->Path + "/" + fileName;
+		}
+
+	inline Status PackfileStore::Initialize( const std::string &path, u64 maxSegmentSize )
+		{
+		if( !this->Path.empty() )
+			{
+			return Status::EAlreadyInitialized;
+			}
+		if( maxSegmentSize <= SegmentHeaderSize + RecordHeaderSize )
+			{
+			return Status::EParam;
+			}
+
+		// find all segments in the directory
+		std::vector<std::string> fileNames;
+		Status status = ListFiles( path, fileNames );
+		if( status != Status::Ok )
+			{
+			return status;
+			}
+		std::vector<u32> segmentIds;
+		for( size_t i = 0; i < fileNames.size(); ++i )
+			{
+			unsigned int id = 0;
+			char extension[8] = {};
+			if( sscanf( fileNames[i].c_str(), "segment-%6u.%5s", &id, extension ) == 2 && strcmp( extension, "pack" ) == 0 && id > 0 )
+				{
+				segmentIds.emplace_back( (u32)id );
+				}
+			}
+		std::sort( segmentIds.begin(), segmentIds.end() );
+
+		this->Path = path;
+		this->MaxSegmentSize = maxSegmentSize;
+
+		// open all segments, and load (or rebuild) their indices
+		for( size_t i = 0; i < segmentIds.size(); ++i )
+			{
+			status = this->OpenSegment( segmentIds[i], false );
+			if( status != Status::Ok )
+				{
+				this->Close( false );
+				return status;
+				}
+
+			std::vector<IndexEntry> entries;
+			if( this->LoadSegmentIndex( i, entries ) != Status::Ok )
+				{
+				status = this->ScanSegment( i, entries );
+				if( status != Status::Ok )
+					{
+					this->Close( false );
+					return status;
+					}
+				}
+
+			this->SortedIndex.insert( this->SortedIndex.end(), entries.begin(), entries.end() );
+			if( i + 1 == segmentIds.size() )
+				{
+				this->ActiveSegmentEntries = std::move( entries );
+				}
+			}
+
+		// make sure there is an active segment to write to
+		if( this->Segments.empty() )
+			{
+			status = this->OpenSegment( 1, true );
+			if( status != Status::Ok )
+				{
+				this->Close( false );
+				return status;
+				}
+			}
+
+		std::sort( this->SortedIndex.begin(), this->SortedIndex.end(),
+			[]( const IndexEntry &a, const IndexEntry &b ) { return a.Id < b.Id; } );
+
+		return Status::Ok;
+		}
+
+	inline void PackfileStore::Deinitialize()
+		{
+		this->Close( true );
+		}
+
+	inline void PackfileStore::Close( bool writeActiveSegmentIndex )
+		{
+		if( this->Path.empty() )
+			{
+			return;
+			}
+
+		// write the index of the active segment, so it does not have to be scanned when opened again. the segment
+		// is synced first, so the index never describes records which are not on disk
+		if( writeActiveSegmentIndex && !this->Segments.empty()
+			&& SyncFile( this->Segments.back().Handle ) == Status::Ok )
+			{
+			this->WriteSegmentIndex( this->Segments.size() - 1, this->ActiveSegmentEntries );
+			}
+
+		for( size_t i = 0; i < this->Segments.size(); ++i )
+			{
+			CloseFile( this->Segments[i].Handle );
+			}
+		this->Segments.clear();
+		this->SortedIndex.clear();
+		this->AppendedIndex.clear();
+		this->ActiveSegmentEntries.clear();
+		this->Path.clear();
+		}
+
+	inline Status PackfileStore::OpenSegment( u32 id, bool create )
+		{
+		const std::string filePath = this->SegmentFilePath( id, "pack" );
+
+		Segment segment;
+		segment.Id = id;
+		u64 fileSize = 0;
+
+#ifdef _MSC_VER
+		segment.Handle = ::CreateFileA( filePath.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, create ? CREATE_NEW : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+		if( segment.Handle == INVALID_HANDLE_VALUE )
+			{
+			return Status::ECantOpen;
+			}
+		LARGE_INTEGER dfilesize = {};
+		if( !::GetFileSizeEx( segment.Handle, &dfilesize ) )
+			{
+			::CloseHandle( segment.Handle );
+			return Status::ECantOpen;
+			}
+		fileSize = (u64)dfilesize.QuadPart;
+#else
+		segment.Handle = ::open( filePath.c_str(), O_RDWR | O_CLOEXEC | ( create ? (O_CREAT | O_EXCL) : 0 ), 0644 );
+		if( segment.Handle < 0 )
+			{
+			return Status::ECantOpen;
+			}
+		struct stat fileStat = {};
+		if( ::fstat( segment.Handle, &fileStat ) != 0 )
+			{
+			::close( segment.Handle );
+			return Status::ECantOpen;
+			}
+		fileSize = (u64)fileStat.st_size;
+#endif
+
+		// check the header, or write it if the segment is new (or the header was never written)
+		if( fileSize < SegmentHeaderSize )
+			{
+			if( WriteAt( segment.Handle, 0, "PDSPACK1", SegmentHeaderSize ) != Status::Ok )
+				{
+				CloseFile( segment.Handle );
+				return Status::ECantWrite;
+				}
+			fileSize = SegmentHeaderSize;
+			}
+		else
+			{
+			char magic[SegmentHeaderSize];
+			if( ReadAt( segment.Handle, 0, magic, SegmentHeaderSize ) != Status::Ok
+				|| memcmp( magic, "PDSPACK1", SegmentHeaderSize ) != 0 )
+				{
+				CloseFile( segment.Handle );
+				return Status::ECorrupted;
+				}
+			}
+		segment.Size = fileSize;
+
+		ctle::readers_writer_lock::write_guard guard( this->IndexLock );
+		this->Segments.emplace_back( segment );
+		return Status::Ok;
+		}
+
+	inline Status PackfileStore::LoadSegmentIndex( size_t segmentIndex, std::vector<IndexEntry> &entries ) const
+		{
+		const Segment &segment = this->Segments[segmentIndex];
+		const std::string filePath = this->SegmentFilePath( segment.Id, "index" );
+
+		FILE *file = fopen( filePath.c_str(), "rb" );
+		if( !file )
+			{
+			return Status::ECantOpen;
+			}
+
+		// the index is only valid if it covers the whole segment
+		u8 header[IndexHeaderSize];
+		u64 segmentSize = 0;
+		u64 entryCount = 0;
+		if( fread( header, 1, IndexHeaderSize, file ) != IndexHeaderSize
+			|| memcmp( header, "PDSINDX1", 8 ) != 0 )
+			{
+			fclose( file );
+			return Status::ECorrupted;
+			}
+		memcpy( &segmentSize, &header[8], sizeof( u64 ) );
+		memcpy( &entryCount, &header[16], sizeof( u64 ) );
+		if( segmentSize != segment.Size || entryCount > segment.Size / RecordHeaderSize )
+			{
+			fclose( file );
+			return Status::ECorrupted;
+			}
+
+		std::vector<u8> data( (size_t)( entryCount * IndexEntrySize ) );
+		if( fread( data.data(), 1, data.size(), file ) != data.size() )
+			{
+			fclose( file );
+			return Status::ECorrupted;
+			}
+		fclose( file );
+
+		entries.resize( (size_t)entryCount );
+		for( size_t i = 0; i < entries.size(); ++i )
+			{
+			const u8 *src = &data[i * IndexEntrySize];
+			memcpy( &entries[i].Id, src, 32 );
+			memcpy( &entries[i].Loc.Offset, src + 32, sizeof( u64 ) );
+			memcpy( &entries[i].Loc.Size, src + 40, sizeof( u64 ) );
+			entries[i].Loc.SegmentIndex = segmentIndex;
+			if( entries[i].Loc.Offset + entries[i].Loc.Size > segment.Size )
+				{
+				return Status::ECorrupted;
+				}
+			}
+
+		return Status::Ok;
+		}
+
+	inline Status PackfileStore::ScanSegment( size_t segmentIndex, std::vector<IndexEntry> &entries )
+		{
+		Segment &segment = this->Segments[segmentIndex];
+		const u64 fileSize = segment.Size;
+
+		entries.clear();
+		std::vector<u8> buffer( 1024 * 1024 );
+		u64 offset = SegmentHeaderSize;
+		while( offset + RecordHeaderSize <= fileSize )
+			{
+			u8 recordHeader[RecordHeaderSize];
+			if( ReadAt( segment.Handle, offset, recordHeader, RecordHeaderSize ) != Status::Ok )
+				{
+				return Status::ECantRead;
+				}
+
+			IndexEntry entry;
+			memcpy( &entry.Id, recordHeader, 32 );
+			memcpy( &entry.Loc.Size, &recordHeader[32], sizeof( u64 ) );
+			entry.Loc.SegmentIndex = segmentIndex;
+			entry.Loc.Offset = offset + RecordHeaderSize;
+
+			// a record which does not fit in the file is torn, stop at the last complete record
+			if( entry.Loc.Size > fileSize - entry.Loc.Offset )
+				{
+				break;
+				}
+
+			// a record with data which does not match its hash was not completely written, stop at the last valid record
+			SHA256 sha;
+			for( u64 dataOffset = 0; dataOffset < entry.Loc.Size; dataOffset += buffer.size() )
+				{
+				const u64 readSize = std::min<u64>( buffer.size(), entry.Loc.Size - dataOffset );
+				if( ReadAt( segment.Handle, entry.Loc.Offset + dataOffset, buffer.data(), readSize ) != Status::Ok )
+					{
+					return Status::ECantRead;
+					}
+				sha.Update( buffer.data(), (size_t)readSize );
+				}
+			hash digest = {};
+			sha.GetDigest( digest.digest );
+			if( digest != entry.Id )
+				{
+				break;
+				}
+
+			entries.emplace_back( entry );
+			offset = entry.Loc.Offset + entry.Loc.Size;
+			}
+
+		// the next record is written after the last complete record
+		segment.Size = offset;
+		return Status::Ok;
+		}
+
+	inline Status PackfileStore::WriteSegmentIndex( size_t segmentIndex, std::vector<IndexEntry> entries ) const
+		{
+		const Segment &segment = this->Segments[segmentIndex];
+		const std::string filePath = this->SegmentFilePath( segment.Id, "index" );
+
+		std::sort( entries.begin(), entries.end(),
+			[]( const IndexEntry &a, const IndexEntry &b ) { return a.Id < b.Id; } );
+
+		std::vector<u8> data( (size_t)( IndexHeaderSize + entries.size() * IndexEntrySize ) );
+		const u64 entryCount = entries.size();
+		memcpy( &data[0], "PDSINDX1", 8 );
+		memcpy( &data[8], &segment.Size, sizeof( u64 ) );
+		memcpy( &data[16], &entryCount, sizeof( u64 ) );
+		for( size_t i = 0; i < entries.size(); ++i )
+			{
+			u8 *dest = &data[(size_t)( IndexHeaderSize + i * IndexEntrySize )];
+			memcpy( dest, &entries[i].Id, 32 );
+			memcpy( dest + 32, &entries[i].Loc.Offset, sizeof( u64 ) );
+			memcpy( dest + 40, &entries[i].Loc.Size, sizeof( u64 ) );
+			}
+
+		FILE *file = fopen( filePath.c_str(), "wb" );
+		if( !file )
+			{
+			return Status::ECantOpen;
+			}
+		const bool written = ( fwrite( data.data(), 1, data.size(), file ) == data.size() );
+		fclose( file );
+		return written ? Status::Ok : Status::ECantWrite;
+		}
+
+	inline bool PackfileStore::Contains( const hash &id )
+		{
+		ctle::readers_writer_lock::read_guard guard( this->IndexLock );
+
+		Location loc;
+		return this->FindLocation( id, loc );
+		}
+
+	inline void PackfileStore::ListEntities( std::vector<hash> &ids )
+		{
+		ctle::readers_writer_lock::read_guard guard( this->IndexLock );
+
+		ids.reserve( ids.size() + this->SortedIndex.size() + this->AppendedIndex.size() );
+		for( size_t i = 0; i < this->SortedIndex.size(); ++i )
+			{
+			ids.emplace_back( this->SortedIndex[i].Id );
+			}
+		for( const auto &entry : this->AppendedIndex )
+			{
+			ids.emplace_back( entry.first );
+			}
+		}
+
+	inline Status PackfileStore::Read( const hash &id, std::vector<u8> &dest )
+		{
+		Location loc;
+		FileHandle handle;
+			{
+			ctle::readers_writer_lock::read_guard guard( this->IndexLock );
+			if( !this->FindLocation( id, loc ) )
+				{
+				return Status::ECantOpen;
+				}
+			handle = this->Segments[loc.SegmentIndex].Handle;
+			}
+
+		dest.resize( (size_t)loc.Size );
+		if( dest.size() != loc.Size )
+			{
+			return Status::ECantAllocate;
+			}
+
+		// the segment handles stay open until the store is closed, so the read can be done outside the lock
+		return ReadAt( handle, loc.Offset, dest.data(), loc.Size );
+		}
+
+	inline Status PackfileStore::Write( const hash &id, const u8 *data, u64 size )
+		{
+		std::lock_guard<std::mutex> writeLock( this->WriteMutex );
+
+		if( this->Contains( id ) )
+			{
+			return Status::WAlreadyExists;
+			}
+
+		// seal the active segment and start a new one, if the record does not fit.
+		// (a record larger than the max size gets a segment of its own)
+		size_t segmentIndex = this->Segments.size() - 1;
+		if( this->Segments[segmentIndex].Size > SegmentHeaderSize
+			&& this->Segments[segmentIndex].Size + RecordHeaderSize + size > this->MaxSegmentSize )
+			{
+			Status status = SyncFile( this->Segments[segmentIndex].Handle );
+			if( status != Status::Ok )
+				{
+				return status;
+				}
+			status = this->WriteSegmentIndex( segmentIndex, this->ActiveSegmentEntries );
+			if( status != Status::Ok )
+				{
+				return status;
+				}
+			status = this->OpenSegment( this->Segments[segmentIndex].Id + 1, true );
+			if( status != Status::Ok )
+				{
+				return status;
+				}
+			this->ActiveSegmentEntries.clear();
+			++segmentIndex;
+			}
+		Segment &segment = this->Segments[segmentIndex];
+
+		// write the record after the last record. if it fails, the size is not updated, so the torn record is overwritten by the next write
+		u8 recordHeader[RecordHeaderSize];
+		memcpy( recordHeader, &id, 32 );
+		memcpy( &recordHeader[32], &size, sizeof( u64 ) );
+		if( WriteAt( segment.Handle, segment.Size, recordHeader, RecordHeaderSize ) != Status::Ok
+			|| WriteAt( segment.Handle, segment.Size + RecordHeaderSize, data, size ) != Status::Ok )
+			{
+			return Status::ECantWrite;
+			}
+
+		IndexEntry entry;
+		entry.Id = id;
+		entry.Loc.SegmentIndex = segmentIndex;
+		entry.Loc.Offset = segment.Size + RecordHeaderSize;
+		entry.Loc.Size = size;
+		segment.Size = entry.Loc.Offset + size;
+		this->ActiveSegmentEntries.emplace_back( entry );
+
+		ctle::readers_writer_lock::write_guard guard( this->IndexLock );
+		this->AppendedIndex.emplace( id, entry.Loc );
+		return Status::Ok;
+		}
+
+	inline Status PackfileStore::Flush()
+		{
+		std::lock_guard<std::mutex> writeLock( this->WriteMutex );
+
+		if( this->Segments.empty() )
+			{
+			return Status::ENotInitialized;
+			}
+		return SyncFile( this->Segments.back().Handle );
+		}
+
+	inline Status PackfileStore::CompactLooseFiles( u64 *compactedCount )
+		{
+		if( compactedCount )
+			{
+			*compactedCount = 0;
+			}
+		if( this->Path.empty() )
+			{
+			return Status::ENotInitialized;
+			}
+
+		std::vector<std::string> fileNames;
+		Status status = ListFiles( this->Path, fileNames );
+		if( status != Status::Ok )
+			{
+			return status;
+			}
+
+		// move the entity files into the packfiles
+		std::vector<std::string> movedFilePaths;
+		for( size_t i = 0; i < fileNames.size(); ++i )
+			{
+			// entity files are named <sha256-hex>.dat
+			const std::string &fileName = fileNames[i];
+			if( fileName.size() != 68 || fileName.compare( 64, 4, ".dat" ) != 0 )
+				{
+				continue;
+				}
+			hash id = {};
+			hex_string_to_bytes( &id, fileName.substr( 0, 64 ).c_str(), 32 );
+			const std::string filePath = this->Path + "/" + fileName;
+
+			FILE *file = fopen( filePath.c_str(), "rb" );
+			if( !file )
+				{
+				pdsErrorLog << "Failed to open loose entity file: " << filePath << pdsErrorLogEnd;
+				continue;
+				}
+			std::vector<u8> data;
+			u8 buffer[64*1024];
+			size_t bytesRead = 0;
+			while( ( bytesRead = fread( buffer, 1, sizeof( buffer ), file ) ) > 0 )
+				{
+				data.insert( data.end(), buffer, buffer + bytesRead );
+				}
+			fclose( file );
+
+			// make sure the data matches the name, so corrupted files are not moved into the packfiles
+			SHA256 sha( data.data(), data.size() );
+			hash digest = {};
+			sha.GetDigest( digest.digest );
+			if( digest != id )
+				{
+				pdsErrorLog << "Loose entity file is corrupted, skipping: " << filePath << pdsErrorLogEnd;
+				continue;
+				}
+
+			status = this->Write( id, data.data(), data.size() );
+			if( status != Status::Ok && status != Status::WAlreadyExists )
+				{
+				return status;
+				}
+			movedFilePaths.emplace_back( filePath );
+			}
+
+		// make sure the entities are on disk before removing the loose files
+		status = this->Flush();
+		if( status != Status::Ok )
+			{
+			return status;
+			}
+		for( size_t i = 0; i < movedFilePaths.size(); ++i )
+			{
+#ifdef _MSC_VER
+			::DeleteFileA( movedFilePaths[i].c_str() );
+#else
+			::unlink( movedFilePaths[i].c_str() );
+#endif
+			}
+
+		if( compactedCount )
+			{
+			*compactedCount = movedFilePaths.size();
+			}
+		return Status::Ok;
+		}
+
+#ifdef _MSC_VER
+
+	inline Status PackfileStore::ReadAt( FileHandle handle, u64 offset, void *dest, u64 size )
+		{
+		u64 bytesRead = 0;
+		while( bytesRead < size )
+			{
+			// read at an explicit offset, so the handle can be shared by concurrent reads
+			OVERLAPPED overlapped = {};
+			overlapped.Offset = (DWORD)( ( offset + bytesRead ) & 0xffffffff );
+			overlapped.OffsetHigh = (DWORD)( ( offset + bytesRead ) >> 32 );
+			const DWORD bytesToRead = (DWORD)std::min<u64>( size - bytesRead, UINT_MAX );
+			DWORD bytesThatWereRead = 0;
+			if( !::ReadFile( handle, (u8 *)dest + bytesRead, bytesToRead, &bytesThatWereRead, &overlapped ) || bytesThatWereRead == 0 )
+				{
+				return Status::ECantRead;
+				}
+			bytesRead += bytesThatWereRead;
+			}
+		return Status::Ok;
+		}
+
+	inline Status PackfileStore::WriteAt( FileHandle handle, u64 offset, const void *src, u64 size )
+		{
+		u64 bytesWritten = 0;
+		while( bytesWritten < size )
+			{
+			OVERLAPPED overlapped = {};
+			overlapped.Offset = (DWORD)( ( offset + bytesWritten ) & 0xffffffff );
+			overlapped.OffsetHigh = (DWORD)( ( offset + bytesWritten ) >> 32 );
+			const DWORD bytesToWrite = (DWORD)std::min<u64>( size - bytesWritten, UINT_MAX );
+			DWORD bytesThatWereWritten = 0;
+			if( !::WriteFile( handle, (const u8 *)src + bytesWritten, bytesToWrite, &bytesThatWereWritten, &overlapped ) )
+				{
+				return Status::ECantWrite;
+				}
+			bytesWritten += bytesThatWereWritten;
+			}
+		return Status::Ok;
+		}
+
+	inline Status PackfileStore::SyncFile( FileHandle handle )
+		{
+		return ::FlushFileBuffers( handle ) ? Status::Ok : Status::ECantWrite;
+		}
+
+	inline void PackfileStore::CloseFile( FileHandle handle )
+		{
+		::CloseHandle( handle );
+		}
+
+	inline Status PackfileStore::ListFiles( const std::string &path, std::vector<std::string> &fileNames )
+		{
+		WIN32_FIND_DATAA findData = {};
+		HANDLE findHandle = ::FindFirstFileA( ( path + "/*" ).c_str(), &findData );
+		if( findHandle == INVALID_HANDLE_VALUE )
+			{
+			return Status::ECantOpen;
+			}
+		do
+			{
+			if( ( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) == 0 )
+				{
+				fileNames.emplace_back( findData.cFileName );
+				}
+			}
+		while( ::FindNextFileA( findHandle, &findData ) );
+		::FindClose( findHandle );
+		return Status::Ok;
+		}
+
+#else
+
+	inline Status PackfileStore::ReadAt( FileHandle handle, u64 offset, void *dest, u64 size )
+		{
+		u64 bytesRead = 0;
+		while( bytesRead < size )
+			{
+			const ssize_t ret = ::pread( handle, (u8 *)dest + bytesRead, (size_t)( size - bytesRead ), (off_t)( offset + bytesRead ) );
+			if( ret < 0 && errno == EINTR )
+				{
+				continue;
+				}
+			if( ret <= 0 )
+				{
+				return Status::ECantRead;
+				}
+			bytesRead += (u64)ret;
+			}
+		return Status::Ok;
+		}
+
+	inline Status PackfileStore::WriteAt( FileHandle handle, u64 offset, const void *src, u64 size )
+		{
+		u64 bytesWritten = 0;
+		while( bytesWritten < size )
+			{
+			const ssize_t ret = ::pwrite( handle, (const u8 *)src + bytesWritten, (size_t)( size - bytesWritten ), (off_t)( offset + bytesWritten ) );
+			if( ret < 0 && errno == EINTR )
+				{
+				continue;
+				}
+			if( ret <= 0 )
+				{
+				return Status::ECantWrite;
+				}
+			bytesWritten += (u64)ret;
+			}
+		return Status::Ok;
+		}
+
+	inline Status PackfileStore::SyncFile( FileHandle handle )
+		{
+		return ( ::fdatasync( handle ) == 0 ) ? Status::Ok : Status::ECantWrite;
+		}
+
+	inline void PackfileStore::CloseFile( FileHandle handle )
+		{
+		::close( handle );
+		}
+
+	inline Status PackfileStore::ListFiles( const std::string &path, std::vector<std::string> &fileNames )
+		{
+		DIR *dir = ::opendir( path.c_str() );
+		if( !dir )
+			{
+			return Status::ECantOpen;
+			}
+		while( struct dirent *entry = ::readdir( dir ) )
+			{
+			if( entry->d_name[0] != '.' )
+				{
+				fileNames.emplace_back( entry->d_name );
+				}
+			}
+		::closedir( dir );
+		return Status::Ok;
+		}
+
+#endif
+
+	};
@@ -12,19 +12,50 @@ namespace pds
 	{
 	class SHA256
 		{
+		public:
+			// the implementations of SHA-256. the best backend supported by the cpu is selected at runtime.
+			enum class Backend
+				{
+				Portable, // picosha2, runs on all cpus
+				Avx2, // picosha2 for single messages, and 8 messages at a time with AVX2 in HashMany
+				ShaExtensions, // the Intel SHA extensions (SHA-NI), for single messages and in HashMany
+				};
+
 		private:
 			//void *MDData = nullptr;
 			std::unique_ptr<u8[]> MData;
 			picosha2::hash256_one_by_one Hasher;
+			bool Finished = false;
+
+			// the state of the hash, when the hash is not calculated by picosha2
+			Backend UsedBackend;
+			u32 State[8] = {};
+			u8 Buffer[64] = {};
+			size_t BufferSize = 0;
+			u64 TotalSize = 0;
 
 		public:
 			SHA256( const u8 *Data = nullptr , size_t DataLength = 0 );
 			~SHA256();
 
-			// update the SHA with the data at Data, length DataLength
+			// update the SHA with the data at Data, length DataLength. the data of all updates is hashed
+			// as one message, so the data can be hashed in parts. can't be called after GetDigest.
 			void Update( const u8 *Data, size_t DataLength );
 
-			// get the calculated digest 
+			// get the calculated digest of all the data
 			void GetDigest( u8 DestDigest[32] );
+
+			// hash count messages, and write the digests into Digests. with the Avx2 backend, 8 messages are
+			// hashed at a time, which is faster than hashing them one by one when the messages are small.
+			static void HashMany( const u8 * const *Datas, const size_t *DataLengths, size_t count, hash *Digests );
+
+			// the backend used by new SHA256 objects and HashMany
+			static Backend GetBackend();
+
+			// check if the cpu supports a backend
+			static bool IsBackendSupported( Backend backend );
+
+			// select the backend, to compare the backends. returns false if the cpu does not support the backend.
+			static bool SetBackend( Backend backend );
 		};
-	};
\ No newline at end of file
+	};
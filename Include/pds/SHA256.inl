@@ -3,6 +3,258 @@
 #pragma once
 
 #include "SHA256.h"
+#include "CpuFeatures.h"
+
+#include <atomic>
+#include <algorithm>
+
+namespace pds
+	{
+	static const u32 sha256_initial_state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+#ifdef PDS_X86
+
+	static const u32 sha256_round_constants[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+		};
+
+	static inline u32 sha256_load_be32( const u8 *src )
+		{
+		return ( u32( src[0] ) << 24 ) | ( u32( src[1] ) << 16 ) | ( u32( src[2] ) << 8 ) | u32( src[3] );
+		}
+
+	static inline void sha256_store_be32( u8 *dest, u32 value )
+		{
+		dest[0] = u8( value >> 24 );
+		dest[1] = u8( value >> 16 );
+		dest[2] = u8( value >> 8 );
+		dest[3] = u8( value );
+		}
+
+	// builds the padded last block(s) of a message into dest, which is 128 bytes. returns the number of blocks, 1 or 2
+	static inline size_t sha256_build_tail_blocks( u8 *dest, const u8 *tail, size_t tailSize, u64 totalSize )
+		{
+		const size_t blockCount = ( tailSize < 56 ) ? 1 : 2;
+		memset( dest, 0, blockCount * 64 );
+		if( tailSize > 0 )
+			{
+			memcpy( dest, tail, tailSize );
+			}
+		dest[tailSize] = 0x80;
+		const u64 bitCount = totalSize * 8;
+		for( size_t i = 0; i < 8; ++i )
+			{
+			dest[blockCount * 64 - 1 - i] = u8( bitCount >> ( 8 * i ) );
+			}
+		return blockCount;
+		}
+
+	// compresses blockCount 64 byte blocks into the state, using the Intel SHA extensions
+	PDS_TARGET( "sha,sse4.1,ssse3" ) static void sha256_compress_sha_extensions( u32 state[8], const u8 *blocks, size_t blockCount )
+		{
+		const __m128i byteSwapMask = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL );
+
+		// the instructions use the state as ABEF and CDGH
+		__m128i tmp = _mm_loadu_si128( (const __m128i *)&state[0] );
+		__m128i state1 = _mm_loadu_si128( (const __m128i *)&state[4] );
+		tmp = _mm_shuffle_epi32( tmp, 0xB1 ); // CDAB
+		state1 = _mm_shuffle_epi32( state1, 0x1B ); // EFGH
+		__m128i state0 = _mm_alignr_epi8( tmp, state1, 8 ); // ABEF
+		state1 = _mm_blend_epi16( state1, tmp, 0xF0 ); // CDGH
+
+		for( size_t block = 0; block < blockCount; ++block, blocks += 64 )
+			{
+			const __m128i abefSave = state0;
+			const __m128i cdghSave = state1;
+
+			// 16 groups of 4 rounds. the message schedule of the group 4 steps ahead is
+			// extended while the rounds run, in a ring of 4 message vectors
+			__m128i msg[4];
+			for( size_t group = 0; group < 16; ++group )
+				{
+				if( group < 4 )
+					{
+					msg[group] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)&blocks[group * 16] ), byteSwapMask );
+					}
+
+				__m128i rounds = _mm_add_epi32( msg[group % 4], _mm_loadu_si128( (const __m128i *)&sha256_round_constants[group * 4] ) );
+				state1 = _mm_sha256rnds2_epu32( state1, state0, rounds );
+				if( group >= 3 && group < 15 )
+					{
+					const size_t next = ( group + 1 ) % 4;
+					tmp = _mm_alignr_epi8( msg[group % 4], msg[( group + 3 ) % 4], 4 );
+					msg[next] = _mm_sha256msg2_epu32( _mm_add_epi32( msg[next], tmp ), msg[group % 4] );
+					}
+				rounds = _mm_shuffle_epi32( rounds, 0x0E );
+				state0 = _mm_sha256rnds2_epu32( state0, state1, rounds );
+				if( group >= 1 && group < 13 )
+					{
+					const size_t previous = ( group + 3 ) % 4;
+					msg[previous] = _mm_sha256msg1_epu32( msg[previous], msg[group % 4] );
+					}
+				}
+
+			state0 = _mm_add_epi32( state0, abefSave );
+			state1 = _mm_add_epi32( state1, cdghSave );
+			}
+
+		// back to ABCD and EFGH
+		tmp = _mm_shuffle_epi32( state0, 0x1B ); // FEBA
+		state1 = _mm_shuffle_epi32( state1, 0xB1 ); // DCHG
+		state0 = _mm_blend_epi16( tmp, state1, 0xF0 ); // DCBA
+		state1 = _mm_alignr_epi8( state1, tmp, 8 ); // ABEF
+		_mm_storeu_si128( (__m128i *)&state[0], state0 );
+		_mm_storeu_si128( (__m128i *)&state[4], state1 );
+		}
+
+	PDS_TARGET( "avx2" ) static inline __m256i sha256_rotr_x8( __m256i value, int bits )
+		{
+		return _mm256_or_si256( _mm256_srli_epi32( value, bits ), _mm256_slli_epi32( value, 32 - bits ) );
+		}
+
+	// compresses one block of each of 8 messages into the 8 interleaved states, using AVX2.
+	// lanes which are not set in activeMask keep their state.
+	PDS_TARGET( "avx2" ) static void sha256_compress_avx2_x8( __m256i state[8], const u8 *const blocks[8], __m256i activeMask )
+		{
+		__m256i w[16];
+		for( int i = 0; i < 16; ++i )
+			{
+			w[i] = _mm256_set_epi32(
+				(int)sha256_load_be32( &blocks[7][i * 4] ), (int)sha256_load_be32( &blocks[6][i * 4] ),
+				(int)sha256_load_be32( &blocks[5][i * 4] ), (int)sha256_load_be32( &blocks[4][i * 4] ),
+				(int)sha256_load_be32( &blocks[3][i * 4] ), (int)sha256_load_be32( &blocks[2][i * 4] ),
+				(int)sha256_load_be32( &blocks[1][i * 4] ), (int)sha256_load_be32( &blocks[0][i * 4] ) );
+			}
+
+		__m256i a = state[0], b = state[1], c = state[2], d = state[3];
+		__m256i e = state[4], f = state[5], g = state[6], h = state[7];
+		for( int i = 0; i < 64; ++i )
+			{
+			// extend the message schedule in the ring of 16 words
+			if( i >= 16 )
+				{
+				const __m256i w15 = w[( i - 15 ) & 15];
+				const __m256i w2 = w[( i - 2 ) & 15];
+				const __m256i s0 = _mm256_xor_si256( _mm256_xor_si256( sha256_rotr_x8( w15, 7 ), sha256_rotr_x8( w15, 18 ) ), _mm256_srli_epi32( w15, 3 ) );
+				const __m256i s1 = _mm256_xor_si256( _mm256_xor_si256( sha256_rotr_x8( w2, 17 ), sha256_rotr_x8( w2, 19 ) ), _mm256_srli_epi32( w2, 10 ) );
+				w[i & 15] = _mm256_add_epi32( _mm256_add_epi32( w[i & 15], s0 ), _mm256_add_epi32( w[( i - 7 ) & 15], s1 ) );
+				}
+
+			const __m256i sum1 = _mm256_xor_si256( _mm256_xor_si256( sha256_rotr_x8( e, 6 ), sha256_rotr_x8( e, 11 ) ), sha256_rotr_x8( e, 25 ) );
+			const __m256i choose = _mm256_xor_si256( _mm256_and_si256( e, f ), _mm256_andnot_si256( e, g ) );
+			const __m256i t1 = _mm256_add_epi32( _mm256_add_epi32( _mm256_add_epi32( h, sum1 ), _mm256_add_epi32( choose, w[i & 15] ) ), _mm256_set1_epi32( (int)sha256_round_constants[i] ) );
+			const __m256i sum0 = _mm256_xor_si256( _mm256_xor_si256( sha256_rotr_x8( a, 2 ), sha256_rotr_x8( a, 13 ) ), sha256_rotr_x8( a, 22 ) );
+			const __m256i majority = _mm256_xor_si256( _mm256_xor_si256( _mm256_and_si256( a, b ), _mm256_and_si256( a, c ) ), _mm256_and_si256( b, c ) );
+			const __m256i t2 = _mm256_add_epi32( sum0, majority );
+			h = g;
+			g = f;
+			f = e;
+			e = _mm256_add_epi32( d, t1 );
+			d = c;
+			c = b;
+			b = a;
+			a = _mm256_add_epi32( t1, t2 );
+			}
+
+		const __m256i result[8] = { a, b, c, d, e, f, g, h };
+		for( int i = 0; i < 8; ++i )
+			{
+			state[i] = _mm256_blendv_epi8( state[i], _mm256_add_epi32( state[i], result[i] ), activeMask );
+			}
+		}
+
+	// hashes up to 8 messages at a time, one message in each lane
+	PDS_TARGET( "avx2" ) static void sha256_hash_many_avx2( const u8 *const *datas, const size_t *dataLengths, size_t count, hash *digests )
+		{
+		static const u8 emptyBlock[64] = {};
+		u8 tailBlocks[8][128];
+
+		for( size_t first = 0; first < count; first += 8 )
+			{
+			const size_t laneCount = std::min<size_t>( 8, count - first );
+
+			// the full blocks are read from the messages, and the padded last blocks from the tail blocks
+			size_t fullBlockCounts[8] = {};
+			size_t blockCounts[8] = {};
+			size_t maxBlockCount = 0;
+			for( size_t lane = 0; lane < laneCount; ++lane )
+				{
+				const size_t length = dataLengths[first + lane];
+				fullBlockCounts[lane] = length / 64;
+				blockCounts[lane] = fullBlockCounts[lane] + sha256_build_tail_blocks( tailBlocks[lane], &datas[first + lane][fullBlockCounts[lane] * 64], length % 64, length );
+				maxBlockCount = std::max( maxBlockCount, blockCounts[lane] );
+				}
+
+			__m256i state[8];
+			for( int i = 0; i < 8; ++i )
+				{
+				state[i] = _mm256_set1_epi32( (int)sha256_initial_state[i] );
+				}
+
+			for( size_t block = 0; block < maxBlockCount; ++block )
+				{
+				const u8 *blocks[8];
+				i32 active[8] = {};
+				for( size_t lane = 0; lane < 8; ++lane )
+					{
+					if( lane >= laneCount || block >= blockCounts[lane] )
+						{
+						blocks[lane] = emptyBlock;
+						}
+					else
+						{
+						blocks[lane] = ( block < fullBlockCounts[lane] ) ? &datas[first + lane][block * 64] : &tailBlocks[lane][( block - fullBlockCounts[lane] ) * 64];
+						active[lane] = -1;
+						}
+					}
+				sha256_compress_avx2_x8( state, blocks, _mm256_loadu_si256( (const __m256i *)active ) );
+				}
+
+			// write the digests of the lanes
+			u32 words[8][8];
+			for( int i = 0; i < 8; ++i )
+				{
+				_mm256_storeu_si256( (__m256i *)words[i], state[i] );
+				}
+			for( size_t lane = 0; lane < laneCount; ++lane )
+				{
+				for( size_t i = 0; i < 8; ++i )
+					{
+					sha256_store_be32( &digests[first + lane].digest[i * 4], words[i][lane] );
+					}
+				}
+			}
+		}
+
+#endif//PDS_X86
+
+	// the best backend which the cpu supports
+	static SHA256::Backend sha256_get_default_backend()
+		{
+		if( SHA256::IsBackendSupported( SHA256::Backend::ShaExtensions ) )
+			{
+			return SHA256::Backend::ShaExtensions;
+			}
+		if( SHA256::IsBackendSupported( SHA256::Backend::Avx2 ) )
+			{
+			return SHA256::Backend::Avx2;
+			}
+		return SHA256::Backend::Portable;
+		}
+
+	static std::atomic<SHA256::Backend> &sha256_selected_backend()
+		{
+		static std::atomic<SHA256::Backend> backend( sha256_get_default_backend() );
+		return backend;
+		}
+	};
 
 using namespace pds;
 
@@ -10,6 +262,8 @@ SHA256::SHA256( const u8 *Data, size_t DataLength )
 	{
 	this->MData = std::make_unique<u8[]>(picosha2::k_digest_size);
 	std::memset(MData.get(), 0,picosha2::k_digest_size );
+	this->UsedBackend = GetBackend();
+	std::memcpy( this->State, sha256_initial_state, sizeof( this->State ) );
 	if( Data != nullptr )
 		{
 		this->Update( Data, DataLength );
@@ -22,24 +276,123 @@ SHA256::~SHA256()
 
 void SHA256::Update( const u8 *Data, size_t DataLength )
 	{
-	const u8 *End = &Data[DataLength];
-	while( Data < End )
+	pdsSanityCheckDebugMacro( !this->Finished );
+
+#ifdef PDS_X86
+	if( this->UsedBackend == Backend::ShaExtensions )
 		{
-		size_t data_len = End - Data;
-		if( data_len > INT_MAX )
-			data_len = INT_MAX;
-		size_t int_data_len = data_len;
+		this->TotalSize += DataLength;
 
-		// update sha hash
-		picosha2::hash256(Data,Data + DataLength, MData.get(), MData.get() + picosha2::k_digest_size );
-		Data += int_data_len;
+		// fill up and compress a partially filled block
+		if( this->BufferSize > 0 )
+			{
+			const size_t copySize = std::min( DataLength, 64 - this->BufferSize );
+			std::memcpy( &this->Buffer[this->BufferSize], Data, copySize );
+			this->BufferSize += copySize;
+			Data += copySize;
+			DataLength -= copySize;
+			if( this->BufferSize < 64 )
+				{
+				return;
+				}
+			sha256_compress_sha_extensions( this->State, this->Buffer, 1 );
+			this->BufferSize = 0;
+			}
+
+		// compress the full blocks directly from the data, and keep the rest
+		const size_t blockCount = DataLength / 64;
+		if( blockCount > 0 )
+			{
+			sha256_compress_sha_extensions( this->State, Data, blockCount );
+			}
+		this->BufferSize = DataLength - blockCount * 64;
+		if( this->BufferSize > 0 )
+			{
+			std::memcpy( this->Buffer, &Data[blockCount * 64], this->BufferSize );
+			}
+		return;
 		}
+#endif
+
+	// update sha hash
+	this->Hasher.process( Data, Data + DataLength );
 	// done
 	}
 
-// get the calculated digest 
+// get the calculated digest
 void SHA256::GetDigest( u8 DestDigest[32] )
 	{
+	// pad and finish the hash the first time the digest is requested
+	if( !this->Finished )
+		{
+#ifdef PDS_X86
+		if( this->UsedBackend == Backend::ShaExtensions )
+			{
+			u8 tailBlocks[128];
+			const size_t blockCount = sha256_build_tail_blocks( tailBlocks, this->Buffer, this->BufferSize, this->TotalSize );
+			sha256_compress_sha_extensions( this->State, tailBlocks, blockCount );
+			for( size_t i = 0; i < 8; ++i )
+				{
+				sha256_store_be32( &MData[i * 4], this->State[i] );
+				}
+			}
+		else
+#endif
+			{
+			this->Hasher.finish();
+			this->Hasher.get_hash_bytes( MData.get(), MData.get() + picosha2::k_digest_size );
+			}
+		this->Finished = true;
+		}
 	std::memcpy(&DestDigest[0],MData.get(),32);
 	}
 
+void SHA256::HashMany( const u8 * const *Datas, const size_t *DataLengths, size_t count, hash *Digests )
+	{
+#ifdef PDS_X86
+	if( GetBackend() == Backend::Avx2 )
+		{
+		sha256_hash_many_avx2( Datas, DataLengths, count, Digests );
+		return;
+		}
+#endif
+
+	// hash the messages one by one
+	for( size_t i = 0; i < count; ++i )
+		{
+		SHA256 sha( Datas[i], DataLengths[i] );
+		sha.GetDigest( Digests[i].digest );
+		}
+	}
+
+SHA256::Backend SHA256::GetBackend()
+	{
+	return sha256_selected_backend().load();
+	}
+
+bool SHA256::IsBackendSupported( Backend backend )
+	{
+	switch( backend )
+		{
+		case Backend::Portable:
+			return true;
+#ifdef PDS_X86
+		case Backend::Avx2:
+			return get_cpu_features().Avx2;
+		case Backend::ShaExtensions:
+			return get_cpu_features().ShaExtensions;
+#endif
+		default:
+			return false;
+		}
+	}
+
+bool SHA256::SetBackend( Backend backend )
+	{
+	if( !IsBackendSupported( backend ) )
+		{
+		return false;
+		}
+	sha256_selected_backend() = backend;
+	return true;
+	}
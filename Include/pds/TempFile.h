@@ -0,0 +1,302 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <functional>
+#include <cstdio>
+
+#ifdef _MSC_VER
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <cerrno>
+#endif
+
+namespace pds
+	{
+	// Temp files are named <prefix><pid>-<random><suffix>, and are created exclusively, so an existing file is never
+	// opened, truncated or reused. Handlers in several processes can then create temp files in the same directory
+	// without writing into each other's files. The pid in the name tells which process owns the file, so files left
+	// by a process which crashed can be found and removed with remove_stale_temp_files, while the files of running
+	// processes are kept.
+
+	// number of names which are tried before create_temp_file gives up
+	const uint TempFileCreateAttempts = 16;
+
+	// the id of the current process
+	inline u64 get_process_id()
+		{
+#ifdef _MSC_VER
+		return (u64)::GetCurrentProcessId();
+#else
+		return (u64)::getpid();
+#endif
+		}
+
+	// checks if the process with the id is running. if this can't be told, the process is assumed to run.
+	inline bool is_process_running( u64 processId )
+		{
+#ifdef _MSC_VER
+		HANDLE processHandle = ::OpenProcess( PROCESS_QUERY_LIMITED_INFORMATION, FALSE, (DWORD)processId );
+		if( !processHandle )
+			{
+			return ::GetLastError() != ERROR_INVALID_PARAMETER;
+			}
+		DWORD exitCode = 0;
+		const bool running = !::GetExitCodeProcess( processHandle, &exitCode ) || exitCode == STILL_ACTIVE;
+		::CloseHandle( processHandle );
+		return running;
+#else
+		return ::kill( (pid_t)processId, 0 ) == 0 || errno != ESRCH;
+#endif
+		}
+
+	// size of a temp file name buffer of create_temp_file_at, including the terminating zero
+	const size_t TempFileNameSize = 256;
+
+	// writes the zero-terminated random part of a new temp file name
+	inline void get_temp_file_random_hex( char( &randomHex )[17] )
+		{
+		// seeded per thread, so threads which create temp files at the same time get different names
+		thread_local std::mt19937_64 generator( ( u64( std::random_device()() )
+			^ u64( std::chrono::high_resolution_clock::now().time_since_epoch().count() )
+			^ u64( std::hash<std::thread::id>()( std::this_thread::get_id() ) ) ) );
+
+		static const char hexDigits[] = "0123456789abcdef";
+		u64 value = generator();
+		for( size_t i = 0; i < 16; ++i, value >>= 4 )
+			{
+			randomHex[i] = hexDigits[value & 0xf];
+			}
+		randomHex[16] = 0;
+		}
+
+	// a new unique name for a temp file of this process
+	inline std::string get_temp_file_path( const std::string &prefix, const std::string &suffix )
+		{
+		char randomHex[17];
+		get_temp_file_random_hex( randomHex );
+		return prefix + std::to_string( get_process_id() ) + "-" + randomHex + suffix;
+		}
+
+#ifdef _MSC_VER
+
+	// create a new temp file, opened with the access rights, and set destPath to its path. returns INVALID_HANDLE_VALUE on failure.
+	inline HANDLE create_temp_file( const std::string &prefix, const std::string &suffix, std::string &destPath, DWORD desiredAccess = GENERIC_WRITE )
+		{
+		for( uint attempt = 0; attempt < TempFileCreateAttempts; ++attempt )
+			{
+			destPath = get_temp_file_path( prefix, suffix );
+			HANDLE fileHandle = ::CreateFileA( destPath.c_str(), desiredAccess, 0, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr );
+			if( fileHandle != INVALID_HANDLE_VALUE || ::GetLastError() != ERROR_FILE_EXISTS )
+				{
+				return fileHandle;
+				}
+			}
+		return INVALID_HANDLE_VALUE;
+		}
+
+#else
+
+	// create a new temp file, opened with the flags (O_WRONLY or O_RDWR), and set destPath to its path. returns -1 and sets errno on failure.
+	inline int create_temp_file( const std::string &prefix, const std::string &suffix, std::string &destPath, int flags = O_WRONLY )
+		{
+		for( uint attempt = 0; attempt < TempFileCreateAttempts; ++attempt )
+			{
+			destPath = get_temp_file_path( prefix, suffix );
+			const int fileDescriptor = ::open( destPath.c_str(), flags | O_CREAT | O_EXCL | O_CLOEXEC, 0644 );
+			if( fileDescriptor >= 0 || errno != EEXIST )
+				{
+				return fileDescriptor;
+				}
+			}
+		return -1;
+		}
+
+	// create a new temp file named <name><marker><pid>-<random> in the open directory, opened with the flags (O_WRONLY or O_RDWR), and 
+	// write its name into destFileName, without allocating the name. returns -1 and sets errno on failure.
+	inline int create_temp_file_at( int directoryDescriptor, const char *name, const char *marker, char( &destFileName )[TempFileNameSize], int flags = O_WRONLY )
+		{
+		for( uint attempt = 0; attempt < TempFileCreateAttempts; ++attempt )
+			{
+			char randomHex[17];
+			get_temp_file_random_hex( randomHex );
+			const int length = snprintf( destFileName, TempFileNameSize, "%s%s%llu-%s", name, marker, (unsigned long long)get_process_id(), randomHex );
+			if( length < 0 || size_t( length ) >= TempFileNameSize )
+				{
+				errno = ENAMETOOLONG;
+				return -1;
+				}
+			const int fileDescriptor = ::openat( directoryDescriptor, destFileName, flags | O_CREAT | O_EXCL | O_CLOEXEC, 0644 );
+			if( fileDescriptor >= 0 || errno != EEXIST )
+				{
+				return fileDescriptor;
+				}
+			}
+		return -1;
+		}
+
+#endif
+
+	// list the names of the files in the directory which match the pattern (Windows wildcards, the pattern only narrows the search),
+	// and the names of the subdirectories if subdirectoryNames is set. returns false if the directory can't be opened.
+	inline bool list_directory( const std::string &directoryPath, const std::string &pattern, std::vector<std::string> &fileNames, std::vector<std::string> *subdirectoryNames = nullptr )
+		{
+#ifdef _MSC_VER
+		WIN32_FIND_DATAA findData = {};
+		HANDLE findHandle = ::FindFirstFileA( ( directoryPath + "/" + ( subdirectoryNames ? std::string( "*" ) : pattern ) ).c_str(), &findData );
+		if( findHandle == INVALID_HANDLE_VALUE )
+			{
+			return false;
+			}
+		do
+			{
+			const std::string name = findData.cFileName;
+			if( ( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY ) == 0 )
+				{
+				fileNames.emplace_back( name );
+				}
+			else if( subdirectoryNames && name != "." && name != ".." )
+				{
+				subdirectoryNames->emplace_back( name );
+				}
+			}
+		while( ::FindNextFileA( findHandle, &findData ) );
+		::FindClose( findHandle );
+#else
+		(void)pattern;
+		DIR *dir = ::opendir( directoryPath.c_str() );
+		if( !dir )
+			{
+			return false;
+			}
+		while( struct dirent *entry = ::readdir( dir ) )
+			{
+			const std::string name = entry->d_name;
+			if( name == "." || name == ".." )
+				{
+				continue;
+				}
+			bool isDirectory = ( entry->d_type == DT_DIR );
+			if( entry->d_type == DT_UNKNOWN )
+				{
+				struct stat entryStat = {};
+				isDirectory = ( ::stat( ( directoryPath + "/" + name ).c_str(), &entryStat ) == 0 && S_ISDIR( entryStat.st_mode ) );
+				}
+			if( !isDirectory )
+				{
+				fileNames.emplace_back( name );
+				}
+			else if( subdirectoryNames )
+				{
+				subdirectoryNames->emplace_back( name );
+				}
+			}
+		::closedir( dir );
+#endif
+		return true;
+		}
+
+	// checks if the part of the file name from position pos is <pid>-<random><suffix>, where the process is not running
+	inline bool is_stale_temp_file_name( const std::string &fileName, size_t pos, const std::string &suffix )
+		{
+		if( fileName.size() < pos + suffix.size() + 2
+			|| fileName.compare( fileName.size() - suffix.size(), suffix.size(), suffix ) != 0 )
+			{
+			return false;
+			}
+		const size_t pidPos = pos;
+		u64 processId = 0;
+		for( ; pos < fileName.size() && fileName[pos] >= '0' && fileName[pos] <= '9'; ++pos )
+			{
+			processId = processId * 10 + u64( fileName[pos] - '0' );
+			}
+		return pos != pidPos && pos < fileName.size() && fileName[pos] == '-' && !is_process_running( processId );
+		}
+
+	// remove a temp file. returns true if the file was removed.
+	inline bool remove_temp_file( const std::string &filePath )
+		{
+#ifdef _MSC_VER
+		return ::DeleteFileA( filePath.c_str() ) != 0;
+#else
+		return ::unlink( filePath.c_str() ) == 0;
+#endif
+		}
+
+	// remove the temp files in the directory with the prefix and suffix, which belong to processes which are not running.
+	// the prefix is the file name part of the prefix. returns the number of removed files.
+	inline u64 remove_stale_temp_files( const std::string &directoryPath, const std::string &prefix, const std::string &suffix )
+		{
+		std::vector<std::string> fileNames;
+		if( !list_directory( directoryPath, prefix + "*", fileNames ) )
+			{
+			return 0;
+			}
+
+		u64 removedCount = 0;
+		for( const std::string &fileName : fileNames )
+			{
+			// <prefix><pid>-<random><suffix>, with at least one digit in the pid
+			if( fileName.compare( 0, prefix.size(), prefix ) == 0
+				&& is_stale_temp_file_name( fileName, prefix.size(), suffix )
+				&& remove_temp_file( directoryPath + "/" + fileName ) )
+				{
+				++removedCount;
+				}
+			}
+		return removedCount;
+		}
+
+	// remove the temp files of any name in the directory and its subdirectories, which are named <name><marker><pid>-<random>, 
+	// and belong to processes which are not running. returns the number of removed files.
+	inline u64 remove_stale_named_temp_files( const std::string &directoryPath, const std::string &marker )
+		{
+		std::vector<std::string> fileNames;
+		std::vector<std::string> subdirectoryNames;
+		if( !list_directory( directoryPath, "*" + marker + "*", fileNames, &subdirectoryNames ) )
+			{
+			return 0;
+			}
+
+		u64 removedCount = 0;
+		auto removeStaleFiles = [&marker, &removedCount]( const std::string &path, const std::vector<std::string> &names )
+			{
+			for( const std::string &fileName : names )
+				{
+				const size_t markerPos = fileName.rfind( marker );
+				if( markerPos != std::string::npos
+					&& is_stale_temp_file_name( fileName, markerPos + marker.size(), "" )
+					&& remove_temp_file( path + "/" + fileName ) )
+					{
+					++removedCount;
+					}
+				}
+			};
+		removeStaleFiles( directoryPath, fileNames );
+		for( const std::string &subdirectoryName : subdirectoryNames )
+			{
+			const std::string subdirectoryPath = directoryPath + "/" + subdirectoryName;
+			std::vector<std::string> subdirectoryFileNames;
+			if( list_directory( subdirectoryPath, "*" + marker + "*", subdirectoryFileNames ) )
+				{
+				removeStaleFiles( subdirectoryPath, subdirectoryFileNames );
+				}
+			}
+		return removedCount;
+		}
+
+	};
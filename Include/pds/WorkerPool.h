@@ -0,0 +1,146 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+namespace pds
+	{
+	// Worker pool is a fixed number of worker threads, which run submitted tasks in
+	// the order they were submitted. The number of threads does not grow with the
+	// number of submitted tasks, so any number of tasks can be queued at once.
+	// Tasks which are queued when the pool is stopped are run before the threads exit.
+	class WorkerPool
+		{
+		private:
+			std::vector<std::thread> Threads;
+
+			std::deque<std::function<void()>> Tasks;
+			std::mutex TasksMutex;
+			std::condition_variable TasksCondition;
+			bool Stopping = false;
+
+			void WorkerThread();
+
+		public:
+			WorkerPool() = default;
+			WorkerPool( const WorkerPool &other ) = delete;
+			WorkerPool &operator=( const WorkerPool &other ) = delete;
+			~WorkerPool() { this->Stop(); }
+
+			// start the pool with threadCount worker threads. if threadCount is 0, the number of hardware threads is used
+			void Start( uint threadCount );
+
+			// run all queued tasks, and stop and join all worker threads
+			void Stop();
+
+			// get the number of worker threads, 0 if the pool is not started
+			uint GetThreadCount() const { return (uint)this->Threads.size(); }
+
+			// queue a task, and return a future for the task result.
+			// if the pool is not started, the task is run directly on the calling thread
+			template<class _Func> auto Submit( _Func func ) -> std::future<decltype(func())>;
+		};
+
+	inline void WorkerPool::Start( uint threadCount )
+		{
+		if( !this->Threads.empty() )
+			{
+			return;
+			}
+
+		if( threadCount == 0 )
+			{
+			threadCount = std::thread::hardware_concurrency();
+			if( threadCount == 0 )
+				{
+				threadCount = 1; // hardware_concurrency can return 0 if the count is not computable
+				}
+			}
+
+		this->Stopping = false;
+		this->Threads.reserve( threadCount );
+		for( uint i = 0; i < threadCount; ++i )
+			{
+			this->Threads.emplace_back( &WorkerPool::WorkerThread, this );
+			}
+		}
+
+	inline void WorkerPool::Stop()
+		{
+		if( this->Threads.empty() )
+			{
+			return;
+			}
+
+		// flag the threads to stop when the queue is empty, and wake all of them
+			{
+			std::lock_guard<std::mutex> lock( this->TasksMutex );
+			this->Stopping = true;
+			}
+		this->TasksCondition.notify_all();
+
+		for( size_t i = 0; i < this->Threads.size(); ++i )
+			{
+			this->Threads[i].join();
+			}
+		this->Threads.clear();
+		}
+
+	inline void WorkerPool::WorkerThread()
+		{
+		for( ;;)
+			{
+			std::function<void()> task;
+
+			// wait for a task, or for the pool to stop
+				{
+				std::unique_lock<std::mutex> lock( this->TasksMutex );
+				this->TasksCondition.wait( lock, [this]() { return this->Stopping || !this->Tasks.empty(); } );
+				if( this->Tasks.empty() )
+					{
+					// stopping, and no tasks left to run
+					return;
+					}
+				task = std::move( this->Tasks.front() );
+				this->Tasks.pop_front();
+				}
+
+			task();
+			}
+		}
+
+	template<class _Func> inline auto WorkerPool::Submit( _Func func ) -> std::future<decltype(func())>
+		{
+		typedef decltype(func()) result_type;
+
+		// packaged_task is move-only, and std::function needs a copyable object, so hold the task in a shared_ptr
+		auto task = std::make_shared<std::packaged_task<result_type()>>( std::move( func ) );
+		std::future<result_type> result = task->get_future();
+
+		if( this->Threads.empty() )
+			{
+			(*task)();
+			return result;
+			}
+
+			{
+			std::lock_guard<std::mutex> lock( this->TasksMutex );
+			this->Tasks.emplace_back( [task]() { (*task)(); } );
+			}
+		this->TasksCondition.notify_one();
+
+		return result;
+		}
+
+	};
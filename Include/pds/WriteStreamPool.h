@@ -0,0 +1,128 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "pds.h"
+#include "MemoryWriteStream.h"
+
+#include <vector>
+#include <mutex>
+#include <memory>
+
+namespace pds
+	{
+	// Write stream pool keeps reset memory write streams, so that the entities which are added are serialized
+	// into the allocation of an earlier write, instead of into a new allocation per write. Each write worker
+	// holds at most one stream at a time, so the pool holds about as many streams as there are write workers.
+	// Streams which have grown above MaxPooledStreamSize are freed when released, so a single large entity
+	// does not keep a large allocation resident. The pool is thread safe.
+	class WriteStreamPool
+		{
+		public:
+			// the allocation size of new streams, and the largest allocation size of a stream which is kept in the pool
+			static const u64 InitialStreamSize = 1024*64;
+			static const u64 MaxPooledStreamSize = 1024*1024*16;
+
+		private:
+			std::vector<std::unique_ptr<MemoryWriteStream>> Streams;
+			std::mutex StreamsMutex;
+			size_t MaxStreamCount = 0;
+			u64 SegmentSize = 0;
+
+		public:
+			WriteStreamPool() = default;
+			WriteStreamPool( const WriteStreamPool &other ) = delete;
+			WriteStreamPool &operator=( const WriteStreamPool &other ) = delete;
+
+			// set the number of streams the pool keeps, the streams above the count are freed when released
+			void SetMaxStreamCount( size_t maxStreamCount ) { this->MaxStreamCount = maxStreamCount; }
+
+			// if set, the pool creates segmented streams with segments of segmentSize bytes (see MemoryWriteStream). set before the first Acquire.
+			void SetSegmentSize( u64 segmentSize ) { this->SegmentSize = segmentSize; }
+
+			// get a reset stream, from the pool if there is one, else a new stream
+			std::unique_ptr<MemoryWriteStream> Acquire();
+
+			// reset the stream and return it to the pool, or free it if it is too large, or the pool is full
+			void Release( std::unique_ptr<MemoryWriteStream> stream );
+
+			// get the number of streams in the pool
+			size_t GetPooledStreamCount();
+		};
+
+	// Pooled write stream acquires a stream from a pool, and releases it back to the pool when it goes out of scope.
+	// If the pool is nullptr, a new stream is created and freed.
+	class PooledWriteStream
+		{
+		private:
+			WriteStreamPool *Pool = nullptr;
+			std::unique_ptr<MemoryWriteStream> Stream;
+
+		public:
+			PooledWriteStream( WriteStreamPool *pool ) : Pool( pool )
+				{
+				this->Stream = ( pool ) ? pool->Acquire() : std::unique_ptr<MemoryWriteStream>( new MemoryWriteStream( WriteStreamPool::InitialStreamSize ) );
+				}
+			PooledWriteStream( const PooledWriteStream &other ) = delete;
+			PooledWriteStream &operator=( const PooledWriteStream &other ) = delete;
+			~PooledWriteStream()
+				{
+				if( this->Pool )
+					{
+					this->Pool->Release( std::move( this->Stream ) );
+					}
+				}
+
+			MemoryWriteStream &operator*() const { return *this->Stream; }
+			MemoryWriteStream *operator->() const { return this->Stream.get(); }
+		};
+
+	inline std::unique_ptr<MemoryWriteStream> WriteStreamPool::Acquire()
+		{
+			{
+			std::lock_guard<std::mutex> lock( this->StreamsMutex );
+			if( !this->Streams.empty() )
+				{
+				std::unique_ptr<MemoryWriteStream> stream = std::move( this->Streams.back() );
+				this->Streams.pop_back();
+				return stream;
+				}
+			}
+
+		// no pooled stream, allocate outside of the lock
+		if( this->SegmentSize != 0 )
+			{
+			return std::unique_ptr<MemoryWriteStream>( new MemoryWriteStream( InitialStreamSize, this->SegmentSize ) );
+			}
+		return std::unique_ptr<MemoryWriteStream>( new MemoryWriteStream( InitialStreamSize ) );
+		}
+
+	inline void WriteStreamPool::Release( std::unique_ptr<MemoryWriteStream> stream )
+		{
+		if( !stream || stream->GetReservedSize() > MaxPooledStreamSize )
+			{
+			return;
+			}
+
+		stream->Reset();
+
+			{
+			std::lock_guard<std::mutex> lock( this->StreamsMutex );
+			if( this->Streams.size() < this->MaxStreamCount )
+				{
+				this->Streams.emplace_back( std::move( stream ) );
+				return;
+				}
+			}
+
+		// the pool is full, the stream is freed when it goes out of scope, outside of the lock
+		}
+
+	inline size_t WriteStreamPool::GetPooledStreamCount()
+		{
+		std::lock_guard<std::mutex> lock( this->StreamsMutex );
+		return this->Streams.size();
+		}
+
+	};
@@ -14,6 +14,9 @@
 #include <unordered_map>
 #include <future>
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <functional>
 
 #include <ctle/thread_safe_map.h>
 #include <ctle/readers_writer_lock.h>
@@ -48,6 +51,17 @@ namespace pds
 	class EntityValidator;
 	class EntityWriter;
 	class EntityReader;
+	class WorkerPool;
+	class WriteStreamPool;
+	class PackfileStore;
+	class GroupCommitQueue;
+	class EntityDirectory;
+	class EntityScrubber;
+	class MemoryWriteStream;
+	class MemoryReadStream;
+	class ChunkedFileReadStream;
+	class EntityKeyTable;
+	struct LazySectionSource;
 
 	// Entity is base for all entities (atomic objects in the graph, which ows all values within the object)
 	class Entity 
@@ -66,6 +80,12 @@ namespace pds
 	// maximum size of a name of a value of subchunk in the entities
 	const size_t EntityMaxKeyLength = 40; 
 
+	// minimum size of a large block which is deferred to a lazy section, smaller blocks are decoded directly (see LazySection)
+	const u64 EntityMinDeferredBlockSize = 256;
+
+	// maximum size of an entity file which is hashed together with other small files in a batched load (see SHA256::HashMany)
+	const u64 EntityMaxBatchHashFileSize = 4096;
+
 	// status message for functions that return more than a bool status
 	enum class Status
 		{
@@ -111,6 +131,35 @@ namespace pds
 	//		u8 KeySizeInBytes; // the size of the key of the value (EntityMaxKeyLength is the max length of any key)
 	//		u8 KeyData[]; // the key of the value 
 	//		u8 Value[]; // <- defined size, equal to the rest of SizeInBytes after the key data ( sizeof(KeySizeInBytes)=1 + KeySizeInBytes bytes) 
+	// * Padded payloads: if the writing stream has a payload alignment (see MemoryWriteStream::SetPayloadAlignment), the values 
+	//   of arrays of base types and the characters of strings are padded to start at a multiple of the alignment in the stream.
+	//   Padded arrays set bit 0x400 in the array flags, and padded strings set the top bit of the character count. The padding is
+	//   written right before the values, as a u8 padding size followed by that many zero bytes. Readers accept both layouts.
+	// 
+	// Interned keys: a stream which is written with interned keys (see EntityWriter::InternKeys) starts with a VT_KeyTable 
+	// block, and the blocks store the id of their key in a key table (see EntityKeyTable), instead of the key data.
+	// * Layout of the first block, without a key:
+	//		u8 Type; // VT_KeyTable
+	//		u64 SizeInBytes; // 8
+	//		u64 KeyTablePosition; // the stream position of the key table block, after the other blocks
+	// * Layout of the key table block, without a key:
+	//		u8 Type; // VT_KeyTable
+	//		u64 SizeInBytes; 
+	//		u16 KeyCount; 
+	//		{ u8 KeySizeInBytes; u8 KeyData[]; } Keys[KeyCount]; // the keys, in id order
+	// * Small blocks store the key id before the value, so the size of an empty value is only the size of the key id:
+	//		u8 Type; 
+	//		u8 SizeInBytes; 
+	//		u8 KeyId[]; // one byte if the id is < 0x80, else two bytes, with the top bit of the first byte set
+	//		u8 Value[]; 
+	// * Large blocks store the key id instead of the key size and key data:
+	//		u8 Type; 
+	//		u64 SizeInBytes; 
+	//		u8 KeyId[]; // one or two bytes, as above
+	//		u8 Value[]; 
+
+	// the payload alignments which can be set on a write stream, the padding size must fit in a u8
+	const u64 EntityMaxPayloadAlignment = 128;
 
 	// reflection and serialization value types
 	enum class ValueType
@@ -166,6 +215,7 @@ namespace pds
 		// --- Specific types: 0xd0 - 0xff
 		VT_Subsection = 0xd0, // a named subsection, containins named values and nested subsections. 
 		VT_Array_Subsection = 0xd1, // array of (unnamed) subsections
+		VT_KeyTable = 0xd2, // the key table of a stream with interned keys, and the block which points at it (never read as a value)
 		VT_String = 0xe0, // a UTF-8 encoded string
 		VT_Array_String = 0xe1, // array of strings
 		};
@@ -202,6 +252,8 @@ namespace pds
 	class EntityHandler
 		{
 		public:
+			static const uint MaxEntityShardCount = 64;
+
 			class PackageRecord
 				{
 				public:
@@ -218,28 +270,311 @@ namespace pds
 					virtual bool Validate( const Entity *obj, EntityValidator &validator ) const = 0;
 				};
 
+			// how the data of an entity is verified against its hash when the entity is loaded
+			enum class VerifyPolicy
+				{
+				Always, // hash the data before the entity is decoded. a corrupted entity fails to load
+				Deferred, // decode the entity right away, and hash the data on the read worker pool afterwards
+				Sampled, // hash the data of one in every Settings::VerifySampleInterval loads, before the entity is decoded
+				};
+
+			// called when the data of an entity is found to not match its hash, on the thread which verified the data
+			typedef std::function<void( const entity_ref &ref )> CorruptionCallback;
+
+			// settings for the handler, which are set in Initialize
+			struct Settings
+				{
+				// load entity files through a read-only memory mapping, instead of reading the
+				// file into an allocation. the entity is hashed and decoded directly from the mapping.
+				bool UseMemoryMappedFiles = false;
+
+				// loose entity files of at least this many bytes are decoded from the file through a sliding buffer (see
+				// ChunkedFileReadStream), instead of being read into one allocation first, so the peak memory of the load is
+				// about the size of the decoded entity. the data is hashed as it is read, and the entity is verified before it
+				// is inserted, also with the deferred verify policy. lazy sections are not used for streamed loads. 
+				// if 0, entity files are read whole. can't be combined with UseMemoryMappedFiles.
+				u64 StreamedLoadSize = 0;
+
+				// pad the values of arrays and strings in the written entity files to start at a multiple of this many bytes in
+				// the file, so that they can be used in place from a memory mapped file, or with aligned SIMD loads (see 
+				// EntityReader::ReadView). entity files with and without padding are both loaded. 0 for no padding, else a
+				// power of two, at most EntityMaxPayloadAlignment.
+				u64 PayloadAlignment = 0;
+
+				// number of worker threads which load entities, and number of worker threads which
+				// serialize and write added entities. if 0, the number of hardware threads is used.
+				uint ReadThreadCount = 0;
+				uint WriteThreadCount = 0;
+
+				// store the entities in append-only packfile segments (see PackfileStore), instead of
+				// in one <sha256-hex>.dat file per entity. loose entity files are still loaded if an 
+				// entity is not found in the packfiles.
+				bool UsePackfiles = false;
+
+				// write added entities durably: each entity is written to a temp file, and a commit thread
+				// syncs and renames pending files into place in groups (see GroupCommitQueue). the AddEntity
+				// futures complete when the group of the entity is durable. can't be combined with UsePackfiles.
+				bool UseDurableWrites = false;
+
+				// the budget in bytes of the loaded entities. when the estimated size of the loaded entities
+				// goes above the budget, entities which are not referenced outside of the handler are evicted
+				// in CLOCK order. the size of an entity is estimated by the size of its serialized data.
+				// if 0, the budget is unlimited, and entities are only unloaded by UnloadNonReferencedEntities.
+				u64 EntityCacheBudget = 0;
+
+				// number of shards of the map of loaded entities, each with its own lock. lookups of entities
+				// in different shards do not contend. must be a power of two, at most MaxEntityShardCount.
+				uint EntityShardCount = MaxEntityShardCount;
+
+				// spread the loose entity files over 256 subdirectories named by the first byte of the hash,
+				// ab/cdef...89.dat, instead of keeping all files in the handler directory (see EntityDirectory).
+				// a flat store must be migrated with EntityDirectory::MigrateToFanOut before it is opened with fan-out.
+				bool UseFanOutDirectories = false;
+
+				// hash added entities while they are serialized, instead of hashing the serialized data afterwards. 
+				// the entity is first measured, to find the sizes of the blocks, and then written with the sizes 
+				// up front, so the data can be hashed in chunks while it is still in the cache. the serialized data 
+				// and the hash are the same. this pays off for large entities, small entities are faster to hash afterwards.
+				bool UseSinglePassHashing = false;
+
+				// serialize added entities into segmented write streams, a chain of fixed-size segments, instead of into one
+				// contiguous allocation (see MemoryWriteStream). the streams grow without copying or large allocations, and the
+				// segments are written to the entity file in one gathered write. can't be combined with UsePackfiles or UseDurableWrites.
+				bool UseSegmentedWriteStreams = false;
+
+				// added entities which serialize to at least this many bytes are spilled to a temp file in the store directory
+				// while they are serialized, and the temp file is renamed into place, so the memory use of a write is bounded no
+				// matter how large the entity is. all entities are measured first, and the spilled entities are hashed while
+				// they are written out (see UseSinglePassHashing). if 0, entities are never spilled. 
+				// can't be combined with UsePackfiles or UseDurableWrites.
+				u64 SpillToFileSize = 0;
+
+				// decode the sections and arrays of loaded entities on first access, instead of when the entity is loaded 
+				// (see LazySection). the data of the entity is kept loaded until all its sections are decoded. loads which
+				// need the references of the entity, such as LoadEntityClosure, still decode the whole entity.
+				bool UseLazySections = false;
+
+				// write a table of contents after the entity in the entity files, which maps the keys of the entity and its sections
+				// to the positions of their blocks, so single values can be read without decoding the entity (see EntityReader::Seek).
+				// the table changes the data, and so the hash, of the entities. entity files with and without a table are both loaded.
+				bool UseTableOfContents = false;
+
+				// write the keys of the entity files once, in a key table, and store the id of the key in each block instead of the 
+				// key, which makes entities with many small values and sections arrays smaller, and faster to decode. the key table 
+				// changes the data, and so the hash, of the entities. entity files with and without interned keys are both loaded.
+				bool UseInternedKeys = false;
+
+				// how loaded entities are verified. with Deferred and Sampled, a corrupted entity may be handed out before the
+				// corruption is found, or not be verified at all on load, so use them only on trusted storage, together with the scrubber.
+				// a corrupted entity which is found after it was loaded is unloaded, and reported to OnCorruptedEntity.
+				VerifyPolicy LoadVerifyPolicy = VerifyPolicy::Always;
+				uint VerifySampleInterval = 16;
+				CorruptionCallback OnCorruptedEntity;
+
+				// re-verify all entities of the store on a background thread, reading at most this many bytes per
+				// second (see EntityScrubber). corrupted entities are reported to OnCorruptedEntity. if 0, there is no scrubber.
+				u64 ScrubberBytesPerSecond = 0;
+				};
+
+			// counters of the entity cache, returned by GetCacheStatistics
+			struct CacheStatistics
+				{
+				// number of load requests for entities which were already loaded, and which had to be loaded
+				u64 HitCount = 0;
+				u64 MissCount = 0;
+
+				// number of entities evicted to stay within the budget
+				u64 EvictionCount = 0;
+
+				// number of load requests which joined a load of the same entity that was already in flight
+				u64 CoalescedCount = 0;
+
+				// number of loaded entities, and their estimated size in bytes
+				u64 EntityCount = 0;
+				u64 EntityBytes = 0;
+				};
+
+			// counters of the verification of entities, returned by GetVerifyStatistics
+			struct VerifyStatistics
+				{
+				// number of loads which verified the data of the entity, and which did not verify it (sampled out)
+				u64 VerifiedCount = 0;
+				u64 UnverifiedCount = 0;
+
+				// number of times the data of an entity did not match its hash, in loads and in the scrubber
+				u64 CorruptedCount = 0;
+
+				// number of entities and bytes verified by the scrubber, and the number of completed passes over the store
+				u64 ScrubbedEntityCount = 0;
+				u64 ScrubbedByteCount = 0;
+				u64 ScrubPassCount = 0;
+				};
+
 		private:
 			std::string Path;
+			Settings HandlerSettings;
 
-			std::unordered_map<entity_ref, std::shared_ptr<const Entity>> Entities;
-			ctle::readers_writer_lock EntitiesLock;
-			std::vector<const PackageRecord*> Records;
+			// the entities referenced by a loaded entity
+			typedef std::shared_ptr<const std::vector<entity_ref>> EntityReferences;
+
+			// a loaded entity, with its estimated size, and its slot in the clock
+			struct CachedEntity
+				{
+				std::shared_ptr<const Entity> Data;
+				u64 Size = 0;
+				size_t ClockIndex = 0;
 
-			void InsertEntity( const entity_ref &ref , const std::shared_ptr<const Entity> &entity );
+				// the entity_refs found when the entity was decoded. nullptr for added entities, which are not decoded
+				EntityReferences References;
 
-			static Status ReadTask( EntityHandler *pThis, const entity_ref ref );
+				// set when the entity is used, and cleared when the clock hand passes it
+				mutable std::atomic<bool> Referenced;
+
+				CachedEntity( const std::shared_ptr<const Entity> &data, u64 size, size_t clockIndex, const EntityReferences &references ) : Data( data ), Size( size ), ClockIndex( clockIndex ), References( references ), Referenced( true ) {}
+				};
+
+			// the digests are uniformly distributed, so the map hashes a digest word directly
+			struct CachedEntityHash
+				{
+				size_t operator()( const entity_ref &ref ) const noexcept;
+				};
+			typedef std::unordered_map<entity_ref, CachedEntity, CachedEntityHash> CachedEntityMap;
+
+			// a load of an entity which is in flight, with the callbacks of the batch and closure loads which joined it.
+			// the callbacks are called when the load is done, so the joined loads don't block a thread while they wait
+			struct InFlightLoad
+				{
+				std::shared_future<Status> Result;
+				std::vector<std::function<void( Status )>> Waiters;
+				};
+
+			// a shard of the loaded entities, with its clock of entities, and the position of the clock hand
+			struct EntityShard
+				{
+				CachedEntityMap Entities;
+				ctle::readers_writer_lock Lock;
+				std::vector<entity_ref> Clock;
+				size_t ClockHand = 0;
+
+				// the loads of entities in the shard which are in flight, so concurrent loads of an entity share one load
+				std::unordered_map<entity_ref, InFlightLoad, CachedEntityHash> Loads;
+				};
+
+			// the shard of an entity is selected by the first byte of the digest
+			EntityShard EntityShards[MaxEntityShardCount];
+			uint EntityShardMask = MaxEntityShardCount - 1;
+			EntityShard &GetEntityShard( const entity_ref &ref );
+
+			// estimated size of all loaded entities, and the next shard to evict entities from
+			std::atomic<u64> EntityBytes;
+			std::atomic<uint> EvictionShard;
+
+			// cache counters
+			std::atomic<u64> CacheHitCount;
+			std::atomic<u64> CacheMissCount;
+			std::atomic<u64> CacheEvictionCount;
+			std::atomic<u64> CacheCoalescedCount;
+
+			// verify counters, and the number of loads, to select the sampled loads
+			std::atomic<u64> VerifiedCount;
+			std::atomic<u64> UnverifiedCount;
+			std::atomic<u64> CorruptedCount;
+			std::atomic<u64> VerifySampleCounter;
+
+			// reports the lazy sections of the loaded entities which fail to decode to the handler, while it is alive,
+			// since the entities can outlive the handler. defined in pds.inl
+			struct LazySectionReporter;
+			std::shared_ptr<LazySectionReporter> SectionReporter;
+
+			std::vector<const PackageRecord*> Records;
+
+			// worker pools which run the async load and add requests, created in Initialize
+			std::unique_ptr<WorkerPool> ReadPool;
+			std::unique_ptr<WorkerPool> WritePool;
+
+			// reset write streams which are reused by the writes, so each write does not allocate a new stream
+			std::unique_ptr<WriteStreamPool> WriteStreams;
+
+			// locates the loose entity files in the handler directory
+			std::unique_ptr<EntityDirectory> Directory;
+
+			// the packfile store, if the handler is set to use packfiles
+			std::unique_ptr<PackfileStore> Packfiles;
+
+			// the commit queue, if the handler is set to write durably
+			std::unique_ptr<GroupCommitQueue> CommitQueue;
+
+			// the scrubber, if the handler is set to scrub the store
+			std::unique_ptr<EntityScrubber> Scrubber;
+
+			// the state of a batched load, and of a closure load, defined in pds.inl
+			struct BatchLoad;
+			struct ClosureLoad;
+
+			void InsertEntity( const entity_ref &ref , const std::shared_ptr<const Entity> &entity , u64 size , const EntityReferences &references = nullptr );
+			void EraseEntity( EntityShard &shard, CachedEntityMap::iterator it );
+			void EvictEntities();
+			void EvictShardEntities( EntityShard &shard );
+			bool IsEntityLoadedForLoad( const entity_ref &ref );
+			EntityReferences GetEntityReferencesForLoad( const entity_ref &ref );
+			std::shared_future<Status> FindOrAddLoad( const entity_ref &ref, std::shared_ptr<std::promise<Status>> &loadPromise );
+			std::shared_ptr<std::promise<Status>> JoinOrAddLoad( const entity_ref &ref, bool needReferences, std::function<void( Status )> onDone );
+			static void FinishLoad( EntityHandler *pThis, const entity_ref &ref, std::shared_ptr<std::promise<Status>> loadPromise, Status status );
+			static void RunLoad( EntityHandler *pThis, const entity_ref ref, std::shared_ptr<std::promise<Status>> loadPromise );
+
+			static Status ReadEntityData( EntityHandler *pThis, const entity_ref &ref, std::vector<u8> &data );
+			static Status ReadTask( EntityHandler *pThis, const entity_ref ref, EntityReferences *references = nullptr );
+			std::shared_ptr<BatchLoad> NewBatchLoad( const std::vector<entity_ref> &refs );
+			static void BatchReadTask( EntityHandler *pThis, std::shared_ptr<BatchLoad> batch );
+			static void ClosureReadTask( EntityHandler *pThis, std::shared_ptr<ClosureLoad> closure, const entity_ref ref, const uint depth );
+			static Status ReadEntityFromMemory( EntityHandler *pThis, const entity_ref &ref, const u8 *data, const u64 dataSize, const std::shared_ptr<const void> &dataOwner, EntityReferences *references = nullptr, const hash *dataDigest = nullptr );
+			static Status ReadEntityFromStream( EntityHandler *pThis, const entity_ref &ref, ChunkedFileReadStream &rstream, EntityReferences *references = nullptr );
+			static Status DecodeEntity( EntityHandler *pThis, MemoryReadStream &rstream, const std::shared_ptr<const LazySectionSource> &deferredSource, std::vector<entity_ref> &referencedEntities, std::shared_ptr<Entity> &entity );
+			bool ShouldVerifyLoad();
+			static void VerifyTask( EntityHandler *pThis, const entity_ref ref, const u8 *data, const u64 dataSize, std::shared_ptr<const void> dataOwner );
+			Status ScrubEntity( const hash &id, u64 &bytesRead );
+			void ListStoredEntities( std::vector<hash> &ids );
+			void ReportCorruptedEntity( const entity_ref &ref );
+			static Status SerializeEntity( EntityHandler *pThis, const Entity *entity, MemoryWriteStream &wstream, hash &digest );
+			static Status SpillEntity( EntityHandler *pThis, const Entity *entity, MemoryWriteStream &wstream, hash &digest );
+			static std::pair<entity_ref, Status> MoveSpilledEntity( EntityHandler *pThis, const std::shared_ptr<const Entity> &entity, MemoryWriteStream &wstream, const hash &digest );
 			static std::pair<entity_ref, Status> WriteTask( EntityHandler *pThis, std::shared_ptr<const Entity> entity );
+			static void DurableWriteTask( EntityHandler *pThis, std::shared_ptr<const Entity> entity, std::shared_ptr<std::promise<std::pair<entity_ref, Status>>> result );
 
 		public:
+			EntityHandler();
+			~EntityHandler();
+
 			Status Initialize( const std::string &path , const std::vector<const PackageRecord*> &records );
+			Status Initialize( const std::string &path , const std::vector<const PackageRecord*> &records , const Settings &settings );
 
 			// Asks the handler to load an entity and insert into the Entities map. 
-			std::future<Status> LoadEntityAsync( const entity_ref &ref );
+			// LoadEntityAsync queues the load on the read worker pool, LoadEntity loads on the calling thread.
+			// Concurrent requests for an entity which is not loaded yet share one load, and the same future.
+			std::shared_future<Status> LoadEntityAsync( const entity_ref &ref );
 			Status LoadEntity( const entity_ref &ref );
 
+			// Asks the handler to load a list of entities and insert into the Entities map. On Linux, the file
+			// reads of the whole list are submitted in batches through io_uring, and the entities are decoded
+			// on the read worker pool while the remaining reads are in flight. Otherwise, the entities are loaded
+			// one by one on the read worker pool. Returns Ok if all entities were loaded, else the error of
+			// the first entity in the list which failed to load.
+			std::future<Status> LoadEntitiesAsync( const std::vector<entity_ref> &refs );
+			Status LoadEntities( const std::vector<entity_ref> &refs );
+
+			// Asks the handler to load an entity, and all entities it references through entity_ref values, directly or 
+			// through other entities, down to maxDepth levels of references (0 loads only the entity itself). The entity_refs
+			// are collected while each entity is decoded, and the referenced entities are queued on the read worker pool right
+			// away, so all of the levels are loaded in parallel. Each entity is loaded once, even if it is referenced many times.
+			// Returns Ok if all entities were loaded, else the error of one of the entities which failed to load.
+			// Note! The references of added entities are not known to the handler, so their files are read to find them.
+			std::future<Status> LoadEntityClosureAsync( const entity_ref &ref, const uint maxDepth );
+			Status LoadEntityClosure( const entity_ref &ref, const uint maxDepth );
+
 			// Unloads all entities which are not referenced outside of the EntityHandler
 			// To make sure an entity is kept around, keep a reference to the entity using the 
-			// std::shared_ptr<const Entity> returned by GetLoadedEntity().
+			// std::shared_ptr<const Entity> returned by GetLoadedEntity(). The same holds for entities
+			// evicted to stay within Settings::EntityCacheBudget.
 			Status UnloadNonReferencedEntities();
 
 			// Checks if an entity is loaded. 
@@ -248,13 +583,20 @@ namespace pds
 			// Returns a loaded entity, or nullptr if the entity is not loaded.
 			std::shared_ptr<const Entity> GetLoadedEntity( const entity_ref &ref );
 
+			// Returns the counters of the entity cache
+			CacheStatistics GetCacheStatistics();
+
+			// Returns the counters of the verification of loaded entities, and of the scrubber
+			VerifyStatistics GetVerifyStatistics();
+
 			// Transfers ownership of a writable entity to the handler. The entity is serialized
 			// and written to disk, and is from now on locked and immutable. 
 			// The method returns the entity reference to the entity on return. 
 			// Note! The ownership is transfered to the handler, and the entity data must be treated as
 			// read-only.
 			// Note! If the exact same entity data (same hash of the serialized data) is added, the 
-			// existing reference will be returned and the Status will be WAlreadyExists
+			// existing reference will be returned and the Status will be WAlreadyExists, and nothing is written.
+			// AddEntityAsync queues the write on the write worker pool, AddEntity writes on the calling thread.
 			std::future<std::pair<entity_ref, Status>> AddEntityAsync( const std::shared_ptr<const Entity> &entity );
 			std::pair<entity_ref, Status> AddEntity( const std::shared_ptr<const Entity> &entity );
 
@@ -8,6 +8,12 @@
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #include <Rpc.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #endif
 
 #include "SHA256.h"
@@ -17,6 +23,17 @@
 
 #include "MemoryWriteStream.h"
 #include "MemoryReadStream.h"
+#include "ChunkedFileReadStream.h"
+#include "MemoryMappedFile.h"
+#include "WorkerPool.h"
+#include "WriteStreamPool.h"
+#include "BatchFileReader.h"
+#include "PackfileStore.h"
+#include "GroupCommitQueue.h"
+#include "TempFile.h"
+#include "EntityDirectory.h"
+#include "EntityScrubber.h"
+#include "LazySection.h"
 
 #include "EntityWriter.h"
 #include "EntityReader.h"
@@ -38,6 +55,9 @@
 
 #include <iostream>
 #include <fstream>
+#include <atomic>
+#include <unordered_set>
+#include <cerrno>
 
 using std::pair;
 using std::make_pair;
@@ -69,6 +89,55 @@ namespace pds
 		return value;
 		}
 
+	void LazySection::Defer( const std::shared_ptr<const LazySectionSource> &source, const u8 *data, u64 size, bool flipByteOrder, const std::shared_ptr<const EntityKeyTable> &keyTable, DecodeFunction decode )
+		{
+		this->Deferred = std::unique_ptr<DeferredData>( new DeferredData );
+		this->Deferred->Source = source;
+		this->Deferred->Data = data;
+		this->Deferred->Size = size;
+		this->Deferred->FlipByteOrder = flipByteOrder;
+		this->Deferred->KeyTable = keyTable;
+		this->Deferred->Decode = decode;
+		this->Pending.store( true, std::memory_order_release );
+		}
+
+	void LazySection::MaterializeDeferred( const void *obj ) const
+		{
+		DeferredData &deferred = *this->Deferred;
+		std::shared_ptr<const LazySectionSource> failedSource;
+			{
+			std::lock_guard<std::mutex> lock( deferred.Mutex );
+
+			// another thread may have decoded the section while this thread waited for the lock
+			if( !this->Pending.load( std::memory_order_acquire ) )
+				{
+				return;
+				}
+
+			// with the Deferred and Sampled verify policies the data may not be verified, so a failed decode is reported as corrupted data
+			MemoryReadStream rstream( deferred.Data, deferred.Size, deferred.FlipByteOrder );
+			rstream.SetKeyTable( deferred.KeyTable );
+			EntityReader reader( rstream );
+			if( !deferred.Decode( const_cast<void *>( obj ), reader ) )
+				{
+				pdsErrorLog << "Failed to decode a lazy section, the entity data is probably corrupted" << pdsErrorLogEnd;
+				failedSource = deferred.Source;
+				}
+
+			// release the data, and publish the decoded value to the other threads
+			deferred.Source.reset();
+			deferred.Data = nullptr;
+			deferred.KeyTable.reset();
+			this->Pending.store( false, std::memory_order_release );
+			}
+
+		// report the failure outside of the lock, since the report may unload the entity
+		if( failedSource && failedSource->OnDecodeFailed )
+			{
+			failedSource->OnDecodeFailed( failedSource->Ref );
+			}
+		}
+
 //#ifdef _MSC_VER
 //	std::wstring widen( const std::string &str )
 //		{
@@ -147,6 +216,30 @@ namespace pds
 		return false;
 		}
 
+	// writes the entity file, with the header section and the entity, and if set, a table of contents after the header section,
+	// and if the keys are interned, the key table last
+	static bool entityWriteFile( const std::vector<const EntityHandler::PackageRecord*> &records , const Entity *obj, MemoryWriteStream &wstream, bool writeTableOfContents, bool internKeys )
+		{
+		EntityWriter writer( wstream );
+		if( internKeys && !writer.InternKeys() )
+			return false;
+		if( writeTableOfContents )
+			writer.CollectTableOfContents();
+		EntityWriter *sectionWriter = writer.BeginWriteSection( pdsKeyMacro( "EntityFile" ) );
+		if( !sectionWriter )
+			return false;
+		sectionWriter->Write<std::string>( pdsKeyMacro( "EntityType" ), obj->EntityTypeString() );
+		if( !entityWrite( records , obj, *sectionWriter ) )
+			return false;
+		if( !writer.EndWriteSection( sectionWriter ) )
+			return false;
+		if( writeTableOfContents && !writer.WriteTableOfContents() )
+			return false;
+		if( internKeys )
+			return writer.WriteKeyTable();
+		return true;
+		}
+
 	static bool entityRead( const std::vector<const EntityHandler::PackageRecord*> &records , Entity *obj, EntityReader &reader )
 		{
 		if( !obj )
@@ -185,14 +278,195 @@ namespace pds
 		return false;
 		}
 
-	void EntityHandler::InsertEntity( const entity_ref &ref, const std::shared_ptr<const Entity> &entity )
+	size_t EntityHandler::CachedEntityHash::operator()( const entity_ref &ref ) const noexcept
+		{
+		// the first byte selects the shard, so use the bytes after it
+		const hash &digest = hash( ref );
+		size_t value;
+		memcpy( &value, &digest.digest[8], sizeof( value ) );
+		return value;
+		}
+
+	EntityHandler::EntityShard &EntityHandler::GetEntityShard( const entity_ref &ref )
+		{
+		return this->EntityShards[hash( ref ).digest[0] & this->EntityShardMask];
+		}
+
+	void EntityHandler::InsertEntity( const entity_ref &ref, const std::shared_ptr<const Entity> &entity, u64 size, const EntityReferences &references )
+		{
+		u64 entityBytes = 0;
+			{
+			EntityShard &shard = this->GetEntityShard( ref );
+			ctle::readers_writer_lock::write_guard guard( shard.Lock );
+
+			const auto result = shard.Entities.emplace( std::piecewise_construct, std::forward_as_tuple( ref ), std::forward_as_tuple( entity, size, shard.Clock.size(), references ) );
+			if( !result.second )
+				{
+				// already loaded, but keep the references if they were not known
+				if( !result.first->second.References )
+					{
+					result.first->second.References = references;
+					}
+				return;
+				}
+			shard.Clock.emplace_back( ref );
+
+			// added while the shard is locked, like it is subtracted in EraseEntity, so an eviction of the entity
+			// from the shard can't subtract the size before it is added
+			entityBytes = ( this->EntityBytes += size );
+			}
+
+		// evict a few entities on every insert, so that loads are never stalled by a full scan
+		if( this->HandlerSettings.EntityCacheBudget > 0 && entityBytes > this->HandlerSettings.EntityCacheBudget )
+			{
+			this->EvictEntities();
+			}
+		}
+
+	void EntityHandler::EraseEntity( EntityShard &shard, CachedEntityMap::iterator it )
+		{
+		// move the last entity of the clock into the slot of the erased entity
+		const size_t clockIndex = it->second.ClockIndex;
+		if( clockIndex != shard.Clock.size() - 1 )
+			{
+			shard.Clock[clockIndex] = shard.Clock.back();
+			shard.Entities.find( shard.Clock[clockIndex] )->second.ClockIndex = clockIndex;
+			}
+		shard.Clock.pop_back();
+		this->EntityBytes -= it->second.Size;
+		shard.Entities.erase( it );
+		}
+
+	void EntityHandler::EvictEntities()
+		{
+		// evict from the shards in turn, locking one shard at a time. each insert starts at the next shard, 
+		// so over time the entities are evicted evenly from all shards
+		const uint shardCount = this->EntityShardMask + 1;
+		for( uint i = 0; i < shardCount && this->EntityBytes > this->HandlerSettings.EntityCacheBudget; ++i )
+			{
+			EntityShard &shard = this->EntityShards[this->EvictionShard.fetch_add( 1 ) & this->EntityShardMask];
+			ctle::readers_writer_lock::write_guard guard( shard.Lock );
+			this->EvictShardEntities( shard );
+			}
+		}
+
+	void EntityHandler::EvictShardEntities( EntityShard &shard )
+		{
+		// advance the clock hand until the entities are within the budget. entities which are used since the 
+		// hand passed them get a second chance, and entities which are referenced outside of the handler are kept.
+		// the hand passes each entity at most twice, so the loop ends even if no entity can be evicted.
+		size_t stepsLeft = shard.Clock.size() * 2;
+		while( this->EntityBytes > this->HandlerSettings.EntityCacheBudget && stepsLeft > 0 && !shard.Clock.empty() )
+			{
+			--stepsLeft;
+			if( shard.ClockHand >= shard.Clock.size() )
+				{
+				shard.ClockHand = 0;
+				}
+
+			auto it = shard.Entities.find( shard.Clock[shard.ClockHand] );
+			if( it->second.Referenced.exchange( false ) || it->second.Data.use_count() > 1 )
+				{
+				++shard.ClockHand;
+				continue;
+				}
+
+			// the hand stays, the last entity of the clock is moved into the slot
+			this->EraseEntity( shard, it );
+			++this->CacheEvictionCount;
+			}
+		}
+
+	bool EntityHandler::IsEntityLoadedForLoad( const entity_ref &ref )
+		{
+		EntityShard &shard = this->GetEntityShard( ref );
+		ctle::readers_writer_lock::read_guard guard( shard.Lock );
+
+		const auto it = shard.Entities.find( ref );
+		if( it == shard.Entities.end() )
+			{
+			++this->CacheMissCount;
+			return false;
+			}
+		it->second.Referenced = true;
+		++this->CacheHitCount;
+		return true;
+		}
+
+	EntityHandler::EntityReferences EntityHandler::GetEntityReferencesForLoad( const entity_ref &ref )
+		{
+		EntityShard &shard = this->GetEntityShard( ref );
+		ctle::readers_writer_lock::read_guard guard( shard.Lock );
+
+		// an entity which is loaded, but without known references, has to be read again, and counts as a miss
+		const auto it = shard.Entities.find( ref );
+		if( it == shard.Entities.end() || !it->second.References )
+			{
+			++this->CacheMissCount;
+			return nullptr;
+			}
+		it->second.Referenced = true;
+		++this->CacheHitCount;
+		return it->second.References;
+		}
+
+	struct EntityHandler::LazySectionReporter
+		{
+		std::mutex Mutex;
+		EntityHandler *Handler = nullptr;
+
+		void Report( const entity_ref &ref )
+			{
+			std::lock_guard<std::mutex> lock( this->Mutex );
+			if( this->Handler )
+				{
+				this->Handler->ReportCorruptedEntity( ref );
+				}
+			}
+		};
+
+	EntityHandler::EntityHandler() : EntityBytes( 0 ), EvictionShard( 0 ), CacheHitCount( 0 ), CacheMissCount( 0 ), CacheEvictionCount( 0 ), CacheCoalescedCount( 0 ), VerifiedCount( 0 ), UnverifiedCount( 0 ), CorruptedCount( 0 ), VerifySampleCounter( 0 ), SectionReporter( std::make_shared<LazySectionReporter>() )
+		{
+		this->SectionReporter->Handler = this;
+		}
+
+	EntityHandler::~EntityHandler()
 		{
-		ctle::readers_writer_lock::write_guard guard( this->EntitiesLock );
+		// the lazy sections of entities which are still held can't report to the handler from now on
+			{
+			std::lock_guard<std::mutex> lock( this->SectionReporter->Mutex );
+			this->SectionReporter->Handler = nullptr;
+			}
+
+		// stop the scrubber before the store it reads from is torn down
+		if( this->Scrubber )
+			{
+			this->Scrubber->Stop();
+			}
+
+		// finish all queued requests before the handler is torn down, since the tasks reference the handler
+		if( this->ReadPool )
+			{
+			this->ReadPool->Stop();
+			}
+		if( this->WritePool )
+			{
+			this->WritePool->Stop();
+			}
 
-		this->Entities.emplace( ref, entity );
+		// commit the remaining durable writes
+		if( this->CommitQueue )
+			{
+			this->CommitQueue->Deinitialize();
+			}
 		}
 
 	Status EntityHandler::Initialize( const std::string &path , const std::vector<const PackageRecord*> &records )
+		{
+		return this->Initialize( path, records, Settings() );
+		}
+
+	Status EntityHandler::Initialize( const std::string &path , const std::vector<const PackageRecord*> &records , const Settings &settings )
 		{
 		if( !this->Path.empty() )
 			{
@@ -202,6 +476,41 @@ namespace pds
 			{
 			return Status::EParam; // must have at least one record
 			}
+		if( settings.EntityShardCount == 0 || settings.EntityShardCount > MaxEntityShardCount || ( settings.EntityShardCount & ( settings.EntityShardCount - 1 ) ) != 0 )
+			{
+			pdsErrorLog << "EntityShardCount must be a power of two, at most " << MaxEntityShardCount << pdsErrorLogEnd;
+			return Status::EParam;
+			}
+		if( settings.UseDurableWrites && settings.UsePackfiles )
+			{
+			pdsErrorLog << "UseDurableWrites can't be combined with UsePackfiles, durable writes commit loose entity files" << pdsErrorLogEnd;
+			return Status::EParam;
+			}
+		if( settings.UseSegmentedWriteStreams && ( settings.UsePackfiles || settings.UseDurableWrites ) )
+			{
+			pdsErrorLog << "UseSegmentedWriteStreams can't be combined with UsePackfiles or UseDurableWrites, segmented streams are only written to loose entity files" << pdsErrorLogEnd;
+			return Status::EParam;
+			}
+		if( settings.SpillToFileSize != 0 && ( settings.UsePackfiles || settings.UseDurableWrites ) )
+			{
+			pdsErrorLog << "SpillToFileSize can't be combined with UsePackfiles or UseDurableWrites, spilled entities are only written to loose entity files" << pdsErrorLogEnd;
+			return Status::EParam;
+			}
+		if( settings.StreamedLoadSize != 0 && settings.UseMemoryMappedFiles )
+			{
+			pdsErrorLog << "StreamedLoadSize can't be combined with UseMemoryMappedFiles, mapped files are decoded directly from the mapping" << pdsErrorLogEnd;
+			return Status::EParam;
+			}
+		if( settings.PayloadAlignment > EntityMaxPayloadAlignment || ( settings.PayloadAlignment & ( settings.PayloadAlignment - 1 ) ) != 0 )
+			{
+			pdsErrorLog << "PayloadAlignment must be 0 or a power of two, at most " << EntityMaxPayloadAlignment << pdsErrorLogEnd;
+			return Status::EParam;
+			}
+		if( settings.LoadVerifyPolicy == VerifyPolicy::Sampled && settings.VerifySampleInterval == 0 )
+			{
+			pdsErrorLog << "VerifySampleInterval must be at least 1 with the sampled verify policy" << pdsErrorLogEnd;
+			return Status::EParam;
+			}
 
 #ifdef _MSC_VER
 		//std::wstring wpath = widen( path );
@@ -224,26 +533,90 @@ namespace pds
 		// copy the package records
 		this->Records = records;
 
+		this->HandlerSettings = settings;
+		this->EntityShardMask = settings.EntityShardCount - 1;
+
+		// open the directory of the loose entity files
+			{
+			this->Directory.reset( new EntityDirectory() );
+			const Status status = this->Directory->Initialize( path, settings.UseFanOutDirectories );
+			if( status != Status::Ok )
+				{
+				pdsErrorLog << "Failed to open the directory: " << path << pdsErrorLogEnd;
+				this->Directory.reset();
+				this->Path.clear();
+				return status;
+				}
+			}
+
+		// remove the spill files which were left by processes which stopped while they spilled an entity
+		remove_stale_temp_files( path, "spill-", ".tmp" );
+
+		// open the packfiles, and load their index
+		if( settings.UsePackfiles )
+			{
+			this->Packfiles.reset( new PackfileStore() );
+			const Status status = this->Packfiles->Initialize( path );
+			if( status != Status::Ok )
+				{
+				pdsErrorLog << "Failed to open the packfiles in path: " << path << pdsErrorLogEnd;
+				this->Packfiles.reset();
+				this->Path.clear();
+				return status;
+				}
+			}
+
+		// start the commit thread for durable writes
+		if( settings.UseDurableWrites )
+			{
+			this->CommitQueue.reset( new GroupCommitQueue() );
+			const Status status = this->CommitQueue->Initialize( path );
+			if( status != Status::Ok )
+				{
+				pdsErrorLog << "Failed to set up durable writes in path: " << path << pdsErrorLogEnd;
+				this->CommitQueue.reset();
+				this->Path.clear();
+				return status;
+				}
+			}
+
+		// start the worker pools, the read and write lanes are separate so that
+		// a burst of adds does not stall loads, and vice versa
+		this->ReadPool.reset( new WorkerPool() );
+		this->ReadPool->Start( settings.ReadThreadCount );
+		this->WritePool.reset( new WorkerPool() );
+		this->WritePool->Start( settings.WriteThreadCount );
+		this->WriteStreams.reset( new WriteStreamPool() );
+		this->WriteStreams->SetMaxStreamCount( this->WritePool->GetThreadCount() );
+		if( settings.UseSegmentedWriteStreams )
+			{
+			this->WriteStreams->SetSegmentSize( MemoryWriteStream::DefaultSegmentSize );
+			}
+
+		// start the scrubber, which slowly re-verifies the whole store in the background
+		if( settings.ScrubberBytesPerSecond > 0 )
+			{
+			this->Scrubber.reset( new EntityScrubber() );
+			this->Scrubber->Start( settings.ScrubberBytesPerSecond,
+				[this]( std::vector<hash> &ids ) { this->ListStoredEntities( ids ); },
+				[this]( const hash &id, u64 &bytesRead ) { return this->ScrubEntity( id, bytesRead ); } );
+			}
+
 		return Status::Ok;
 		}
 
-	Status EntityHandler::ReadTask( EntityHandler *pThis, const entity_ref ref )
+	Status EntityHandler::ReadEntityData( EntityHandler *pThis, const entity_ref &ref, std::vector<u8> &data )
 		{
-		const uint hash_size = 32;
-
-		// skip if entity already is loaded
-		if( pThis->IsEntityLoaded( ref ) )
+		// if set, read from the packfiles. entities which are not in the packfiles are loaded from loose files
+		if( pThis->Packfiles && pThis->Packfiles->Contains( hash( ref ) ) )
 			{
-			return Status::Ok;
+			return pThis->Packfiles->Read( hash( ref ), data );
 			}
 
-		// create the file name and path from the hash
-		const std::string fileName = value_to_hex_string( hash( ref ) ) + ".dat";
-		const std::string filePath = pThis->Path + "/" + fileName;
-
 #ifdef _MSC_VER
 
 		// open the file
+		const std::string filePath = pThis->Directory->GetFilePath( hash( ref ) );
 		HANDLE file_handle = ::CreateFileA( filePath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_READONLY, nullptr );
 		if( file_handle == INVALID_HANDLE_VALUE )
 			{
@@ -260,21 +633,14 @@ namespace pds
 			}
 		u64 total_bytes_to_read = dfilesize.QuadPart;
 
-		// cant be less in size than the size of the hash at the end
-		if( total_bytes_to_read < hash_size )
-			{
-			return Status::ECorrupted;
-			}
-
 		// read in all of the file
-		std::vector<u8> allocation;
-		allocation.resize( total_bytes_to_read );
-		if( allocation.size() != total_bytes_to_read )
+		data.resize( total_bytes_to_read );
+		if( data.size() != total_bytes_to_read )
 			{
 			// failed to allocate the memory
 			return Status::ECantAllocate;
 			}
-		u8 *buffer = allocation.data();
+		u8 *buffer = data.data();
 
 		u64 bytes_read = 0;
 		while( bytes_read < total_bytes_to_read )
@@ -300,239 +666,1336 @@ namespace pds
 		::CloseHandle( file_handle );
 #else
 
-		// open the file at the end
-		std::ifstream file( filePath.c_str(), std::ios::in | std::ios::binary | std::ios::ate );
-		if( !file.is_open() )
+		// open the file, relative to the open directory
+		int file_descriptor = pThis->Directory->OpenFile( hash( ref ), O_RDONLY );
+		if( file_descriptor < 0 )
 			{
 			// failed to open the file
 			return Status::ECantOpen;
 			}
 
-		// get the size of the file, and move to the beginning
-		u64 total_bytes_to_read = file.tellg();
-		file.seekg(0, std::ios::beg);
-
-		// cant be less in size than the size of the hash at the end
-		if( total_bytes_to_read < hash_size )
+		// get the size of the file
+		struct stat file_stat = {};
+		if( ::fstat( file_descriptor, &file_stat ) != 0 )
 			{
-			return Status::ECorrupted;
+			::close( file_descriptor );
+			return Status::ECantOpen;
 			}
+		u64 total_bytes_to_read = (u64)file_stat.st_size;
 
 		// allocate the data
-		std::vector<u8> allocation;
-		allocation.resize( total_bytes_to_read );
-		if( allocation.size() != total_bytes_to_read )
+		data.resize( total_bytes_to_read );
+		if( data.size() != total_bytes_to_read )
 			{
 			// failed to allocate the memory
+			::close( file_descriptor );
 			return Status::ECantAllocate;
 			}
-		u8 *buffer = allocation.data();
+		u8 *buffer = data.data();
 
-		// read the data
-		file.read( (char*)buffer, total_bytes_to_read);
-		file.close();
-#endif
-
-		// calculate the sha256 hash on the data, and make sure it compares correctly with the hash
-		SHA256 sha( buffer, total_bytes_to_read );
-		hash digest = {};
-		sha.GetDigest( digest.digest );
-		if( digest != hash( ref ) )
+		// read the data directly into the allocation, without going through a stream buffer
+		u64 bytes_read = 0;
+		while( bytes_read < total_bytes_to_read )
 			{
-			// sha hash does not compare correctly, file is corrupted
-			return Status::ECorrupted;
+			const ssize_t bytes_that_were_read = ::pread( file_descriptor, &buffer[bytes_read], (size_t)(total_bytes_to_read - bytes_read), (off_t)bytes_read );
+			if( bytes_that_were_read < 0 && errno == EINTR )
+				{
+				continue;
+				}
+			if( bytes_that_were_read <= 0 )
+				{
+				// failed to read, or the file was truncated
+				::close( file_descriptor );
+				return Status::ECantRead;
+				}
+			bytes_read += (u64)bytes_that_were_read;
 			}
 
-		// set up a memory stream and deserializer
-		MemoryReadStream rstream( buffer, total_bytes_to_read, false );
-		EntityReader reader( rstream );
-
-		// read file header and deserialize the entity
-		bool result = {};
-		EntityReader *sectionReader;
-		std::tie( sectionReader, result ) = reader.BeginReadSection( pdsKeyMacro( "EntityFile" ), false );
-		if( !result )
-			return Status::ECorrupted;
-		std::string entityTypeString;
-		result = sectionReader->Read<std::string>( pdsKeyMacro( "EntityType" ), entityTypeString );
-		if( !result )
-			return Status::ECorrupted;
-		std::shared_ptr<Entity> entity = entityNew( pThis->Records , entityTypeString.c_str() );
-		if( !entity )
-			return Status::ENotInitialized;
-		result = entityRead( pThis->Records , entity.get(), *sectionReader );
-		if( !result )
-			return Status::ECorrupted;
-		result = reader.EndReadSection( sectionReader );
-		if( !result )
-			return Status::ECorrupted;
-
-		// transfer into the Entities map 
-		pThis->InsertEntity( ref, entity );
+		::close( file_descriptor );
+#endif
 
-		// done
 		return Status::Ok;
 		}
 
-	std::future<Status> EntityHandler::LoadEntityAsync( const entity_ref &ref )
-		{
-		return std::async( ReadTask, this, ref );
-		}
-
-	Status EntityHandler::LoadEntity( const entity_ref &ref )
+	Status EntityHandler::ReadTask( EntityHandler *pThis, const entity_ref ref, EntityReferences *references )
 		{
-		auto futr = this->LoadEntityAsync( ref );
-		futr.wait();
-		return futr.get();
-		}
+		const uint hash_size = 32;
 
-	Status EntityHandler::UnloadNonReferencedEntities()
-		{
-		ctle::readers_writer_lock::write_guard guard( this->EntitiesLock );
+		// skip if entity already is loaded. if the references are requested, they must be known as well
+		if( !references && pThis->IsEntityLoaded( ref ) )
+			{
+			return Status::Ok;
+			}
 
-		auto it = this->Entities.begin();
-		while( it != this->Entities.end() )
+		// if set, map the file and decode directly from the mapped memory, without copying the data
+		if( pThis->HandlerSettings.UseMemoryMappedFiles && !( pThis->Packfiles && pThis->Packfiles->Contains( hash( ref ) ) ) )
 			{
-			// if this entity is only held by us, remove it, else skip to next
-			if( it->second.use_count() == 1 )
+			auto mappedFile = std::make_shared<MemoryMappedFile>();
+#ifdef _MSC_VER
+			const Status status = mappedFile->Open( pThis->Directory->GetFilePath( hash( ref ) ).c_str() );
+#else
+			const int fileDescriptor = pThis->Directory->OpenFile( hash( ref ), O_RDONLY );
+			const Status status = ( fileDescriptor < 0 ) ? Status::ECantOpen : mappedFile->Open( fileDescriptor );
+#endif
+			if( status != Status::Ok )
 				{
-				it = this->Entities.erase( it );
+				return status;
 				}
-			else
+
+			// cant be less in size than the size of the hash at the end
+			if( mappedFile->GetSize() < hash_size )
 				{
-				++it;
+				return Status::ECorrupted;
 				}
-			}
 
-		return Status::Ok;
-		}
+			// the mapping is released when the last reference to mappedFile is dropped, which may be a deferred verify
+			return ReadEntityFromMemory( pThis, ref, mappedFile->GetData(), mappedFile->GetSize(), mappedFile, references );
+			}
 
+		// if set, decode large loose files through a sliding buffer, instead of reading them into memory first
+		if( pThis->HandlerSettings.StreamedLoadSize != 0 && !( pThis->Packfiles && pThis->Packfiles->Contains( hash( ref ) ) ) )
+			{
+			ChunkedFileReadStream rstream;
+#ifdef _MSC_VER
+			const Status status = rstream.Open( pThis->Directory->GetFilePath( hash( ref ) ).c_str() );
+#else
+			const int fileDescriptor = pThis->Directory->OpenFile( hash( ref ), O_RDONLY );
+			const Status status = ( fileDescriptor < 0 ) ? Status::ECantOpen : rstream.Open( fileDescriptor );
+#endif
+			if( status != Status::Ok )
+				{
+				return status;
+				}
 
-	bool EntityHandler::IsEntityLoaded( const entity_ref &ref )
-		{
-		ctle::readers_writer_lock::read_guard guard( this->EntitiesLock );
+			// cant be less in size than the size of the hash at the end
+			if( rstream.GetSize() < hash_size )
+				{
+				return Status::ECorrupted;
+				}
+			if( rstream.GetSize() >= pThis->HandlerSettings.StreamedLoadSize )
+				{
+				return ReadEntityFromStream( pThis, ref, rstream, references );
+				}
 
-		return this->Entities.find( ref ) != this->Entities.end();
-		}
+			// small files are read whole from the opened file, the read goes directly into the allocation
+			auto allocation = std::make_shared<std::vector<u8>>( (size_t)rstream.GetSize() );
+			if( rstream.Read( allocation->data(), allocation->size() ) != allocation->size() )
+				{
+				return Status::ECantRead;
+				}
+			return ReadEntityFromMemory( pThis, ref, allocation->data(), allocation->size(), allocation, references );
+			}
 
-	std::shared_ptr<const Entity> EntityHandler::GetLoadedEntity( const entity_ref &ref )
-		{
-		ctle::readers_writer_lock::read_guard guard( this->EntitiesLock );
+		// read the entity from the packfiles, or from its loose file
+		auto allocation = std::make_shared<std::vector<u8>>();
+		const Status status = ReadEntityData( pThis, ref, *allocation );
+		if( status != Status::Ok )
+			{
+			return status;
+			}
 
-		const auto it = this->Entities.find( ref );
-		if( it == this->Entities.end() )
-			return nullptr;
+		// cant be less in size than the size of the hash at the end
+		if( allocation->size() < hash_size )
+			{
+			return Status::ECorrupted;
+			}
 
-		return it->second;
+		return ReadEntityFromMemory( pThis, ref, allocation->data(), allocation->size(), allocation, references );
 		}
 
-	std::pair<entity_ref, Status> EntityHandler::WriteTask( EntityHandler *pThis, std::shared_ptr<const Entity> entity )
+	Status EntityHandler::ReadEntityFromMemory( EntityHandler *pThis, const entity_ref &ref, const u8 *data, const u64 dataSize, const std::shared_ptr<const void> &dataOwner, EntityReferences *references, const hash *dataDigest )
 		{
-		EntityValidator validator;
-		MemoryWriteStream wstream;
-		EntityWriter writer( wstream );
+		// calculate the sha256 hash on the data, unless it is already calculated, and make sure it compares correctly with the hash.
+		// with the deferred policy, the data is hashed after the entity is decoded, on the read pool
+		const bool verify = pThis->ShouldVerifyLoad();
+		if( verify )
+			{
+			hash digest = {};
+			if( dataDigest )
+				{
+				digest = *dataDigest;
+				}
+			else
+				{
+				SHA256 sha( data, dataSize );
+				sha.GetDigest( digest.digest );
+				}
+			if( digest != hash( ref ) )
+				{
+				// sha hash does not compare correctly, file is corrupted
+				pThis->ReportCorruptedEntity( ref );
+				return Status::ECorrupted;
+				}
+			}
 
-		// make sure the entity is valid
-		if( !entityValidate( pThis->Records , entity.get(), validator ) )
-			return std::pair<entity_ref, Status>( {}, Status::ECorrupted );
-		if( validator.GetErrorCount() > 0 )
-			return std::pair<entity_ref, Status>( {}, Status::EInvalid );
+		// decode the entity. with lazy sections, the sections are decoded on first access and keep the data alive until then, 
+		// and the references of the entity are not known. loads which need the references decode the entity directly.
+		const bool deferSections = pThis->HandlerSettings.UseLazySections && !references;
+		// sections which fail to decode on access are reported as corrupted, as the data may not be verified
+		std::shared_ptr<LazySectionSource> deferredSource;
+		if( deferSections )
+			{
+			deferredSource = std::make_shared<LazySectionSource>();
+			deferredSource->Owner = dataOwner;
+			deferredSource->Ref = ref;
+			std::shared_ptr<LazySectionReporter> reporter = pThis->SectionReporter;
+			deferredSource->OnDecodeFailed = [reporter]( const entity_ref &failedRef ) { reporter->Report( failedRef ); };
+			}
+		MemoryReadStream rstream( data, dataSize, false );
+		std::vector<entity_ref> referencedEntities;
+		std::shared_ptr<Entity> entity;
+		const Status decodeStatus = DecodeEntity( pThis, rstream, deferredSource, referencedEntities, entity );
+		if( decodeStatus != Status::Ok )
+			return decodeStatus;
 
-		// serialize to a stream
-		EntityWriter *sectionWriter = writer.BeginWriteSection( pdsKeyMacro( "EntityFile" ) );
-		if( !sectionWriter )
-			return std::pair<entity_ref, Status>( {}, Status::EUndefined );
-		sectionWriter->Write<std::string>( pdsKeyMacro( "EntityType" ), entity->EntityTypeString() );
-		if( !entityWrite( pThis->Records , entity.get(), *sectionWriter ) )
-			return std::pair<entity_ref, Status>( {}, Status::EUndefined );
-		if( !writer.EndWriteSection( sectionWriter ) )
-			return std::pair<entity_ref, Status>( {}, Status::EUndefined );
+		// transfer into the Entities map 
+		EntityReferences entityReferences = deferSections ? nullptr : std::make_shared<const std::vector<entity_ref>>( std::move( referencedEntities ) );
+		pThis->InsertEntity( ref, entity, dataSize, entityReferences );
+		if( references )
+			{
+			*references = std::move( entityReferences );
+			}
+
+		// hash the data now that the entity is handed out. the data is kept alive by the owner until it is hashed
+		if( !verify && pThis->HandlerSettings.LoadVerifyPolicy == VerifyPolicy::Deferred )
+			{
+			std::shared_ptr<const void> owner = dataOwner;
+			pThis->ReadPool->Submit( [pThis, ref, data, dataSize, owner]() { VerifyTask( pThis, ref, data, dataSize, owner ); } );
+			}
 
-		// calculate the sha256 hash on the data
-		SHA256 sha( (u8 *)wstream.GetData(), wstream.GetSize() );
+		// done
+		return Status::Ok;
+		}
+
+	Status EntityHandler::ReadEntityFromStream( EntityHandler *pThis, const entity_ref &ref, ChunkedFileReadStream &rstream, EntityReferences *references )
+		{
+		// the data is not kept after the load, so it is hashed while it is decoded, also with the deferred policy
+		const bool deferredPolicy = ( pThis->HandlerSettings.LoadVerifyPolicy == VerifyPolicy::Deferred );
+		const bool verify = pThis->ShouldVerifyLoad() || deferredPolicy;
+		if( verify )
+			{
+			rstream.BeginHashedRead();
+			}
+
+		// decode the entity, the references are always collected, as the sections are not deferred
+		std::vector<entity_ref> referencedEntities;
+		std::shared_ptr<Entity> entity;
+		const Status decodeStatus = DecodeEntity( pThis, rstream, nullptr, referencedEntities, entity );
+		if( rstream.HasReadFailed() )
+			{
+			return Status::ECantRead;
+			}
+
+		// check the hash of the whole file, also if the decode failed, so a corrupted file is reported
+		if( verify )
+			{
+			hash digest = {};
+			if( !rstream.EndHashedRead( digest ) )
+				{
+				return Status::ECantRead;
+				}
+			if( deferredPolicy )
+				{
+				++pThis->VerifiedCount;
+				}
+			if( digest != hash( ref ) )
+				{
+				// sha hash does not compare correctly, file is corrupted
+				pThis->ReportCorruptedEntity( ref );
+				return Status::ECorrupted;
+				}
+			}
+		if( decodeStatus != Status::Ok )
+			{
+			return decodeStatus;
+			}
+
+		// transfer into the Entities map
+		EntityReferences entityReferences = std::make_shared<const std::vector<entity_ref>>( std::move( referencedEntities ) );
+		pThis->InsertEntity( ref, entity, rstream.GetSize(), entityReferences );
+		if( references )
+			{
+			*references = std::move( entityReferences );
+			}
+		return Status::Ok;
+		}
+
+	Status EntityHandler::DecodeEntity( EntityHandler *pThis, MemoryReadStream &rstream, const std::shared_ptr<const LazySectionSource> &deferredSource, std::vector<entity_ref> &referencedEntities, std::shared_ptr<Entity> &entity )
+		{
+		// set up a deserializer, which defers the sections if the source of the data is set, else collects the entity_refs of the entity
+		EntityReader reader( rstream );
+		if( deferredSource )
+			{
+			reader.SetDeferredSource( deferredSource );
+			}
+		else
+			{
+			reader.SetReferencedEntities( &referencedEntities );
+			}
+
+		// read the key table if the keys are interned, and the file header, and deserialize the entity
+		if( !reader.ReadKeyTable() )
+			return Status::ECorrupted;
+		bool result = {};
+		EntityReader *sectionReader;
+		std::tie( sectionReader, result ) = reader.BeginReadSection( pdsKeyMacro( "EntityFile" ), false );
+		if( !result )
+			return Status::ECorrupted;
+		std::string entityTypeString;
+		result = sectionReader->Read<std::string>( pdsKeyMacro( "EntityType" ), entityTypeString );
+		if( !result )
+			return Status::ECorrupted;
+		entity = entityNew( pThis->Records , entityTypeString.c_str() );
+		if( !entity )
+			return Status::ENotInitialized;
+		result = entityRead( pThis->Records , entity.get(), *sectionReader );
+		if( !result )
+			return Status::ECorrupted;
+		result = reader.EndReadSection( sectionReader );
+		if( !result )
+			return Status::ECorrupted;
+		return Status::Ok;
+		}
+
+	bool EntityHandler::ShouldVerifyLoad()
+		{
+		bool verify = true;
+		switch( this->HandlerSettings.LoadVerifyPolicy )
+			{
+			case VerifyPolicy::Always:
+				break;
+			case VerifyPolicy::Deferred:
+				verify = false;
+				break;
+			case VerifyPolicy::Sampled:
+				verify = ( this->VerifySampleCounter.fetch_add( 1 ) % this->HandlerSettings.VerifySampleInterval ) == 0;
+				break;
+			}
+
+		// deferred loads are counted as verified when they are hashed
+		if( verify )
+			{
+			++this->VerifiedCount;
+			}
+		else if( this->HandlerSettings.LoadVerifyPolicy == VerifyPolicy::Sampled )
+			{
+			++this->UnverifiedCount;
+			}
+		return verify;
+		}
+
+	void EntityHandler::VerifyTask( EntityHandler *pThis, const entity_ref ref, const u8 *data, const u64 dataSize, std::shared_ptr<const void> /*dataOwner*/ )
+		{
+		// the data is kept alive by the owner, which is released when the task is done
+		SHA256 sha( data, dataSize );
 		hash digest = {};
 		sha.GetDigest( digest.digest );
+		++pThis->VerifiedCount;
+		if( digest != hash( ref ) )
+			{
+			pThis->ReportCorruptedEntity( ref );
+			}
+		}
 
-		// get file data
-		const u8 *writeBuffer = (u8 *)wstream.GetData();
-		const u64 totalBytesToWrite = wstream.GetSize();
+	void EntityHandler::ReportCorruptedEntity( const entity_ref &ref )
+		{
+		++this->CorruptedCount;
+
+		// unload the entity, so it is not handed out again. entities held outside of the handler are not affected
+			{
+			EntityShard &shard = this->GetEntityShard( ref );
+			ctle::readers_writer_lock::write_guard guard( shard.Lock );
+			const auto it = shard.Entities.find( ref );
+			if( it != shard.Entities.end() )
+				{
+				this->EraseEntity( shard, it );
+				}
+			}
+
+		if( this->HandlerSettings.OnCorruptedEntity )
+			{
+			this->HandlerSettings.OnCorruptedEntity( ref );
+			}
+		}
+
+	void EntityHandler::ListStoredEntities( std::vector<hash> &ids )
+		{
+		// the same entity may be both in a packfile and in a loose file, it is then verified twice
+		if( this->Packfiles )
+			{
+			this->Packfiles->ListEntities( ids );
+			}
+		if( this->Directory->ListEntities( ids ) != Status::Ok )
+			{
+			pdsErrorLog << "The scrubber failed to list the entity files in path: " << this->Path << pdsErrorLogEnd;
+			}
+		}
+
+	Status EntityHandler::ScrubEntity( const hash &id, u64 &bytesRead )
+		{
+		std::vector<u8> data;
+		const Status status = ReadEntityData( this, entity_ref( id ), data );
+		bytesRead = data.size();
+		if( status != Status::Ok )
+			{
+			// the file may have been removed since the entities were listed
+			return status;
+			}
+
+		SHA256 sha( data.data(), data.size() );
+		hash digest = {};
+		sha.GetDigest( digest.digest );
+		if( digest != id )
+			{
+			this->ReportCorruptedEntity( entity_ref( id ) );
+			return Status::ECorrupted;
+			}
+		return Status::Ok;
+		}
 
-		// create the file name and path from the hash
-		const std::string fileName = value_to_hex_string( digest ) + ".dat";
-		const std::string filePath = pThis->Path + "/" + fileName;
+	std::shared_future<Status> EntityHandler::FindOrAddLoad( const entity_ref &ref, std::shared_ptr<std::promise<Status>> &loadPromise )
+		{
+		EntityShard &shard = this->GetEntityShard( ref );
+		ctle::readers_writer_lock::write_guard guard( shard.Lock );
+
+		// join the load in flight, if there is one
+		const auto it = shard.Loads.find( ref );
+		if( it != shard.Loads.end() )
+			{
+			++this->CacheCoalescedCount;
+			return it->second.Result;
+			}
+
+		// the entity may have been loaded since the caller checked
+		auto promise = std::make_shared<std::promise<Status>>();
+		std::shared_future<Status> load = promise->get_future().share();
+		if( shard.Entities.find( ref ) != shard.Entities.end() )
+			{
+			promise->set_value( Status::Ok );
+			return load;
+			}
+
+		// add the load, which the caller has to run with RunLoad
+		shard.Loads[ref].Result = load;
+		loadPromise = std::move( promise );
+		return load;
+		}
+
+	std::shared_ptr<std::promise<Status>> EntityHandler::JoinOrAddLoad( const entity_ref &ref, bool needReferences, std::function<void( Status )> onDone )
+		{
+			{
+			EntityShard &shard = this->GetEntityShard( ref );
+			ctle::readers_writer_lock::write_guard guard( shard.Lock );
+
+			// join the load in flight, if there is one. onDone is called by the task which finishes the load
+			const auto it = shard.Loads.find( ref );
+			if( it != shard.Loads.end() )
+				{
+				++this->CacheCoalescedCount;
+				it->second.Waiters.emplace_back( std::move( onDone ) );
+				return nullptr;
+				}
+
+			// add the load, which the caller has to finish with FinishLoad, unless the entity has been loaded since the caller
+			// checked. if the caller needs the references of the entity, an entity which is loaded without them is loaded again
+			const auto entityIt = shard.Entities.find( ref );
+			if( entityIt == shard.Entities.end() || ( needReferences && !entityIt->second.References ) )
+				{
+				auto promise = std::make_shared<std::promise<Status>>();
+				shard.Loads[ref].Result = promise->get_future().share();
+				return promise;
+				}
+			}
+
+		// the entity is loaded, call onDone outside of the lock
+		onDone( Status::Ok );
+		return nullptr;
+		}
+
+	void EntityHandler::FinishLoad( EntityHandler *pThis, const entity_ref &ref, std::shared_ptr<std::promise<Status>> loadPromise, Status status )
+		{
+		// remove the load before the result is set, so a failed load can be retried by a later request
+		std::vector<std::function<void( Status )>> waiters;
+			{
+			EntityShard &shard = pThis->GetEntityShard( ref );
+			ctle::readers_writer_lock::write_guard guard( shard.Lock );
+			const auto it = shard.Loads.find( ref );
+			pdsSanityCheckDebugMacro( it != shard.Loads.end() );
+			waiters = std::move( it->second.Waiters );
+			shard.Loads.erase( it );
+			}
+		loadPromise->set_value( status );
+		for( size_t i = 0; i < waiters.size(); ++i )
+			{
+			waiters[i]( status );
+			}
+		}
+
+	void EntityHandler::RunLoad( EntityHandler *pThis, const entity_ref ref, std::shared_ptr<std::promise<Status>> loadPromise )
+		{
+		FinishLoad( pThis, ref, std::move( loadPromise ), ReadTask( pThis, ref ) );
+		}
+
+	std::shared_future<Status> EntityHandler::LoadEntityAsync( const entity_ref &ref )
+		{
+		if( !this->ReadPool )
+			{
+			// not initialized, no pool to queue the request on
+			std::promise<Status> notInitialized;
+			notInitialized.set_value( Status::ENotInitialized );
+			return notInitialized.get_future().share();
+			}
+
+		// if the entity is already loaded, there is nothing to queue
+		if( this->IsEntityLoadedForLoad( ref ) )
+			{
+			std::promise<Status> loaded;
+			loaded.set_value( Status::Ok );
+			return loaded.get_future().share();
+			}
+
+		// queue the load, unless the entity is already being loaded
+		std::shared_ptr<std::promise<Status>> loadPromise;
+		std::shared_future<Status> load = this->FindOrAddLoad( ref, loadPromise );
+		if( loadPromise )
+			{
+			EntityHandler *pThis = this;
+			this->ReadPool->Submit( [pThis, ref, loadPromise]() { RunLoad( pThis, ref, loadPromise ); } );
+			}
+		return load;
+		}
+
+	Status EntityHandler::LoadEntity( const entity_ref &ref )
+		{
+		if( this->Path.empty() )
+			{
+			return Status::ENotInitialized;
+			}
+
+		if( this->IsEntityLoadedForLoad( ref ) )
+			{
+			return Status::Ok;
+			}
+
+		// the caller waits for the result anyway, so load directly on the calling thread, unless the entity is already being loaded
+		std::shared_ptr<std::promise<Status>> loadPromise;
+		std::shared_future<Status> load = this->FindOrAddLoad( ref, loadPromise );
+		if( loadPromise )
+			{
+			RunLoad( this, ref, loadPromise );
+			}
+		return load.get();
+		}
 
+	// the state of a batched load, shared by the task which reads the files, and the tasks which decode the entities
+	struct EntityHandler::BatchLoad
+		{
+		EntityHandler *Handler = nullptr;
+		std::vector<entity_ref> Refs;
+		std::vector<Status> Statuses;
+
+		// the loads of the entities which the batch reads. the other entities are loaded by loads in flight, which the batch joins
+		std::vector<std::shared_ptr<std::promise<Status>>> Loads;
+
+		// number of entities which are not done, plus one held by the read task until all decodes are queued
+		std::atomic<size_t> PendingCount;
+		std::promise<Status> Result;
+
+		// mark entity i as done, and finish its load if the batch reads it. when all entities are done, the result is set to
+		// the first failed status in the list
+		void Complete( size_t index, Status status )
+			{
+			this->Statuses[index] = status;
+			if( this->Loads[index] )
+				{
+				FinishLoad( this->Handler, this->Refs[index], std::move( this->Loads[index] ), status );
+				}
+			this->Release();
+			}
+
+		void Release()
+			{
+			if( this->PendingCount.fetch_sub( 1 ) != 1 )
+				{
+				return;
+				}
+			for( size_t i = 0; i < this->Statuses.size(); ++i )
+				{
+				if( this->Statuses[i] != Status::Ok )
+					{
+					this->Result.set_value( this->Statuses[i] );
+					return;
+					}
+				}
+			this->Result.set_value( Status::Ok );
+			}
+		};
+
+	void EntityHandler::BatchReadTask( EntityHandler *pThis, std::shared_ptr<BatchLoad> batch )
+		{
+		// join the loads of the entities which are in flight, and add loads for the rest, which are read by the batch
+		std::vector<size_t> readIndices;
+		readIndices.reserve( batch->Refs.size() );
+		for( size_t i = 0; i < batch->Refs.size(); ++i )
+			{
+			auto loadPromise = pThis->JoinOrAddLoad( batch->Refs[i], false, [batch, i]( Status status ) { batch->Complete( i, status ); } );
+			if( loadPromise )
+				{
+				batch->Loads[i] = std::move( loadPromise );
+				readIndices.emplace_back( i );
+				}
+			}
+
+		// memory mapped and packfile loads are done per entity, else try to set up batched reads
+		BatchFileReader reader;
+		if( pThis->HandlerSettings.UseMemoryMappedFiles || pThis->Packfiles || reader.Initialize() != Status::Ok )
+			{
+			// no batched reads, load the entities one by one on the read pool
+			for( size_t r = 0; r < readIndices.size(); ++r )
+				{
+				const size_t i = readIndices[r];
+				const entity_ref ref = batch->Refs[i];
+				pThis->ReadPool->Submit( [pThis, batch, ref, i]() { batch->Complete( i, ReadTask( pThis, ref ) ); } );
+				}
+			batch->Release();
+			return;
+			}
+
+		// the files are opened relative to their open directories, with the file names written directly into the slots of the reader
+		static_assert( EntityDirectory::FileNameSize <= BatchFileReader::FileNameSize, "The entity file names must fit the names of the reader" );
+		auto locateFile = [pThis, batch, &readIndices]( size_t readIndex, int &directoryDescriptor, char( &fileName )[BatchFileReader::FileNameSize] ) -> bool
+			{
 #ifdef _MSC_VER
-		// open the file
-		HANDLE fileHandle = ::CreateFileA( filePath.c_str(), GENERIC_WRITE, FILE_SHARE_WRITE, nullptr, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, nullptr );
-		if( fileHandle == INVALID_HANDLE_VALUE )
+			(void)pThis; (void)batch; (void)readIndices; (void)readIndex; (void)directoryDescriptor; (void)fileName;
+			return false;
+#else
+			char entityFileName[EntityDirectory::FileNameSize];
+			directoryDescriptor = pThis->Directory->GetFileLocation( hash( batch->Refs[readIndices[readIndex]] ), false, entityFileName );
+			memcpy( fileName, entityFileName, EntityDirectory::FileNameSize );
+			return directoryDescriptor >= 0;
+#endif
+			};
+
+		// small files which are always verified are hashed in groups with HashMany, which hashes several messages at a time,
+		// and the group is then decoded. the digests are passed on, so the files are not hashed again when decoded.
+		typedef std::vector<std::pair<size_t, std::shared_ptr<std::vector<u8>>>> HashGroup;
+		const size_t hashGroupSize = 8;
+		const bool hashSmallFiles = ( pThis->HandlerSettings.LoadVerifyPolicy == VerifyPolicy::Always );
+		auto hashGroup = std::make_shared<HashGroup>();
+		auto submitHashGroup = [pThis, batch, &hashGroup]()
+			{
+			std::shared_ptr<HashGroup> group = std::move( hashGroup );
+			hashGroup = std::make_shared<HashGroup>();
+			pThis->ReadPool->Submit( [pThis, batch, group]()
+				{
+				std::vector<const u8 *> datas( group->size() );
+				std::vector<size_t> dataLengths( group->size() );
+				std::vector<hash> digests( group->size() );
+				for( size_t i = 0; i < group->size(); ++i )
+					{
+					datas[i] = ( *group )[i].second->data();
+					dataLengths[i] = ( *group )[i].second->size();
+					}
+				SHA256::HashMany( datas.data(), dataLengths.data(), group->size(), digests.data() );
+				for( size_t i = 0; i < group->size(); ++i )
+					{
+					const size_t index = ( *group )[i].first;
+					const std::shared_ptr<std::vector<u8>> &fileData = ( *group )[i].second;
+					batch->Complete( index, ReadEntityFromMemory( pThis, batch->Refs[index], fileData->data(), fileData->size(), fileData, nullptr, &digests[i] ) );
+					}
+				} );
+			};
+
+		// decode each entity on the read pool as soon as its file is read, while the rest of the reads are in flight
+		std::vector<bool> fileIsRead( readIndices.size(), false );
+		const Status status = reader.ReadFiles( readIndices.size(), locateFile, [pThis, batch, &readIndices, &fileIsRead, hashSmallFiles, &hashGroup, &submitHashGroup]( size_t readIndex, Status fileStatus, std::vector<u8> &&data )
 			{
-			// file open failed. if it is because the file already exists, that is ok
-			// all other issues, return error
-			DWORD errorCode = GetLastError();
-			if( errorCode != ERROR_FILE_EXISTS )
+			fileIsRead[readIndex] = true;
+			const size_t index = readIndices[readIndex];
+			if( fileStatus != Status::Ok )
 				{
-				// failed to open the file
-				return std::pair<entity_ref, Status>( {}, Status::ECantOpen );
+				batch->Complete( index, fileStatus );
+				return;
 				}
+
+			// cant be less in size than the size of the hash at the end
+			if( data.size() < sha256_hash_size )
+				{
+				batch->Complete( index, Status::ECorrupted );
+				return;
+				}
+
+			auto fileData = std::make_shared<std::vector<u8>>( std::move( data ) );
+			if( hashSmallFiles && fileData->size() <= EntityMaxBatchHashFileSize )
+				{
+				hashGroup->emplace_back( index, std::move( fileData ) );
+				if( hashGroup->size() == hashGroupSize )
+					{
+					submitHashGroup();
+					}
+				return;
+				}
+			pThis->ReadPool->Submit( [pThis, batch, index, fileData]()
+				{
+				batch->Complete( index, ReadEntityFromMemory( pThis, batch->Refs[index], fileData->data(), fileData->size(), fileData ) );
+				} );
+			} );
+
+		// decode the files of the last group, which was not filled
+		if( !hashGroup->empty() )
+			{
+			submitHashGroup();
 			}
 
-		// write the file
-		u64 bytesWritten = 0;
-		while( bytesWritten < totalBytesToWrite )
+		if( status != Status::Ok )
 			{
-			// check how much to write, capped at UINT_MAX
-			u64 bytesToWrite = std::min<u64>( totalBytesToWrite - bytesWritten, UINT_MAX );
+			// the reads were aborted, mark the entities which were never read as failed
+			for( size_t r = 0; r < readIndices.size(); ++r )
+				{
+				if( !fileIsRead[r] )
+					{
+					batch->Complete( readIndices[r], status );
+					}
+				}
+			}
+
+		batch->Release();
+		}
 
-			// write the bytes to file
-			DWORD numBytesWritten = 0;
-			if( !::WriteFile( fileHandle, &writeBuffer[bytesWritten], (DWORD)bytesToWrite, &numBytesWritten, nullptr ) )
+	std::shared_ptr<EntityHandler::BatchLoad> EntityHandler::NewBatchLoad( const std::vector<entity_ref> &refs )
+		{
+		// skip entities which are already loaded, and duplicates in the list
+		auto batch = std::make_shared<BatchLoad>();
+		std::unordered_set<entity_ref> uniqueRefs;
+		for( size_t i = 0; i < refs.size(); ++i )
+			{
+			if( uniqueRefs.insert( refs[i] ).second && !this->IsEntityLoadedForLoad( refs[i] ) )
+				{
+				batch->Refs.emplace_back( refs[i] );
+				}
+			}
+		batch->Handler = this;
+		batch->Statuses.resize( batch->Refs.size(), Status::Ok );
+		batch->Loads.resize( batch->Refs.size() );
+		batch->PendingCount = batch->Refs.size() + 1;
+		return batch;
+		}
+
+	std::future<Status> EntityHandler::LoadEntitiesAsync( const std::vector<entity_ref> &refs )
+		{
+		if( !this->ReadPool )
+			{
+			// not initialized, no pool to queue the request on
+			std::promise<Status> notInitialized;
+			notInitialized.set_value( Status::ENotInitialized );
+			return notInitialized.get_future();
+			}
+
+		auto batch = this->NewBatchLoad( refs );
+		std::future<Status> result = batch->Result.get_future();
+
+		// the read task does not wait for the decodes, so it can be run on the read pool as well
+		EntityHandler *pThis = this;
+		this->ReadPool->Submit( [pThis, batch]() { BatchReadTask( pThis, batch ); } );
+		return result;
+		}
+
+	Status EntityHandler::LoadEntities( const std::vector<entity_ref> &refs )
+		{
+		if( !this->ReadPool )
+			{
+			return Status::ENotInitialized;
+			}
+
+		// run the reads on the calling thread, so all of the read pool is free to decode the entities
+		auto batch = this->NewBatchLoad( refs );
+		std::future<Status> result = batch->Result.get_future();
+		BatchReadTask( this, batch );
+		return result.get();
+		}
+
+	// the state of a closure load, shared by the tasks which load the entities of the closure
+	struct EntityHandler::ClosureLoad
+		{
+		uint MaxDepth = 0;
+
+		// the smallest depth each entity is queued at. an entity is queued again if it is reached at a smaller depth
+		// through a shorter path, so its references within the max depth are loaded whichever path is walked first
+		std::unordered_map<entity_ref, uint> QueuedDepths;
+		std::mutex QueuedMutex;
+
+		// number of entities which are not done. when it drops to zero, the closure is loaded
+		std::atomic<size_t> PendingCount;
+		std::atomic<Status> FirstError;
+		std::promise<Status> Result;
+
+		// mark an entity as done, and set the result when all entities are done
+		void Complete( Status status )
+			{
+			if( status != Status::Ok )
+				{
+				Status noError = Status::Ok;
+				this->FirstError.compare_exchange_strong( noError, status );
+				}
+			if( this->PendingCount.fetch_sub( 1 ) == 1 )
+				{
+				this->Result.set_value( this->FirstError.load() );
+				}
+			}
+		};
+
+	void EntityHandler::ClosureReadTask( EntityHandler *pThis, std::shared_ptr<ClosureLoad> closure, const entity_ref ref, const uint depth )
+		{
+		// use the references of the loaded entity, or load it and collect the references while it is decoded
+		EntityReferences references = pThis->GetEntityReferencesForLoad( ref );
+		if( !references )
+			{
+			// if the entity is being loaded, continue on the read pool when the load is done, instead of loading it again
+			auto loadPromise = pThis->JoinOrAddLoad( ref, true, [pThis, closure, ref, depth]( Status status )
+				{
+				if( status != Status::Ok )
+					{
+					closure->Complete( status );
+					return;
+					}
+				pThis->ReadPool->Submit( [pThis, closure, ref, depth]() { ClosureReadTask( pThis, closure, ref, depth ); } );
+				} );
+			if( !loadPromise )
+				{
+				return;
+				}
+
+			const Status status = ReadTask( pThis, ref, &references );
+			FinishLoad( pThis, ref, std::move( loadPromise ), status );
+			if( status != Status::Ok )
+				{
+				closure->Complete( status );
+				return;
+				}
+			}
+
+		// queue the referenced entities which are not queued yet, or are queued at a larger depth, before this entity is marked as done.
+		// if the entity has been queued again at a smaller depth, that task queues the references instead
+		if( depth < closure->MaxDepth )
+			{
+			for( size_t i = 0; i < references->size(); ++i )
+				{
+				const entity_ref referencedRef = (*references)[i];
+					{
+					std::lock_guard<std::mutex> lock( closure->QueuedMutex );
+					if( closure->QueuedDepths[ref] < depth )
+						{
+						break;
+						}
+					const auto inserted = closure->QueuedDepths.emplace( referencedRef, depth + 1 );
+					if( !inserted.second )
+						{
+						if( inserted.first->second <= depth + 1 )
+							{
+							continue;
+							}
+						inserted.first->second = depth + 1;
+						}
+					}
+				++closure->PendingCount;
+				pThis->ReadPool->Submit( [pThis, closure, referencedRef, depth]() { ClosureReadTask( pThis, closure, referencedRef, depth + 1 ); } );
+				}
+			}
+
+		closure->Complete( Status::Ok );
+		}
+
+	std::future<Status> EntityHandler::LoadEntityClosureAsync( const entity_ref &ref, const uint maxDepth )
+		{
+		if( !this->ReadPool )
+			{
+			// not initialized, no pool to queue the request on
+			std::promise<Status> notInitialized;
+			notInitialized.set_value( Status::ENotInitialized );
+			return notInitialized.get_future();
+			}
+
+		auto closure = std::make_shared<ClosureLoad>();
+		closure->MaxDepth = maxDepth;
+		closure->QueuedDepths.emplace( ref, 0 );
+		closure->PendingCount = 1;
+		closure->FirstError = Status::Ok;
+		std::future<Status> result = closure->Result.get_future();
+
+		EntityHandler *pThis = this;
+		this->ReadPool->Submit( [pThis, closure, ref]() { ClosureReadTask( pThis, closure, ref, 0 ); } );
+		return result;
+		}
+
+	Status EntityHandler::LoadEntityClosure( const entity_ref &ref, const uint maxDepth )
+		{
+		if( !this->ReadPool )
+			{
+			return Status::ENotInitialized;
+			}
+
+		// load the first entity on the calling thread, the referenced entities are loaded on the read pool
+		auto closure = std::make_shared<ClosureLoad>();
+		closure->MaxDepth = maxDepth;
+		closure->QueuedDepths.emplace( ref, 0 );
+		closure->PendingCount = 1;
+		closure->FirstError = Status::Ok;
+		std::future<Status> result = closure->Result.get_future();
+		ClosureReadTask( this, closure, ref, 0 );
+		return result.get();
+		}
+
+	Status EntityHandler::UnloadNonReferencedEntities()
+		{
+		// lock one shard at a time, so lookups in the other shards can go on
+		for( uint shardIndex = 0; shardIndex <= this->EntityShardMask; ++shardIndex )
+			{
+			EntityShard &shard = this->EntityShards[shardIndex];
+			ctle::readers_writer_lock::write_guard guard( shard.Lock );
+
+			// walk the clock backwards, so erasing an entity only moves an entity which is already checked
+			for( size_t i = shard.Clock.size(); i > 0; --i )
+				{
+				// if this entity is only held by us, remove it, else skip to next
+				auto it = shard.Entities.find( shard.Clock[i - 1] );
+				if( it->second.Data.use_count() == 1 )
+					{
+					this->EraseEntity( shard, it );
+					}
+				}
+			}
+
+		return Status::Ok;
+		}
+
+
+	bool EntityHandler::IsEntityLoaded( const entity_ref &ref )
+		{
+		EntityShard &shard = this->GetEntityShard( ref );
+		ctle::readers_writer_lock::read_guard guard( shard.Lock );
+
+		return shard.Entities.find( ref ) != shard.Entities.end();
+		}
+
+	std::shared_ptr<const Entity> EntityHandler::GetLoadedEntity( const entity_ref &ref )
+		{
+		EntityShard &shard = this->GetEntityShard( ref );
+		ctle::readers_writer_lock::read_guard guard( shard.Lock );
+
+		const auto it = shard.Entities.find( ref );
+		if( it == shard.Entities.end() )
+			return nullptr;
+
+		it->second.Referenced = true;
+		return it->second.Data;
+		}
+
+	EntityHandler::CacheStatistics EntityHandler::GetCacheStatistics()
+		{
+		CacheStatistics statistics;
+		statistics.HitCount = this->CacheHitCount;
+		statistics.MissCount = this->CacheMissCount;
+		statistics.EvictionCount = this->CacheEvictionCount;
+		statistics.CoalescedCount = this->CacheCoalescedCount;
+		for( uint shardIndex = 0; shardIndex <= this->EntityShardMask; ++shardIndex )
+			{
+			EntityShard &shard = this->EntityShards[shardIndex];
+			ctle::readers_writer_lock::read_guard guard( shard.Lock );
+			statistics.EntityCount += shard.Entities.size();
+			}
+		statistics.EntityBytes = this->EntityBytes;
+		return statistics;
+		}
+
+	EntityHandler::VerifyStatistics EntityHandler::GetVerifyStatistics()
+		{
+		VerifyStatistics statistics;
+		statistics.VerifiedCount = this->VerifiedCount;
+		statistics.UnverifiedCount = this->UnverifiedCount;
+		statistics.CorruptedCount = this->CorruptedCount;
+		if( this->Scrubber )
+			{
+			statistics.ScrubbedEntityCount = this->Scrubber->GetScrubbedEntityCount();
+			statistics.ScrubbedByteCount = this->Scrubber->GetScrubbedByteCount();
+			statistics.ScrubPassCount = this->Scrubber->GetPassCount();
+			}
+		return statistics;
+		}
+
+	Status EntityHandler::SerializeEntity( EntityHandler *pThis, const Entity *entity, MemoryWriteStream &wstream, hash &digest )
+		{
+		EntityValidator validator;
+
+		// make sure the entity is valid
+		if( !entityValidate( pThis->Records , entity, validator ) )
+			return Status::ECorrupted;
+		if( validator.GetErrorCount() > 0 )
+			return Status::EInvalid;
+
+		wstream.SetPayloadAlignment( pThis->HandlerSettings.PayloadAlignment );
+
+		// if set, measure the entity first, and then write and hash the data in one pass. 
+		// entities which are large enough to spill are written and hashed in one pass to the spill file
+		const u64 spillToFileSize = pThis->HandlerSettings.SpillToFileSize;
+		if( pThis->HandlerSettings.UseSinglePassHashing || spillToFileSize != 0 )
+			{
+			wstream.BeginMeasure();
+			if( !entityWriteFile( pThis->Records , entity, wstream, pThis->HandlerSettings.UseTableOfContents, pThis->HandlerSettings.UseInternedKeys ) )
+				return Status::EUndefined;
+			if( spillToFileSize != 0 && wstream.GetSize() >= spillToFileSize )
+				return SpillEntity( pThis, entity, wstream, digest );
+			wstream.BeginHashedWrite();
+			if( !entityWriteFile( pThis->Records , entity, wstream, pThis->HandlerSettings.UseTableOfContents, pThis->HandlerSettings.UseInternedKeys ) )
+				return Status::EUndefined;
+			if( !wstream.EndHashedWrite( digest ) )
+				return Status::EUndefined;
+			return Status::Ok;
+			}
+
+		// serialize to a stream
+		if( !entityWriteFile( pThis->Records , entity, wstream, pThis->HandlerSettings.UseTableOfContents, pThis->HandlerSettings.UseInternedKeys ) )
+			return Status::EUndefined;
+
+		// calculate the sha256 hash on the data, segment by segment
+		SHA256 sha;
+		for( size_t i = 0; i < wstream.GetSegmentCount(); ++i )
+			{
+			sha.Update( wstream.GetSegmentData( i ), (size_t)wstream.GetSegmentSize( i ) );
+			}
+		sha.GetDigest( digest.digest );
+
+		return Status::Ok;
+		}
+
+	// checks if the entity file exists, with the size of the entity data. since the file is named by the hash of the data, 
+	// a file with another size is a file which was left partially written, and is replaced when the entity is written.
+	static bool isEntityFileStored( EntityDirectory &directory, const hash &digest, u64 size )
+		{
+		u64 fileSize = 0;
+		return directory.GetFileSize( digest, fileSize ) && fileSize == size;
+		}
+
+	Status EntityHandler::SpillEntity( EntityHandler *pThis, const Entity *entity, MemoryWriteStream &wstream, hash &digest )
+		{
+		// the hash is not known until the data is written, so write to a new temp file, which is owned by this process
+		if( !wstream.BeginSpill( pThis->Path + "/spill-", ".tmp" ) )
+			return Status::ECantOpen;
+		const std::string &spillFilePath = wstream.GetSpillFilePath();
+
+		// write and hash the measured entity to the file
+		wstream.BeginHashedWrite();
+		const bool written = entityWriteFile( pThis->Records , entity, wstream, pThis->HandlerSettings.UseTableOfContents, pThis->HandlerSettings.UseInternedKeys ) 
+			&& wstream.EndHashedWrite( digest );
+		if( !wstream.EndSpill() )
+			{
+			::remove( spillFilePath.c_str() );
+			return Status::ECantWrite;
+			}
+		if( !written )
+			{
+			::remove( spillFilePath.c_str() );
+			return Status::EUndefined;
+			}
+		return Status::Ok;
+		}
+
+	std::pair<entity_ref, Status> EntityHandler::MoveSpilledEntity( EntityHandler *pThis, const std::shared_ptr<const Entity> &entity, MemoryWriteStream &wstream, const hash &digest )
+		{
+		const std::string &spillFilePath = wstream.GetSpillFilePath();
+		const u64 size = wstream.GetSize();
+
+		// if the entity is already stored, the spill file is not needed. a file with another size was left partially written, and is replaced
+		if( pThis->IsEntityLoaded( entity_ref( digest ) ) || isEntityFileStored( *pThis->Directory, digest, size ) )
+			{
+			::remove( spillFilePath.c_str() );
+			pThis->InsertEntity( entity_ref( digest ), entity, size );
+			return std::pair<entity_ref, Status>( entity_ref( digest ), Status::WAlreadyExists );
+			}
+
+		// move the complete file into place, replacing a partially written file. if the move fails, the entity is 
+		// only stored if a concurrent write of the same entity finished first
+#ifdef _MSC_VER
+		const Status directoryStatus = pThis->Directory->MakeDirectory( digest );
+		if( directoryStatus != Status::Ok )
+			{
+			::remove( spillFilePath.c_str() );
+			return std::pair<entity_ref, Status>( {}, directoryStatus );
+			}
+		const bool moved = ::MoveFileExA( spillFilePath.c_str(), pThis->Directory->GetFilePath( digest ).c_str(), MOVEFILE_REPLACE_EXISTING ) != 0;
+#else
+		char fileName[EntityDirectory::FileNameSize];
+		const int directoryDescriptor = pThis->Directory->GetFileLocation( digest, true, fileName );
+		if( directoryDescriptor < 0 )
+			{
+			::remove( spillFilePath.c_str() );
+			return std::pair<entity_ref, Status>( {}, Status::ECantWrite );
+			}
+		const bool moved = ::renameat( AT_FDCWD, spillFilePath.c_str(), directoryDescriptor, fileName ) == 0;
+#endif
+		if( !moved )
+			{
+			::remove( spillFilePath.c_str() );
+			if( !isEntityFileStored( *pThis->Directory, digest, size ) )
 				{
-				// failed to write
 				return std::pair<entity_ref, Status>( {}, Status::ECantWrite );
 				}
+			pThis->InsertEntity( entity_ref( digest ), entity, size );
+			return std::pair<entity_ref, Status>( entity_ref( digest ), Status::WAlreadyExists );
+			}
 
-			// update number of bytes that were read
-			bytesWritten += numBytesWritten;
+		pThis->InsertEntity( entity_ref( digest ), entity, size );
+		return std::pair<entity_ref, Status>( entity_ref( digest ), Status::Ok );
+		}
+
+	// writes all segments of the stream to the file, a segmented stream is written with gathered writes
+#ifdef _MSC_VER
+	static bool writeStreamToFile( HANDLE fileHandle, const MemoryWriteStream &wstream )
+		{
+		for( size_t i = 0; i < wstream.GetSegmentCount(); ++i )
+			{
+			const u8 *writeBuffer = wstream.GetSegmentData( i );
+			const u64 totalBytesToWrite = wstream.GetSegmentSize( i );
+			u64 bytesWritten = 0;
+			while( bytesWritten < totalBytesToWrite )
+				{
+				// check how much to write, capped at UINT_MAX
+				u64 bytesToWrite = std::min<u64>( totalBytesToWrite - bytesWritten, UINT_MAX );
+
+				// write the bytes to file
+				DWORD numBytesWritten = 0;
+				if( !::WriteFile( fileHandle, &writeBuffer[bytesWritten], (DWORD)bytesToWrite, &numBytesWritten, nullptr ) )
+					{
+					return false;
+					}
+
+				// update number of bytes that were read
+				bytesWritten += numBytesWritten;
+				}
+			}
+		return true;
+		}
+#else
+	static bool writeStreamToFile( int fileDescriptor, const MemoryWriteStream &wstream )
+		{
+		std::vector<iovec> segments( wstream.GetSegmentCount() );
+		for( size_t i = 0; i < segments.size(); ++i )
+			{
+			segments[i].iov_base = (void *)wstream.GetSegmentData( i );
+			segments[i].iov_len = (size_t)wstream.GetSegmentSize( i );
+			}
+
+		// write the segments, at most IOV_MAX per call, and continue after the last written byte on partial writes
+		size_t segmentIndex = 0;
+		while( segmentIndex < segments.size() )
+			{
+			const int segmentCount = (int)std::min<size_t>( segments.size() - segmentIndex, IOV_MAX );
+			ssize_t ret = ::writev( fileDescriptor, &segments[segmentIndex], segmentCount );
+			if( ret < 0 && errno == EINTR )
+				{
+				continue;
+				}
+			if( ret <= 0 )
+				{
+				return false;
+				}
+			while( ret > 0 )
+				{
+				const size_t segmentBytes = std::min<size_t>( (size_t)ret, segments[segmentIndex].iov_len );
+				segments[segmentIndex].iov_base = (u8 *)segments[segmentIndex].iov_base + segmentBytes;
+				segments[segmentIndex].iov_len -= segmentBytes;
+				ret -= (ssize_t)segmentBytes;
+				if( segments[segmentIndex].iov_len == 0 )
+					{
+					++segmentIndex;
+					}
+				}
+			}
+		return true;
+		}
+#endif
+
+	std::pair<entity_ref, Status> EntityHandler::WriteTask( EntityHandler *pThis, std::shared_ptr<const Entity> entity )
+		{
+		PooledWriteStream wstream( pThis->WriteStreams.get() );
+		hash digest = {};
+		const Status serializeStatus = SerializeEntity( pThis, entity.get(), *wstream, digest );
+		if( serializeStatus != Status::Ok )
+			return std::pair<entity_ref, Status>( {}, serializeStatus );
+
+		// a spilled entity is already written to the spill file
+		if( wstream->IsSpilled() )
+			return MoveSpilledEntity( pThis, entity, *wstream, digest );
+
+		// a loaded entity is already stored, so there is nothing to write
+		if( pThis->IsEntityLoaded( entity_ref( digest ) ) )
+			return std::pair<entity_ref, Status>( entity_ref( digest ), Status::WAlreadyExists );
+
+		// get file data
+		const u64 totalBytesToWrite = wstream->GetSize();
+
+		// if set, append to the packfiles. if the entity is already stored, there is nothing to write
+		// Note! segmented streams are not combined with packfiles, so the stream is contiguous
+		if( pThis->Packfiles )
+			{
+			pdsSanityCheckDebugMacro( !wstream->IsSegmented() );
+			const Status status = pThis->Packfiles->Write( digest, (const u8 *)wstream->GetData(), totalBytesToWrite );
+			if( status != Status::Ok && status != Status::WAlreadyExists )
+				{
+				return std::pair<entity_ref, Status>( {}, status );
+				}
+
+			pThis->InsertEntity( entity_ref( digest ), entity, totalBytesToWrite );
+			return std::pair<entity_ref, Status>( entity_ref( digest ), status );
 			}
 
-		::CloseHandle( fileHandle );
+		// if the file exists with the size of the entity, the entity is already stored, and the write is skipped
+		if( isEntityFileStored( *pThis->Directory, digest, totalBytesToWrite ) )
+			{
+			pThis->InsertEntity( entity_ref( digest ), entity, totalBytesToWrite );
+			return std::pair<entity_ref, Status>( entity_ref( digest ), Status::WAlreadyExists );
+			}
+
+		// write the data to a new temp file next to the entity file, and rename it into place when it is complete, so the
+		// entity file is never partially written. a file which was left partially written by a crash is replaced. 
+#ifdef _MSC_VER
+		const Status directoryStatus = pThis->Directory->MakeDirectory( digest );
+		if( directoryStatus != Status::Ok )
+			{
+			return std::pair<entity_ref, Status>( {}, directoryStatus );
+			}
+		const std::string filePath = pThis->Directory->GetFilePath( digest );
+		std::string tempFilePath;
+		HANDLE fileHandle = create_temp_file( filePath + ".tmp-", "", tempFilePath );
+		if( fileHandle == INVALID_HANDLE_VALUE )
+			{
+			return std::pair<entity_ref, Status>( {}, Status::ECantOpen );
+			}
+		const bool written = writeStreamToFile( fileHandle, *wstream );
+		const bool closed = ::CloseHandle( fileHandle ) != 0;
+		if( !written || !closed || !::MoveFileExA( tempFilePath.c_str(), filePath.c_str(), MOVEFILE_REPLACE_EXISTING ) )
+			{
+			// failed to write, remove the partial file so the entity can be added again
+			::DeleteFileA( tempFilePath.c_str() );
+			return std::pair<entity_ref, Status>( {}, Status::ECantWrite );
+			}
 #else
-		// create the file
-		// we can't check if the file already exists (need to use Linux specific code)
-		std::ofstream file( filePath.c_str(), std::ios::out | std::ios::binary );
-		if( !file.is_open() )
+		// the file names are built on the stack, and the files are created and renamed relative to the open directory
+		char fileName[EntityDirectory::FileNameSize];
+		const int directoryDescriptor = pThis->Directory->GetFileLocation( digest, true, fileName );
+		if( directoryDescriptor < 0 )
+			{
+			return std::pair<entity_ref, Status>( {}, Status::ECantWrite );
+			}
+		char tempFileName[TempFileNameSize];
+		const int fileDescriptor = create_temp_file_at( directoryDescriptor, fileName, ".tmp-", tempFileName );
+		if( fileDescriptor < 0 )
 			{
-			// failed to open the file
 			return std::pair<entity_ref, Status>( {}, Status::ECantOpen );
 			}
-
-		// write the file
-		file.write( (const char*)writeBuffer , totalBytesToWrite );
-		if( (u64)file.tellp() != totalBytesToWrite )
+		const bool written = writeStreamToFile( fileDescriptor, *wstream );
+		const bool closed = ::close( fileDescriptor ) == 0;
+		if( !written || !closed || ::renameat( directoryDescriptor, tempFileName, directoryDescriptor, fileName ) != 0 )
 			{
-			// failed to write full file
+			// failed to write, remove the partial file so the entity can be added again
+			::unlinkat( directoryDescriptor, tempFileName, 0 );
 			return std::pair<entity_ref, Status>( {}, Status::ECantWrite );
 			}
-		file.close();
 #endif
 
 		// transfer into the Entities map 
-		pThis->InsertEntity( entity_ref( digest ), entity );
+		pThis->InsertEntity( entity_ref( digest ), entity, totalBytesToWrite );
 
 		// done
 		return std::pair<entity_ref, Status>( entity_ref( digest ), Status::Ok );
 		}
 
+	void EntityHandler::DurableWriteTask( EntityHandler *pThis, std::shared_ptr<const Entity> entity, std::shared_ptr<std::promise<std::pair<entity_ref, Status>>> result )
+		{
+		PooledWriteStream wstream( pThis->WriteStreams.get() );
+		hash digest = {};
+		Status status = SerializeEntity( pThis, entity.get(), *wstream, digest );
+		if( status != Status::Ok )
+			{
+			result->set_value( std::pair<entity_ref, Status>( {}, status ) );
+			return;
+			}
+
+		// skip the write if the entity is already stored. entity files are only renamed into place when they are
+		// complete, the size check catches files which were left partially written by older versions
+		if( pThis->IsEntityLoaded( entity_ref( digest ) ) || isEntityFileStored( *pThis->Directory, digest, wstream->GetSize() ) )
+			{
+			pThis->InsertEntity( entity_ref( digest ), entity, wstream->GetSize() );
+			result->set_value( std::pair<entity_ref, Status>( entity_ref( digest ), Status::WAlreadyExists ) );
+			return;
+			}
+
+		// write to a temp file, and complete when the group commit which renames it into place is durable
+		status = pThis->Directory->MakeDirectory( digest );
+		if( status != Status::Ok )
+			{
+			result->set_value( std::pair<entity_ref, Status>( {}, status ) );
+			return;
+			}
+		// Note! segmented streams are not combined with durable writes, so the stream is contiguous
+		pdsSanityCheckDebugMacro( !wstream->IsSegmented() );
+		const std::string fileName = pThis->Directory->GetRelativeFilePath( digest );
+		const u64 size = wstream->GetSize();
+		status = pThis->CommitQueue->Write( fileName, (const u8 *)wstream->GetData(), size, [pThis, entity, digest, size, result]( Status commitStatus )
+			{
+			if( commitStatus != Status::Ok )
+				{
+				result->set_value( std::pair<entity_ref, Status>( {}, commitStatus ) );
+				return;
+				}
+
+			// transfer into the Entities map 
+			pThis->InsertEntity( entity_ref( digest ), entity, size );
+			result->set_value( std::pair<entity_ref, Status>( entity_ref( digest ), Status::Ok ) );
+			} );
+		if( status != Status::Ok )
+			{
+			result->set_value( std::pair<entity_ref, Status>( {}, status ) );
+			}
+		}
+
 	std::future<std::pair<entity_ref, Status>> EntityHandler::AddEntityAsync( const std::shared_ptr<const Entity> &entity )
 		{
-		return std::async( WriteTask, this, entity );
+		if( !this->WritePool )
+			{
+			// not initialized, no pool to queue the request on
+			std::promise<std::pair<entity_ref, Status>> notInitialized;
+			notInitialized.set_value( std::pair<entity_ref, Status>( {}, Status::ENotInitialized ) );
+			return notInitialized.get_future();
+			}
+
+		if( this->CommitQueue )
+			{
+			// the future is completed by the group commit, not when the task is done
+			auto result = std::make_shared<std::promise<std::pair<entity_ref, Status>>>();
+			std::future<std::pair<entity_ref, Status>> futr = result->get_future();
+			this->WritePool->Submit( [this, entity, result]() { DurableWriteTask( this, entity, result ); } );
+			return futr;
+			}
+
+		return this->WritePool->Submit( [this, entity]() { return WriteTask( this, entity ); } );
 		}
 
 	std::pair<entity_ref, Status> EntityHandler::AddEntity( const std::shared_ptr<const Entity> &entity )
 		{
-		auto futr = this->AddEntityAsync( entity );
-		futr.wait();
-		return futr.get();
+		if( this->Path.empty() )
+			{
+			return std::pair<entity_ref, Status>( {}, Status::ENotInitialized );
+			}
+
+		// the caller waits for the result anyway, so write directly on the calling thread
+		if( this->CommitQueue )
+			{
+			auto result = std::make_shared<std::promise<std::pair<entity_ref, Status>>>();
+			std::future<std::pair<entity_ref, Status>> futr = result->get_future();
+			DurableWriteTask( this, entity, result );
+			return futr.get();
+			}
+		return WriteTask( this, entity );
 		}
 
 	}
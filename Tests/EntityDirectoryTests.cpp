@@ -0,0 +1,161 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Tests.h"
+
+#include <pds/EntityDirectory.h>
+
+#include "TestHelpers/structure_generation.h"
+
+using TestPackA::TestEntityA;
+
+static bool FileExists( const std::string &path )
+	{
+	FILE *file = fopen( path.c_str(), "rb" );
+	if( !file )
+		{
+		return false;
+		}
+	fclose( file );
+	return true;
+	}
+
+// loads the entities with a new handler set up with the settings, and compares them to the added entities
+static void LoadAndCompareEntities( const std::string &path, const EntityHandler::Settings &settings, const std::vector<entity_ref> &refs, const std::vector<std::shared_ptr<TestEntityA>> &entities )
+	{
+	EntityHandler handler;
+	EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+	EXPECT_EQ( handler.LoadEntities( refs ), Status::Ok );
+	for( size_t i = 0; i < refs.size(); ++i )
+		{
+		// load one by one as well, with a handler which has nothing loaded
+		EntityHandler singleHandler;
+		EXPECT_EQ( singleHandler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		EXPECT_EQ( singleHandler.LoadEntity( refs[i] ), Status::Ok );
+
+		auto loaded = std::dynamic_pointer_cast<const TestEntityA>( handler.GetLoadedEntity( refs[i] ) );
+		EXPECT_TRUE( loaded != nullptr );
+		if( loaded )
+			{
+			EXPECT_TRUE( TestEntityA::MF::Equals( loaded.get(), entities[i].get() ) );
+			}
+		}
+	}
+
+// lists the entities of the store at path, and checks that they are the same as refs
+static void ListAndCompareEntities( const std::string &path, bool useFanOut, const std::vector<entity_ref> &refs )
+	{
+	EntityDirectory directory;
+	EXPECT_EQ( directory.Initialize( path, useFanOut ), Status::Ok );
+	std::vector<hash> ids;
+	EXPECT_EQ( directory.ListEntities( ids ), Status::Ok );
+	EXPECT_EQ( ids.size(), refs.size() );
+	const std::unordered_set<hash> listed( ids.begin(), ids.end() );
+	for( size_t i = 0; i < refs.size(); ++i )
+		{
+		EXPECT_TRUE( listed.find( hash( refs[i] ) ) != listed.end() );
+		}
+	}
+
+TEST( EntityDirectoryTests , FileNames )
+	{
+	hash id = {};
+	for( size_t i = 0; i < 32; ++i )
+		{
+		id.digest[i] = u8( i * 8 + 7 );
+		}
+	const std::string hexName = value_to_hex_string( id );
+
+	EntityDirectory flat;
+	EXPECT_EQ( flat.Initialize( "./TestFolder", false ), Status::Ok );
+	EXPECT_EQ( flat.GetRelativeFilePath( id ), hexName + ".dat" );
+	EXPECT_EQ( flat.GetFilePath( id ), "./TestFolder/" + hexName + ".dat" );
+
+	EntityDirectory fanOut;
+	EXPECT_EQ( fanOut.Initialize( "./TestFolder", true ), Status::Ok );
+	EXPECT_EQ( fanOut.GetRelativeFilePath( id ), hexName.substr( 0, 2 ) + "/" + hexName.substr( 2 ) + ".dat" );
+	char fileName[EntityDirectory::FileNameSize];
+	fanOut.GetFileName( id, fileName );
+	EXPECT_EQ( std::string( fileName ), hexName.substr( 2 ) + ".dat" );
+
+	EntityDirectory missing;
+	EXPECT_EQ( missing.Initialize( "./TestFolder/does-not-exist", true ), Status::ECantOpen );
+	}
+
+TEST( EntityDirectoryTests , FanOutAndMigrate )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "FanOutAndMigrate" );
+	const size_t entity_count = 50;
+
+	// add entities to a flat store
+	std::vector<std::shared_ptr<TestEntityA>> entities;
+	std::vector<entity_ref> refs;
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		for( size_t i = 0; i < entity_count; ++i )
+			{
+			entities.emplace_back( GenerateRandomTestEntityA( 0, 20 ) );
+			const auto ret = handler.AddEntity( entities.back() );
+			EXPECT_EQ( ret.second, Status::Ok );
+			refs.emplace_back( ret.first );
+			}
+		}
+	const std::string flatName = value_to_hex_string( hash( refs[0] ) );
+	EXPECT_TRUE( FileExists( path + "/" + flatName + ".dat" ) );
+	ListAndCompareEntities( path, false, refs );
+
+	// migrate into the fan-out layout
+	u64 movedCount = 0;
+	EXPECT_EQ( EntityDirectory::MigrateToFanOut( path, &movedCount ), Status::Ok );
+	EXPECT_EQ( movedCount, u64( entity_count ) );
+	EXPECT_FALSE( FileExists( path + "/" + flatName + ".dat" ) );
+	EXPECT_TRUE( FileExists( path + "/" + flatName.substr( 0, 2 ) + "/" + flatName.substr( 2 ) + ".dat" ) );
+
+	// migrating again moves nothing
+	EXPECT_EQ( EntityDirectory::MigrateToFanOut( path, &movedCount ), Status::Ok );
+	EXPECT_EQ( movedCount, u64( 0 ) );
+	ListAndCompareEntities( path, true, refs );
+
+	EntityHandler::Settings settings;
+	settings.UseFanOutDirectories = true;
+	LoadAndCompareEntities( path, settings, refs, entities );
+	settings.UseMemoryMappedFiles = true;
+	LoadAndCompareEntities( path, settings, refs, entities );
+
+	// add more entities directly into the fan-out layout, with plain and durable writes
+	for( uint durable = 0; durable < 2; ++durable )
+		{
+		EntityHandler::Settings addSettings;
+		addSettings.UseFanOutDirectories = true;
+		addSettings.UseDurableWrites = ( durable != 0 );
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, addSettings ), Status::Ok );
+
+		std::vector<std::future<std::pair<entity_ref, Status>>> addFutures;
+		for( size_t i = 0; i < entity_count; ++i )
+			{
+			entities.emplace_back( GenerateRandomTestEntityA( 0, 20 ) );
+			addFutures.emplace_back( handler.AddEntityAsync( entities.back() ) );
+			}
+		for( size_t i = 0; i < addFutures.size(); ++i )
+			{
+			const auto ret = addFutures[i].get();
+			EXPECT_EQ( ret.second, Status::Ok );
+			refs.emplace_back( ret.first );
+
+			const std::string name = value_to_hex_string( hash( ret.first ) );
+			EXPECT_TRUE( FileExists( path + "/" + name.substr( 0, 2 ) + "/" + name.substr( 2 ) + ".dat" ) );
+			}
+
+		// the existing entities are found in the fan-out layout
+		EntityHandler existingHandler;
+		EXPECT_EQ( existingHandler.Initialize( path, { TestPackA::GetPackageRecord() }, addSettings ), Status::Ok );
+		EXPECT_EQ( existingHandler.AddEntity( entities[0] ).second, Status::WAlreadyExists );
+		}
+
+	settings.UseMemoryMappedFiles = false;
+	LoadAndCompareEntities( path, settings, refs, entities );
+	}
@@ -0,0 +1,1373 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Tests.h"
+
+#include <thread>
+#include <chrono>
+#include <mutex>
+
+#include <pds/TempFile.h>
+
+#include "TestHelpers/structure_generation.h"
+#include "TestPackA/TestEntityC.h"
+
+using TestPackA::TestEntityA;
+using TestPackA::TestEntityC;
+
+// adds random entities with one handler, and loads them back using a second handler set up with the settings
+static void TestEntityHandlerAddAndLoad( const EntityHandler::Settings &settings )
+	{
+	const size_t entity_count = 10;
+
+	EntityHandler writeHandler;
+	EXPECT_EQ( writeHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+
+	std::vector<std::shared_ptr<TestEntityA>> entities;
+	std::vector<entity_ref> refs;
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		entities.emplace_back( GenerateRandomTestEntityA( 0, 100 ) );
+		const auto ret = writeHandler.AddEntity( entities.back() );
+		EXPECT_TRUE( IsAddedStatus( ret.second ) );
+		refs.emplace_back( ret.first );
+		}
+
+	EntityHandler readHandler;
+	EXPECT_EQ( readHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		EXPECT_EQ( readHandler.LoadEntity( refs[i] ), Status::Ok );
+		auto loaded = std::dynamic_pointer_cast<const TestEntityA>( readHandler.GetLoadedEntity( refs[i] ) );
+		EXPECT_TRUE( loaded != nullptr );
+		if( loaded )
+			{
+			EXPECT_TRUE( TestEntityA::MF::Equals( loaded.get(), entities[i].get() ) );
+			}
+		}
+
+	// a reference to a file which does not exist should fail to open
+	EXPECT_EQ( readHandler.LoadEntity( entity_ref( hash_rand() ) ), Status::ECantOpen );
+	}
+
+TEST( EntityHandlerTests , AddAndLoadEntities )
+	{
+	setup_random_seed();
+
+	EntityHandler::Settings settings;
+	TestEntityHandlerAddAndLoad( settings );
+	}
+
+TEST( EntityHandlerTests , AddAndLoadEntitiesMemoryMapped )
+	{
+	setup_random_seed();
+
+	EntityHandler::Settings settings;
+	settings.UseMemoryMappedFiles = true;
+	TestEntityHandlerAddAndLoad( settings );
+	}
+
+TEST( EntityHandlerTests , AddAndLoadEntitiesLazySections )
+	{
+	setup_random_seed();
+
+	EntityHandler::Settings settings;
+	settings.UseLazySections = true;
+	TestEntityHandlerAddAndLoad( settings );
+	settings.UseMemoryMappedFiles = true;
+	TestEntityHandlerAddAndLoad( settings );
+	}
+
+TEST( EntityHandlerTests , AddAndLoadEntitiesStreamed )
+	{
+	setup_random_seed();
+
+	EntityHandler::Settings settings;
+	settings.StreamedLoadSize = 1;
+	TestEntityHandlerAddAndLoad( settings );
+	}
+
+TEST( EntityHandlerTests , AddExistingEntity )
+	{
+	setup_random_seed();
+
+	auto testAddExisting = [&]( const EntityHandler::Settings &settings )
+		{
+		const std::shared_ptr<TestEntityA> entity = GenerateRandomTestEntityA( 0, 20 );
+
+		EntityHandler firstHandler;
+		EXPECT_EQ( firstHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		const auto first = firstHandler.AddEntity( entity );
+		EXPECT_TRUE( IsAddedStatus( first.second ) );
+
+		// the entity is loaded in the handler, so it is found without touching the file
+		const auto loaded = firstHandler.AddEntity( entity );
+		EXPECT_EQ( loaded.second, Status::WAlreadyExists );
+		EXPECT_EQ( loaded.first, first.first );
+
+		// cut the file short, like a file which was partially written when the system crashed. since the 
+		// file does not have the size of the entity, a new handler writes the entity again, and replaces the file
+		const std::string filePath = "./TestFolder/" + value_to_hex_string( hash( first.first ) ) + ".dat";
+		FILE *file = fopen( filePath.c_str(), "rb" );
+		ASSERT_TRUE( file != nullptr );
+		fseek( file, 0, SEEK_END );
+		const size_t fileSize = (size_t)ftell( file );
+		fclose( file );
+		file = fopen( filePath.c_str(), "wb" );
+		ASSERT_TRUE( file != nullptr );
+		const std::vector<u8> junk( fileSize, 0 );
+		fwrite( junk.data(), 1, fileSize / 2, file );
+		fclose( file );
+
+			{
+			EntityHandler repairHandler;
+			EXPECT_EQ( repairHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+			EXPECT_EQ( repairHandler.AddEntity( entity ).second, Status::Ok );
+			EntityHandler repairedHandler;
+			EXPECT_EQ( repairedHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+			EXPECT_EQ( repairedHandler.LoadEntity( first.first ), Status::Ok );
+			}
+
+		// replace the file with data of the same size which is not an entity. since the file exists with the size
+		// of the entity, a new handler does not write the entity again, which shows in that the load fails the hash check
+		file = fopen( filePath.c_str(), "wb" );
+		ASSERT_TRUE( file != nullptr );
+		fwrite( junk.data(), 1, fileSize, file );
+		fclose( file );
+
+		EntityHandler secondHandler;
+		EXPECT_EQ( secondHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		const auto existing = secondHandler.AddEntity( entity );
+		EXPECT_EQ( existing.second, Status::WAlreadyExists );
+		EXPECT_EQ( existing.first, first.first );
+		EXPECT_TRUE( secondHandler.IsEntityLoaded( existing.first ) );
+
+		EntityHandler readHandler;
+		EXPECT_EQ( readHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+		EXPECT_EQ( readHandler.LoadEntity( first.first ), Status::ECorrupted );
+
+		// remove the junk file, so the entity is written again by the next add
+		remove( filePath.c_str() );
+		EXPECT_EQ( readHandler.AddEntity( entity ).second, Status::Ok );
+		EntityHandler verifyHandler;
+		EXPECT_EQ( verifyHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+		EXPECT_EQ( verifyHandler.LoadEntity( first.first ), Status::Ok );
+		};
+
+	EntityHandler::Settings settings;
+	testAddExisting( settings );
+	settings.UseDurableWrites = true;
+	testAddExisting( settings );
+	}
+
+TEST( EntityHandlerTests , AddAndLoadEntitiesAsync )
+	{
+	setup_random_seed();
+
+	const size_t entity_count = 100;
+
+	EntityHandler::Settings settings;
+	settings.ReadThreadCount = 2;
+	settings.WriteThreadCount = 2;
+
+	EntityHandler writeHandler;
+	EXPECT_EQ( writeHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+	// queue all adds at once, more than there are worker threads
+	std::vector<std::shared_ptr<TestEntityA>> entities;
+	std::vector<std::future<std::pair<entity_ref, Status>>> addFutures;
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		entities.emplace_back( GenerateRandomTestEntityA( 0, 20 ) );
+		addFutures.emplace_back( writeHandler.AddEntityAsync( entities.back() ) );
+		}
+	std::vector<entity_ref> refs;
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		const auto ret = addFutures[i].get();
+		EXPECT_TRUE( IsAddedStatus( ret.second ) );
+		refs.emplace_back( ret.first );
+		}
+
+	EntityHandler readHandler;
+	EXPECT_EQ( readHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+	std::vector<std::shared_future<Status>> loadFutures;
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		loadFutures.emplace_back( readHandler.LoadEntityAsync( refs[i] ) );
+		}
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		EXPECT_EQ( loadFutures[i].get(), Status::Ok );
+		auto loaded = std::dynamic_pointer_cast<const TestEntityA>( readHandler.GetLoadedEntity( refs[i] ) );
+		EXPECT_TRUE( loaded != nullptr );
+		if( loaded )
+			{
+			EXPECT_TRUE( TestEntityA::MF::Equals( loaded.get(), entities[i].get() ) );
+			}
+		}
+
+	// queued requests are finished when the handler is destroyed
+	std::shared_future<Status> pendingLoad;
+		{
+		EntityHandler shortLivedHandler;
+		EXPECT_EQ( shortLivedHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		pendingLoad = shortLivedHandler.LoadEntityAsync( refs[0] );
+		}
+	EXPECT_EQ( pendingLoad.get(), Status::Ok );
+
+	// concurrent requests for an entity which is being loaded share the load
+		{
+		const size_t request_count = 32;
+		EntityHandler::Settings coalesceSettings = settings;
+		coalesceSettings.ReadThreadCount = 1;
+		EntityHandler coalesceHandler;
+		EXPECT_EQ( coalesceHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, coalesceSettings ), Status::Ok );
+		std::vector<std::shared_future<Status>> requestFutures;
+		for( size_t i = 0; i < request_count; ++i )
+			{
+			requestFutures.emplace_back( coalesceHandler.LoadEntityAsync( refs[1] ) );
+			}
+		EXPECT_EQ( coalesceHandler.LoadEntity( refs[1] ), Status::Ok );
+		for( size_t i = 0; i < request_count; ++i )
+			{
+			EXPECT_EQ( requestFutures[i].get(), Status::Ok );
+			}
+		const EntityHandler::CacheStatistics statistics = coalesceHandler.GetCacheStatistics();
+		EXPECT_EQ( statistics.HitCount + statistics.MissCount, u64( request_count + 1 ) );
+		EXPECT_LE( statistics.CoalescedCount, statistics.MissCount - 1 );
+		EXPECT_EQ( statistics.EntityCount, u64( 1 ) );
+
+		// a failed load is not kept, so it is tried again by the next request
+		const entity_ref missingRef = entity_ref( hash_rand() );
+		EXPECT_EQ( coalesceHandler.LoadEntityAsync( missingRef ).get(), Status::ECantOpen );
+		EXPECT_EQ( coalesceHandler.LoadEntity( missingRef ), Status::ECantOpen );
+		}
+
+	// batch and closure loads join the loads in flight as well, so each entity is only read (and verified) once
+		{
+		const size_t join_count = 8;
+		const std::vector<entity_ref> joinRefs( refs.begin(), refs.begin() + join_count );
+		EntityHandler joinHandler;
+		EXPECT_EQ( joinHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		std::vector<std::shared_future<Status>> requestFutures;
+		std::vector<std::future<Status>> groupFutures;
+		for( size_t pass = 0; pass < 4; ++pass )
+			{
+			for( size_t i = 0; i < join_count; ++i )
+				{
+				requestFutures.emplace_back( joinHandler.LoadEntityAsync( joinRefs[i] ) );
+				}
+			groupFutures.emplace_back( joinHandler.LoadEntitiesAsync( joinRefs ) );
+			groupFutures.emplace_back( joinHandler.LoadEntityClosureAsync( joinRefs[pass], 0 ) );
+			}
+		EXPECT_EQ( joinHandler.LoadEntities( joinRefs ), Status::Ok );
+		EXPECT_EQ( joinHandler.LoadEntityClosure( joinRefs[0], 0 ), Status::Ok );
+		for( size_t i = 0; i < requestFutures.size(); ++i )
+			{
+			EXPECT_EQ( requestFutures[i].get(), Status::Ok );
+			}
+		for( size_t i = 0; i < groupFutures.size(); ++i )
+			{
+			EXPECT_EQ( groupFutures[i].get(), Status::Ok );
+			}
+		EXPECT_EQ( joinHandler.GetVerifyStatistics().VerifiedCount, u64( join_count ) );
+		EXPECT_EQ( joinHandler.GetCacheStatistics().EntityCount, u64( join_count ) );
+		}
+
+	// requests on a handler which is not initialized fail directly
+	EntityHandler uninitializedHandler;
+	EXPECT_EQ( uninitializedHandler.LoadEntityAsync( refs[0] ).get(), Status::ENotInitialized );
+	EXPECT_EQ( uninitializedHandler.LoadEntity( refs[0] ), Status::ENotInitialized );
+	EXPECT_EQ( uninitializedHandler.AddEntityAsync( entities[0] ).get().second, Status::ENotInitialized );
+	}
+
+// adds random entities, and loads them back in one batch using a second handler set up with the settings
+static void TestEntityHandlerBatchLoad( const EntityHandler::Settings &settings )
+	{
+	const size_t entity_count = 200;
+
+	EntityHandler writeHandler;
+	EXPECT_EQ( writeHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+
+	std::vector<std::shared_ptr<TestEntityA>> entities;
+	std::vector<entity_ref> refs;
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		entities.emplace_back( GenerateRandomTestEntityA( 0, 20 ) );
+		const auto ret = writeHandler.AddEntity( entities.back() );
+		EXPECT_TRUE( IsAddedStatus( ret.second ) );
+		refs.emplace_back( ret.first );
+		}
+
+	EntityHandler readHandler;
+	EXPECT_EQ( readHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+	// load the first half synchronously, and the rest (including duplicates of the first half) async
+	const std::vector<entity_ref> firstHalf( refs.begin(), refs.begin() + entity_count / 2 );
+	EXPECT_EQ( readHandler.LoadEntities( firstHalf ), Status::Ok );
+	EXPECT_EQ( readHandler.LoadEntitiesAsync( refs ).get(), Status::Ok );
+	EXPECT_EQ( readHandler.LoadEntities( {} ), Status::Ok );
+
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		auto loaded = std::dynamic_pointer_cast<const TestEntityA>( readHandler.GetLoadedEntity( refs[i] ) );
+		EXPECT_TRUE( loaded != nullptr );
+		if( loaded )
+			{
+			EXPECT_TRUE( TestEntityA::MF::Equals( loaded.get(), entities[i].get() ) );
+			}
+		}
+
+	// a missing file fails the batch, but the rest of the batch is still loaded
+	EntityHandler missingHandler;
+	EXPECT_EQ( missingHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+	std::vector<entity_ref> withMissing = { refs[0], entity_ref( hash_rand() ), refs[1] };
+	EXPECT_EQ( missingHandler.LoadEntities( withMissing ), Status::ECantOpen );
+	EXPECT_TRUE( missingHandler.IsEntityLoaded( refs[0] ) );
+	EXPECT_TRUE( missingHandler.IsEntityLoaded( refs[1] ) );
+	}
+
+TEST( EntityHandlerTests , BatchLoadEntities )
+	{
+	setup_random_seed();
+
+	EntityHandler::Settings settings;
+	TestEntityHandlerBatchLoad( settings );
+
+	// with a single read thread, the batch read task and the decodes share the thread
+	settings.ReadThreadCount = 1;
+	TestEntityHandlerBatchLoad( settings );
+	}
+
+TEST( EntityHandlerTests , BatchLoadEntitiesMemoryMapped )
+	{
+	setup_random_seed();
+
+	EntityHandler::Settings settings;
+	settings.UseMemoryMappedFiles = true;
+	TestEntityHandlerBatchLoad( settings );
+	}
+
+TEST( EntityHandlerTests , AddEntitiesDurable )
+	{
+	setup_random_seed();
+
+	const size_t entity_count = 100;
+
+	EntityHandler::Settings settings;
+	settings.UseDurableWrites = true;
+	settings.WriteThreadCount = 4;
+
+	// durable writes can't be combined with packfiles
+	EntityHandler::Settings packSettings = settings;
+	packSettings.UsePackfiles = true;
+	EntityHandler packHandler;
+	EXPECT_EQ( packHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, packSettings ), Status::EParam );
+
+	std::vector<std::shared_ptr<TestEntityA>> entities;
+	std::vector<entity_ref> refs;
+		{
+		EntityHandler writeHandler;
+		EXPECT_EQ( writeHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+		// a synchronous add returns when the entity is committed
+		entities.emplace_back( GenerateRandomTestEntityA( 0, 20 ) );
+		const auto ret = writeHandler.AddEntity( entities.back() );
+		EXPECT_TRUE( IsAddedStatus( ret.second ) );
+		refs.emplace_back( ret.first );
+		EXPECT_TRUE( writeHandler.IsEntityLoaded( ret.first ) );
+
+		// the async adds are committed in groups, and each future completes when its group is committed
+		std::vector<std::future<std::pair<entity_ref, Status>>> addFutures;
+		for( size_t i = 1; i < entity_count; ++i )
+			{
+			entities.emplace_back( GenerateRandomTestEntityA( 0, 20 ) );
+			addFutures.emplace_back( writeHandler.AddEntityAsync( entities.back() ) );
+			}
+		for( size_t i = 0; i < addFutures.size(); ++i )
+			{
+			const auto asyncRet = addFutures[i].get();
+			EXPECT_TRUE( IsAddedStatus( asyncRet.second ) );
+			refs.emplace_back( asyncRet.first );
+
+			// the entity file is in place under its final name
+			const std::string filePath = "./TestFolder/" + value_to_hex_string( hash( asyncRet.first ) ) + ".dat";
+			FILE *file = fopen( filePath.c_str(), "rb" );
+			EXPECT_TRUE( file != nullptr );
+			if( file )
+				{
+				fclose( file );
+				}
+			}
+		}
+
+	EntityHandler readHandler;
+	EXPECT_EQ( readHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+	EXPECT_EQ( readHandler.LoadEntities( refs ), Status::Ok );
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		auto loaded = std::dynamic_pointer_cast<const TestEntityA>( readHandler.GetLoadedEntity( refs[i] ) );
+		EXPECT_TRUE( loaded != nullptr );
+		if( loaded )
+			{
+			EXPECT_TRUE( TestEntityA::MF::Equals( loaded.get(), entities[i].get() ) );
+			}
+		}
+
+	// temporary files which were left by a process which is not running are removed from the directory and its subdirectories
+	// when durable writes are set up, while the temporary files of running processes are kept
+	const std::string path = CreateTestDirectory( "AddEntitiesDurable" );
+	const std::string subdirectoryPath = path + "/ab";
+#ifdef _MSC_VER
+	EXPECT_TRUE( ::CreateDirectoryA( subdirectoryPath.c_str(), nullptr ) );
+#else
+	EXPECT_EQ( ::mkdir( subdirectoryPath.c_str(), 0755 ), 0 );
+#endif
+	const std::string runningTempFileSuffix = ".dat.tmp-" + std::to_string( get_process_id() ) + "-0123456789abcdef";
+	const std::string staleTempFilePaths[] = { path + "/stale.dat.tmp-999999999-0123456789abcdef", subdirectoryPath + "/stale.dat.tmp-999999999-0123456789abcdef" };
+	const std::string runningTempFilePaths[] = { path + "/running" + runningTempFileSuffix, subdirectoryPath + "/running" + runningTempFileSuffix };
+	for( const std::string &tempFilePath : { staleTempFilePaths[0], staleTempFilePaths[1], runningTempFilePaths[0], runningTempFilePaths[1] } )
+		{
+		FILE *file = fopen( tempFilePath.c_str(), "wb" );
+		ASSERT_TRUE( file != nullptr );
+		fclose( file );
+		}
+		{
+		EntityHandler durableHandler;
+		EXPECT_EQ( durableHandler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		}
+	for( size_t i = 0; i < 2; ++i )
+		{
+		FILE *file = fopen( staleTempFilePaths[i].c_str(), "rb" );
+		EXPECT_TRUE( file == nullptr );
+		if( file )
+			{
+			fclose( file );
+			}
+		file = fopen( runningTempFilePaths[i].c_str(), "rb" );
+		EXPECT_TRUE( file != nullptr );
+		if( file )
+			{
+			fclose( file );
+			}
+		}
+	}
+
+TEST( EntityHandlerTests , EntityCacheBudget )
+	{
+	setup_random_seed();
+
+	const size_t entity_count = 50;
+
+	std::vector<entity_ref> refs;
+	u64 totalSize = 0;
+		{
+		EntityHandler writeHandler;
+		EXPECT_EQ( writeHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+		for( size_t i = 0; i < entity_count; ++i )
+			{
+			const auto ret = writeHandler.AddEntity( GenerateRandomTestEntityA( 0, 20 ) );
+			EXPECT_TRUE( IsAddedStatus( ret.second ) );
+			refs.emplace_back( ret.first );
+			}
+		totalSize = writeHandler.GetCacheStatistics().EntityBytes;
+		EXPECT_EQ( writeHandler.GetCacheStatistics().EntityCount, u64( entity_count ) );
+		}
+
+	// the shard count must be a power of two
+	EntityHandler::Settings shardSettings;
+	shardSettings.EntityShardCount = 3;
+	EntityHandler shardHandler;
+	EXPECT_EQ( shardHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, shardSettings ), Status::EParam );
+
+	// a budget of about a fifth of the entities
+	EntityHandler::Settings settings;
+	settings.EntityCacheBudget = totalSize / 5;
+	EntityHandler handler;
+	EXPECT_EQ( handler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+	// an entity which is referenced outside of the handler is never evicted
+	EXPECT_EQ( handler.LoadEntity( refs[0] ), Status::Ok );
+	const std::shared_ptr<const Entity> heldEntity = handler.GetLoadedEntity( refs[0] );
+	EXPECT_TRUE( heldEntity != nullptr );
+
+	for( size_t i = 1; i < entity_count; ++i )
+		{
+		EXPECT_EQ( handler.LoadEntity( refs[i] ), Status::Ok );
+
+		// the unreferenced entities are evicted as the entities are loaded
+		EXPECT_LE( handler.GetCacheStatistics().EntityBytes, settings.EntityCacheBudget );
+		}
+	EXPECT_TRUE( handler.IsEntityLoaded( refs[0] ) );
+
+	EntityHandler::CacheStatistics statistics = handler.GetCacheStatistics();
+	EXPECT_EQ( statistics.MissCount, u64( entity_count ) );
+	EXPECT_EQ( statistics.HitCount, u64( 0 ) );
+	EXPECT_GT( statistics.EvictionCount, u64( 0 ) );
+	EXPECT_EQ( statistics.EntityCount + statistics.EvictionCount, u64( entity_count ) );
+
+	// loading the held entity again is a hit
+	EXPECT_EQ( handler.LoadEntity( refs[0] ), Status::Ok );
+	EXPECT_EQ( handler.LoadEntitiesAsync( { refs[0], refs[1] } ).get(), Status::Ok );
+	statistics = handler.GetCacheStatistics();
+	EXPECT_EQ( statistics.HitCount + statistics.MissCount, u64( entity_count + 3 ) );
+	EXPECT_GE( statistics.HitCount, u64( 2 ) );
+
+	// unloading keeps the referenced entity
+	EXPECT_EQ( handler.UnloadNonReferencedEntities(), Status::Ok );
+	statistics = handler.GetCacheStatistics();
+	EXPECT_EQ( statistics.EntityCount, u64( 1 ) );
+	EXPECT_TRUE( handler.IsEntityLoaded( refs[0] ) );
+	}
+
+// adds an entity which references the entities in children, and the entity in reference through its table
+static entity_ref AddTestEntityC( EntityHandler &handler, const std::string &name, const std::vector<entity_ref> &children, const entity_ref &parent, const entity_ref &reference )
+	{
+	auto entity = std::make_shared<TestEntityC>();
+	entity->Name() = name;
+	entity->Children() = children;
+	if( parent )
+		{
+		entity->Parent().set( parent );
+		}
+	if( reference )
+		{
+		entity->References().set();
+		entity->References().value().Insert( item_ref::make_ref() ).Reference() = reference;
+		}
+	const auto ret = handler.AddEntity( entity );
+	EXPECT_TRUE( IsAddedStatus( ret.second ) );
+	return ret.first;
+	}
+
+TEST( EntityHandlerTests , LoadEntityClosure )
+	{
+	setup_random_seed();
+
+	// root -> middle0 -> leaf0, leaf1 
+	// root -> middle1 -> leaf2 (in the table), leaf3 (as parent)
+	EntityHandler writeHandler;
+	EXPECT_EQ( writeHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+	std::vector<entity_ref> leaves;
+	for( size_t i = 0; i < 4; ++i )
+		{
+		leaves.emplace_back( AddTestEntityC( writeHandler, "leaf" + std::to_string( i ), {}, {}, {} ) );
+		}
+	std::vector<entity_ref> middles;
+	middles.emplace_back( AddTestEntityC( writeHandler, "middle0", { leaves[0], leaves[1] }, {}, {} ) );
+	middles.emplace_back( AddTestEntityC( writeHandler, "middle1", {}, leaves[3], leaves[2] ) );
+
+	// the root references middle0 twice, it is still loaded once
+	const entity_ref root = AddTestEntityC( writeHandler, "root", { middles[0], middles[1], middles[0] }, {}, {} );
+
+	// the references of the added entities are not known, so the files are read to find them
+	EXPECT_EQ( writeHandler.LoadEntityClosure( root, 2 ), Status::Ok );
+
+		{
+		// load the root and the middle entities, but not the leaves
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntityClosure( root, 1 ), Status::Ok );
+		EXPECT_TRUE( handler.IsEntityLoaded( root ) );
+		EXPECT_TRUE( handler.IsEntityLoaded( middles[0] ) );
+		EXPECT_TRUE( handler.IsEntityLoaded( middles[1] ) );
+		for( size_t i = 0; i < leaves.size(); ++i )
+			{
+			EXPECT_FALSE( handler.IsEntityLoaded( leaves[i] ) );
+			}
+		EXPECT_EQ( handler.GetCacheStatistics().MissCount, u64( 3 ) );
+
+		// the loaded entities are hits, and their references are used to load the leaves
+		EXPECT_EQ( handler.LoadEntityClosureAsync( root, 2 ).get(), Status::Ok );
+		for( size_t i = 0; i < leaves.size(); ++i )
+			{
+			EXPECT_TRUE( handler.IsEntityLoaded( leaves[i] ) );
+			}
+		const EntityHandler::CacheStatistics statistics = handler.GetCacheStatistics();
+		EXPECT_EQ( statistics.HitCount, u64( 3 ) );
+		EXPECT_EQ( statistics.MissCount, u64( 7 ) );
+		EXPECT_EQ( statistics.EntityCount, u64( 7 ) );
+		}
+
+		{
+		// depth 0 loads only the entity itself
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntityClosureAsync( middles[1], 0 ).get(), Status::Ok );
+		EXPECT_EQ( handler.GetCacheStatistics().EntityCount, u64( 1 ) );
+		}
+
+	// an entity which references a missing entity fails to load the closure, but the entity itself is loaded
+	const entity_ref broken = AddTestEntityC( writeHandler, "broken", { leaves[0], entity_ref( hash_rand() ) }, {}, {} );
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntityClosure( broken, 1 ), Status::ECantOpen );
+		EXPECT_TRUE( handler.IsEntityLoaded( broken ) );
+		EXPECT_TRUE( handler.IsEntityLoaded( leaves[0] ) );
+		}
+
+	// diamond -> long0 -> long1 -> shared -> sharedLeaf
+	// diamond -> short0 -> shared
+	// shared is reached at depth 3 through the long path, and at depth 2 through the short path. whichever path is walked
+	// first, the shared entity is expanded at depth 2, so its leaf at depth 3 is loaded
+	const entity_ref sharedLeaf = AddTestEntityC( writeHandler, "sharedLeaf", {}, {}, {} );
+	const entity_ref shared = AddTestEntityC( writeHandler, "shared", { sharedLeaf }, {}, {} );
+	const entity_ref long1 = AddTestEntityC( writeHandler, "long1", { shared }, {}, {} );
+	const entity_ref long0 = AddTestEntityC( writeHandler, "long0", { long1 }, {}, {} );
+	const entity_ref short0 = AddTestEntityC( writeHandler, "short0", { shared }, {}, {} );
+	const entity_ref diamond = AddTestEntityC( writeHandler, "diamond", { long0, short0 }, {}, {} );
+	for( uint pass = 0; pass < 10; ++pass )
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+
+		// in every other pass the long path is already loaded, so it is walked faster, and likely reaches the shared entity first
+		if( pass % 2 == 1 )
+			{
+			EXPECT_EQ( handler.LoadEntity( long0 ), Status::Ok );
+			EXPECT_EQ( handler.LoadEntity( long1 ), Status::Ok );
+			}
+		EXPECT_EQ( handler.LoadEntityClosure( diamond, 3 ), Status::Ok );
+		EXPECT_TRUE( handler.IsEntityLoaded( shared ) );
+		EXPECT_TRUE( handler.IsEntityLoaded( sharedLeaf ) );
+		EXPECT_EQ( handler.GetCacheStatistics().EntityCount, u64( 6 ) );
+		}
+	}
+
+TEST( EntityHandlerTests , AddEntitiesSinglePassHashing )
+	{
+	setup_random_seed();
+
+	const size_t entity_count = 10;
+
+	EntityHandler handler;
+	EXPECT_EQ( handler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+	EntityHandler::Settings settings;
+	settings.UseSinglePassHashing = true;
+	EntityHandler singlePassHandler;
+	EXPECT_EQ( singlePassHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+	// the single pass writes the same data, so the entities get the same references
+	std::vector<std::shared_ptr<TestEntityA>> entities;
+	std::vector<entity_ref> refs;
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		entities.emplace_back( GenerateRandomTestEntityA( 0, 100 ) );
+		const auto ret = singlePassHandler.AddEntity( entities.back() );
+		EXPECT_TRUE( IsAddedStatus( ret.second ) );
+		EXPECT_EQ( handler.AddEntity( entities.back() ).first, ret.first );
+		refs.emplace_back( ret.first );
+		}
+
+	// nested sections and section arrays
+	auto entityC = std::make_shared<TestEntityC>();
+	entityC->Name() = "single pass";
+	entityC->Children() = refs;
+	entityC->References().set();
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		entityC->References().value().Insert( item_ref::make_ref() ).Reference() = refs[i];
+		}
+	const auto retC = singlePassHandler.AddEntity( entityC );
+	EXPECT_TRUE( IsAddedStatus( retC.second ) );
+	EXPECT_EQ( handler.AddEntity( entityC ).first, retC.first );
+
+	// the written entities load and pass the hash check
+	EntityHandler readHandler;
+	EXPECT_EQ( readHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+	for( size_t i = 0; i < entity_count; ++i )
+		{
+		EXPECT_EQ( readHandler.LoadEntity( refs[i] ), Status::Ok );
+		auto loaded = std::dynamic_pointer_cast<const TestEntityA>( readHandler.GetLoadedEntity( refs[i] ) );
+		EXPECT_TRUE( loaded != nullptr );
+		if( loaded )
+			{
+			EXPECT_TRUE( TestEntityA::MF::Equals( loaded.get(), entities[i].get() ) );
+			}
+		}
+	EXPECT_EQ( readHandler.LoadEntity( retC.first ), Status::Ok );
+	auto loadedC = std::dynamic_pointer_cast<const TestEntityC>( readHandler.GetLoadedEntity( retC.first ) );
+	EXPECT_TRUE( loadedC != nullptr );
+	if( loadedC )
+		{
+		EXPECT_TRUE( TestEntityC::MF::Equals( loadedC.get(), entityC.get() ) );
+		}
+	}
+
+// waits until the condition is true, or a few seconds have passed. returns the condition
+template<class _Func> static bool WaitForCondition( _Func condition )
+	{
+	for( uint i = 0; i < 500 && !condition(); ++i )
+		{
+		std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+		}
+	return condition();
+	}
+
+// records the entities reported to the corruption callback
+struct CorruptionRecorder
+	{
+	std::mutex Mutex;
+	std::vector<entity_ref> Refs;
+
+	EntityHandler::CorruptionCallback GetCallback()
+		{
+		return [this]( const entity_ref &ref )
+			{
+			std::lock_guard<std::mutex> lock( this->Mutex );
+			this->Refs.emplace_back( ref );
+			};
+		}
+
+	std::vector<entity_ref> GetRefs()
+		{
+		std::lock_guard<std::mutex> lock( this->Mutex );
+		return this->Refs;
+		}
+	};
+
+// appends a byte to the entity file, so the data no longer matches the hash, but the entity can still be decoded
+static void CorruptEntityFile( const std::string &path, const entity_ref &ref )
+	{
+	const std::string filePath = path + "/" + value_to_hex_string( hash( ref ) ) + ".dat";
+	FILE *file = fopen( filePath.c_str(), "ab" );
+	ASSERT_TRUE( file != nullptr );
+	const u8 junk = 0x5a;
+	fwrite( &junk, 1, 1, file );
+	fclose( file );
+	}
+
+// flips the bits of the byte after the first occurrence of the text in the entity file, which is a key of a block, so the
+// header of the block is intact, but the value of the block can't be decoded. returns false if the text is not found.
+static bool CorruptEntityFileAfterText( const std::string &path, const entity_ref &ref, const std::string &text )
+	{
+	const std::string filePath = path + "/" + value_to_hex_string( hash( ref ) ) + ".dat";
+	FILE *file = fopen( filePath.c_str(), "r+b" );
+	if( !file )
+		{
+		return false;
+		}
+	std::vector<u8> data;
+	u8 buffer[4096];
+	size_t readCount = 0;
+	while( ( readCount = fread( buffer, 1, sizeof( buffer ), file ) ) > 0 )
+		{
+		data.insert( data.end(), buffer, buffer + readCount );
+		}
+	const auto it = std::search( data.begin(), data.end(), text.begin(), text.end() );
+	bool corrupted = false;
+	if( it != data.end() && it + text.size() != data.end() )
+		{
+		const u8 junk = u8( *( it + text.size() ) ^ 0xff );
+		fseek( file, long( ( it - data.begin() ) + text.size() ), SEEK_SET );
+		corrupted = ( fwrite( &junk, 1, 1, file ) == 1 );
+		}
+	fclose( file );
+	return corrupted;
+	}
+
+TEST( EntityHandlerTests , AddEntitiesSegmentedWriteStreams )
+	{
+	setup_random_seed();
+
+	EntityHandler handler;
+	EXPECT_EQ( handler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+
+	// segmented streams can't be combined with packfiles or durable writes
+	EntityHandler::Settings settings;
+	settings.UseSegmentedWriteStreams = true;
+	settings.UsePackfiles = true;
+	EntityHandler packfileHandler;
+	EXPECT_EQ( packfileHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::EParam );
+	settings.UsePackfiles = false;
+
+	// an entity which spans many segments, written with and without single pass hashing
+	auto entityC = std::make_shared<TestEntityC>();
+	entityC->Name() = "segmented";
+	entityC->Children().resize( 100000 );
+	for( size_t i = 0; i < entityC->Children().size(); ++i )
+		{
+		entityC->Children()[i] = entity_ref( hash_rand() );
+		}
+	const entity_ref ref = handler.AddEntity( entityC ).first;
+	for( uint pass_index = 0; pass_index < 2; ++pass_index )
+		{
+		settings.UseSinglePassHashing = ( pass_index == 1 );
+		EntityHandler segmentedHandler;
+		EXPECT_EQ( segmentedHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+		// the segmented stream writes the same data, so the entities get the same references
+		EXPECT_EQ( segmentedHandler.AddEntity( entityC ).first, ref );
+		auto entityA = GenerateRandomTestEntityA( 0, 100 );
+		const auto retA = segmentedHandler.AddEntity( entityA );
+		EXPECT_TRUE( IsAddedStatus( retA.second ) );
+		EXPECT_EQ( handler.AddEntity( entityA ).first, retA.first );
+		}
+
+	// remove the file, and write it again with the segmented stream, it loads and passes the hash check
+	const std::string filePath = "./TestFolder/" + value_to_hex_string( hash( ref ) ) + ".dat";
+	remove( filePath.c_str() );
+	settings.UseSinglePassHashing = false;
+		{
+		EntityHandler segmentedHandler;
+		EXPECT_EQ( segmentedHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		const auto ret = segmentedHandler.AddEntity( entityC );
+		EXPECT_EQ( ret.second, Status::Ok );
+		EXPECT_EQ( ret.first, ref );
+		}
+	EntityHandler readHandler;
+	EXPECT_EQ( readHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+	EXPECT_EQ( readHandler.LoadEntity( ref ), Status::Ok );
+	auto loaded = std::dynamic_pointer_cast<const TestEntityC>( readHandler.GetLoadedEntity( ref ) );
+	EXPECT_TRUE( loaded != nullptr );
+	if( loaded )
+		{
+		EXPECT_TRUE( TestEntityC::MF::Equals( loaded.get(), entityC.get() ) );
+		}
+	}
+
+TEST( EntityHandlerTests , AddEntitiesSpilledToFile )
+	{
+	setup_random_seed();
+
+	EntityHandler handler;
+	EXPECT_EQ( handler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+
+	// spilling can't be combined with packfiles or durable writes
+	EntityHandler::Settings settings;
+	settings.SpillToFileSize = 1024*64;
+	settings.UseDurableWrites = true;
+	EntityHandler durableHandler;
+	EXPECT_EQ( durableHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::EParam );
+	settings.UseDurableWrites = false;
+
+	// an entity which is much larger than the spill buffer, and a small entity which is not spilled
+	auto entityC = std::make_shared<TestEntityC>();
+	entityC->Name() = "spilled";
+	entityC->Children().resize( 300000 );
+	for( size_t i = 0; i < entityC->Children().size(); ++i )
+		{
+		entityC->Children()[i] = entity_ref( hash_rand() );
+		}
+	const entity_ref ref = handler.AddEntity( entityC ).first;
+		{
+		EntityHandler spillHandler;
+		EXPECT_EQ( spillHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+		// the spilled entity is written with the same data, so it gets the same reference
+		const auto retC = spillHandler.AddEntity( entityC );
+		EXPECT_EQ( retC.second, Status::WAlreadyExists );
+		EXPECT_EQ( retC.first, ref );
+		auto entityA = GenerateRandomTestEntityA( 0, 10 );
+		const auto retA = spillHandler.AddEntity( entityA );
+		EXPECT_TRUE( IsAddedStatus( retA.second ) );
+		EXPECT_EQ( handler.AddEntity( entityA ).first, retA.first );
+		}
+
+	// cut the file short, like a file which was partially written, and write it again through the spill file. the spilled 
+	// file replaces the partial file, and it loads and passes the hash check
+	const std::string filePath = "./TestFolder/" + value_to_hex_string( hash( ref ) ) + ".dat";
+	FILE *file = fopen( filePath.c_str(), "wb" );
+	ASSERT_TRUE( file != nullptr );
+	const u8 junk[16] = {};
+	fwrite( junk, 1, sizeof( junk ), file );
+	fclose( file );
+		{
+		EntityHandler spillHandler;
+		EXPECT_EQ( spillHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		const auto ret = spillHandler.AddEntity( entityC );
+		EXPECT_EQ( ret.second, Status::Ok );
+		EXPECT_EQ( ret.first, ref );
+		}
+	EntityHandler readHandler;
+	EXPECT_EQ( readHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() } ), Status::Ok );
+	EXPECT_EQ( readHandler.LoadEntity( ref ), Status::Ok );
+	auto loaded = std::dynamic_pointer_cast<const TestEntityC>( readHandler.GetLoadedEntity( ref ) );
+	EXPECT_TRUE( loaded != nullptr );
+	if( loaded )
+		{
+		EXPECT_TRUE( TestEntityC::MF::Equals( loaded.get(), entityC.get() ) );
+		}
+
+	// spill files which were left by a process which is not running are removed when a handler is initialized, 
+	// while the spill files of running processes are kept
+	const std::string staleSpillFilePath = "./TestFolder/spill-999999999-0123456789abcdef.tmp";
+	const std::string runningSpillFilePath = "./TestFolder/spill-" + std::to_string( get_process_id() ) + "-0123456789abcdef.tmp";
+	for( const std::string &spillFilePath : { staleSpillFilePath, runningSpillFilePath } )
+		{
+		file = fopen( spillFilePath.c_str(), "wb" );
+		ASSERT_TRUE( file != nullptr );
+		fclose( file );
+		}
+		{
+		EntityHandler spillHandler;
+		EXPECT_EQ( spillHandler.Initialize( "./TestFolder", { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		}
+	const auto fileExists = []( const std::string &path )
+		{
+		FILE *existingFile = fopen( path.c_str(), "rb" );
+		if( !existingFile )
+			{
+			return false;
+			}
+		fclose( existingFile );
+		return true;
+		};
+	EXPECT_FALSE( fileExists( staleSpillFilePath ) );
+	EXPECT_TRUE( fileExists( runningSpillFilePath ) );
+	remove( runningSpillFilePath.c_str() );
+	}
+
+TEST( EntityHandlerTests , AddEntitiesPaddedPayloads )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "AddEntitiesPaddedPayloads" );
+
+	// the alignment must be a power of two, and fit the padding size
+	EntityHandler::Settings settings;
+	EntityHandler invalidHandler;
+	settings.PayloadAlignment = 48;
+	EXPECT_EQ( invalidHandler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::EParam );
+	settings.PayloadAlignment = EntityMaxPayloadAlignment * 2;
+	EXPECT_EQ( invalidHandler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::EParam );
+	settings.PayloadAlignment = 64;
+
+	// the padded entity has different data than the unpadded entity, so it has a different reference
+	auto entity = GenerateRandomTestEntityA( 0, 100 );
+	entity_ref ref;
+	entity_ref paddedRef;
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		ref = handler.AddEntity( entity ).first;
+
+		EntityHandler paddedHandler;
+		EXPECT_EQ( paddedHandler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		const auto ret = paddedHandler.AddEntity( entity );
+		EXPECT_TRUE( IsAddedStatus( ret.second ) );
+		paddedRef = ret.first;
+		EXPECT_NE( paddedRef, ref );
+		}
+
+	// both are loaded, from allocations and from mapped files
+	for( uint pass_index = 0; pass_index < 2; ++pass_index )
+		{
+		EntityHandler::Settings readSettings;
+		readSettings.UseMemoryMappedFiles = ( pass_index == 1 );
+		EntityHandler readHandler;
+		EXPECT_EQ( readHandler.Initialize( path, { TestPackA::GetPackageRecord() }, readSettings ), Status::Ok );
+		for( const entity_ref &loadRef : { ref, paddedRef } )
+			{
+			EXPECT_EQ( readHandler.LoadEntity( loadRef ), Status::Ok );
+			auto loaded = std::dynamic_pointer_cast<const TestEntityA>( readHandler.GetLoadedEntity( loadRef ) );
+			EXPECT_TRUE( loaded != nullptr );
+			if( loaded )
+				{
+				EXPECT_TRUE( TestEntityA::MF::Equals( loaded.get(), entity.get() ) );
+				}
+			}
+		}
+	}
+
+TEST( EntityHandlerTests , AddAndLoadEntitiesInternedKeys )
+	{
+	setup_random_seed();
+
+	// interned keys are loaded from allocations, mapped files with lazy sections, and streamed files
+	EntityHandler::Settings settings;
+	settings.UseInternedKeys = true;
+	TestEntityHandlerAddAndLoad( settings );
+	settings.UseMemoryMappedFiles = true;
+	settings.UseLazySections = true;
+	TestEntityHandlerAddAndLoad( settings );
+	settings = EntityHandler::Settings();
+	settings.UseInternedKeys = true;
+	settings.StreamedLoadSize = 1;
+	TestEntityHandlerAddAndLoad( settings );
+
+	// the entity with interned keys has different data than the entity without, so it has a different reference
+	const std::string path = CreateTestDirectory( "AddAndLoadEntitiesInternedKeys" );
+	auto entity = GenerateRandomTestEntityA( 0, 100 );
+	entity_ref ref;
+	entity_ref internedRef;
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		ref = handler.AddEntity( entity ).first;
+
+		settings = EntityHandler::Settings();
+		settings.UseInternedKeys = true;
+		EntityHandler internedHandler;
+		EXPECT_EQ( internedHandler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		const auto ret = internedHandler.AddEntity( entity );
+		EXPECT_TRUE( IsAddedStatus( ret.second ) );
+		internedRef = ret.first;
+		EXPECT_NE( internedRef, ref );
+		}
+
+	// both are loaded by a handler which does not intern keys
+	EntityHandler readHandler;
+	EXPECT_EQ( readHandler.Initialize( path, { TestPackA::GetPackageRecord() } ), Status::Ok );
+	for( const entity_ref &loadRef : { ref, internedRef } )
+		{
+		EXPECT_EQ( readHandler.LoadEntity( loadRef ), Status::Ok );
+		auto loaded = std::dynamic_pointer_cast<const TestEntityA>( readHandler.GetLoadedEntity( loadRef ) );
+		EXPECT_TRUE( loaded != nullptr );
+		if( loaded )
+			{
+			EXPECT_TRUE( TestEntityA::MF::Equals( loaded.get(), entity.get() ) );
+			}
+		}
+	}
+
+TEST( EntityHandlerTests , VerifyPolicies )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "VerifyPolicies" );
+
+	// add a good entity, and an entity which is corrupted after it is written
+	entity_ref goodRef;
+	entity_ref badRef;
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		goodRef = handler.AddEntity( GenerateRandomTestEntityA( 0, 20 ) ).first;
+		badRef = handler.AddEntity( GenerateRandomTestEntityA( 0, 20 ) ).first;
+		}
+	CorruptEntityFile( path, badRef );
+
+	// verify always: the corrupted entity fails to load
+		{
+		CorruptionRecorder recorder;
+		EntityHandler::Settings settings;
+		settings.OnCorruptedEntity = recorder.GetCallback();
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntity( goodRef ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntity( badRef ), Status::ECorrupted );
+		EXPECT_FALSE( handler.IsEntityLoaded( badRef ) );
+
+		const EntityHandler::VerifyStatistics statistics = handler.GetVerifyStatistics();
+		EXPECT_EQ( statistics.VerifiedCount, u64( 2 ) );
+		EXPECT_EQ( statistics.UnverifiedCount, u64( 0 ) );
+		EXPECT_EQ( statistics.CorruptedCount, u64( 1 ) );
+		EXPECT_EQ( recorder.GetRefs(), std::vector<entity_ref>( { badRef } ) );
+		}
+
+	// deferred: the corrupted entity is loaded, and unloaded when the verify finds the corruption
+		{
+		CorruptionRecorder recorder;
+		EntityHandler::Settings settings;
+		settings.LoadVerifyPolicy = EntityHandler::VerifyPolicy::Deferred;
+		settings.OnCorruptedEntity = recorder.GetCallback();
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntity( goodRef ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntity( badRef ), Status::Ok );
+
+		EXPECT_TRUE( WaitForCondition( [&]() { return handler.GetVerifyStatistics().VerifiedCount == 2; } ) );
+		EXPECT_EQ( handler.GetVerifyStatistics().CorruptedCount, u64( 1 ) );
+		EXPECT_EQ( recorder.GetRefs(), std::vector<entity_ref>( { badRef } ) );
+		EXPECT_TRUE( handler.IsEntityLoaded( goodRef ) );
+		EXPECT_FALSE( handler.IsEntityLoaded( badRef ) );
+
+		// the memory mapping is kept until the deferred verify is done
+		EntityHandler::Settings mappedSettings = settings;
+		mappedSettings.UseMemoryMappedFiles = true;
+		EntityHandler mappedHandler;
+		EXPECT_EQ( mappedHandler.Initialize( path, { TestPackA::GetPackageRecord() }, mappedSettings ), Status::Ok );
+		EXPECT_EQ( mappedHandler.LoadEntities( { goodRef, badRef } ), Status::Ok );
+		EXPECT_TRUE( WaitForCondition( [&]() { return mappedHandler.GetVerifyStatistics().VerifiedCount == 2; } ) );
+		EXPECT_EQ( mappedHandler.GetVerifyStatistics().CorruptedCount, u64( 1 ) );
+		}
+
+	// sampled: one in every two loads is verified, so the corrupted entity is loaded unverified
+		{
+		EntityHandler::Settings settings;
+		settings.LoadVerifyPolicy = EntityHandler::VerifyPolicy::Sampled;
+		settings.VerifySampleInterval = 0;
+		EntityHandler invalidHandler;
+		EXPECT_EQ( invalidHandler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::EParam );
+
+		settings.VerifySampleInterval = 2;
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntity( goodRef ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntity( badRef ), Status::Ok );
+
+		const EntityHandler::VerifyStatistics statistics = handler.GetVerifyStatistics();
+		EXPECT_EQ( statistics.VerifiedCount, u64( 1 ) );
+		EXPECT_EQ( statistics.UnverifiedCount, u64( 1 ) );
+		EXPECT_EQ( statistics.CorruptedCount, u64( 0 ) );
+		}
+	}
+
+TEST( EntityHandlerTests , StreamedLoads )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "StreamedLoads" );
+
+	// add an entity which is much larger than the buffer of the stream, and a copy which is corrupted after it is written
+	auto entityC = std::make_shared<TestEntityC>();
+	entityC->Name() = "streamed";
+	entityC->Children().resize( 300000 );
+	for( size_t i = 0; i < entityC->Children().size(); ++i )
+		{
+		entityC->Children()[i] = entity_ref( hash_rand() );
+		}
+	auto badEntityC = std::make_shared<TestEntityC>( *entityC );
+	badEntityC->Name() = "corrupted";
+	entity_ref goodRef;
+	entity_ref badRef;
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		goodRef = handler.AddEntity( entityC ).first;
+		badRef = handler.AddEntity( badEntityC ).first;
+		}
+	CorruptEntityFile( path, badRef );
+
+	// streamed loads can't be combined with memory mapped files
+	EntityHandler::Settings settings;
+	settings.StreamedLoadSize = 1024*64;
+	settings.UseMemoryMappedFiles = true;
+	EntityHandler mappedHandler;
+	EXPECT_EQ( mappedHandler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::EParam );
+	settings.UseMemoryMappedFiles = false;
+
+	// the entity is decoded from the stream, and the corrupted entity is found before it is inserted, also with the deferred policy
+	for( uint pass_index = 0; pass_index < 2; ++pass_index )
+		{
+		CorruptionRecorder recorder;
+		settings.LoadVerifyPolicy = ( pass_index == 0 ) ? EntityHandler::VerifyPolicy::Always : EntityHandler::VerifyPolicy::Deferred;
+		settings.OnCorruptedEntity = recorder.GetCallback();
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntity( goodRef ), Status::Ok );
+		auto loaded = std::dynamic_pointer_cast<const TestEntityC>( handler.GetLoadedEntity( goodRef ) );
+		EXPECT_TRUE( loaded != nullptr );
+		if( loaded )
+			{
+			EXPECT_TRUE( TestEntityC::MF::Equals( loaded.get(), entityC.get() ) );
+			}
+
+		EXPECT_EQ( handler.LoadEntity( badRef ), Status::ECorrupted );
+		EXPECT_FALSE( handler.IsEntityLoaded( badRef ) );
+		EXPECT_EQ( handler.GetVerifyStatistics().VerifiedCount, u64( 2 ) );
+		EXPECT_EQ( recorder.GetRefs(), std::vector<entity_ref>( { badRef } ) );
+		}
+	}
+
+TEST( EntityHandlerTests , LoadEmptyEntityFile )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "LoadEmptyEntityFile" );
+
+	// add an entity, and truncate its file
+	entity_ref emptyRef;
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		emptyRef = handler.AddEntity( GenerateRandomTestEntityA( 0, 20 ) ).first;
+		}
+	const std::string filePath = path + "/" + value_to_hex_string( hash( emptyRef ) ) + ".dat";
+	FILE *file = fopen( filePath.c_str(), "wb" );
+	ASSERT_TRUE( file != nullptr );
+	fclose( file );
+
+	// the empty file is corrupted, whether it is read, mapped or streamed, and loaded alone or in a batch
+	for( uint pass = 0; pass < 3; ++pass )
+		{
+		EntityHandler::Settings settings;
+		settings.UseMemoryMappedFiles = ( pass == 1 );
+		settings.StreamedLoadSize = ( pass == 2 ) ? 1024 : 0;
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntity( emptyRef ), Status::ECorrupted );
+		EXPECT_EQ( handler.LoadEntities( { emptyRef } ), Status::ECorrupted );
+		EXPECT_FALSE( handler.IsEntityLoaded( emptyRef ) );
+		}
+	}
+
+TEST( EntityHandlerTests , Scrubber )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "Scrubber" );
+	const size_t entity_count = 20;
+
+	// add half of the entities as loose files, and half into packfiles, and corrupt one of the loose files
+	std::vector<entity_ref> refs;
+		{
+		EntityHandler looseHandler;
+		EXPECT_EQ( looseHandler.Initialize( path, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		EntityHandler::Settings packSettings;
+		packSettings.UsePackfiles = true;
+		EntityHandler packHandler;
+		EXPECT_EQ( packHandler.Initialize( path, { TestPackA::GetPackageRecord() }, packSettings ), Status::Ok );
+		for( size_t i = 0; i < entity_count; ++i )
+			{
+			const auto ret = ( i % 2 ) ? packHandler.AddEntity( GenerateRandomTestEntityA( 0, 20 ) ) : looseHandler.AddEntity( GenerateRandomTestEntityA( 0, 20 ) );
+			EXPECT_EQ( ret.second, Status::Ok );
+			refs.emplace_back( ret.first );
+			}
+		}
+	CorruptEntityFile( path, refs[0] );
+
+	// scrub the whole store, the loose files and the packfiles
+		{
+		CorruptionRecorder recorder;
+		EntityHandler::Settings settings;
+		settings.UsePackfiles = true;
+		settings.ScrubberBytesPerSecond = 1024 * 1024 * 1024;
+		settings.OnCorruptedEntity = recorder.GetCallback();
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		EXPECT_TRUE( WaitForCondition( [&]() { return handler.GetVerifyStatistics().ScrubPassCount >= 1; } ) );
+
+		const EntityHandler::VerifyStatistics statistics = handler.GetVerifyStatistics();
+		EXPECT_GE( statistics.ScrubbedEntityCount, u64( entity_count ) );
+		EXPECT_GT( statistics.ScrubbedByteCount, u64( 0 ) );
+		EXPECT_GE( statistics.CorruptedCount, u64( 1 ) );
+		const std::vector<entity_ref> corruptedRefs = recorder.GetRefs();
+		EXPECT_FALSE( corruptedRefs.empty() );
+		for( size_t i = 0; i < corruptedRefs.size(); ++i )
+			{
+			EXPECT_EQ( corruptedRefs[i], refs[0] );
+			}
+		}
+
+	// at a low rate, the scrubber waits after the first entity, and is stopped without finishing the pass
+		{
+		EntityHandler::Settings settings;
+		settings.ScrubberBytesPerSecond = 1;
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		EXPECT_TRUE( WaitForCondition( [&]() { return handler.GetVerifyStatistics().ScrubbedEntityCount >= 1; } ) );
+		EXPECT_EQ( handler.GetVerifyStatistics().ScrubbedEntityCount, u64( 1 ) );
+		EXPECT_EQ( handler.GetVerifyStatistics().ScrubPassCount, u64( 0 ) );
+		}
+	}
+
+TEST( EntityHandlerTests , LazySections )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "LazySections" );
+	const size_t child_count = 20;
+
+	// an entity with a children array and a table which are large enough to be deferred, and one with small ones
+	EntityHandler writeHandler;
+	EXPECT_EQ( writeHandler.Initialize( path, { TestPackA::GetPackageRecord() } ), Status::Ok );
+	std::vector<entity_ref> children;
+	for( size_t i = 0; i < child_count; ++i )
+		{
+		const auto ret = writeHandler.AddEntity( GenerateRandomTestEntityA( 0, 20 ) );
+		EXPECT_TRUE( IsAddedStatus( ret.second ) );
+		children.emplace_back( ret.first );
+		}
+	auto largeEntity = std::make_shared<TestEntityC>();
+	largeEntity->Name() = "large";
+	largeEntity->Children() = children;
+	largeEntity->References().set();
+	for( size_t i = 0; i < child_count; ++i )
+		{
+		largeEntity->References().value().Insert( item_ref::make_ref() ).Reference() = children[i];
+		}
+	const entity_ref largeRef = writeHandler.AddEntity( largeEntity ).first;
+	const entity_ref smallRef = AddTestEntityC( writeHandler, "small", { children[0] }, {}, {} );
+
+	for( uint pass = 0; pass < 2; ++pass )
+		{
+		EntityHandler::Settings settings;
+		settings.UseLazySections = true;
+		settings.UseMemoryMappedFiles = ( pass == 1 );
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+		// the sections are decoded once, when they are first accessed from any of the threads
+		EXPECT_EQ( handler.LoadEntity( largeRef ), Status::Ok );
+		auto loaded = std::dynamic_pointer_cast<const TestEntityC>( handler.GetLoadedEntity( largeRef ) );
+		ASSERT_TRUE( loaded != nullptr );
+		EXPECT_EQ( loaded->Name(), "large" );
+		std::vector<std::thread> threads;
+		std::atomic<uint> matchCount( 0 );
+		for( uint i = 0; i < 4; ++i )
+			{
+			threads.emplace_back( [&]()
+				{
+				if( loaded->Children() == children && loaded->References().has_value() && loaded->References().value().Size() == child_count )
+					{
+					++matchCount;
+					}
+				} );
+			}
+		for( size_t i = 0; i < threads.size(); ++i )
+			{
+			threads[i].join();
+			}
+		EXPECT_EQ( matchCount.load(), uint( 4 ) );
+		EXPECT_TRUE( TestEntityC::MF::Equals( loaded.get(), largeEntity.get() ) );
+
+		// small sections are decoded directly
+		EXPECT_EQ( handler.LoadEntity( smallRef ), Status::Ok );
+		auto loadedSmall = std::dynamic_pointer_cast<const TestEntityC>( handler.GetLoadedEntity( smallRef ) );
+		ASSERT_TRUE( loadedSmall != nullptr );
+		EXPECT_FALSE( TestEntityC::MF::HasPendingSections( *loadedSmall ) );
+		EXPECT_EQ( loadedSmall->Children().size(), size_t( 1 ) );
+
+		// a copy of a lazy entity which is not decoded yet is decoded, and equals the written entity
+		EntityHandler copyHandler;
+		EXPECT_EQ( copyHandler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		EXPECT_EQ( copyHandler.LoadEntity( largeRef ), Status::Ok );
+		auto pending = std::dynamic_pointer_cast<const TestEntityC>( copyHandler.GetLoadedEntity( largeRef ) );
+		ASSERT_TRUE( pending != nullptr );
+		EXPECT_TRUE( TestEntityC::MF::HasPendingSections( *pending ) );
+		const TestEntityC copy = *pending;
+		EXPECT_FALSE( TestEntityC::MF::HasPendingSections( copy ) );
+		EXPECT_TRUE( TestEntityC::MF::Equals( &copy, largeEntity.get() ) );
+
+		// the references of lazily loaded entities are not known, so the closure decodes the entity again to find them
+		EXPECT_EQ( handler.LoadEntityClosure( largeRef, 1 ), Status::Ok );
+		for( size_t i = 0; i < child_count; ++i )
+			{
+			EXPECT_TRUE( handler.IsEntityLoaded( children[i] ) );
+			}
+		}
+
+	// a section of an entity which was not verified when it was loaded, and fails to decode on access, is reported as corrupted
+	ASSERT_TRUE( CorruptEntityFileAfterText( path, largeRef, "Children" ) );
+		{
+		CorruptionRecorder recorder;
+		EntityHandler::Settings settings;
+		settings.UseLazySections = true;
+		settings.LoadVerifyPolicy = EntityHandler::VerifyPolicy::Sampled;
+		settings.VerifySampleInterval = 1000;
+		settings.OnCorruptedEntity = recorder.GetCallback();
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+		// the first load is the sampled one, so the corrupted entity is loaded unverified
+		EXPECT_EQ( handler.LoadEntity( smallRef ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntity( largeRef ), Status::Ok );
+		auto loaded = std::dynamic_pointer_cast<const TestEntityC>( handler.GetLoadedEntity( largeRef ) );
+		ASSERT_TRUE( loaded != nullptr );
+		EXPECT_EQ( handler.GetVerifyStatistics().CorruptedCount, u64( 0 ) );
+
+		// the entity is unloaded when the section is accessed
+		EXPECT_EQ( loaded->Name(), "large" );
+		EXPECT_NE( loaded->Children(), children );
+		EXPECT_EQ( handler.GetVerifyStatistics().CorruptedCount, u64( 1 ) );
+		EXPECT_EQ( recorder.GetRefs(), std::vector<entity_ref>( { largeRef } ) );
+		EXPECT_FALSE( handler.IsEntityLoaded( largeRef ) );
+		EXPECT_TRUE( handler.IsEntityLoaded( smallRef ) );
+		}
+	}
@@ -107,13 +107,15 @@ TEST( EntityReadWriteTests , TestEntityWriterAndReadback )
 	{
 	setup_random_seed();
 
-	// for each pass, run with normal or flipped byte order
-	for( uint pass_index=0; pass_index<(2*global_number_of_passes); ++pass_index )
+	// for each pass, run with normal or flipped byte order, and with unpadded or padded payloads
+	const u64 payload_alignments[] = { 0, 16, 64 };
+	for( uint pass_index=0; pass_index<(6*global_number_of_passes); ++pass_index )
 		{
 		MemoryWriteStream ws;
 		EntityWriter ew( ws );
 
 		ws.SetFlipByteOrder( (pass_index & 0x1) != 0 );
+		ws.SetPayloadAlignment( payload_alignments[(pass_index / 2) % 3] );
 
 		std::vector<std::string> key_names =
 			{
@@ -192,3 +194,381 @@ TEST( EntityReadWriteTests , TestEntityWriterAndReadback )
 		TestEntityWriter_TestValueType<entity_ref>( ws, ew, key_names );
 		}
 	}
+
+// reads the values of the blocks written by TestEntityWriter_TableOfContents, in reverse order
+static void TestEntityReader_SeekValues( MemoryReadStream &rs, EntityReader &er, const std::vector<u32> &values, const std::string &text, const fmat4 &transform )
+	{
+	// values in the section and nested section
+	EntityReader *section_reader = nullptr;
+	bool success = false;
+	EXPECT_TRUE( er.Seek( pdsKeyMacro( "Section" ) ) );
+	std::tie( section_reader, success ) = er.BeginReadSection( pdsKeyMacro( "Section" ), false );
+	EXPECT_TRUE( success );
+	ASSERT_TRUE( section_reader != nullptr );
+	EXPECT_TRUE( section_reader->Seek( pdsKeyMacro( "Nested" ) ) );
+	EntityReader *nested_reader = nullptr;
+	std::tie( nested_reader, success ) = section_reader->BeginReadSection( pdsKeyMacro( "Nested" ), false );
+	EXPECT_TRUE( success );
+	ASSERT_TRUE( nested_reader != nullptr );
+	EXPECT_TRUE( nested_reader->Seek( pdsKeyMacro( "Text" ) ) );
+	std::string read_text;
+	EXPECT_TRUE( nested_reader->Read( pdsKeyMacro( "Text" ), read_text ) );
+	EXPECT_EQ( read_text, text );
+	EXPECT_TRUE( section_reader->EndReadSection( nested_reader ) );
+	EXPECT_TRUE( section_reader->Seek( pdsKeyMacro( "Transform" ) ) );
+	fmat4 read_transform = {};
+	EXPECT_TRUE( section_reader->Read( pdsKeyMacro( "Transform" ), read_transform ) );
+	EXPECT_EQ( read_transform, transform );
+	EXPECT_FALSE( section_reader->Seek( pdsKeyMacro( "Values" ) ) );
+	er.EndReadSection( section_reader );
+
+	// the top values, the last value first
+	for( size_t i = values.size(); i-- > 0; )
+		{
+		const std::string key = "Value" + std::to_string( i );
+		EXPECT_TRUE( er.Seek( key.c_str(), (u8)key.size() ) );
+		u32 read_value = 0;
+		EXPECT_TRUE( er.Read( key.c_str(), (u8)key.size(), read_value ) );
+		EXPECT_EQ( read_value, values[i] );
+		}
+	EXPECT_TRUE( er.Seek( pdsKeyMacro( "Values" ) ) );
+	std::vector<u32> read_values;
+	EXPECT_TRUE( er.Read( pdsKeyMacro( "Values" ), read_values ) );
+	EXPECT_EQ( read_values, values );
+
+	// keys which are not in the reader are not found, and the position is not moved
+	const u64 position = rs.GetPosition();
+	EXPECT_FALSE( er.Seek( pdsKeyMacro( "Missing" ) ) );
+	EXPECT_FALSE( er.Seek( pdsKeyMacro( "Transform" ) ) );
+	EXPECT_EQ( rs.GetPosition(), position );
+	}
+
+TEST( EntityReadWriteTests , TableOfContents )
+	{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < 2; ++pass_index )
+		{
+		// the first and last bytes of the values are zero, so the value bytes before the keys of the small blocks can't be the
+		// start of a longer key, in either byte order, and the blocks are found when scanned (see is_small_block_key_ambiguous)
+		std::vector<u32> values;
+		random_vector<u32>( values, 10, 100 );
+		for( size_t i = 0; i < values.size(); ++i )
+			{
+			values[i] &= 0x00ffff00;
+			}
+		const std::string text = random_value<std::string>();
+		const fmat4 transform = random_value<fmat4>();
+
+		// a values array, a section with a nested section, a sections array, and small values after the large blocks
+		MemoryWriteStream ws;
+		ws.SetFlipByteOrder( pass_index == 1 );
+		EntityWriter ew( ws );
+		ew.CollectTableOfContents();
+		EXPECT_TRUE( ew.Write( pdsKeyMacro( "Values" ), values ) );
+		EntityWriter *section_writer = ew.BeginWriteSection( pdsKeyMacro( "Section" ) );
+		ASSERT_TRUE( section_writer != nullptr );
+		EXPECT_TRUE( section_writer->Write( pdsKeyMacro( "Transform" ), transform ) );
+		EntityWriter *nested_writer = section_writer->BeginWriteSection( pdsKeyMacro( "Nested" ) );
+		ASSERT_TRUE( nested_writer != nullptr );
+		EXPECT_TRUE( nested_writer->Write( pdsKeyMacro( "Text" ), text ) );
+		EXPECT_TRUE( section_writer->EndWriteSection( nested_writer ) );
+		EXPECT_TRUE( ew.EndWriteSection( section_writer ) );
+		EntityWriter *array_writer = ew.BeginWriteSectionsArray( pdsKeyMacro( "Array" ), 1 );
+		ASSERT_TRUE( array_writer != nullptr );
+		EXPECT_TRUE( ew.BeginWriteSectionInArray( array_writer, 0 ) );
+		EXPECT_TRUE( array_writer->Write( pdsKeyMacro( "Text" ), text ) );
+		EXPECT_TRUE( ew.EndWriteSectionInArray( array_writer, 0 ) );
+		EXPECT_TRUE( ew.EndWriteSectionsArray( array_writer ) );
+		for( size_t i = 0; i < values.size(); ++i )
+			{
+			const std::string key = "Value" + std::to_string( i );
+			EXPECT_TRUE( ew.Write( key.c_str(), (u8)key.size(), values[i] ) );
+			}
+		const u64 size_without_table = ws.GetSize();
+		EXPECT_TRUE( ew.WriteTableOfContents() );
+		EXPECT_GT( ws.GetSize(), size_without_table );
+		EXPECT_FALSE( ew.WriteTableOfContents() );
+
+		// read with the table of contents
+			{
+			MemoryReadStream rs( ws.GetData(), ws.GetSize(), ws.GetFlipByteOrder() );
+			EntityReader er( rs );
+			EXPECT_TRUE( er.ReadTableOfContents() );
+			EXPECT_TRUE( er.HasTableOfContents() );
+			TestEntityReader_SeekValues( rs, er, values, text, transform );
+			}
+
+		// read by scanning the blocks, without the table of contents
+			{
+			MemoryReadStream rs( ws.GetData(), size_without_table, ws.GetFlipByteOrder() );
+			EntityReader er( rs );
+			EXPECT_TRUE( er.ReadTableOfContents() );
+			EXPECT_FALSE( er.HasTableOfContents() );
+			TestEntityReader_SeekValues( rs, er, values, text, transform );
+			}
+		}
+
+	// without a table of contents, a small block with the key "abId" and a u16 value can also be read as the key "Id" with 
+	// a u32 value, so it is not matched by a seek for "Id". a block which is only a match for "Id" is found.
+	for( uint pass_index = 0; pass_index < 2; ++pass_index )
+		{
+		const u16 suffix_value = 0x1234;
+		const u32 value = 0x00567800;
+		MemoryWriteStream ws;
+		ws.SetFlipByteOrder( pass_index == 1 );
+		EntityWriter ew( ws );
+		EXPECT_TRUE( ew.Write( pdsKeyMacro( "abId" ), suffix_value ) );
+		const u64 size_without_id = ws.GetSize();
+		EXPECT_TRUE( ew.Write( pdsKeyMacro( "Id" ), value ) );
+
+			{
+			MemoryReadStream rs( ws.GetData(), size_without_id, ws.GetFlipByteOrder() );
+			EntityReader er( rs );
+			EXPECT_FALSE( er.Seek( pdsKeyMacro( "Id" ) ) );
+			EXPECT_TRUE( er.Seek( pdsKeyMacro( "abId" ) ) );
+			u16 read_suffix_value = 0;
+			EXPECT_TRUE( er.Read( pdsKeyMacro( "abId" ), read_suffix_value ) );
+			EXPECT_EQ( read_suffix_value, suffix_value );
+			}
+
+			{
+			MemoryReadStream rs( ws.GetData(), ws.GetSize(), ws.GetFlipByteOrder() );
+			EntityReader er( rs );
+			EXPECT_TRUE( er.Seek( pdsKeyMacro( "Id" ) ) );
+			u32 read_value = 0;
+			EXPECT_TRUE( er.Read( pdsKeyMacro( "Id" ), read_value ) );
+			EXPECT_EQ( read_value, value );
+			}
+		}
+	}
+
+TEST( EntityReadWriteTests , ReadView )
+	{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < 2; ++pass_index )
+		{
+		std::vector<u64> values;
+		random_vector<u64>( values, 10, 100 );
+		std::vector<fvec3> vectors;
+		random_vector<fvec3>( vectors, 10, 100 );
+
+		MemoryWriteStream ws;
+		ws.SetFlipByteOrder( pass_index == 1 );
+		EntityWriter ew( ws );
+		EXPECT_TRUE( ew.Write( pdsKeyMacro( "Values" ), values ) );
+		EXPECT_TRUE( ew.Write( pdsKeyMacro( "Vectors" ), vectors ) );
+
+		// place the data at each offset within an alignment of the values, the values are in place in exactly one of them
+		uint in_place_count = 0;
+		for( size_t offset = 0; offset < sizeof( u64 ); ++offset )
+			{
+			std::vector<u64> buffer( (size_t)( ws.GetSize() / sizeof( u64 ) ) + 2 );
+			u8 *data = ( (u8 *)buffer.data() ) + offset;
+			memcpy( data, ws.GetData(), (size_t)ws.GetSize() );
+
+			MemoryReadStream rs( data, ws.GetSize(), ws.GetFlipByteOrder() );
+			EntityReader er( rs );
+
+			array_view<u64> values_view;
+			std::vector<u64> values_copy;
+			EXPECT_TRUE( er.ReadView( pdsKeyMacro( "Values" ), values_view, values_copy ) );
+			ASSERT_EQ( values_view.size(), values.size() );
+			EXPECT_TRUE( std::equal( values_view.begin(), values_view.end(), values.begin() ) );
+
+			const bool in_place = ( values_view.data() != values_copy.data() );
+			if( in_place )
+				{
+				EXPECT_TRUE( values_copy.empty() );
+				EXPECT_TRUE( (const u8 *)values_view.data() >= data && (const u8 *)values_view.end() <= data + ws.GetSize() );
+				EXPECT_EQ( (size_t)values_view.data() % alignof( u64 ), size_t( 0 ) );
+				++in_place_count;
+				}
+
+			array_view<fvec3> vectors_view;
+			std::vector<fvec3> vectors_copy;
+			EXPECT_TRUE( er.ReadView( pdsKeyMacro( "Vectors" ), vectors_view, vectors_copy ) );
+			ASSERT_EQ( vectors_view.size(), vectors.size() );
+			EXPECT_TRUE( std::equal( vectors_view.begin(), vectors_view.end(), vectors.begin() ) );
+			}
+
+		// flipped values are always copied
+		EXPECT_EQ( in_place_count, ( pass_index == 0 ) ? 1u : 0u );
+		}
+	}
+
+TEST( EntityReadWriteTests , PaddedPayloads )
+	{
+	setup_random_seed();
+
+	std::vector<u64> values;
+	random_vector<u64>( values, 10, 100 );
+	const std::string text = random_value<std::string>();
+	idx_vector<fvec4> indexed_vectors;
+	random_idx_vector<fvec4>( indexed_vectors, 10, 100 );
+
+	const u64 payload_alignments[] = { 16, 64 };
+	for( u64 alignment : payload_alignments )
+		{
+		// keys of all lengths, so the payloads start at all offsets without padding
+		MemoryWriteStream ws;
+		ws.SetPayloadAlignment( alignment );
+		EntityWriter ew( ws );
+		std::vector<std::string> keys;
+		for( size_t key_length = 1; key_length <= EntityMaxKeyLength; ++key_length )
+			{
+			keys.emplace_back( std::string( key_length, 'k' ) );
+			EXPECT_TRUE( ew.Write( keys.back().c_str(), (u8)key_length, values ) );
+			EXPECT_TRUE( ew.Write( keys.back().c_str(), (u8)key_length, text ) );
+			EXPECT_TRUE( ew.Write( keys.back().c_str(), (u8)key_length, indexed_vectors ) );
+			}
+
+		// the start of the stream is aligned in the buffer, so the values are viewed in place, at a multiple of the alignment
+		std::vector<u8> buffer( (size_t)( ws.GetSize() + alignment ) );
+		u8 *data = buffer.data() + ( alignment - ( (size_t)buffer.data() % alignment ) ) % alignment;
+		memcpy( data, ws.GetData(), (size_t)ws.GetSize() );
+		MemoryReadStream rs( data, ws.GetSize(), false );
+		EntityReader er( rs );
+		for( const std::string &key : keys )
+			{
+			array_view<u64> values_view;
+			std::vector<u64> values_copy;
+			EXPECT_TRUE( er.ReadView( key.c_str(), (u8)key.size(), values_view, values_copy ) );
+			EXPECT_TRUE( values_copy.empty() );
+			EXPECT_EQ( u64( (const u8 *)values_view.data() - data ) % alignment, u64( 0 ) );
+			ASSERT_EQ( values_view.size(), values.size() );
+			EXPECT_TRUE( std::equal( values_view.begin(), values_view.end(), values.begin() ) );
+
+			std::string read_text;
+			EXPECT_TRUE( er.Read( key.c_str(), (u8)key.size(), read_text ) );
+			EXPECT_EQ( read_text, text );
+
+			idx_vector<fvec4> read_indexed_vectors;
+			EXPECT_TRUE( er.Read( key.c_str(), (u8)key.size(), read_indexed_vectors ) );
+			EXPECT_EQ( read_indexed_vectors, indexed_vectors );
+			}
+		EXPECT_EQ( rs.GetPosition(), ws.GetSize() );
+		}
+	}
+
+TEST( EntityReadWriteTests , InternedKeys )
+	{
+	setup_random_seed();
+
+	for( uint pass_index = 0; pass_index < 2; ++pass_index )
+		{
+		std::vector<u32> values;
+		random_vector<u32>( values, 200, 300 );
+		const std::string text = random_value<std::string>();
+		const fmat4 transform = random_value<fmat4>();
+
+		// the same blocks as the table of contents test, written with and without interned keys. more than 0x80 keys, so both id sizes are used
+		MemoryWriteStream streams[2];
+		for( uint intern_index = 0; intern_index < 2; ++intern_index )
+			{
+			MemoryWriteStream &ws = streams[intern_index];
+			ws.SetFlipByteOrder( pass_index == 1 );
+			EntityWriter ew( ws );
+			if( intern_index == 1 )
+				{
+				EXPECT_TRUE( ew.InternKeys() );
+				}
+			ew.CollectTableOfContents();
+			EXPECT_TRUE( ew.Write( pdsKeyMacro( "Values" ), values ) );
+			EntityWriter *section_writer = ew.BeginWriteSection( pdsKeyMacro( "Section" ) );
+			ASSERT_TRUE( section_writer != nullptr );
+			EXPECT_TRUE( section_writer->Write( pdsKeyMacro( "Transform" ), transform ) );
+			EntityWriter *nested_writer = section_writer->BeginWriteSection( pdsKeyMacro( "Nested" ) );
+			ASSERT_TRUE( nested_writer != nullptr );
+			EXPECT_TRUE( nested_writer->Write( pdsKeyMacro( "Text" ), text ) );
+			EXPECT_TRUE( section_writer->EndWriteSection( nested_writer ) );
+			EXPECT_TRUE( ew.EndWriteSection( section_writer ) );
+			EntityWriter *array_writer = ew.BeginWriteSectionsArray( pdsKeyMacro( "Array" ), 1 );
+			ASSERT_TRUE( array_writer != nullptr );
+			EXPECT_TRUE( ew.BeginWriteSectionInArray( array_writer, 0 ) );
+			EXPECT_TRUE( array_writer->Write( pdsKeyMacro( "Text" ), text ) );
+			EXPECT_TRUE( ew.EndWriteSectionInArray( array_writer, 0 ) );
+			EXPECT_TRUE( ew.EndWriteSectionsArray( array_writer ) );
+			for( size_t i = 0; i < values.size(); ++i )
+				{
+				const std::string key = "Value" + std::to_string( i );
+				EXPECT_TRUE( ew.Write( key.c_str(), (u8)key.size(), values[i] ) );
+				}
+			EXPECT_TRUE( ew.WriteTableOfContents() );
+			if( intern_index == 1 )
+				{
+				EXPECT_TRUE( ew.WriteKeyTable() );
+				EXPECT_FALSE( ew.InternKeys() );
+				}
+			else
+				{
+				EXPECT_FALSE( ew.WriteKeyTable() );
+				}
+			}
+		const MemoryWriteStream &ws = streams[1];
+		EXPECT_LT( ws.GetSize(), streams[0].GetSize() );
+
+		// read the blocks in order
+			{
+			MemoryReadStream rs( ws.GetData(), ws.GetSize(), ws.GetFlipByteOrder() );
+			EntityReader er( rs );
+			EXPECT_TRUE( er.ReadKeyTable() );
+			EXPECT_TRUE( rs.GetKeyTable() != nullptr );
+			std::vector<u32> read_values;
+			EXPECT_TRUE( er.Read( pdsKeyMacro( "Values" ), read_values ) );
+			EXPECT_EQ( read_values, values );
+			EntityReader *section_reader = nullptr;
+			bool success = false;
+			std::tie( section_reader, success ) = er.BeginReadSection( pdsKeyMacro( "Section" ), false );
+			EXPECT_TRUE( success );
+			ASSERT_TRUE( section_reader != nullptr );
+			fmat4 read_transform = {};
+			EXPECT_TRUE( section_reader->Read( pdsKeyMacro( "Transform" ), read_transform ) );
+			EXPECT_EQ( read_transform, transform );
+			EntityReader *nested_reader = nullptr;
+			std::tie( nested_reader, success ) = section_reader->BeginReadSection( pdsKeyMacro( "Nested" ), false );
+			EXPECT_TRUE( success );
+			ASSERT_TRUE( nested_reader != nullptr );
+			std::string read_text;
+			EXPECT_TRUE( nested_reader->Read( pdsKeyMacro( "Text" ), read_text ) );
+			EXPECT_EQ( read_text, text );
+			EXPECT_TRUE( section_reader->EndReadSection( nested_reader ) );
+			EXPECT_TRUE( er.EndReadSection( section_reader ) );
+			}
+
+		// seek with and without the table of contents
+		for( uint toc_index = 0; toc_index < 2; ++toc_index )
+			{
+			MemoryReadStream rs( ws.GetData(), ws.GetSize(), ws.GetFlipByteOrder() );
+			EntityReader er( rs );
+			EXPECT_TRUE( er.ReadKeyTable() );
+			if( toc_index == 1 )
+				{
+				EXPECT_TRUE( er.ReadTableOfContents() );
+				EXPECT_TRUE( er.HasTableOfContents() );
+				}
+			EXPECT_FALSE( er.Seek( pdsKeyMacro( "NotAKey" ) ) );
+			TestEntityReader_SeekValues( rs, er, values, text, transform );
+			}
+
+		// a stream without interned keys has no key table
+			{
+			MemoryReadStream rs( streams[0].GetData(), streams[0].GetSize(), streams[0].GetFlipByteOrder() );
+			EntityReader er( rs );
+			EXPECT_TRUE( er.ReadKeyTable() );
+			EXPECT_TRUE( rs.GetKeyTable() == nullptr );
+			EXPECT_EQ( rs.GetPosition(), u64( 0 ) );
+			}
+
+		// a corrupted pointer to the key table fails
+			{
+			std::vector<u8> corrupted( ws.GetData(), ws.GetData() + ws.GetSize() );
+			corrupted[9] ^= 0x01;
+			MemoryReadStream rs( corrupted.data(), corrupted.size(), ws.GetFlipByteOrder() );
+			EntityReader er( rs );
+			EXPECT_FALSE( er.ReadKeyTable() );
+			EXPECT_TRUE( rs.GetKeyTable() == nullptr );
+			}
+		}
+	}
@@ -0,0 +1,265 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Tests.h"
+
+#include <pds/PackfileStore.h>
+#include <pds/SHA256.h>
+
+#include "TestHelpers/structure_generation.h"
+
+using TestPackA::TestEntityA;
+
+// generates random data, and its sha256 hash
+static std::vector<u8> RandomData( hash &id, size_t minSize, size_t maxSize )
+	{
+	std::vector<u8> data( capped_rand( minSize, maxSize ) );
+	for( size_t i = 0; i < data.size(); ++i )
+		{
+		data[i] = u8_rand();
+		}
+	SHA256 sha( data.data(), data.size() );
+	sha.GetDigest( id.digest );
+	return data;
+	}
+
+static bool FileExists( const std::string &path )
+	{
+	FILE *file = fopen( path.c_str(), "rb" );
+	if( !file )
+		{
+		return false;
+		}
+	fclose( file );
+	return true;
+	}
+
+TEST( PackfileStoreTests , WriteAndRead )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "WriteAndRead" );
+	const size_t count = 500;
+	const u64 maxSegmentSize = 64 * 1024; // small segments, so the test spans many segments
+
+	std::vector<hash> ids( count );
+	std::vector<std::vector<u8>> datas( count );
+
+		{
+		PackfileStore store;
+		EXPECT_EQ( store.Initialize( path, maxSegmentSize ), Status::Ok );
+		for( size_t i = 0; i < count; ++i )
+			{
+			datas[i] = RandomData( ids[i], 1, 2000 );
+			EXPECT_EQ( store.Write( ids[i], datas[i].data(), datas[i].size() ), Status::Ok );
+			}
+
+		// writing the same data again is detected
+		EXPECT_EQ( store.Write( ids[0], datas[0].data(), datas[0].size() ), Status::WAlreadyExists );
+
+		for( size_t i = 0; i < count; ++i )
+			{
+			std::vector<u8> readData;
+			EXPECT_EQ( store.Read( ids[i], readData ), Status::Ok );
+			EXPECT_EQ( readData, datas[i] );
+			}
+
+		std::vector<u8> readData;
+		EXPECT_EQ( store.Read( hash_rand(), readData ), Status::ECantOpen );
+		}
+
+	// the store has more than one segment, with index files
+	EXPECT_TRUE( FileExists( path + "/segment-000002.pack" ) );
+	EXPECT_TRUE( FileExists( path + "/segment-000001.index" ) );
+
+	// reopen the store, which loads the index files, and append some more
+		{
+		PackfileStore store;
+		EXPECT_EQ( store.Initialize( path, maxSegmentSize ), Status::Ok );
+		for( size_t i = 0; i < count; ++i )
+			{
+			EXPECT_TRUE( store.Contains( ids[i] ) );
+			std::vector<u8> readData;
+			EXPECT_EQ( store.Read( ids[i], readData ), Status::Ok );
+			EXPECT_EQ( readData, datas[i] );
+			}
+
+		hash id;
+		std::vector<u8> data = RandomData( id, 1, 2000 );
+		EXPECT_EQ( store.Write( id, data.data(), data.size() ), Status::Ok );
+		ids.emplace_back( id );
+		datas.emplace_back( data );
+		}
+
+	// reopen and check the appended entity as well
+		{
+		PackfileStore store;
+		EXPECT_EQ( store.Initialize( path, maxSegmentSize ), Status::Ok );
+		for( size_t i = 0; i < ids.size(); ++i )
+			{
+			std::vector<u8> readData;
+			EXPECT_EQ( store.Read( ids[i], readData ), Status::Ok );
+			EXPECT_EQ( readData, datas[i] );
+			}
+		}
+	}
+
+TEST( PackfileStoreTests , RecoverTornSegment )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "RecoverTornSegment" );
+
+	hash id1, id2;
+	const std::vector<u8> data1 = RandomData( id1, 100, 200 );
+	const std::vector<u8> data2 = RandomData( id2, 100, 200 );
+
+		{
+		PackfileStore store;
+		EXPECT_EQ( store.Initialize( path ), Status::Ok );
+		EXPECT_EQ( store.Write( id1, data1.data(), data1.size() ), Status::Ok );
+		}
+
+	// simulate a crash in the middle of appending a record: the index is outdated, and the segment ends with a partial record
+	FILE *file = fopen( ( path + "/segment-000001.pack" ).c_str(), "ab" );
+	ASSERT_TRUE( file != nullptr );
+	const u64 tornSize = 1000;
+	fwrite( &id2, 1, 32, file );
+	fwrite( &tornSize, 1, sizeof( u64 ), file );
+	fwrite( data2.data(), 1, 10, file );
+	fclose( file );
+
+		{
+		PackfileStore store;
+		EXPECT_EQ( store.Initialize( path ), Status::Ok );
+		EXPECT_TRUE( store.Contains( id1 ) );
+		EXPECT_FALSE( store.Contains( id2 ) );
+
+		// the torn record is overwritten
+		EXPECT_EQ( store.Write( id2, data2.data(), data2.size() ), Status::Ok );
+		}
+
+		{
+		PackfileStore store;
+		EXPECT_EQ( store.Initialize( path ), Status::Ok );
+		std::vector<u8> readData;
+		EXPECT_EQ( store.Read( id1, readData ), Status::Ok );
+		EXPECT_EQ( readData, data1 );
+		EXPECT_EQ( store.Read( id2, readData ), Status::Ok );
+		EXPECT_EQ( readData, data2 );
+		}
+	}
+
+TEST( PackfileStoreTests , RecoverZeroFilledSegment )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "RecoverZeroFilledSegment" );
+
+	hash id1, id2;
+	const std::vector<u8> data1 = RandomData( id1, 100, 200 );
+	const std::vector<u8> data2 = RandomData( id2, 100, 200 );
+
+		{
+		PackfileStore store;
+		EXPECT_EQ( store.Initialize( path ), Status::Ok );
+		EXPECT_EQ( store.Write( id1, data1.data(), data1.size() ), Status::Ok );
+		}
+
+	// simulate a crash after the size of the segment grew, but before the data reached the disk: a record header with 
+	// data which does not match its hash, followed by a zero-filled tail, which both fit in the segment
+	FILE *file = fopen( ( path + "/segment-000001.pack" ).c_str(), "ab" );
+	ASSERT_TRUE( file != nullptr );
+	const u64 recordSize = data2.size();
+	const std::vector<u8> zeros( 4096, 0 );
+	fwrite( &id2, 1, 32, file );
+	fwrite( &recordSize, 1, sizeof( u64 ), file );
+	fwrite( zeros.data(), 1, data2.size(), file );
+	fwrite( zeros.data(), 1, zeros.size(), file );
+	fclose( file );
+
+		{
+		PackfileStore store;
+		EXPECT_EQ( store.Initialize( path ), Status::Ok );
+		std::vector<hash> ids;
+		store.ListEntities( ids );
+		ASSERT_EQ( ids.size(), size_t( 1 ) );
+		EXPECT_EQ( ids[0], id1 );
+		EXPECT_FALSE( store.Contains( id2 ) );
+
+		// the records which did not match are overwritten
+		EXPECT_EQ( store.Write( id2, data2.data(), data2.size() ), Status::Ok );
+		}
+
+		{
+		PackfileStore store;
+		EXPECT_EQ( store.Initialize( path ), Status::Ok );
+		std::vector<u8> readData;
+		EXPECT_EQ( store.Read( id1, readData ), Status::Ok );
+		EXPECT_EQ( readData, data1 );
+		EXPECT_EQ( store.Read( id2, readData ), Status::Ok );
+		EXPECT_EQ( readData, data2 );
+		}
+	}
+
+TEST( PackfileStoreTests , EntityHandlerWithPackfiles )
+	{
+	setup_random_seed();
+
+	const std::string path = CreateTestDirectory( "EntityHandlerWithPackfiles" );
+	const size_t entity_count = 50;
+
+	// write half of the entities as loose files, and half into packfiles
+	std::vector<std::shared_ptr<TestEntityA>> entities;
+	std::vector<entity_ref> refs;
+		{
+		EntityHandler looseHandler;
+		EXPECT_EQ( looseHandler.Initialize( path, { TestPackA::GetPackageRecord() } ), Status::Ok );
+
+		EntityHandler::Settings settings;
+		settings.UsePackfiles = true;
+		EntityHandler packHandler;
+		EXPECT_EQ( packHandler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+		for( size_t i = 0; i < entity_count; ++i )
+			{
+			entities.emplace_back( GenerateRandomTestEntityA( 0, 50 ) );
+			const auto ret = ( i % 2 ) ? packHandler.AddEntity( entities.back() ) : looseHandler.AddEntity( entities.back() );
+			EXPECT_EQ( ret.second, Status::Ok );
+			refs.emplace_back( ret.first );
+			}
+		}
+	EXPECT_TRUE( FileExists( path + "/" + value_to_hex_string( hash( refs[0] ) ) + ".dat" ) );
+	EXPECT_FALSE( FileExists( path + "/" + value_to_hex_string( hash( refs[1] ) ) + ".dat" ) );
+
+	// a packfile handler loads both packed and loose entities
+	auto loadAll = [&]()
+		{
+		EntityHandler::Settings settings;
+		settings.UsePackfiles = true;
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( path, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		EXPECT_EQ( handler.LoadEntities( refs ), Status::Ok );
+		for( size_t i = 0; i < entity_count; ++i )
+			{
+			auto loaded = std::dynamic_pointer_cast<const TestEntityA>( handler.GetLoadedEntity( refs[i] ) );
+			EXPECT_TRUE( loaded != nullptr );
+			if( loaded )
+				{
+				EXPECT_TRUE( TestEntityA::MF::Equals( loaded.get(), entities[i].get() ) );
+				}
+			}
+		};
+	loadAll();
+
+	// compact the loose files into the packfiles, and load again
+		{
+		PackfileStore store;
+		EXPECT_EQ( store.Initialize( path ), Status::Ok );
+		u64 compactedCount = 0;
+		EXPECT_EQ( store.CompactLooseFiles( &compactedCount ), Status::Ok );
+		EXPECT_EQ( compactedCount, u64( entity_count / 2 ) );
+		}
+	EXPECT_FALSE( FileExists( path + "/" + value_to_hex_string( hash( refs[0] ) ) + ".dat" ) );
+	loadAll();
+	}
@@ -0,0 +1,300 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "PerformanceTests.h"
+
+#include <pds/ByteSwap.h>
+#include <pds/MemoryWriteStream.h>
+#include <pds/EntityWriter.inl>
+#include <pds/EntityReader.inl>
+
+// loads all the entities with a new handler set up with the settings, and returns the time it took
+static double LoadAllEntities( const std::vector<entity_ref> &refs, const EntityHandler::Settings &settings )
+	{
+	EntityHandler handler;
+	EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+
+	return MeasureMilliseconds( [&]()
+		{
+		for( size_t i = 0; i < refs.size(); ++i )
+			{
+			EXPECT_EQ( handler.LoadEntity( refs[i] ), Status::Ok );
+			}
+		} );
+	}
+
+// compares loading entities by reading the file into an allocation, with loading from a memory mapping
+static void CompareReadFileAndMemoryMappedLoads( const char *testName, size_t entityCount, size_t minItems, size_t maxItems )
+	{
+	const uint passes = 3;
+
+	const std::vector<entity_ref> refs = AddRandomTestEntities( entityCount, minItems, maxItems );
+
+	EntityHandler::Settings readFileSettings;
+	readFileSettings.UseMemoryMappedFiles = false;
+	EntityHandler::Settings memoryMappedSettings;
+	memoryMappedSettings.UseMemoryMappedFiles = true;
+
+	// warm up the file cache, so both variants are measured with the files cached
+	LoadAllEntities( refs, readFileSettings );
+
+	// alternate between the variants, and keep the best time of each
+	double readFileTime = DBL_MAX;
+	double memoryMappedTime = DBL_MAX;
+	for( uint pass = 0; pass < passes; ++pass )
+		{
+		readFileTime = std::min( readFileTime, LoadAllEntities( refs, readFileSettings ) );
+		memoryMappedTime = std::min( memoryMappedTime, LoadAllEntities( refs, memoryMappedSettings ) );
+		}
+
+	PrintPerformanceResult( testName, "read file", entityCount, readFileTime );
+	PrintPerformanceResult( testName, "memory mapped", entityCount, memoryMappedTime );
+	}
+
+TEST( EntityLoadPerformanceTests , SmallEntities )
+	{
+	setup_random_seed();
+	CompareReadFileAndMemoryMappedLoads( "SmallEntities", 5000, 0, 10 );
+	}
+
+TEST( EntityLoadPerformanceTests , LargeEntities )
+	{
+	setup_random_seed();
+	CompareReadFileAndMemoryMappedLoads( "LargeEntities", 50, 5000, 10000 );
+	}
+
+// reads a large array of vec3s which is stored in the flipped byte order, with each of the byte swap backends
+TEST( EntityLoadPerformanceTests , FlippedByteOrderArrays )
+	{
+	setup_random_seed();
+
+	const uint passes = 3;
+	const size_t itemCount = 4 * 1024 * 1024;
+	std::vector<float> values( itemCount * 3 );
+	for( size_t i = 0; i < values.size(); ++i )
+		{
+		values[i] = float_rand();
+		}
+	MemoryWriteStream ws;
+	ws.SetFlipByteOrder( true );
+	ws.Write( values.data(), values.size() );
+
+	const ByteSwap::Backend defaultBackend = ByteSwap::GetBackend();
+	const std::pair<ByteSwap::Backend, const char *> backends[] = { { ByteSwap::Backend::Portable, "portable" }, { ByteSwap::Backend::Ssse3, "ssse3" }, { ByteSwap::Backend::Avx2, "avx2" } };
+	std::vector<float> readValues( values.size() );
+	for( const auto &backend : backends )
+		{
+		if( !ByteSwap::SetBackend( backend.first ) )
+			{
+			continue;
+			}
+
+		double time = DBL_MAX;
+		for( uint pass = 0; pass < passes; ++pass )
+			{
+			time = std::min( time, MeasureMilliseconds( [&]()
+				{
+				MemoryReadStream rs( ws.GetData(), ws.GetSize(), true );
+				EXPECT_EQ( rs.Read( readValues.data(), readValues.size() ), u64( values.size() ) );
+				} ) );
+			}
+		EXPECT_EQ( readValues, values );
+		PrintPerformanceResult( "FlippedByteOrderArrays", backend.second, itemCount, time );
+		}
+	EXPECT_TRUE( ByteSwap::SetBackend( defaultBackend ) );
+	}
+
+// compares loading entities one by one, async one by one, and in one batch
+static void CompareSingleAndBatchLoads( const char *testName, size_t entityCount, size_t minItems, size_t maxItems )
+	{
+	const uint passes = 3;
+
+	const std::vector<entity_ref> refs = AddRandomTestEntities( entityCount, minItems, maxItems );
+
+	// each variant is run with a new handler, so no entity is already loaded
+	auto loadOneByOne = [&]()
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		return MeasureMilliseconds( [&]()
+			{
+			for( size_t i = 0; i < refs.size(); ++i )
+				{
+				EXPECT_EQ( handler.LoadEntity( refs[i] ), Status::Ok );
+				}
+			} );
+		};
+	auto loadAsyncOneByOne = [&]()
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		return MeasureMilliseconds( [&]()
+			{
+			std::vector<std::shared_future<Status>> futures;
+			futures.reserve( refs.size() );
+			for( size_t i = 0; i < refs.size(); ++i )
+				{
+				futures.emplace_back( handler.LoadEntityAsync( refs[i] ) );
+				}
+			for( size_t i = 0; i < futures.size(); ++i )
+				{
+				EXPECT_EQ( futures[i].get(), Status::Ok );
+				}
+			} );
+		};
+	auto loadBatch = [&]()
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		return MeasureMilliseconds( [&]()
+			{
+			EXPECT_EQ( handler.LoadEntities( refs ), Status::Ok );
+			} );
+		};
+
+	// warm up the file cache
+	loadOneByOne();
+
+	double oneByOneTime = DBL_MAX;
+	double asyncOneByOneTime = DBL_MAX;
+	double batchTime = DBL_MAX;
+	for( uint pass = 0; pass < passes; ++pass )
+		{
+		oneByOneTime = std::min( oneByOneTime, loadOneByOne() );
+		asyncOneByOneTime = std::min( asyncOneByOneTime, loadAsyncOneByOne() );
+		batchTime = std::min( batchTime, loadBatch() );
+		}
+
+	PrintPerformanceResult( testName, "LoadEntity", entityCount, oneByOneTime );
+	PrintPerformanceResult( testName, "LoadEntityAsync", entityCount, asyncOneByOneTime );
+	PrintPerformanceResult( testName, "LoadEntities", entityCount, batchTime );
+	}
+
+TEST( EntityLoadPerformanceTests , BatchLoadSmallEntities )
+	{
+	setup_random_seed();
+	CompareSingleAndBatchLoads( "BatchLoadSmallEntities", 10000, 0, 10 );
+	}
+
+// loads a few shared entities, which are each requested by many concurrent requests, like a material which is
+// referenced by many meshes. the requests for an entity which is being loaded join the load in flight.
+static void FanInLoads( const char *testName, size_t sharedCount, size_t requestCount, size_t minItems, size_t maxItems )
+	{
+	const uint passes = 3;
+
+	const std::vector<entity_ref> refs = AddRandomTestEntities( sharedCount, minItems, maxItems );
+
+	double fanInTime = DBL_MAX;
+	u64 coalescedCount = 0;
+	for( uint pass = 0; pass < passes; ++pass )
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		fanInTime = std::min( fanInTime, MeasureMilliseconds( [&]()
+			{
+			std::vector<std::shared_future<Status>> futures;
+			futures.reserve( requestCount );
+			for( size_t i = 0; i < requestCount; ++i )
+				{
+				futures.emplace_back( handler.LoadEntityAsync( refs[i % refs.size()] ) );
+				}
+			for( size_t i = 0; i < futures.size(); ++i )
+				{
+				EXPECT_EQ( futures[i].get(), Status::Ok );
+				}
+			} ) );
+		coalescedCount = handler.GetCacheStatistics().CoalescedCount;
+		}
+
+	PrintPerformanceResult( testName, "LoadEntityAsync", requestCount, fanInTime );
+	printf( "[ PERF     ] %-28s %-24s %8zu items %10llu coalesced\n", testName, "LoadEntityAsync", requestCount, (unsigned long long)coalescedCount );
+	}
+
+TEST( EntityLoadPerformanceTests , FanInLoads )
+	{
+	setup_random_seed();
+	FanInLoads( "FanInLoads", 16, 4000, 2000, 4000 );
+	}
+
+// serializes each entity into a stream, with or without interned keys, and returns the total size of the streams
+static size_t SerializeEntities( const std::vector<std::shared_ptr<TestPackA::TestEntityA>> &entities, bool internKeys, std::vector<std::unique_ptr<MemoryWriteStream>> &destStreams )
+	{
+	size_t totalSize = 0;
+	destStreams.clear();
+	for( size_t i = 0; i < entities.size(); ++i )
+		{
+		destStreams.emplace_back( std::make_unique<MemoryWriteStream>() );
+		EntityWriter writer( *destStreams.back() );
+		if( internKeys )
+			{
+			EXPECT_TRUE( writer.InternKeys() );
+			}
+		EXPECT_TRUE( TestPackA::TestEntityA::MF::Write( *entities[i], writer ) );
+		if( internKeys )
+			{
+			EXPECT_TRUE( writer.WriteKeyTable() );
+			}
+		totalSize += (size_t)destStreams.back()->GetSize();
+		}
+	return totalSize;
+	}
+
+// decodes the entities from the streams, and returns the time it took
+static double DecodeEntities( const std::vector<std::unique_ptr<MemoryWriteStream>> &streams )
+	{
+	return MeasureMilliseconds( [&]()
+		{
+		for( size_t i = 0; i < streams.size(); ++i )
+			{
+			MemoryReadStream rstream( streams[i]->GetData(), streams[i]->GetSize(), streams[i]->GetFlipByteOrder() );
+			EntityReader reader( rstream );
+			EXPECT_TRUE( reader.ReadKeyTable() );
+			TestPackA::TestEntityA entity;
+			EXPECT_TRUE( TestPackA::TestEntityA::MF::Read( entity, reader ) );
+			}
+		} );
+	}
+
+// compares the size and the decode time of entities which are written with and without interned keys
+static void CompareInternedKeys( const char *testName, size_t entityCount, size_t minItems, size_t maxItems )
+	{
+	const uint passes = 3;
+
+	std::vector<std::shared_ptr<TestPackA::TestEntityA>> entities;
+	entities.reserve( entityCount );
+	for( size_t i = 0; i < entityCount; ++i )
+		{
+		entities.emplace_back( GenerateRandomTestEntityA( minItems, maxItems ) );
+		}
+
+	std::vector<std::unique_ptr<MemoryWriteStream>> keyStreams;
+	std::vector<std::unique_ptr<MemoryWriteStream>> internedStreams;
+	const size_t keySize = SerializeEntities( entities, false, keyStreams );
+	const size_t internedSize = SerializeEntities( entities, true, internedStreams );
+	EXPECT_LT( internedSize, keySize );
+
+	double keyTime = DBL_MAX;
+	double internedTime = DBL_MAX;
+	for( uint pass = 0; pass < passes; ++pass )
+		{
+		keyTime = std::min( keyTime, DecodeEntities( keyStreams ) );
+		internedTime = std::min( internedTime, DecodeEntities( internedStreams ) );
+		}
+
+	PrintPerformanceResult( testName, "keys", entityCount, keyTime );
+	PrintPerformanceResult( testName, "interned keys", entityCount, internedTime );
+	printf( "[ PERF     ] %-28s %-24s %10zu bytes\n", testName, "keys", keySize );
+	printf( "[ PERF     ] %-28s %-24s %10zu bytes %10.2f %%\n", testName, "interned keys", internedSize, ( 100.0 * double( internedSize ) ) / double( keySize ) );
+	}
+
+TEST( EntityLoadPerformanceTests , InternedKeysSmallEntities )
+	{
+	setup_random_seed();
+	CompareInternedKeys( "InternedKeysSmall", 5000, 0, 10 );
+	}
+
+TEST( EntityLoadPerformanceTests , InternedKeysLargeEntities )
+	{
+	setup_random_seed();
+	CompareInternedKeys( "InternedKeysLarge", 50, 2000, 4000 );
+	}
@@ -0,0 +1,60 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "PerformanceTests.h"
+
+#include <thread>
+
+// looks up the loaded entities from threadCount threads at once, with a handler which has shardCount shards,
+// and returns the time it took
+static double LookupEntities( const std::vector<entity_ref> &refs, uint shardCount, uint threadCount, size_t lookupsPerThread )
+	{
+	EntityHandler::Settings settings;
+	settings.EntityShardCount = shardCount;
+	EntityHandler handler;
+	EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+	EXPECT_EQ( handler.LoadEntities( refs ), Status::Ok );
+
+	return MeasureMilliseconds( [&]()
+		{
+		std::vector<std::thread> threads;
+		for( uint t = 0; t < threadCount; ++t )
+			{
+			threads.emplace_back( [&handler, &refs, lookupsPerThread, t]()
+				{
+				// each thread walks the refs with its own stride, so the threads hit different shards
+				size_t index = t;
+				size_t foundCount = 0;
+				for( size_t i = 0; i < lookupsPerThread; ++i )
+					{
+					index = ( index + 7919 ) % refs.size();
+					if( handler.GetLoadedEntity( refs[index] ) )
+						{
+						++foundCount;
+						}
+					}
+				EXPECT_EQ( foundCount, lookupsPerThread );
+				} );
+			}
+		for( size_t t = 0; t < threads.size(); ++t )
+			{
+			threads[t].join();
+			}
+		} );
+	}
+
+TEST( EntityMapPerformanceTests , ConcurrentLookups )
+	{
+	setup_random_seed();
+
+	const size_t lookupsPerThread = 200000;
+	const std::vector<entity_ref> refs = AddRandomTestEntities( 10000, 0, 4 );
+
+	// compare one shard, which is a single lock around all entities, with the default number of shards
+	for( uint threadCount = 1; threadCount <= 32; threadCount *= 2 )
+		{
+		const std::string testName = "ConcurrentLookups " + std::to_string( threadCount ) + " threads";
+		PrintPerformanceResult( testName.c_str(), "1 shard", threadCount * lookupsPerThread, LookupEntities( refs, 1, threadCount, lookupsPerThread ) );
+		PrintPerformanceResult( testName.c_str(), "64 shards", threadCount * lookupsPerThread, LookupEntities( refs, EntityHandler::MaxEntityShardCount, threadCount, lookupsPerThread ) );
+		}
+	}
@@ -0,0 +1,178 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "PerformanceTests.h"
+
+#include <pds/MemoryWriteStream.h>
+#include <pds/EntityWriter.inl>
+#include <pds/WorkerPool.h>
+#include <pds/WriteStreamPool.h>
+
+#include "TestPackA/TestEntityC.h"
+
+// serializes the entity and hashes the serialized data afterwards, and returns the time it took
+template<class _Ty> static double WriteThenHash( const _Ty &entity, hash &digest )
+	{
+	return MeasureMilliseconds( [&]()
+		{
+		MemoryWriteStream wstream;
+		EntityWriter writer( wstream );
+		EXPECT_TRUE( _Ty::MF::Write( entity, writer ) );
+		SHA256 sha( (const u8 *)wstream.GetData(), wstream.GetSize() );
+		sha.GetDigest( digest.digest );
+		} );
+	}
+
+// measures the entity, and serializes and hashes it in one pass, and returns the time it took
+template<class _Ty> static double SinglePassHash( const _Ty &entity, hash &digest )
+	{
+	return MeasureMilliseconds( [&]()
+		{
+		MemoryWriteStream wstream;
+		wstream.BeginMeasure();
+			{
+			EntityWriter writer( wstream );
+			EXPECT_TRUE( _Ty::MF::Write( entity, writer ) );
+			}
+		wstream.BeginHashedWrite();
+			{
+			EntityWriter writer( wstream );
+			EXPECT_TRUE( _Ty::MF::Write( entity, writer ) );
+			}
+		EXPECT_TRUE( wstream.EndHashedWrite( digest ) );
+		} );
+	}
+
+// compares hashing the serialized data afterwards, with hashing it while it is written
+template<class _Ty> static void CompareWriteHashing( const char *testName, const _Ty &entity, size_t itemCount )
+	{
+	const uint passes = 3;
+
+	double writeThenHashTime = DBL_MAX;
+	double singlePassTime = DBL_MAX;
+	for( uint pass = 0; pass < passes; ++pass )
+		{
+		hash writeThenHashDigest = {};
+		hash singlePassDigest = {};
+		writeThenHashTime = std::min( writeThenHashTime, WriteThenHash( entity, writeThenHashDigest ) );
+		singlePassTime = std::min( singlePassTime, SinglePassHash( entity, singlePassDigest ) );
+		EXPECT_EQ( writeThenHashDigest, singlePassDigest );
+		}
+
+	PrintPerformanceResult( testName, "write then hash", itemCount, writeThenHashTime );
+	PrintPerformanceResult( testName, "single pass", itemCount, singlePassTime );
+	}
+
+TEST( EntityWritePerformanceTests , SinglePassHashingManyItems )
+	{
+	setup_random_seed();
+
+	const size_t itemCount = 100000;
+	const auto entity = GenerateRandomTestEntityA( itemCount, itemCount );
+	CompareWriteHashing( "SinglePassHashingManyItems", *entity, itemCount );
+	}
+
+TEST( EntityWritePerformanceTests , SinglePassHashingLargeArray )
+	{
+	setup_random_seed();
+
+	// 4M entity_refs, 128MB of array data
+	const size_t itemCount = 4 * 1024 * 1024;
+	TestPackA::TestEntityC entity;
+	entity.Children().resize( itemCount );
+	for( size_t i = 0; i < itemCount; ++i )
+		{
+		entity.Children()[i] = entity_ref( hash_rand() );
+		}
+	CompareWriteHashing( "SinglePassHashingLargeArray", entity, itemCount );
+	}
+
+// serializes the entity to the stream, and hashes the serialized data
+static void SerializeAndHash( const TestPackA::TestEntityA &entity, MemoryWriteStream &wstream )
+	{
+	EntityWriter writer( wstream );
+	EXPECT_TRUE( TestPackA::TestEntityA::MF::Write( entity, writer ) );
+	hash digest = {};
+	SHA256 sha( (const u8 *)wstream.GetData(), wstream.GetSize() );
+	sha.GetDigest( digest.digest );
+	}
+
+// serializes each entity on the worker pool, into a new stream per entity, or into a stream from the pool if set, and returns the time it took
+static double SerializeEntities( const std::vector<std::shared_ptr<TestPackA::TestEntityA>> &entities, WorkerPool &workers, WriteStreamPool *streamPool )
+	{
+	return MeasureMilliseconds( [&]()
+		{
+		std::vector<std::future<void>> futures;
+		futures.reserve( entities.size() );
+		for( size_t i = 0; i < entities.size(); ++i )
+			{
+			const TestPackA::TestEntityA *entity = entities[i].get();
+			futures.emplace_back( workers.Submit( [entity, streamPool]()
+				{
+				if( streamPool )
+					{
+					PooledWriteStream wstream( streamPool );
+					SerializeAndHash( *entity, *wstream );
+					}
+				else
+					{
+					MemoryWriteStream wstream;
+					SerializeAndHash( *entity, wstream );
+					}
+				} ) );
+			}
+		for( size_t i = 0; i < futures.size(); ++i )
+			{
+			futures[i].get();
+			}
+		} );
+	}
+
+// compares serializing small entities into a new stream per entity, with reusing streams from a pool,
+// and measures the throughput of adding the small entities to a handler, which uses the pool
+TEST( EntityWritePerformanceTests , PooledWriteStreamsSmallEntities )
+	{
+	setup_random_seed();
+
+	const uint passes = 3;
+	const size_t entityCount = 5000;
+	std::vector<std::shared_ptr<TestPackA::TestEntityA>> entities;
+	entities.reserve( entityCount );
+	for( size_t i = 0; i < entityCount; ++i )
+		{
+		entities.emplace_back( GenerateRandomTestEntityA( 0, 10 ) );
+		}
+
+	WorkerPool workers;
+	workers.Start( 0 );
+	WriteStreamPool streamPool;
+	streamPool.SetMaxStreamCount( workers.GetThreadCount() );
+
+	double newStreamTime = DBL_MAX;
+	double pooledStreamTime = DBL_MAX;
+	for( uint pass = 0; pass < passes; ++pass )
+		{
+		newStreamTime = std::min( newStreamTime, SerializeEntities( entities, workers, nullptr ) );
+		pooledStreamTime = std::min( pooledStreamTime, SerializeEntities( entities, workers, &streamPool ) );
+		}
+	PrintPerformanceResult( "PooledWriteStreamsSmall", "new stream per entity", entityCount, newStreamTime );
+	PrintPerformanceResult( "PooledWriteStreamsSmall", "pooled streams", entityCount, pooledStreamTime );
+
+	// add the entities with the handler, the files do not exist, so each entity is written
+	EntityHandler handler;
+	EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+	const double addTime = MeasureMilliseconds( [&]()
+		{
+		std::vector<std::future<std::pair<entity_ref, Status>>> futures;
+		futures.reserve( entities.size() );
+		for( size_t i = 0; i < entities.size(); ++i )
+			{
+			futures.emplace_back( handler.AddEntityAsync( entities[i] ) );
+			}
+		for( size_t i = 0; i < futures.size(); ++i )
+			{
+			EXPECT_TRUE( IsAddedStatus( futures[i].get().second ) );
+			}
+		} );
+	PrintPerformanceResult( "PooledWriteStreamsSmall", "AddEntityAsync", entityCount, addTime );
+	}
@@ -0,0 +1,6 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#define PDS_IMPLEMENTATION
+#include "PerformanceTests.h"
+
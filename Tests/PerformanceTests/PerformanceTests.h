@@ -0,0 +1,63 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#pragma once
+
+#include "../Tests.h"
+
+#include <chrono>
+#include <cstdio>
+#include <algorithm>
+
+#include "../TestHelpers/structure_generation.h"
+
+// the folder to write the performance test entities into, set up by the cmake script
+#ifndef PDS_PERFORMANCE_TEST_FOLDER
+#define PDS_PERFORMANCE_TEST_FOLDER "./PerformanceTestFolder"
+#endif
+
+// runs the function, and returns the wall clock time it took in milliseconds
+template<class _Func> inline double MeasureMilliseconds( _Func func )
+	{
+	const auto start = std::chrono::high_resolution_clock::now();
+	func();
+	const auto end = std::chrono::high_resolution_clock::now();
+	return std::chrono::duration<double, std::milli>( end - start ).count();
+	}
+
+// prints a result row of a performance test
+inline void PrintPerformanceResult( const char *testName, const char *variantName, size_t itemCount, double milliseconds )
+	{
+	printf( "[ PERF     ] %-28s %-24s %8zu items %10.2f ms %10.2f us/item\n", testName, variantName, itemCount, milliseconds, (milliseconds * 1000.0) / double( itemCount ) );
+	}
+
+// prints the median, 99th percentile and max of a list of latencies, as a result row of a performance test
+inline void PrintLatencyResult( const char *testName, const char *variantName, std::vector<double> latencies )
+	{
+	if( latencies.empty() )
+		{
+		return;
+		}
+	std::sort( latencies.begin(), latencies.end() );
+	const double p50 = latencies[latencies.size() / 2];
+	const double p99 = latencies[std::min( latencies.size() - 1, (latencies.size() * 99) / 100 )];
+	printf( "[ PERF     ] %-28s %-24s latency p50 %10.3f ms p99 %10.3f ms max %10.3f ms\n", testName, variantName, p50, p99, latencies.back() );
+	}
+
+// adds count random entities to the performance test folder, and returns their references
+inline std::vector<entity_ref> AddRandomTestEntities( size_t count, size_t minItems, size_t maxItems )
+	{
+	EntityHandler handler;
+	EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+
+	std::vector<entity_ref> refs;
+	refs.reserve( count );
+	for( size_t i = 0; i < count; ++i )
+		{
+		const auto ret = handler.AddEntity( GenerateRandomTestEntityA( minItems, maxItems ) );
+		EXPECT_TRUE( IsAddedStatus( ret.second ) );
+		refs.emplace_back( ret.first );
+		}
+
+	return refs;
+	}
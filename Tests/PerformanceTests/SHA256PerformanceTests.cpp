@@ -0,0 +1,124 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "PerformanceTests.h"
+
+#include <pds/SHA256.h>
+
+static const SHA256::Backend AllBackends[] = { SHA256::Backend::Portable, SHA256::Backend::Avx2, SHA256::Backend::ShaExtensions };
+
+static const char *BackendName( SHA256::Backend backend )
+	{
+	switch( backend )
+		{
+		case SHA256::Backend::Portable: return "portable";
+		case SHA256::Backend::Avx2: return "avx2";
+		case SHA256::Backend::ShaExtensions: return "sha-ni";
+		}
+	return "unknown";
+	}
+
+// prints a throughput result row of a performance test
+static void PrintThroughputResult( const char *testName, const char *variantName, size_t byteCount, double milliseconds )
+	{
+	printf( "[ PERF     ] %-28s %-24s %10zu bytes %10.2f ms %10.2f MB/s\n", testName, variantName, byteCount, milliseconds, ( double( byteCount ) / ( 1024.0 * 1024.0 ) ) / ( milliseconds / 1000.0 ) );
+	}
+
+TEST( SHA256PerformanceTests , LargeBuffer )
+	{
+	setup_random_seed();
+
+	const uint passes = 3;
+	const size_t byteCount = 64 * 1024 * 1024;
+	std::vector<u8> data( byteCount );
+	for( size_t i = 0; i < byteCount; ++i )
+		{
+		data[i] = u8_rand();
+		}
+
+	const SHA256::Backend defaultBackend = SHA256::GetBackend();
+	hash reference = {};
+	for( const SHA256::Backend backend : AllBackends )
+		{
+		if( !SHA256::SetBackend( backend ) )
+			{
+			continue;
+			}
+
+		double time = DBL_MAX;
+		for( uint pass = 0; pass < passes; ++pass )
+			{
+			hash digest = {};
+			time = std::min( time, MeasureMilliseconds( [&]()
+				{
+				SHA256 sha( data.data(), data.size() );
+				sha.GetDigest( digest.digest );
+				} ) );
+
+			// all backends must calculate the same digest
+			if( backend == SHA256::Backend::Portable )
+				{
+				reference = digest;
+				}
+			EXPECT_EQ( digest, reference );
+			}
+		PrintThroughputResult( "LargeBuffer", BackendName( backend ), byteCount, time );
+		}
+	EXPECT_TRUE( SHA256::SetBackend( defaultBackend ) );
+	}
+
+TEST( SHA256PerformanceTests , ManySmallMessages )
+	{
+	setup_random_seed();
+
+	// entity-sized messages, hashed one by one, and with HashMany
+	const uint passes = 3;
+	const size_t messageCount = 100000;
+	const size_t messageSize = 256;
+	std::vector<u8> data( messageCount * messageSize );
+	for( size_t i = 0; i < data.size(); ++i )
+		{
+		data[i] = u8_rand();
+		}
+	std::vector<const u8 *> datas( messageCount );
+	std::vector<size_t> dataLengths( messageCount, messageSize );
+	for( size_t i = 0; i < messageCount; ++i )
+		{
+		datas[i] = &data[i * messageSize];
+		}
+
+	const SHA256::Backend defaultBackend = SHA256::GetBackend();
+	std::vector<hash> oneByOneDigests( messageCount );
+	std::vector<hash> hashManyDigests( messageCount );
+	for( const SHA256::Backend backend : AllBackends )
+		{
+		if( !SHA256::SetBackend( backend ) )
+			{
+			continue;
+			}
+
+		double oneByOneTime = DBL_MAX;
+		double hashManyTime = DBL_MAX;
+		for( uint pass = 0; pass < passes; ++pass )
+			{
+			oneByOneTime = std::min( oneByOneTime, MeasureMilliseconds( [&]()
+				{
+				for( size_t i = 0; i < messageCount; ++i )
+					{
+					SHA256 sha( datas[i], dataLengths[i] );
+					sha.GetDigest( oneByOneDigests[i].digest );
+					}
+				} ) );
+			hashManyTime = std::min( hashManyTime, MeasureMilliseconds( [&]()
+				{
+				SHA256::HashMany( datas.data(), dataLengths.data(), messageCount, hashManyDigests.data() );
+				} ) );
+			EXPECT_TRUE( oneByOneDigests == hashManyDigests );
+			}
+
+		const std::string name = BackendName( backend );
+		PrintThroughputResult( "ManySmallMessages", ( name + " one by one" ).c_str(), data.size(), oneByOneTime );
+		PrintThroughputResult( "ManySmallMessages", ( name + " hash many" ).c_str(), data.size(), hashManyTime );
+		}
+	EXPECT_TRUE( SHA256::SetBackend( defaultBackend ) );
+	}
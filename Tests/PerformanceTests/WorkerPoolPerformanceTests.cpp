@@ -0,0 +1,163 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "PerformanceTests.h"
+
+#include <system_error>
+
+typedef std::chrono::high_resolution_clock request_clock;
+
+// the largest number of concurrent requests in the tests
+static const size_t MaxRequestCount = 100000;
+
+// the entities used by the tests, generated and written once, and shared by all the tests
+static const std::vector<std::shared_ptr<const Entity>> &GetTestEntities()
+	{
+	static std::vector<std::shared_ptr<const Entity>> entities;
+	if( entities.empty() )
+		{
+		setup_random_seed();
+		entities.reserve( MaxRequestCount );
+		for( size_t i = 0; i < MaxRequestCount; ++i )
+			{
+			entities.emplace_back( GenerateRandomTestEntityA( 0, 4 ) );
+			}
+		}
+	return entities;
+	}
+
+static const std::vector<entity_ref> &GetTestEntityRefs()
+	{
+	static std::vector<entity_ref> refs;
+	if( refs.empty() )
+		{
+		const auto &entities = GetTestEntities();
+
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+
+		refs.reserve( entities.size() );
+		for( size_t i = 0; i < entities.size(); ++i )
+			{
+			const auto ret = handler.AddEntity( entities[i] );
+			EXPECT_TRUE( IsAddedStatus( ret.second ) );
+			refs.emplace_back( ret.first );
+			}
+		}
+	return refs;
+	}
+
+// issues count requests at once using submit, then waits for all of them in order, and checks the results using check.
+// prints the total time and the latency of each request, from when it was submitted until its result was retrieved.
+template<class _Submit, class _Check> static void RunConcurrentRequests( const char *testName, const char *variantName, size_t count, _Submit submit, _Check check )
+	{
+	typedef decltype(submit( size_t() )) future_type;
+
+	std::vector<future_type> futures;
+	std::vector<request_clock::time_point> submitTimes;
+	std::vector<double> latencies;
+	futures.reserve( count );
+	submitTimes.reserve( count );
+	latencies.reserve( count );
+
+	const auto start = request_clock::now();
+	try
+		{
+		for( size_t i = 0; i < count; ++i )
+			{
+			submitTimes.emplace_back( request_clock::now() );
+			futures.emplace_back( submit( i ) );
+			}
+		}
+	catch( const std::system_error &err )
+		{
+		// std::async throws if a thread can't be created. the futures which were created are waited on when destroyed
+		printf( "[ PERF     ] %-28s %-24s failed after %zu requests: %s\n", testName, variantName, futures.size(), err.what() );
+		return;
+		}
+
+	for( size_t i = 0; i < count; ++i )
+		{
+		check( futures[i].get() );
+		latencies.emplace_back( std::chrono::duration<double, std::milli>( request_clock::now() - submitTimes[i] ).count() );
+		}
+	const double totalTime = std::chrono::duration<double, std::milli>( request_clock::now() - start ).count();
+
+	PrintPerformanceResult( testName, variantName, count, totalTime );
+	PrintLatencyResult( testName, variantName, latencies );
+	}
+
+// compares loading entities with the worker pool of the handler, with launching a std::async task per load
+static void CompareConcurrentLoads( const char *testName, size_t count )
+	{
+	const auto &refs = GetTestEntityRefs();
+	ASSERT_LE( count, refs.size() );
+
+	auto checkStatus = []( Status status ) { EXPECT_EQ( status, Status::Ok ); };
+
+	// use a new handler per variant, so no entity is already loaded
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		RunConcurrentRequests( testName, "std::async", count,
+			[&]( size_t i ) { return std::async( std::launch::async, [&handler, &refs, i]() { return handler.LoadEntity( refs[i] ); } ); },
+			checkStatus );
+		}
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		RunConcurrentRequests( testName, "worker pool", count,
+			[&]( size_t i ) { return handler.LoadEntityAsync( refs[i] ); },
+			checkStatus );
+		}
+	}
+
+// compares adding entities with the worker pool of the handler, with launching a std::async task per add
+static void CompareConcurrentAdds( const char *testName, size_t count )
+	{
+	const auto &entities = GetTestEntities();
+	GetTestEntityRefs(); // make sure all files exist beforehand, so all variants find existing files and skip the writes
+	ASSERT_LE( count, entities.size() );
+
+	auto checkStatus = []( const std::pair<entity_ref, Status> &ret ) { EXPECT_TRUE( IsAddedStatus( ret.second ) ); };
+
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		RunConcurrentRequests( testName, "std::async", count,
+			[&]( size_t i ) { return std::async( std::launch::async, [&handler, &entities, i]() { return handler.AddEntity( entities[i] ); } ); },
+			checkStatus );
+		}
+		{
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() } ), Status::Ok );
+		RunConcurrentRequests( testName, "worker pool", count,
+			[&]( size_t i ) { return handler.AddEntityAsync( entities[i] ); },
+			checkStatus );
+		}
+
+	// durable adds complete when their group is synced, so the cost of each sync is shared by the adds in the group
+		{
+		EntityHandler::Settings settings;
+		settings.UseDurableWrites = true;
+		EntityHandler handler;
+		EXPECT_EQ( handler.Initialize( PDS_PERFORMANCE_TEST_FOLDER, { TestPackA::GetPackageRecord() }, settings ), Status::Ok );
+		RunConcurrentRequests( testName, "durable worker pool", count,
+			[&]( size_t i ) { return handler.AddEntityAsync( entities[i] ); },
+			checkStatus );
+		}
+	}
+
+TEST( WorkerPoolPerformanceTests , ConcurrentLoads )
+	{
+	CompareConcurrentLoads( "ConcurrentLoads 1k", 1000 );
+	CompareConcurrentLoads( "ConcurrentLoads 10k", 10000 );
+	CompareConcurrentLoads( "ConcurrentLoads 100k", 100000 );
+	}
+
+TEST( WorkerPoolPerformanceTests , ConcurrentAdds )
+	{
+	CompareConcurrentAdds( "ConcurrentAdds 1k", 1000 );
+	CompareConcurrentAdds( "ConcurrentAdds 10k", 10000 );
+	CompareConcurrentAdds( "ConcurrentAdds 100k", 100000 );
+	}
@@ -5,6 +5,13 @@
 
 #include <pds/EntityReader.inl>
 #include <pds/EntityWriter.inl>
+#include <pds/WriteStreamPool.h>
+#include <pds/ChunkedFileReadStream.h>
+#include <pds/ByteSwap.h>
+
+#ifdef __linux__
+#include <sys/resource.h>
+#endif
 
 template<class T> void ExpectReadValueIs( MemoryReadStream *rs, T ref_value )
 	{
@@ -124,3 +131,217 @@ TEST( ReadWriteTests , MemoryWriteReadStream )
 		rs = nullptr;
 		}
 	}
+
+TEST( ReadWriteTests , WriteStreamPool )
+	{
+	WriteStreamPool pool;
+	pool.SetMaxStreamCount( 1 );
+
+	// a released stream is reset, and handed out again with its allocation
+	std::unique_ptr<MemoryWriteStream> stream = pool.Acquire();
+	const MemoryWriteStream *streamPtr = stream.get();
+	stream->SetFlipByteOrder( true );
+	stream->Write( u64_rand() );
+	stream->Write( hash_rand() );
+	pool.Release( std::move( stream ) );
+	EXPECT_EQ( pool.GetPooledStreamCount(), size_t(1) );
+	stream = pool.Acquire();
+	EXPECT_EQ( stream.get(), streamPtr );
+	EXPECT_EQ( stream->GetSize(), u64(0) );
+	EXPECT_EQ( stream->GetPosition(), u64(0) );
+	EXPECT_FALSE( stream->GetFlipByteOrder() );
+	EXPECT_EQ( stream->GetReservedSize(), u64( WriteStreamPool::InitialStreamSize ) );
+
+	// streams above the max count are freed
+	std::unique_ptr<MemoryWriteStream> secondStream = pool.Acquire();
+	pool.Release( std::move( stream ) );
+	pool.Release( std::move( secondStream ) );
+	EXPECT_EQ( pool.GetPooledStreamCount(), size_t(1) );
+
+	// streams which have grown too large are freed
+		{
+		PooledWriteStream pooledStream( &pool );
+		EXPECT_EQ( pool.GetPooledStreamCount(), size_t(0) );
+		pooledStream->SetPosition( WriteStreamPool::MaxPooledStreamSize + 1 );
+		}
+	EXPECT_EQ( pool.GetPooledStreamCount(), size_t(0) );
+	}
+
+TEST( ReadWriteTests , MemoryWriteStreamGrowth )
+	{
+	setup_random_seed();
+
+	// grow a small stream many times, the data is committed in place, and does not move
+	MemoryWriteStream ws( 1024 );
+	const void *data = ws.GetData();
+	const u64 valueCount = 1024 * 1024 * 4;
+	const u64 seed = u64_rand();
+	for( u64 i = 0; i < valueCount; ++i )
+		{
+		ws.Write( seed + i );
+		}
+	EXPECT_EQ( ws.GetData(), data );
+	EXPECT_EQ( ws.GetSize(), valueCount * sizeof( u64 ) );
+	EXPECT_GE( ws.GetReservedSize(), ws.GetSize() );
+
+	const u64 *values = (const u64 *)ws.GetData();
+	for( u64 i = 0; i < valueCount; ++i )
+		{
+		if( values[i] != seed + i )
+			{
+			ADD_FAILURE() << "value " << i << " is not the written value";
+			break;
+			}
+		}
+	}
+
+#ifdef __linux__
+// limit the address space of the process to the size it uses, plus the headroom
+static void LimitAddressSpace( u64 headroom )
+	{
+	FILE *file = fopen( "/proc/self/statm", "r" );
+	ASSERT_TRUE( file != nullptr );
+	unsigned long long pageCount = 0;
+	ASSERT_EQ( fscanf( file, "%llu", &pageCount ), 1 );
+	fclose( file );
+	struct rlimit limit = {};
+	limit.rlim_cur = limit.rlim_max = rlim_t( pageCount * u64( sysconf( _SC_PAGESIZE ) ) + headroom );
+	ASSERT_EQ( setrlimit( RLIMIT_AS, &limit ), 0 );
+	}
+
+TEST( ReadWriteTests , MemoryWriteStreamLimitedAddressSpace )
+	{
+	// the stream can't reserve its full range of address space, so it reserves a smaller range, and grows past it.
+	// the address space is limited in a child process, which exits with 0 if all values are written
+	EXPECT_EXIT(
+		{
+		LimitAddressSpace( 1024ull * 1024 * 512 );
+		MemoryWriteStream ws( 1024 );
+		const u64 valueCount = 1024 * 1024 * 40;
+		for( u64 i = 0; i < valueCount; ++i )
+			{
+			ws.Write( i );
+			}
+		const u64 *values = (const u64 *)ws.GetData();
+		u64 i = 0;
+		while( i < valueCount && values[i] == i )
+			{
+			++i;
+			}
+		exit( ( i == valueCount ) ? 0 : 1 );
+		}, ::testing::ExitedWithCode( 0 ), "" );
+	}
+#endif
+
+TEST( ReadWriteTests , ChunkedFileReadStream )
+	{
+	setup_random_seed();
+
+	// write random values to a file
+	const u64 valueCount = 100000;
+	std::vector<u64> values( valueCount );
+	for( u64 i = 0; i < valueCount; ++i )
+		{
+		values[i] = u64_rand();
+		}
+	const std::string filePath = CreateTestDirectory( "ChunkedFileReadStream" ) + "/values.dat";
+	FILE *file = fopen( filePath.c_str(), "wb" );
+	ASSERT_TRUE( file != nullptr );
+	EXPECT_EQ( fwrite( values.data(), sizeof( u64 ), valueCount, file ), size_t( valueCount ) );
+	fclose( file );
+
+	// read the values with a small buffer, in order, out of order, and in large reads which skip the buffer
+	ChunkedFileReadStream rs( 1024 );
+	EXPECT_EQ( rs.Open( filePath.c_str() ), Status::Ok );
+	EXPECT_EQ( rs.GetSize(), valueCount * sizeof( u64 ) );
+	EXPECT_TRUE( rs.GetData() == nullptr );
+	rs.BeginHashedRead();
+	for( u64 i = 0; i < 1000; ++i )
+		{
+		EXPECT_EQ( rs.Peek(), u8( values[i] & 0xff ) );
+		ExpectReadValueIs( &rs, values[i] );
+		}
+	EXPECT_TRUE( rs.SetPosition( 10 * sizeof( u64 ) ) );
+	ExpectReadValueIs( &rs, values[10] );
+	EXPECT_TRUE( rs.SetPosition( 50000 * sizeof( u64 ) ) );
+	ExpectReadValueIs( &rs, values[50000] );
+	std::vector<u64> largeRead( 10000 );
+	EXPECT_EQ( rs.Read( largeRead.data(), largeRead.size() ), u64( largeRead.size() ) );
+	EXPECT_TRUE( memcmp( largeRead.data(), &values[50001], largeRead.size() * sizeof( u64 ) ) == 0 );
+
+	// the skipped data is hashed in EndHashedRead, so the digest is the hash of the whole file
+	hash digest = {};
+	EXPECT_TRUE( rs.EndHashedRead( digest ) );
+	hash expectedDigest = {};
+	SHA256 sha( (const u8 *)values.data(), valueCount * sizeof( u64 ) );
+	sha.GetDigest( expectedDigest.digest );
+	EXPECT_EQ( digest, expectedDigest );
+	EXPECT_FALSE( rs.HasReadFailed() );
+	rs.Close();
+	remove( filePath.c_str() );
+	}
+
+// flips the values with the backend, and compares with flipping the bytes one value at a time
+template<class T> static void ExpectByteSwapMatchesReference( size_t count, size_t offset, bool inPlace )
+	{
+	std::vector<u8> src( count * sizeof(T) + offset );
+	for( size_t i = 0; i < src.size(); ++i )
+		{
+		src[i] = u8_rand();
+		}
+	std::vector<u8> reference = src;
+	for( size_t i = 0; i < count; ++i )
+		{
+		std::reverse( &reference[offset + i * sizeof(T)], &reference[offset + ( i + 1 ) * sizeof(T)] );
+		}
+
+	std::vector<u8> dest( src.size() );
+	u8 *destData = inPlace ? src.data() : dest.data();
+	ByteSwap::CopySwapped<T>( destData + offset, src.data() + offset, count );
+	EXPECT_TRUE( memcmp( destData + offset, reference.data() + offset, count * sizeof(T) ) == 0 );
+	}
+
+TEST( ReadWriteTests , ByteSwapBackends )
+	{
+	setup_random_seed();
+
+	const ByteSwap::Backend defaultBackend = ByteSwap::GetBackend();
+	EXPECT_TRUE( ByteSwap::IsBackendSupported( ByteSwap::Backend::Portable ) );
+
+	for( const ByteSwap::Backend backend : { ByteSwap::Backend::Portable, ByteSwap::Backend::Ssse3, ByteSwap::Backend::Avx2 } )
+		{
+		if( !ByteSwap::SetBackend( backend ) )
+			{
+			EXPECT_FALSE( ByteSwap::IsBackendSupported( backend ) );
+			continue;
+			}
+
+		// all counts around the vector sizes, unaligned, and in place
+		for( size_t count = 0; count <= 70; ++count )
+			{
+			for( size_t offset = 0; offset < 3; ++offset )
+				{
+				ExpectByteSwapMatchesReference<u16>( count, offset, ( offset == 1 ) );
+				ExpectByteSwapMatchesReference<u32>( count, offset, ( offset == 1 ) );
+				ExpectByteSwapMatchesReference<u64>( count, offset, ( offset == 1 ) );
+				}
+			}
+		ExpectByteSwapMatchesReference<u32>( 100000, 1, false );
+
+		// flipped arrays are written and read back with the backend
+		std::vector<float> values( 1000 );
+		for( size_t i = 0; i < values.size(); ++i )
+			{
+			values[i] = float_rand();
+			}
+		MemoryWriteStream ws;
+		ws.SetFlipByteOrder( true );
+		ws.Write( values.data(), values.size() );
+		MemoryReadStream rs( ws.GetData(), ws.GetSize(), true );
+		std::vector<float> readValues( values.size() );
+		EXPECT_EQ( rs.Read( readValues.data(), readValues.size() ), u64( values.size() ) );
+		EXPECT_EQ( readValues, values );
+		}
+
+	EXPECT_TRUE( ByteSwap::SetBackend( defaultBackend ) );
+	}
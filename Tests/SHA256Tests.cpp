@@ -0,0 +1,119 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+#include "Tests.h"
+
+#include <pds/SHA256.h>
+
+static const SHA256::Backend AllBackends[] = { SHA256::Backend::Portable, SHA256::Backend::Avx2, SHA256::Backend::ShaExtensions };
+
+static std::vector<u8> RandomBytes( size_t size )
+	{
+	std::vector<u8> data( size );
+	for( size_t i = 0; i < size; ++i )
+		{
+		data[i] = u8_rand();
+		}
+	return data;
+	}
+
+// the reference digest, calculated by picosha2
+static hash ReferenceDigest( const std::vector<u8> &data )
+	{
+	hash digest;
+	picosha2::hash256( data.begin(), data.end(), digest.digest, digest.digest + 32 );
+	return digest;
+	}
+
+static hash BackendDigest( const std::vector<u8> &data )
+	{
+	hash digest;
+	SHA256 sha( data.data(), data.size() );
+	sha.GetDigest( digest.digest );
+	return digest;
+	}
+
+TEST( SHA256Tests, BackendsMatchReference )
+	{
+	setup_random_seed();
+
+	const SHA256::Backend defaultBackend = SHA256::GetBackend();
+	EXPECT_TRUE( SHA256::IsBackendSupported( SHA256::Backend::Portable ) );
+
+	for( const SHA256::Backend backend : AllBackends )
+		{
+		if( !SHA256::SetBackend( backend ) )
+			{
+			EXPECT_FALSE( SHA256::IsBackendSupported( backend ) );
+			continue;
+			}
+		EXPECT_EQ( SHA256::GetBackend(), backend );
+
+		// all lengths around the block and padding boundaries
+		for( size_t size = 0; size <= 200; ++size )
+			{
+			const std::vector<u8> data = RandomBytes( size );
+			EXPECT_EQ( BackendDigest( data ), ReferenceDigest( data ) );
+			}
+
+		// random lengths, hashed in one go and in random parts
+		for( uint pass = 0; pass < 50; ++pass )
+			{
+			const std::vector<u8> data = RandomBytes( capped_rand( 0, 5000 ) );
+			const hash reference = ReferenceDigest( data );
+			EXPECT_EQ( BackendDigest( data ), reference );
+
+			SHA256 sha;
+			size_t pos = 0;
+			while( pos < data.size() )
+				{
+				const size_t partSize = std::min( capped_rand( 0, 130 ), data.size() - pos );
+				sha.Update( &data[pos], partSize );
+				pos += partSize;
+				}
+			hash digest;
+			sha.GetDigest( digest.digest );
+			EXPECT_EQ( digest, reference );
+			}
+		}
+
+	EXPECT_TRUE( SHA256::SetBackend( defaultBackend ) );
+	}
+
+TEST( SHA256Tests, HashManyMatchesReference )
+	{
+	setup_random_seed();
+
+	const SHA256::Backend defaultBackend = SHA256::GetBackend();
+
+	for( const SHA256::Backend backend : AllBackends )
+		{
+		if( !SHA256::SetBackend( backend ) )
+			{
+			continue;
+			}
+
+		// counts which are not multiples of 8, with lengths that differ between the messages
+		for( size_t count = 0; count <= 20; ++count )
+			{
+			std::vector<std::vector<u8>> messages( count );
+			std::vector<const u8 *> datas( count );
+			std::vector<size_t> dataLengths( count );
+			for( size_t i = 0; i < count; ++i )
+				{
+				messages[i] = RandomBytes( capped_rand( 0, ( i % 3 == 0 ) ? 1000 : 100 ) );
+				datas[i] = messages[i].data();
+				dataLengths[i] = messages[i].size();
+				}
+
+			std::vector<hash> digests( count );
+			SHA256::HashMany( datas.data(), dataLengths.data(), count, digests.data() );
+			for( size_t i = 0; i < count; ++i )
+				{
+				EXPECT_EQ( digests[i], ReferenceDigest( messages[i] ) );
+				}
+			}
+		}
+
+	EXPECT_TRUE( SHA256::SetBackend( defaultBackend ) );
+	}
@@ -60,4 +60,20 @@ size_t GenerateRandomItemTable( Dict &random_dict , size_t minc = 0, size_t maxc
 		}
 
 	return random_dict.Size();
-	}
\ No newline at end of file
+	}
+
+// create a random TestEntityA, with a random item table of between minc and maxc named items
+inline std::shared_ptr<TestPackA::TestEntityA> GenerateRandomTestEntityA( size_t minc = 0, size_t maxc = 100 )
+	{
+	auto entity = std::make_shared<TestPackA::TestEntityA>();
+	entity->Name() = random_value<std::string>();
+	entity->TestVariableA().set();
+
+	size_t item_count = capped_rand( minc, maxc );
+	for( size_t i = 0; i < item_count; ++i )
+		{
+		entity->TestVariableA().value().Insert( item_ref::make_ref() ).Name() = random_value<std::string>();
+		}
+
+	return entity;
+	}
@@ -14,6 +14,9 @@
 #pragma warning( disable : 4127 )
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
+#else
+#include <sys/stat.h>
+#include <cerrno>
 #endif
 
 #include <glm/glm.hpp>
@@ -33,3 +36,34 @@ using namespace pds;
 
 // set this to a higher number to run more passes where the values are randomized
 const size_t global_number_of_passes = 1;
+
+// adding an entity which is already stored, for instance by an earlier run of the tests, returns WAlreadyExists
+inline bool IsAddedStatus( Status status ) { return status == Status::Ok || status == Status::WAlreadyExists; }
+
+// creates a new, empty, directory for a test. the random seed is fixed, so retry while the
+// directory name is taken by an earlier run. any other error fails the test.
+inline std::string CreateTestDirectory( const char *name )
+	{
+	for( ;;)
+		{
+		const std::string path = std::string( "./TestFolder/" ) + name + "-" + value_to_hex_string( u64_rand() );
+#ifdef _MSC_VER
+		if( ::CreateDirectoryA( path.c_str(), nullptr ) )
+			{
+			return path;
+			}
+		const bool exists = ( ::GetLastError() == ERROR_ALREADY_EXISTS );
+#else
+		if( ::mkdir( path.c_str(), 0755 ) == 0 )
+			{
+			return path;
+			}
+		const bool exists = ( errno == EEXIST );
+#endif
+		if( !exists )
+			{
+			ADD_FAILURE() << "Failed to create the test directory: " << path;
+			return path;
+			}
+		}
+	}
@@ -160,6 +160,15 @@ TEST( TypeTests , SHA256Hashing )
 			};
 
 		EXPECT_EQ( memcmp( calc_hash, expected_hash, 32 ) , 0 );
+
+		// hashing the data in parts gives the same digest
+		SHA256 partsSha;
+		partsSha.Update( testdata, 7 );
+		partsSha.Update( &testdata[7], 64 );
+		partsSha.Update( &testdata[71], sizeof( testdata ) - 71 );
+		u8 parts_hash[32];
+		partsSha.GetDigest( parts_hash );
+		EXPECT_EQ( memcmp( parts_hash, expected_hash, 32 ) , 0 );
 		}
 	}
 
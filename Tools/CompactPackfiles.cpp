@@ -0,0 +1,48 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+// pds_compact - moves the loose <sha256-hex>.dat entity files of a store directory into packfiles
+// usage: pds_compact <store directory> [max segment size in MB]
+
+#define PDS_IMPLEMENTATION
+#include <pds/pds.h>
+#include <pds/PackfileStore.h>
+
+#include <cstdio>
+#include <cstdlib>
+
+using namespace pds;
+
+int main( int argc, char *argv[] )
+	{
+	if( argc < 2 || argc > 3 )
+		{
+		printf( "usage: pds_compact <store directory> [max segment size in MB]\n" );
+		return 1;
+		}
+
+	u64 maxSegmentSize = PackfileStore::DefaultMaxSegmentSize;
+	if( argc == 3 )
+		{
+		maxSegmentSize = u64( strtoull( argv[2], nullptr, 10 ) ) * 1024 * 1024;
+		}
+
+	PackfileStore store;
+	Status status = store.Initialize( argv[1], maxSegmentSize );
+	if( status != Status::Ok )
+		{
+		printf( "Failed to open the packfiles in %s, error: %d\n", argv[1], (int)status );
+		return 1;
+		}
+
+	u64 compactedCount = 0;
+	status = store.CompactLooseFiles( &compactedCount );
+	if( status != Status::Ok )
+		{
+		printf( "Failed to compact %s, error: %d (%llu files were moved)\n", argv[1], (int)status, (unsigned long long)compactedCount );
+		return 1;
+		}
+
+	printf( "Moved %llu loose entity files into packfiles\n", (unsigned long long)compactedCount );
+	return 0;
+	}
@@ -0,0 +1,34 @@
+// pds - Persistent data structure framework, Copyright (c) 2022 Ulrik Lindahl
+// Licensed under the MIT license https://github.com/Cooolrik/pds/blob/main/LICENSE
+
+// pds_fanout - moves the loose <sha256-hex>.dat entity files of a flat store directory into the
+// fan-out layout, ab/cdef...89.dat, which is used by handlers set up with UseFanOutDirectories
+// usage: pds_fanout <store directory>
+
+#define PDS_IMPLEMENTATION
+#include <pds/pds.h>
+#include <pds/EntityDirectory.h>
+
+#include <cstdio>
+
+using namespace pds;
+
+int main( int argc, char *argv[] )
+	{
+	if( argc != 2 )
+		{
+		printf( "usage: pds_fanout <store directory>\n" );
+		return 1;
+		}
+
+	u64 movedCount = 0;
+	const Status status = EntityDirectory::MigrateToFanOut( argv[1], &movedCount );
+	if( status != Status::Ok )
+		{
+		printf( "Failed to migrate %s, error: %d (%llu files were moved)\n", argv[1], (int)status, (unsigned long long)movedCount );
+		return 1;
+		}
+
+	printf( "Moved %llu entity files into the fan-out layout\n", (unsigned long long)movedCount );
+	return 0;
+	}